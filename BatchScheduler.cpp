@@ -0,0 +1,384 @@
+// BatchScheduler.cpp: runs many independent mux sessions on a thread pool
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "BatchScheduler.h"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
+#endif
+
+// a worker with nothing it can start waits for a session to
+// finish, or at most this long, before looking again
+const DWORD ms_idle_wait = 100;
+
+// --- buffer pool -----------------------------------------
+
+BufferPool::BufferPool(long cBuffer)
+: m_cBuffer(cBuffer),
+  m_nAllocated(0)
+{
+}
+
+smart_array<BYTE>
+BufferPool::Get()
+{
+    CAutoLock lock(&m_csPool);
+    if (m_Free.empty())
+    {
+        m_nAllocated++;
+        return smart_array<BYTE>(new BYTE[m_cBuffer]);
+    }
+    smart_array<BYTE> pBuffer = m_Free.front();
+    m_Free.pop_front();
+    return pBuffer;
+}
+
+void
+BufferPool::Release(smart_array<BYTE> pBuffer)
+{
+    CAutoLock lock(&m_csPool);
+    m_Free.push_back(pBuffer);
+}
+
+// --- workers ---------------------------------------------
+
+BatchScheduler::Worker::Worker(BatchScheduler* pScheduler, long idx)
+: m_pScheduler(pScheduler),
+  m_idx(idx)
+{
+}
+
+void
+BatchScheduler::Worker::Start()
+{
+    Create();
+}
+
+void
+BatchScheduler::Worker::Push(BatchJobPtr pJob)
+{
+    CAutoLock lock(&m_csQueue);
+    m_Queue.push_back(pJob);
+}
+
+long
+BatchScheduler::Worker::Queued()
+{
+    CAutoLock lock(&m_csQueue);
+    return (long)m_Queue.size();
+}
+
+bool
+BatchScheduler::Worker::Take(bool bSteal, BatchJobPtr* ppJob)
+{
+    // the owner works from the front, in the order added;
+    // others steal from the back, furthest from the owner
+    CAutoLock lock(&m_csQueue);
+    if (bSteal)
+    {
+        for (list<BatchJobPtr>::reverse_iterator it = m_Queue.rbegin(); it != m_Queue.rend(); it++)
+        {
+            if (m_pScheduler->TryAcquire(*it))
+            {
+                *ppJob = *it;
+                m_Queue.erase(--(it.base()));
+                return true;
+            }
+        }
+    }
+    else
+    {
+        for (list<BatchJobPtr>::iterator it = m_Queue.begin(); it != m_Queue.end(); it++)
+        {
+            if (m_pScheduler->TryAcquire(*it))
+            {
+                *ppJob = *it;
+                m_Queue.erase(it);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+DWORD
+BatchScheduler::Worker::ThreadProc()
+{
+    BatchJobPtr pJob;
+    while (m_pScheduler->NextJob(m_idx, &pJob))
+    {
+        m_pScheduler->RunJob(m_idx, pJob);
+        pJob = NULL;
+    }
+    return 0;
+}
+
+// --- scheduler -------------------------------------------
+
+BatchScheduler::BatchScheduler(long nWorkers, long nPerDevice, long cBuffer)
+: m_nPerDevice(nPerDevice),
+  m_Pool(cBuffer),
+  m_cPending(0),
+  m_cSteals(0),
+  m_msElapsed(0),
+  m_evRelease(TRUE),
+  m_nWakeups(0)
+{
+    nWorkers = max(nWorkers, 1L);
+    for (long i = 0; i < nWorkers; i++)
+    {
+        WorkerPtr pWorker = new Worker(this, i);
+        m_Workers.push_back(pWorker);
+    }
+}
+
+BatchScheduler::~BatchScheduler()
+{
+    for (size_t i = 0; i < m_Workers.size(); i++)
+    {
+        m_Workers[i]->Close();
+    }
+}
+
+void
+BatchScheduler::Add(BatchJobPtr pJob)
+{
+    // one entry per device, for the limits
+    vector<string> paths;
+    pJob->GetPaths(&paths);
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        string strDevice = DeviceOf(paths[i]);
+        bool bFound = false;
+        for (size_t j = 0; j < pJob->m_Devices.size(); j++)
+        {
+            if (pJob->m_Devices[j] == strDevice)
+            {
+                bFound = true;
+                break;
+            }
+        }
+        if (!bFound)
+        {
+            pJob->m_Devices.push_back(strDevice);
+        }
+    }
+
+    // dealt out in turn: stealing evens out the differences in size
+    m_Workers[m_Jobs.size() % m_Workers.size()]->Push(pJob);
+    m_Jobs.push_back(pJob);
+    m_cPending++;
+}
+
+HRESULT
+BatchScheduler::Run()
+{
+    DWORD msStart = GetTickCount();
+    for (size_t i = 0; i < m_Workers.size(); i++)
+    {
+        m_Workers[i]->Start();
+    }
+    for (size_t i = 0; i < m_Workers.size(); i++)
+    {
+        m_Workers[i]->Close();
+    }
+    m_msElapsed = max(GetTickCount() - msStart, DWORD(1));
+
+    for (size_t i = 0; i < m_Jobs.size(); i++)
+    {
+        if (FAILED(m_Jobs[i]->hr))
+        {
+            return S_FALSE;
+        }
+    }
+    return S_OK;
+}
+
+bool
+BatchScheduler::NextJob(long idxWorker, BatchJobPtr* ppJob)
+{
+    for (;;)
+    {
+        long nWakeups;
+        {
+            CAutoLock lock(&m_csDevices);
+            if (m_cPending == 0)
+            {
+                return false;
+            }
+            nWakeups = m_nWakeups;
+        }
+        if (m_Workers[idxWorker]->Take(false, ppJob))
+        {
+            break;
+        }
+
+        // steal, trying the longest queues first
+        vector<long> victims;
+        for (long i = 0; i < (long)m_Workers.size(); i++)
+        {
+            if (i != idxWorker)
+            {
+                victims.push_back(i);
+            }
+        }
+        vector<long> queued(m_Workers.size());
+        for (size_t i = 0; i < victims.size(); i++)
+        {
+            queued[victims[i]] = m_Workers[victims[i]]->Queued();
+        }
+        for (size_t i = 1; i < victims.size(); i++)
+        {
+            for (size_t j = i; (j > 0) && (queued[victims[j]] > queued[victims[j - 1]]); j--)
+            {
+                swap(victims[j], victims[j - 1]);
+            }
+        }
+        bool bStolen = false;
+        for (size_t i = 0; i < victims.size(); i++)
+        {
+            if ((queued[victims[i]] > 0) && m_Workers[victims[i]]->Take(true, ppJob))
+            {
+                bStolen = true;
+                break;
+            }
+        }
+        if (bStolen)
+        {
+            CAutoLock lock(&m_csDevices);
+            m_cSteals++;
+            break;
+        }
+
+        // all remaining jobs are on busy devices: wait for a session to
+        // finish, unless one has since the queues were searched
+        {
+            CAutoLock lock(&m_csDevices);
+            if (m_nWakeups != nWakeups)
+            {
+                continue;
+            }
+            m_evRelease.Reset();
+        }
+        m_evRelease.Wait(ms_idle_wait);
+    }
+
+    CAutoLock lock(&m_csDevices);
+    m_cPending--;
+    if (m_cPending == 0)
+    {
+        // idle workers can exit
+        m_nWakeups++;
+        m_evRelease.Set();
+    }
+    return true;
+}
+
+void
+BatchScheduler::RunJob(long idxWorker, BatchJob* pJob)
+{
+    DWORD msStart = GetTickCount();
+    LONGLONG cInput = 0;
+    LONGLONG cOutput = 0;
+    HRESULT hr = pJob->Run(&m_Pool, &cInput, &cOutput);
+    pJob->msElapsed = GetTickCount() - msStart;
+    pJob->cInput = cInput;
+    pJob->cOutput = cOutput;
+    pJob->idxWorker = idxWorker;
+    pJob->hr = hr;
+    ReleaseDevices(pJob);
+}
+
+bool
+BatchScheduler::TryAcquire(BatchJob* pJob)
+{
+    CAutoLock lock(&m_csDevices);
+    if (m_nPerDevice > 0)
+    {
+        for (size_t i = 0; i < pJob->m_Devices.size(); i++)
+        {
+            if (m_Busy[pJob->m_Devices[i]] >= m_nPerDevice)
+            {
+                return false;
+            }
+        }
+    }
+    for (size_t i = 0; i < pJob->m_Devices.size(); i++)
+    {
+        m_Busy[pJob->m_Devices[i]]++;
+    }
+    return true;
+}
+
+void
+BatchScheduler::ReleaseDevices(BatchJob* pJob)
+{
+    CAutoLock lock(&m_csDevices);
+    for (size_t i = 0; i < pJob->m_Devices.size(); i++)
+    {
+        m_Busy[pJob->m_Devices[i]]--;
+    }
+    m_nWakeups++;
+    m_evRelease.Set();
+}
+
+#ifdef _WIN32
+
+//static
+long
+BatchScheduler::ProcessorCount()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return max(long(info.dwNumberOfProcessors), 1L);
+}
+
+//static
+string
+BatchScheduler::DeviceOf(const string& strPath)
+{
+    char szVolume[MAX_PATH];
+    if (!GetVolumePathNameA(strPath.c_str(), szVolume, MAX_PATH))
+    {
+        return string();
+    }
+    return szVolume;
+}
+
+#else
+
+//static
+long
+BatchScheduler::ProcessorCount()
+{
+    return max(long(sysconf(_SC_NPROCESSORS_ONLN)), 1L);
+}
+
+//static
+string
+BatchScheduler::DeviceOf(const string& strPath)
+{
+    struct stat st;
+    if (stat(strPath.c_str(), &st) != 0)
+    {
+        size_t idx = strPath.find_last_of('/');
+        string strDir = (idx == string::npos) ? string(".") : strPath.substr(0, max(idx, size_t(1)));
+        if (stat(strDir.c_str(), &st) != 0)
+        {
+            return string();
+        }
+    }
+    char sz[32];
+    snprintf(sz, sizeof(sz), "%llu", (unsigned long long)st.st_dev);
+    return sz;
+}
+
+#endif
@@ -0,0 +1,179 @@
+// BatchScheduler.h: runs many independent mux sessions on a thread pool
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "MuxEngine.h"
+#include <map>
+
+// Fixed-size buffers shared between the sessions of a batch, so that
+// each session's output buffer is reused rather than allocated and freed
+// for every file. At most one buffer per worker is ever in use.
+class BufferPool
+{
+public:
+    BufferPool(long cBuffer);
+
+    long BufferSize()
+    {
+        return m_cBuffer;
+    }
+    smart_array<BYTE> Get();
+    void Release(smart_array<BYTE> pBuffer);
+
+    // buffers allocated since the pool was created
+    long Allocated()
+    {
+        CAutoLock lock(&m_csPool);
+        return m_nAllocated;
+    }
+
+private:
+    CCritSec m_csPool;
+    long m_cBuffer;
+    long m_nAllocated;
+    list<smart_array<BYTE> > m_Free;
+};
+
+// One session of a batch: typically one output file from its inputs.
+// The scheduler sets the results after Run returns.
+class BatchJob
+{
+public:
+    BatchJob()
+    : hr(S_OK),
+      cInput(0),
+      cOutput(0),
+      msElapsed(0),
+      idxWorker(-1)
+    {
+    }
+    virtual ~BatchJob() {}
+
+    // the files read or written, for the per-device limits
+    virtual void GetPaths(vector<string>* pPaths) = 0;
+
+    // runs the session on a worker thread. The pool's buffers are
+    // for the output, and must be returned before Run returns.
+    virtual HRESULT Run(BufferPool* pPool, LONGLONG* pcInput, LONGLONG* pcOutput) = 0;
+
+    HRESULT hr;
+    LONGLONG cInput;
+    LONGLONG cOutput;
+    DWORD msElapsed;
+    long idxWorker;
+
+private:
+    friend class BatchScheduler;
+    vector<string> m_Devices;
+};
+typedef smart_ptr<BatchJob> BatchJobPtr;
+
+// Runs the jobs on a pool of worker threads. Each worker has its own
+// queue of jobs, and takes work from the back of the busiest other
+// queue when its own is empty, so that long and short files balance
+// out without a shared queue that every worker contends on.
+//
+// A job does not start while any device it uses already has the
+// maximum number of sessions running: the worker looks further down
+// the queues for a job on another device instead, and only waits when
+// no job can start.
+class BatchScheduler
+{
+public:
+    // nPerDevice of 0 means no limit
+    BatchScheduler(long nWorkers, long nPerDevice, long cBuffer);
+    ~BatchScheduler();
+
+    void Add(BatchJobPtr pJob);
+
+    // runs all the jobs, returning S_FALSE if any failed
+    HRESULT Run();
+
+    long Jobs()
+    {
+        return (long)m_Jobs.size();
+    }
+    BatchJob* Job(long idx)
+    {
+        return m_Jobs[idx];
+    }
+    long Workers()
+    {
+        return (long)m_Workers.size();
+    }
+    long Steals()
+    {
+        return m_cSteals;
+    }
+    DWORD Elapsed()
+    {
+        return m_msElapsed;
+    }
+    BufferPool* Pool()
+    {
+        return &m_Pool;
+    }
+
+    static long ProcessorCount();
+
+    // the volume that holds the file, or its directory if the
+    // file does not exist yet
+    static string DeviceOf(const string& strPath);
+
+private:
+    class Worker : public CAMThread
+    {
+    public:
+        Worker(BatchScheduler* pScheduler, long idx);
+
+        void Start();
+        void Push(BatchJobPtr pJob);
+
+        // takes the first job whose devices are free, from the
+        // front of this queue (bSteal false) or the back (true)
+        bool Take(bool bSteal, BatchJobPtr* ppJob);
+        long Queued();
+
+    private:
+        DWORD ThreadProc();
+
+    private:
+        BatchScheduler* m_pScheduler;
+        long m_idx;
+        CCritSec m_csQueue;
+        list<BatchJobPtr> m_Queue;
+    };
+    typedef smart_ptr<Worker> WorkerPtr;
+
+    bool NextJob(long idxWorker, BatchJobPtr* ppJob);
+    void RunJob(long idxWorker, BatchJob* pJob);
+    bool TryAcquire(BatchJob* pJob);
+    void ReleaseDevices(BatchJob* pJob);
+
+private:
+    long m_nPerDevice;
+    BufferPool m_Pool;
+    vector<BatchJobPtr> m_Jobs;
+    vector<WorkerPtr> m_Workers;
+
+    // jobs not yet started: when 0 the workers exit
+    long m_cPending;
+    long m_cSteals;
+    DWORD m_msElapsed;
+
+    // sessions running on each device
+    CCritSec m_csDevices;
+    map<string, long> m_Busy;
+
+    // manual-reset, so that every idle worker wakes when a session
+    // finishes (it may free more than one device). m_nWakeups counts
+    // each set, so a worker does not clear one it has not yet seen.
+    CAMEvent m_evRelease;
+    long m_nWakeups;
+};
@@ -0,0 +1,343 @@
+// ElementaryStream.cpp: access unit parsers for raw elementary streams
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "ElementaryStream.h"
+#include "NALUnit.h"
+
+ElementaryStream::ElementaryStream(const BYTE* pData, LONGLONG cBytes, MuxBufferPtr pBuffer)
+: m_pData(pData),
+  m_cBytes(cBytes),
+  m_pos(0),
+  m_pBuffer(pBuffer)
+{
+}
+
+void
+ElementaryStream::MakeSample(MuxSample* pSample, const BYTE* pData, long cBytes, REFERENCE_TIME tStart, REFERENCE_TIME tStop, bool bSync)
+{
+    pSample->pData = pData;
+    pSample->cBytes = cBytes;
+    pSample->tStart = tStart;
+    pSample->tStop = tStop;
+    pSample->dwFlags = MuxSample_Time;
+    if (bSync)
+    {
+        pSample->dwFlags |= MuxSample_Sync;
+    }
+    pSample->pBuffer = m_pBuffer;
+}
+
+// --- parsing helpers --------------------------
+
+const BYTE*
+FindStartCode(const BYTE* pFrom, const BYTE* pEnd)
+{
+    // look for the 01 and check for the two zeros before it
+    const BYTE* p = pFrom + 2;
+    while (p < pEnd)
+    {
+        const BYTE* pOne = (const BYTE*)memchr(p, 1, size_t(pEnd - p));
+        if (pOne == NULL)
+        {
+            break;
+        }
+        if ((pOne[-1] == 0) && (pOne[-2] == 0))
+        {
+            // include any leading zeros (a 4-byte start code
+            // or trailing zeros after the previous NALU)
+            const BYTE* pStart = pOne - 2;
+            while ((pStart > pFrom) && (pStart[-1] == 0))
+            {
+                pStart--;
+            }
+            return pStart;
+        }
+        p = pOne + 1;
+    }
+    return pEnd;
+}
+
+bool
+H264ConfigFromByteStream(const BYTE* pData, const BYTE* pEnd, REFERENCE_TIME tFrame, MuxCodecConfig* pConfig)
+{
+    const BYTE* p = FindStartCode(pData, pEnd);
+    while (p < pEnd)
+    {
+        const BYTE* pNext = FindStartCode(p + 3, pEnd);
+        NALUnit nal;
+        if (nal.Parse(p, int(pNext - p), 0, true) &&
+            (nal.Type() == NALUnit::NAL_Sequence_Params))
+        {
+            SeqParamSet seq;
+            if (!seq.Parse(&nal))
+            {
+                return false;
+            }
+            *pConfig = MuxCodecConfig();
+            pConfig->codec = MuxCodec_H264ByteStream;
+            pConfig->width = seq.CroppedWidth();
+            pConfig->height = seq.CroppedHeight();
+            pConfig->tFrame = tFrame;
+            pConfig->profile = seq.Profile();
+            pConfig->level = seq.Level();
+            pConfig->nalLength = 4;
+            return true;
+        }
+        p = pNext;
+    }
+    return false;
+}
+
+static const long ADTSSampleRates[] =
+{
+    96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350,
+};
+
+ADTSHeader::ADTSHeader()
+: cFrame(0),
+  cHeader(0),
+  nBlocks(0),
+  SampleRate(0),
+  Channels(0)
+{
+    ZeroMemory(ASC, sizeof(ASC));
+}
+
+bool
+ADTSHeader::Parse(const BYTE* p, LONGLONG cBytes)
+{
+    // syncword, layer 0
+    if ((cBytes < min_header_size) || (p[0] != 0xff) || ((p[1] & 0xf6) != 0xf0))
+    {
+        return false;
+    }
+    cFrame = ((p[3] & 3) << 11) | (p[4] << 3) | (p[5] >> 5);
+    cHeader = (p[1] & 1) ? 7 : 9;
+    if (cFrame <= cHeader)
+    {
+        return false;
+    }
+    int profile = p[2] >> 6;
+    int idxRate = (p[2] >> 2) & 0xf;
+    if (idxRate >= int(sizeof(ADTSSampleRates) / sizeof(ADTSSampleRates[0])))
+    {
+        return false;
+    }
+    SampleRate = ADTSSampleRates[idxRate];
+    Channels = ((p[2] & 1) << 2) | (p[3] >> 6);
+    nBlocks = (p[6] & 3) + 1;
+
+    // AudioSpecificConfig: object type (profile + 1), rate index, channels
+    int objType = profile + 1;
+    ASC[0] = BYTE((objType << 3) | (idxRate >> 1));
+    ASC[1] = BYTE(((idxRate & 1) << 7) | (Channels << 3));
+    return true;
+}
+
+void
+ADTSHeader::GetConfig(MuxCodecConfig* pConfig)
+{
+    *pConfig = MuxCodecConfig();
+    pConfig->codec = MuxCodec_AAC;
+    pConfig->sampleRate = SampleRate;
+    pConfig->channels = Channels;
+    pConfig->bitsPerSample = 16;
+    pConfig->pConfig = ASC;
+    pConfig->cConfig = sizeof(ASC);
+}
+
+// --- H264 -------------------------------------
+
+H264ElementaryStream::H264ElementaryStream(const BYTE* pData, LONGLONG cBytes, MuxBufferPtr pBuffer, REFERENCE_TIME tFrame)
+: ElementaryStream(pData, cBytes, pBuffer),
+  m_tFrame(tFrame),
+  m_nFrames(0)
+{
+}
+
+bool
+H264ElementaryStream::GetConfig(MuxCodecConfig* pConfig)
+{
+    return H264ConfigFromByteStream(m_pData, m_pData + m_cBytes, m_tFrame, pConfig);
+}
+
+bool
+H264ElementaryStream::Next(MuxSample* pSample)
+{
+    const BYTE* pEnd = m_pData + m_cBytes;
+    const BYTE* pAU = FindStartCode(m_pData + m_pos, pEnd);
+    if (pAU >= pEnd)
+    {
+        m_pos = m_cBytes;
+        return false;
+    }
+
+    // An access unit ends before an AUD, SEI or param set, or before the
+    // first slice of the next picture (first_mb_in_slice is 0, so the
+    // first bit of the slice header is 1), once it contains a slice.
+    bool bSlice = false;
+    bool bSync = false;
+    const BYTE* p = pAU;
+    while (p < pEnd)
+    {
+        // skip to the NALU type byte
+        const BYTE* pHdr = p;
+        while (*pHdr == 0)
+        {
+            pHdr++;
+        }
+        pHdr++;
+        const BYTE* pNext = FindStartCode(pHdr, pEnd);
+        if (pHdr >= pNext)
+        {
+            // empty NALU at the end of the stream
+            p = pNext;
+            break;
+        }
+
+        int type = pHdr[0] & 0x1f;
+        bool bVCL = (type >= NALUnit::NAL_Slice) && (type <= NALUnit::NAL_IDR_Slice);
+        if (bSlice)
+        {
+            if (((type >= NALUnit::NAL_SEI) && (type <= NALUnit::NAL_AUD)) ||
+                ((type >= 14) && (type <= 18)))
+            {
+                break;
+            }
+            if (bVCL && (type != NALUnit::NAL_PartitionB) && (type != NALUnit::NAL_PartitionC) &&
+                ((pHdr + 1) < pNext) && (pHdr[1] & 0x80))
+            {
+                break;
+            }
+        }
+        if (bVCL)
+        {
+            bSlice = true;
+        }
+        if (type == NALUnit::NAL_IDR_Slice)
+        {
+            bSync = true;
+        }
+        p = pNext;
+    }
+    m_pos = p - m_pData;
+
+    REFERENCE_TIME tStart = m_nFrames * m_tFrame;
+    m_nFrames++;
+    MakeSample(pSample, pAU, long(p - pAU), tStart, tStart + m_tFrame, bSync);
+    return true;
+}
+
+// --- ADTS -------------------------------------
+
+ADTSElementaryStream::ADTSElementaryStream(const BYTE* pData, LONGLONG cBytes, MuxBufferPtr pBuffer)
+: ElementaryStream(pData, cBytes, pBuffer),
+  m_SampleRate(0),
+  m_nSamples(0)
+{
+}
+
+// moves m_pos to the next complete frame, or returns false
+bool
+ADTSElementaryStream::FindHeader(ADTSHeader* pHeader)
+{
+    while ((m_pos + ADTSHeader::min_header_size) <= m_cBytes)
+    {
+        if (pHeader->Parse(m_pData + m_pos, m_cBytes - m_pos) &&
+            ((m_pos + pHeader->cFrame) <= m_cBytes))
+        {
+            return true;
+        }
+        m_pos++;
+    }
+    return false;
+}
+
+bool
+ADTSElementaryStream::GetConfig(MuxCodecConfig* pConfig)
+{
+    LONGLONG pos = m_pos;
+    bool bFound = FindHeader(&m_First);
+    m_pos = pos;
+    if (!bFound)
+    {
+        return false;
+    }
+    m_SampleRate = m_First.SampleRate;
+    m_First.GetConfig(pConfig);
+    return true;
+}
+
+bool
+ADTSElementaryStream::Next(MuxSample* pSample)
+{
+    ADTSHeader hdr;
+    if ((m_SampleRate == 0) || !FindHeader(&hdr))
+    {
+        m_pos = m_cBytes;
+        return false;
+    }
+    const BYTE* p = m_pData + m_pos;
+    m_pos += hdr.cFrame;
+
+    REFERENCE_TIME tStart = m_nSamples * UNITS / m_SampleRate;
+    m_nSamples += hdr.nBlocks * ADTSHeader::samples_per_block;
+    REFERENCE_TIME tStop = m_nSamples * UNITS / m_SampleRate;
+    MakeSample(pSample, p + hdr.cHeader, hdr.cFrame - hdr.cHeader, tStart, tStop, true);
+    return true;
+}
+
+// --- PCM --------------------------------------
+
+PCMElementaryStream::PCMElementaryStream(const BYTE* pData, LONGLONG cBytes, MuxBufferPtr pBuffer, long sampleRate, long channels, long bitsPerSample)
+: ElementaryStream(pData, cBytes, pBuffer),
+  m_SampleRate(sampleRate),
+  m_Channels(channels),
+  m_BitsPerSample(bitsPerSample),
+  m_BlockAlign(channels * ((bitsPerSample + 7) / 8))
+{
+    // 20ms of audio per sample
+    m_cBlock = max(m_SampleRate / 50, 1L) * m_BlockAlign;
+}
+
+bool
+PCMElementaryStream::GetConfig(MuxCodecConfig* pConfig)
+{
+    if ((m_SampleRate <= 0) || (m_BlockAlign <= 0))
+    {
+        return false;
+    }
+    *pConfig = MuxCodecConfig();
+    pConfig->codec = MuxCodec_PCM;
+    pConfig->sampleRate = m_SampleRate;
+    pConfig->channels = m_Channels;
+    pConfig->bitsPerSample = m_BitsPerSample;
+    pConfig->blockAlign = m_BlockAlign;
+    pConfig->bytesPerSec = m_SampleRate * m_BlockAlign;
+    return true;
+}
+
+bool
+PCMElementaryStream::Next(MuxSample* pSample)
+{
+    // only whole blocks
+    LONGLONG cRemain = m_cBytes - m_pos;
+    cRemain -= cRemain % m_BlockAlign;
+    if (cRemain <= 0)
+    {
+        return false;
+    }
+    long cBytes = long(min(LONGLONG(m_cBlock), cRemain));
+
+    REFERENCE_TIME tStart = (m_pos / m_BlockAlign) * UNITS / m_SampleRate;
+    REFERENCE_TIME tStop = ((m_pos + cBytes) / m_BlockAlign) * UNITS / m_SampleRate;
+    MakeSample(pSample, m_pData + m_pos, cBytes, tStart, tStop, true);
+    m_pos += cBytes;
+    return true;
+}
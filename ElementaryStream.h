@@ -0,0 +1,121 @@
+// ElementaryStream.h: access unit parsers for raw elementary streams
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "MuxEngine.h"
+
+// --- parsing helpers, also used by the transport stream demux ---
+
+// the first zero of the next H.264 start code at or after pFrom
+// (including any leading zeros), or pEnd if there is none
+const BYTE* FindStartCode(const BYTE* pFrom, const BYTE* pEnd);
+
+// describes an H.264 byte stream from the first sequence param set in
+// the buffer, or returns false if there is none
+bool H264ConfigFromByteStream(const BYTE* pData, const BYTE* pEnd, REFERENCE_TIME tFrame, MuxCodecConfig* pConfig);
+
+// ADTS frame header
+class ADTSHeader
+{
+public:
+    ADTSHeader();
+
+    // false if there is no valid header at pData (the frame itself
+    // need not be complete)
+    bool Parse(const BYTE* pData, LONGLONG cBytes);
+
+    // describes the stream. The config refers to this header's ASC bytes
+    void GetConfig(MuxCodecConfig* pConfig);
+
+    enum { samples_per_block = 1024, min_header_size = 7 };
+
+    long cFrame;            // including header
+    long cHeader;
+    long nBlocks;           // raw data blocks in the frame
+    long SampleRate;
+    long Channels;
+    BYTE ASC[2];            // AudioSpecificConfig
+};
+
+// Splits an elementary stream held in memory into samples for the engine.
+// The samples point into the stream's buffer and hold a reference to its
+// MuxBuffer, so the payload is never copied before it is written.
+// Times are generated from the frame rate or sampling rate, starting at 0.
+class ElementaryStream
+{
+public:
+    ElementaryStream(const BYTE* pData, LONGLONG cBytes, MuxBufferPtr pBuffer);
+    virtual ~ElementaryStream() {}
+
+    // describes the stream, or returns false if it is not recognised
+    virtual bool GetConfig(MuxCodecConfig* pConfig) = 0;
+
+    // the next access unit, or false at the end of the stream
+    virtual bool Next(MuxSample* pSample) = 0;
+
+protected:
+    void MakeSample(MuxSample* pSample, const BYTE* pData, long cBytes, REFERENCE_TIME tStart, REFERENCE_TIME tStop, bool bSync);
+
+protected:
+    const BYTE* m_pData;
+    LONGLONG m_cBytes;
+    LONGLONG m_pos;
+    MuxBufferPtr m_pBuffer;
+};
+
+// H.264 byte stream (Annex B). Access units are found from the NAL unit
+// types and the first slice of each picture.
+class H264ElementaryStream : public ElementaryStream
+{
+public:
+    H264ElementaryStream(const BYTE* pData, LONGLONG cBytes, MuxBufferPtr pBuffer, REFERENCE_TIME tFrame);
+
+    bool GetConfig(MuxCodecConfig* pConfig);
+    bool Next(MuxSample* pSample);
+
+private:
+    REFERENCE_TIME m_tFrame;
+    LONGLONG m_nFrames;
+};
+
+// AAC in ADTS framing. The ADTS headers are skipped and the
+// AudioSpecificConfig is built from the first header.
+class ADTSElementaryStream : public ElementaryStream
+{
+public:
+    ADTSElementaryStream(const BYTE* pData, LONGLONG cBytes, MuxBufferPtr pBuffer);
+
+    bool GetConfig(MuxCodecConfig* pConfig);
+    bool Next(MuxSample* pSample);
+
+private:
+    bool FindHeader(ADTSHeader* pHeader);
+
+private:
+    ADTSHeader m_First;     // holds the config bytes
+    long m_SampleRate;
+    LONGLONG m_nSamples;
+};
+
+// little-endian PCM, cut into samples of about 20ms
+class PCMElementaryStream : public ElementaryStream
+{
+public:
+    PCMElementaryStream(const BYTE* pData, LONGLONG cBytes, MuxBufferPtr pBuffer, long sampleRate, long channels, long bitsPerSample);
+
+    bool GetConfig(MuxCodecConfig* pConfig);
+    bool Next(MuxSample* pSample);
+
+private:
+    long m_SampleRate;
+    long m_Channels;
+    long m_BitsPerSample;
+    long m_BlockAlign;
+    long m_cBlock;
+};
@@ -0,0 +1,923 @@
+// EsMux.cpp: command-line muxing of elementary stream files
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+//
+// esmux [options] output.mp4 input...
+//
+// Muxes raw .h264 (Annex B), .aac (ADTS) and .pcm files, or a single
+// MPEG-2 transport stream (.ts, .m2ts), into an MP4 file using the engine
+// directly, without DirectShow. The inputs are mapped,
+// and each sample points into the mapped pages: no payload is copied
+// until it is written to the output (H.264 start codes are replaced with
+// lengths as it is written, see H264ByteStreamHandler::Transform).
+//
+// -bench <n> runs the mux n times and reports the throughput, and then
+// repeats the runs with each sample copied on input (as the filter does
+// when it uses its own allocator) for comparison. An output of "-"
+// discards the output, to measure the muxing alone.
+//
+// -batch <list> muxes many files in one process: each line of the list
+// is an output followed by its inputs. The sessions run in parallel on
+// -jobs threads (default: one per processor), with at most -io sessions
+// at once using any one disk, and the output buffers are shared between
+// sessions. The time for each file and the total throughput are reported.
+//
+// -seek also writes a seek index sidecar (output.mp4.kidx, see SeekIndex.h).
+// -stz2 writes sample sizes as stz2 with 4, 8 or 16-bit fields where they
+// fit (not all players support it).
+// -spill keeps the index tables in a temporary file (output.mp4.spill)
+// rather than in memory until the moov is written (see IndexSpill.h).
+// -queue <ms> holds at most ms of each track's queued chunks in memory,
+// and moves the rest to a temporary file (output.mp4.queue) until they
+// are written (see QueueSpill.h).
+//
+// -group <n> adds up to n consecutive samples of an input in each call
+// to the track, as the filter does for a ReceiveMultiple batch, to
+// measure the cost per call against the cost per sample.
+//
+// -poll <n>, with -bench, runs n threads that read the movie's progress
+// as fast as they can while each run is muxed, as a user interface
+// polling it might, and reports the rate: compare the throughput with
+// and without it to see the cost of polling to the writer.
+
+#include "stdafx.h"
+#include "MovieWriter.h"
+#include "FileSink.h"
+#include "MappedFile.h"
+#include "ElementaryStream.h"
+#include "TsDemux.h"
+#include "BatchScheduler.h"
+#include "SeekIndex.h"
+#include "IndexSpill.h"
+#include "QueueSpill.h"
+#include <stdio.h>
+
+struct EsMuxOptions
+{
+    EsMuxOptions()
+    : tFrame(UNITS / 25),
+      sampleRate(48000),
+      channels(2),
+      bitsPerSample(16),
+      nRuns(0),
+      bCopy(false),
+      bSeekIndex(false),
+      bCompactSizes(false),
+      bSpill(false),
+      tQueue(0),
+      nPollers(0),
+      nGroup(0),
+      nJobs(0),
+      nPerDevice(0)
+    {
+    }
+
+    REFERENCE_TIME tFrame;
+    long sampleRate;
+    long channels;
+    long bitsPerSample;
+    int nRuns;
+    bool bCopy;
+    bool bSeekIndex;
+    bool bCompactSizes;
+    bool bSpill;
+    REFERENCE_TIME tQueue;
+    long nPollers;
+    long nGroup;
+    string strOutput;
+    vector<string> inputs;
+
+    // batch mode
+    string strBatch;
+    long nJobs;
+    long nPerDevice;
+};
+
+// size of the output buffer for each session:
+// the engine writes each NALU length and payload separately
+const long output_buffer_size = 4 * 1024 * 1024;
+
+// discards the output (for -bench with an output of "-")
+class NullSink : public AtomWriter
+{
+public:
+    NullSink()
+    : m_llBytes(0)
+    {
+    }
+    LONGLONG Length()
+    {
+        return m_llBytes;
+    }
+    LONGLONG Position()
+    {
+        return 0;
+    }
+    HRESULT Replace(LONGLONG pos, const BYTE* pBuffer, long cBytes)
+    {
+        UNREFERENCED_PARAMETER(pos);
+        UNREFERENCED_PARAMETER(pBuffer);
+        UNREFERENCED_PARAMETER(cBytes);
+        return S_OK;
+    }
+    HRESULT Append(const BYTE* pBuffer, long cBytes)
+    {
+        UNREFERENCED_PARAMETER(pBuffer);
+        m_llBytes += cBytes;
+        return S_OK;
+    }
+private:
+    LONGLONG m_llBytes;
+};
+
+// -poll: threads reading the progress of the movie while it is written.
+// Declare after the movie: the threads are stopped when this is deleted,
+// and their polls added to *pcPolls.
+class ProgressPoller
+{
+public:
+    ProgressPoller(long nThreads, LONGLONG* pcPolls)
+    : m_nThreads(nThreads),
+      m_bStop(false),
+      m_pcPolls(pcPolls)
+    {
+    }
+    ~ProgressPoller()
+    {
+        m_bStop = true;
+        for (size_t i = 0; i < m_Threads.size(); i++)
+        {
+            m_Threads[i]->Close();
+            *m_pcPolls += m_Threads[i]->Polls();
+        }
+    }
+
+    // once all the movie's tracks are made
+    void Start(MovieWriter* pMovie)
+    {
+        for (long i = 0; i < m_nThreads; i++)
+        {
+            smart_ptr<PollThread> pThread = new PollThread(pMovie, &m_bStop);
+            if (pThread->Create())
+            {
+                m_Threads.push_back(pThread);
+            }
+        }
+    }
+private:
+    class PollThread : public CAMThread
+    {
+    public:
+        PollThread(MovieWriter* pMovie, volatile bool* pbStop)
+        : m_pMovie(pMovie),
+          m_pbStop(pbStop),
+          m_cPolls(0)
+        {
+        }
+        LONGLONG Polls()
+        {
+            return m_cPolls;
+        }
+    private:
+        DWORD ThreadProc()
+        {
+            while (!*m_pbStop)
+            {
+                m_pMovie->CurrentPosition();
+                for (long i = 0; i < m_pMovie->TrackCount(); i++)
+                {
+                    m_pMovie->Track(i)->Progress();
+                }
+                m_cPolls++;
+            }
+            return 0;
+        }
+
+        MovieWriter* m_pMovie;
+        volatile bool* m_pbStop;
+        LONGLONG m_cPolls;
+    };
+
+    long m_nThreads;
+    volatile bool m_bStop;
+    LONGLONG* m_pcPolls;
+    vector<smart_ptr<PollThread> > m_Threads;
+};
+
+// one input file, its parser and the next sample to add
+class EsInput
+{
+public:
+    EsInput()
+    : m_pFile(NULL),
+      m_pTrack(NULL),
+      m_bMore(false)
+    {
+    }
+
+    HRESULT Open(const string& strPath, const EsMuxOptions* pOptions)
+    {
+        m_pFile = new MappedFile;
+        m_pHold = m_pFile;
+        HRESULT hr = m_pFile->Open(strPath.c_str());
+        if (FAILED(hr))
+        {
+            fprintf(stderr, "cannot open %s (0x%08x)\n", strPath.c_str(), (unsigned int)hr);
+            return hr;
+        }
+
+        string strExt;
+        size_t idx = strPath.find_last_of('.');
+        if (idx != string::npos)
+        {
+            strExt = strPath.substr(idx + 1);
+        }
+        if ((strExt == "h264") || (strExt == "264") || (strExt == "avc") || (strExt == "es"))
+        {
+            m_pStream = new H264ElementaryStream(m_pFile->Data(), m_pFile->Size(), m_pHold, pOptions->tFrame);
+        }
+        else if ((strExt == "aac") || (strExt == "adts"))
+        {
+            m_pStream = new ADTSElementaryStream(m_pFile->Data(), m_pFile->Size(), m_pHold);
+        }
+        else if ((strExt == "pcm") || (strExt == "raw"))
+        {
+            m_pStream = new PCMElementaryStream(m_pFile->Data(), m_pFile->Size(), m_pHold, pOptions->sampleRate, pOptions->channels, pOptions->bitsPerSample);
+        }
+        else
+        {
+            fprintf(stderr, "%s: unknown stream type\n", strPath.c_str());
+            return E_INVALIDARG;
+        }
+        if (!m_pStream->GetConfig(&m_config))
+        {
+            fprintf(stderr, "%s: stream format not recognised\n", strPath.c_str());
+            return VFW_E_TYPE_NOT_ACCEPTED;
+        }
+        return S_OK;
+    }
+
+    HRESULT MakeTrack(MovieWriter* pMovie)
+    {
+        m_pTrack = pMovie->MakeTrack(&m_config);
+        if (m_pTrack == NULL)
+        {
+            return VFW_E_TYPE_NOT_ACCEPTED;
+        }
+        m_bMore = m_pStream->Next(&m_sample);
+        if (!m_bMore)
+        {
+            m_pTrack->OnEOS();
+        }
+        return S_OK;
+    }
+
+    bool HasMore()
+    {
+        return m_bMore;
+    }
+    REFERENCE_TIME NextTime()
+    {
+        return m_sample.tStart;
+    }
+
+    // adds the next sample, or with nGroup > 1, up to nGroup
+    // consecutive samples in one call (as the filter's ReceiveMultiple)
+    HRESULT AddNext(bool bCopy, long nGroup)
+    {
+        HRESULT hr = S_OK;
+        if (nGroup > 1)
+        {
+            m_Group.clear();
+            while (m_bMore && ((long)m_Group.size() < nGroup))
+            {
+                m_Group.push_back(m_sample);
+                if (bCopy)
+                {
+                    m_Group.back().pBuffer = NULL;
+                }
+                m_bMore = m_pStream->Next(&m_sample);
+            }
+            hr = m_pTrack->Add(&m_Group[0], (long)m_Group.size());
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+        }
+        else
+        {
+            if (bCopy)
+            {
+                // the engine copies samples without a buffer
+                m_sample.pBuffer = NULL;
+            }
+            hr = m_pTrack->Add(&m_sample);
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+            m_bMore = m_pStream->Next(&m_sample);
+        }
+        if (!m_bMore)
+        {
+            m_pTrack->OnEOS();
+        }
+        return S_OK;
+    }
+
+    LONGLONG Size()
+    {
+        return m_pFile->Size();
+    }
+
+private:
+    MappedFile* m_pFile;
+    MuxBufferPtr m_pHold;
+    smart_ptr<ElementaryStream> m_pStream;
+    MuxCodecConfig m_config;
+    TrackWriter* m_pTrack;
+    MuxSample m_sample;
+    bool m_bMore;
+    vector<MuxSample> m_Group;
+};
+
+static bool
+IsTransportStream(const string& strPath)
+{
+    string strExt;
+    size_t idx = strPath.find_last_of('.');
+    if (idx != string::npos)
+    {
+        strExt = strPath.substr(idx + 1);
+    }
+    return (strExt == "ts") || (strExt == "m2ts") || (strExt == "mts");
+}
+
+// a transport stream input: its H.264 and AAC streams are the tracks,
+// with times taken from the PES headers
+static HRESULT
+MuxTransportStream(MovieWriter* pMovie, const string& strPath, LONGLONG* pcInput, ProgressPoller* pPoller)
+{
+    MappedFile* pFile = new MappedFile;
+    MuxBufferPtr pHold = pFile;
+    HRESULT hr = pFile->Open(strPath.c_str());
+    if (FAILED(hr))
+    {
+        fprintf(stderr, "cannot open %s (0x%08x)\n", strPath.c_str(), (unsigned int)hr);
+        return hr;
+    }
+    *pcInput += pFile->Size();
+
+    TsDemux demux;
+    hr = demux.Probe(pFile->Data(), pFile->Size());
+    if (FAILED(hr))
+    {
+        fprintf(stderr, "%s: no H.264 or AAC streams found\n", strPath.c_str());
+        return hr;
+    }
+    for (long i = 0; i < demux.Streams(); i++)
+    {
+        TsStream* pStream = demux.Stream(i);
+        if (pStream->IsConfigured())
+        {
+            TrackWriter* pTrack = pMovie->MakeTrack(pStream->Config());
+            if (pTrack == NULL)
+            {
+                return VFW_E_TYPE_NOT_ACCEPTED;
+            }
+            pStream->SetTrack(pTrack);
+        }
+    }
+    pPoller->Start(pMovie);
+    hr = demux.Parse(pFile->Data(), pFile->Size());
+    if (demux.ContinuityErrors() > 0)
+    {
+        fprintf(stderr, "%s: %ld continuity errors\n", strPath.c_str(), demux.ContinuityErrors());
+    }
+    return hr;
+}
+
+static HRESULT
+WidePath(const string& strPath, wstring* pstrWide)
+{
+    size_t cch = mbstowcs(NULL, strPath.c_str(), 0);
+    if (cch == (size_t)-1)
+    {
+        return E_INVALIDARG;
+    }
+    pstrWide->assign(cch, L'\0');
+    mbstowcs(&(*pstrWide)[0], strPath.c_str(), cch);
+    return S_OK;
+}
+
+static HRESULT
+CreateSeekIndex(MovieWriter* pMovie, const string& strOutput)
+{
+    wstring strPath;
+    if (FAILED(WidePath(strOutput, &strPath)))
+    {
+        return E_INVALIDARG;
+    }
+    strPath = SeekIndex::DefaultPath(strPath.c_str());
+
+    SeekIndex* pSeekIndex = new SeekIndex;
+    HRESULT hr = pSeekIndex->Create(strPath.c_str());
+    if (FAILED(hr))
+    {
+        fprintf(stderr, "cannot create seek index for %s (0x%08x)\n", strOutput.c_str(), (unsigned int)hr);
+        delete pSeekIndex;
+        return hr;
+    }
+    pMovie->SetSeekIndex(pSeekIndex);
+    return S_OK;
+}
+
+static HRESULT
+CreateIndexSpill(MovieWriter* pMovie, const string& strOutput)
+{
+    wstring strPath;
+    if (FAILED(WidePath(strOutput, &strPath)))
+    {
+        return E_INVALIDARG;
+    }
+    strPath = IndexSpill::DefaultPath(strPath.c_str());
+
+    IndexSpill* pSpill = new IndexSpill;
+    HRESULT hr = pSpill->Create(strPath.c_str());
+    if (FAILED(hr))
+    {
+        fprintf(stderr, "cannot create index spill file for %s (0x%08x)\n", strOutput.c_str(), (unsigned int)hr);
+        delete pSpill;
+        return hr;
+    }
+    pMovie->SetIndexSpill(pSpill);
+    return S_OK;
+}
+
+static HRESULT
+CreateQueueSpill(MovieWriter* pMovie, const string& strOutput, REFERENCE_TIME tQueue)
+{
+    wstring strPath;
+    if (FAILED(WidePath(strOutput, &strPath)))
+    {
+        return E_INVALIDARG;
+    }
+    strPath = QueueSpill::DefaultPath(strPath.c_str());
+
+    QueueSpill* pSpill = new QueueSpill;
+    HRESULT hr = pSpill->Create(strPath.c_str());
+    if (FAILED(hr))
+    {
+        fprintf(stderr, "cannot create queue spill file for %s (0x%08x)\n", strOutput.c_str(), (unsigned int)hr);
+        delete pSpill;
+        return hr;
+    }
+    pMovie->SetQueueSpill(pSpill, 0, tQueue);
+    return S_OK;
+}
+
+// muxes the inputs into pOut, through a buffer of output_buffer_size
+static HRESULT
+MuxTo(const EsMuxOptions* pOptions, bool bCopy, AtomWriter* pOut, smart_array<BYTE> pBuffer, LONGLONG* pcInput, LONGLONG* pcOutput,
+      LONGLONG* pcPolls)
+{
+    BufferedSink buffer(pOut, pBuffer, output_buffer_size);
+
+    vector<smart_ptr<EsInput> > inputs;
+    *pcInput = 0;
+    HRESULT hr = S_OK;
+    {
+        MovieWriter movie(&buffer);
+        movie.SetCompactSizes(pOptions->bCompactSizes);
+        ProgressPoller poller(pcPolls ? pOptions->nPollers : 0, pcPolls);
+
+        if (pOptions->bSeekIndex && (pOptions->strOutput != "-"))
+        {
+            hr = CreateSeekIndex(&movie, pOptions->strOutput);
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+        }
+        if (pOptions->bSpill && (pOptions->strOutput != "-"))
+        {
+            hr = CreateIndexSpill(&movie, pOptions->strOutput);
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+        }
+        if ((pOptions->tQueue > 0) && (pOptions->strOutput != "-"))
+        {
+            hr = CreateQueueSpill(&movie, pOptions->strOutput, pOptions->tQueue);
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+        }
+        bool bTS = (pOptions->inputs.size() == 1) && IsTransportStream(pOptions->inputs[0]);
+        if (bTS)
+        {
+            hr = MuxTransportStream(&movie, pOptions->inputs[0], pcInput, &poller);
+            if (FAILED(hr))
+            {
+                fprintf(stderr, "mux failed (0x%08x)\n", (unsigned int)hr);
+                return hr;
+            }
+        }
+        for (size_t i = 0; !bTS && (i < pOptions->inputs.size()); i++)
+        {
+            smart_ptr<EsInput> pInput = new EsInput;
+            hr = pInput->Open(pOptions->inputs[i], pOptions);
+            if (SUCCEEDED(hr))
+            {
+                hr = pInput->MakeTrack(&movie);
+            }
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+            inputs.push_back(pInput);
+            *pcInput += pInput->Size();
+        }
+        if (!bTS)
+        {
+            poller.Start(&movie);
+        }
+
+        // add in time order across the inputs, so that
+        // the interleaving queues stay short
+        for (;;)
+        {
+            EsInput* pNext = NULL;
+            for (size_t i = 0; i < inputs.size(); i++)
+            {
+                if (inputs[i]->HasMore() &&
+                    ((pNext == NULL) || (inputs[i]->NextTime() < pNext->NextTime())))
+                {
+                    pNext = inputs[i];
+                }
+            }
+            if (pNext == NULL)
+            {
+                break;
+            }
+            hr = pNext->AddNext(bCopy, pOptions->nGroup);
+            if (FAILED(hr))
+            {
+                fprintf(stderr, "mux failed (0x%08x)\n", (unsigned int)hr);
+                return hr;
+            }
+        }
+
+        REFERENCE_TIME tDuration;
+        hr = movie.Close(&tDuration);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = buffer.WriteBuffer();
+    }
+    *pcOutput = buffer.Length();
+    return hr;
+}
+
+// pPool, if not NULL, supplies the output buffer. With pcPolls, the
+// progress is polled during the mux (-poll), and the polls are added to it.
+static HRESULT
+Mux(const EsMuxOptions* pOptions, bool bCopy, LONGLONG* pcInput, LONGLONG* pcOutput, BufferPool* pPool = NULL,
+    LONGLONG* pcPolls = NULL)
+{
+    NullSink null;
+    FileSink file;
+    AtomWriter* pOut = &null;
+    if (pOptions->strOutput != "-")
+    {
+        size_t cch = mbstowcs(NULL, pOptions->strOutput.c_str(), 0);
+        if (cch == (size_t)-1)
+        {
+            return E_INVALIDARG;
+        }
+        wstring strPath(cch, L'\0');
+        mbstowcs(&strPath[0], pOptions->strOutput.c_str(), cch);
+        HRESULT hr = file.Create(strPath.c_str());
+        if (FAILED(hr))
+        {
+            fprintf(stderr, "cannot create %s (0x%08x)\n", pOptions->strOutput.c_str(), (unsigned int)hr);
+            return hr;
+        }
+        pOut = &file;
+    }
+
+    smart_array<BYTE> pBuffer = pPool ? pPool->Get() : smart_array<BYTE>(new BYTE[output_buffer_size]);
+    HRESULT hr = MuxTo(pOptions, bCopy, pOut, pBuffer, pcInput, pcOutput, pcPolls);
+    if (pPool)
+    {
+        pPool->Release(pBuffer);
+    }
+    return hr;
+}
+
+static void
+Bench(const EsMuxOptions* pOptions, bool bCopy)
+{
+    LONGLONG cInput = 0;
+    LONGLONG cOutput = 0;
+    DWORD msTotal = 0;
+    DWORD msBest = 0;
+    LONGLONG cPolls = 0;
+    for (int i = 0; i < pOptions->nRuns; i++)
+    {
+        DWORD msStart = GetTickCount();
+        if (FAILED(Mux(pOptions, bCopy, &cInput, &cOutput, NULL, &cPolls)))
+        {
+            return;
+        }
+        DWORD ms = max(GetTickCount() - msStart, DWORD(1));
+        msTotal += ms;
+        if ((i == 0) || (ms < msBest))
+        {
+            msBest = ms;
+        }
+    }
+    double mb = double(cInput) / (1024 * 1024);
+    printf("%-8s %d runs, %.1f MB in: average %.1f MB/s, best %.1f MB/s\n",
+        bCopy ? "copied" : "mapped",
+        pOptions->nRuns,
+        mb,
+        mb * 1000 * pOptions->nRuns / msTotal,
+        mb * 1000 / msBest);
+    if (pOptions->nPollers > 0)
+    {
+        printf("         %ld polling threads: %.0f polls/s\n",
+            pOptions->nPollers,
+            double(cPolls) * 1000 / msTotal);
+    }
+}
+
+// one file of a batch
+class EsMuxJob : public BatchJob
+{
+public:
+    EsMuxJob(const EsMuxOptions* pOptions, const string& strOutput, const vector<string>& inputs)
+    : m_options(*pOptions)
+    {
+        m_options.strOutput = strOutput;
+        m_options.inputs = inputs;
+    }
+
+    void GetPaths(vector<string>* pPaths)
+    {
+        *pPaths = m_options.inputs;
+        if (m_options.strOutput != "-")
+        {
+            pPaths->push_back(m_options.strOutput);
+        }
+    }
+    HRESULT Run(BufferPool* pPool, LONGLONG* pcInput, LONGLONG* pcOutput)
+    {
+        return Mux(&m_options, m_options.bCopy, pcInput, pcOutput, pPool);
+    }
+    const string& Output()
+    {
+        return m_options.strOutput;
+    }
+
+private:
+    EsMuxOptions m_options;
+};
+
+// reads the list: one output and its inputs per line, blank
+// lines and lines starting with # are ignored
+static HRESULT
+ReadBatch(const EsMuxOptions* pOptions, BatchScheduler* pScheduler, vector<EsMuxJob*>* pJobs)
+{
+    FILE* pf = fopen(pOptions->strBatch.c_str(), "r");
+    if (pf == NULL)
+    {
+        fprintf(stderr, "cannot open %s\n", pOptions->strBatch.c_str());
+        return E_INVALIDARG;
+    }
+    char szLine[4096];
+    HRESULT hr = S_OK;
+    while (fgets(szLine, sizeof(szLine), pf) != NULL)
+    {
+        vector<string> args;
+        string strLine = szLine;
+        const char* pszSpace = " \t\r\n";
+        size_t idx = strLine.find_first_not_of(pszSpace);
+        while (idx != string::npos)
+        {
+            size_t idxEnd = strLine.find_first_of(pszSpace, idx);
+            args.push_back(strLine.substr(idx, idxEnd - idx));
+            idx = strLine.find_first_not_of(pszSpace, idxEnd);
+        }
+        if (args.empty() || (args[0][0] == '#'))
+        {
+            continue;
+        }
+        if (args.size() < 2)
+        {
+            fprintf(stderr, "%s: no inputs for %s\n", pOptions->strBatch.c_str(), args[0].c_str());
+            hr = E_INVALIDARG;
+            break;
+        }
+        vector<string> inputs(args.begin() + 1, args.end());
+        EsMuxJob* pJob = new EsMuxJob(pOptions, args[0], inputs);
+        pScheduler->Add(pJob);
+        pJobs->push_back(pJob);
+    }
+    fclose(pf);
+    return hr;
+}
+
+static int
+Batch(const EsMuxOptions* pOptions)
+{
+    long nJobs = (pOptions->nJobs > 0) ? pOptions->nJobs : BatchScheduler::ProcessorCount();
+    BatchScheduler scheduler(nJobs, pOptions->nPerDevice, output_buffer_size);
+    vector<EsMuxJob*> jobs;
+    if (FAILED(ReadBatch(pOptions, &scheduler, &jobs)))
+    {
+        return 1;
+    }
+    HRESULT hr = scheduler.Run();
+
+    LONGLONG cInput = 0;
+    LONGLONG cOutput = 0;
+    long cFailed = 0;
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        EsMuxJob* pJob = jobs[i];
+        cInput += pJob->cInput;
+        cOutput += pJob->cOutput;
+        if (FAILED(pJob->hr))
+        {
+            cFailed++;
+        }
+        double mb = double(pJob->cInput) / (1024 * 1024);
+        printf("%-40s %s %8.1f MB %7lu ms %8.1f MB/s  worker %ld\n",
+            pJob->Output().c_str(),
+            FAILED(pJob->hr) ? "FAILED" : "ok    ",
+            mb,
+            (unsigned long)pJob->msElapsed,
+            mb * 1000 / max(pJob->msElapsed, DWORD(1)),
+            pJob->idxWorker);
+    }
+    double mb = double(cInput) / (1024 * 1024);
+    printf("%ld files (%ld failed) on %ld threads in %.2f s: %.1f MB in, %.1f MB out, %.1f MB/s; %ld stolen, %ld buffers\n",
+        scheduler.Jobs(),
+        cFailed,
+        scheduler.Workers(),
+        scheduler.Elapsed() / 1000.0,
+        mb,
+        double(cOutput) / (1024 * 1024),
+        mb * 1000 / scheduler.Elapsed(),
+        scheduler.Steals(),
+        scheduler.Pool()->Allocated());
+    return (hr == S_OK) ? 0 : 1;
+}
+
+static void
+Usage()
+{
+    fprintf(stderr,
+        "usage: esmux [options] output.mp4 input...\n"
+        "       esmux [options] -batch list\n"
+        "  inputs: .h264 .264 (Annex B), .aac (ADTS), .pcm .raw (little-endian PCM)\n"
+        "          or one .ts .m2ts .mts (H.264 and AAC, with times from the stream)\n"
+        "  -fps <rate>        video frame rate (default 25)\n"
+        "  -rate <hz>         PCM sampling rate (default 48000)\n"
+        "  -channels <n>      PCM channels (default 2)\n"
+        "  -bits <n>          PCM bits per sample (default 16)\n"
+        "  -copy              copy each sample on input instead of referencing the mapped file\n"
+        "  -bench <n>         run n times, mapped and copied, and report throughput\n"
+        "  -batch <list>      mux each line of the list: output input...\n"
+        "  -jobs <n>          batch threads (default: one per processor)\n"
+        "  -io <n>            batch sessions using any one disk at once (default: no limit)\n"
+        "  -seek              also write a seek index sidecar (<output>.kidx)\n"
+        "  -stz2              write sample sizes as stz2 where they fit in 16 bits\n"
+        "  -spill             hold the index in a temporary file (<output>.spill)\n"
+        "  -queue <ms>        hold at most ms of each track's queue in memory, the rest in <output>.queue\n"
+        "  -poll <n>          with -bench, n threads poll the progress during each run\n"
+        "  -group <n>         add up to n consecutive samples of an input in each call\n"
+        "  output \"-\" discards the output\n");
+}
+
+int
+main(int argc, char* argv[])
+{
+    EsMuxOptions options;
+    for (int i = 1; i < argc; i++)
+    {
+        string strArg = argv[i];
+        bool bValue = (i + 1) < argc;
+        if ((strArg == "-fps") && bValue)
+        {
+            double fps = atof(argv[++i]);
+            if (fps <= 0)
+            {
+                Usage();
+                return 1;
+            }
+            options.tFrame = REFERENCE_TIME(UNITS / fps + 0.5);
+        }
+        else if ((strArg == "-rate") && bValue)
+        {
+            options.sampleRate = atol(argv[++i]);
+        }
+        else if ((strArg == "-channels") && bValue)
+        {
+            options.channels = atol(argv[++i]);
+        }
+        else if ((strArg == "-bits") && bValue)
+        {
+            options.bitsPerSample = atol(argv[++i]);
+        }
+        else if ((strArg == "-bench") && bValue)
+        {
+            options.nRuns = atoi(argv[++i]);
+        }
+        else if ((strArg == "-poll") && bValue)
+        {
+            options.nPollers = atol(argv[++i]);
+        }
+        else if ((strArg == "-queue") && bValue)
+        {
+            options.tQueue = REFERENCE_TIME(atol(argv[++i])) * (UNITS / 1000);
+        }
+        else if ((strArg == "-group") && bValue)
+        {
+            options.nGroup = atol(argv[++i]);
+        }
+        else if ((strArg == "-batch") && bValue)
+        {
+            options.strBatch = argv[++i];
+        }
+        else if ((strArg == "-jobs") && bValue)
+        {
+            options.nJobs = atol(argv[++i]);
+        }
+        else if ((strArg == "-io") && bValue)
+        {
+            options.nPerDevice = atol(argv[++i]);
+        }
+        else if (strArg == "-copy")
+        {
+            options.bCopy = true;
+        }
+        else if (strArg == "-seek")
+        {
+            options.bSeekIndex = true;
+        }
+        else if (strArg == "-stz2")
+        {
+            options.bCompactSizes = true;
+        }
+        else if (strArg == "-spill")
+        {
+            options.bSpill = true;
+        }
+        else if ((strArg.size() > 1) && (strArg[0] == '-'))
+        {
+            Usage();
+            return 1;
+        }
+        else if (options.strOutput.empty())
+        {
+            options.strOutput = strArg;
+        }
+        else
+        {
+            options.inputs.push_back(strArg);
+        }
+    }
+    if (!options.strBatch.empty())
+    {
+        if (!options.strOutput.empty())
+        {
+            Usage();
+            return 1;
+        }
+        return Batch(&options);
+    }
+    if (options.inputs.empty())
+    {
+        Usage();
+        return 1;
+    }
+
+    if (options.nRuns > 0)
+    {
+        Bench(&options, false);
+        Bench(&options, true);
+        return 0;
+    }
+
+    LONGLONG cInput, cOutput;
+    HRESULT hr = Mux(&options, options.bCopy, &cInput, &cOutput);
+    return SUCCEEDED(hr) ? 0 : 1;
+}
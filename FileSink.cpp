@@ -0,0 +1,667 @@
+// FileSink.cpp: AtomWriter container over a plain file handle.
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "FileSink.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+FileSink::FileSink()
+: m_llBytes(0)
+{
+#ifdef _WIN32
+    m_hFile = INVALID_HANDLE_VALUE;
+#else
+    m_fd = -1;
+#endif
+}
+
+FileSink::~FileSink()
+{
+    Close();
+}
+
+HRESULT
+FileSink::Append(const BYTE* pBuffer, long cBytes)
+{
+    CAutoLock lock(&m_csFile);
+    HRESULT hr = Replace(m_llBytes, pBuffer, cBytes);
+    if (SUCCEEDED(hr))
+    {
+        m_llBytes += cBytes;
+    }
+    return hr;
+}
+
+// unit of copy between files
+const long copy_block_size = 1024 * 1024;
+
+HRESULT
+FileSink::CopyFrom(FileSink* pSource, LONGLONG pos, LONGLONG cBytes)
+{
+#if !defined(_WIN32) && defined(__linux__)
+    while (cBytes > 0)
+    {
+        // positioned I/O, so the source lock is not held during the copy
+        int fdSource;
+        {
+            CAutoLock lockSource(&pSource->m_csFile);
+            fdSource = pSource->m_fd;
+        }
+        CAutoLock lock(&m_csFile);
+        if (!IsOpen() || (fdSource < 0))
+        {
+            return E_FAIL;
+        }
+        loff_t posIn = pos;
+        loff_t posOut = m_llBytes;
+        size_t cThis = size_t(min(cBytes, LONGLONG(copy_block_size) * 16));
+        ssize_t cActual = copy_file_range(fdSource, &posIn, m_fd, &posOut, cThis, 0);
+        if (cActual < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if ((errno == ENOSYS) || (errno == EXDEV) || (errno == EINVAL) || (errno == EOPNOTSUPP))
+            {
+                // not between these files: copy through memory instead
+                break;
+            }
+            return HRESULT_FROM_ERRNO(errno);
+        }
+        if (cActual == 0)
+        {
+            // beyond the end of the source
+            return E_FAIL;
+        }
+        pos += cActual;
+        cBytes -= cActual;
+        m_llBytes += cActual;
+    }
+#endif
+
+    if (cBytes > 0)
+    {
+        smart_array<BYTE> pBuffer = new BYTE[copy_block_size];
+        while (cBytes > 0)
+        {
+            long cThis = long(min(cBytes, LONGLONG(copy_block_size)));
+            HRESULT hr = pSource->Read(pos, pBuffer, cThis);
+            if (SUCCEEDED(hr))
+            {
+                hr = Append(pBuffer, cThis);
+            }
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+            pos += cThis;
+            cBytes -= cThis;
+        }
+    }
+    return S_OK;
+}
+
+// --- buffering ---------------------------------------------------
+
+BufferedSink::BufferedSink(AtomWriter* pTarget, long cBuffer)
+: m_pTarget(pTarget),
+  m_pBuffer(new BYTE[cBuffer]),
+  m_cBuffer(cBuffer),
+  m_cValid(0),
+  m_llWritten(pTarget->Length())
+{
+}
+
+BufferedSink::BufferedSink(AtomWriter* pTarget, smart_array<BYTE> pBuffer, long cBuffer)
+: m_pTarget(pTarget),
+  m_pBuffer(pBuffer),
+  m_cBuffer(cBuffer),
+  m_cValid(0),
+  m_llWritten(pTarget->Length())
+{
+}
+
+HRESULT
+BufferedSink::WriteBuffer()
+{
+    CAutoLock lock(&m_csBuffer);
+    if (m_cValid == 0)
+    {
+        return S_OK;
+    }
+    HRESULT hr = m_pTarget->Append(m_pBuffer, m_cValid);
+    if (SUCCEEDED(hr))
+    {
+        m_llWritten += m_cValid;
+        m_cValid = 0;
+    }
+    return hr;
+}
+
+HRESULT
+BufferedSink::Append(const BYTE* pBuffer, long cBytes)
+{
+    CAutoLock lock(&m_csBuffer);
+    HRESULT hr = S_OK;
+    if ((m_cValid + cBytes) > m_cBuffer)
+    {
+        hr = WriteBuffer();
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+    }
+    if (cBytes >= m_cBuffer)
+    {
+        // too large to buffer
+        hr = m_pTarget->Append(pBuffer, cBytes);
+        if (SUCCEEDED(hr))
+        {
+            m_llWritten += cBytes;
+        }
+        return hr;
+    }
+    CopyMemory(m_pBuffer + m_cValid, pBuffer, cBytes);
+    m_cValid += cBytes;
+    return S_OK;
+}
+
+HRESULT
+BufferedSink::Replace(LONGLONG pos, const BYTE* pBuffer, long cBytes)
+{
+    CAutoLock lock(&m_csBuffer);
+    if ((pos + cBytes) > (m_llWritten + m_cValid))
+    {
+        return E_INVALIDARG;
+    }
+
+    // any part already written goes to the target
+    HRESULT hr = S_OK;
+    if (pos < m_llWritten)
+    {
+        long cWritten = long(min(LONGLONG(cBytes), m_llWritten - pos));
+        hr = m_pTarget->Replace(pos, pBuffer, cWritten);
+        pos += cWritten;
+        pBuffer += cWritten;
+        cBytes -= cWritten;
+    }
+    if (SUCCEEDED(hr) && (cBytes > 0))
+    {
+        CopyMemory(m_pBuffer + long(pos - m_llWritten), pBuffer, cBytes);
+    }
+    return hr;
+}
+
+HRESULT
+BufferedSink::Flush()
+{
+    HRESULT hr = WriteBuffer();
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pTarget->Flush();
+    }
+    return hr;
+}
+
+// --- memory ------------------------------------------------------
+
+HRESULT
+MemorySink::Replace(LONGLONG pos, const BYTE* pBuffer, long cBytes)
+{
+    if ((pos < 0) || ((pos + cBytes) > m_llBytes))
+    {
+        return E_INVALIDARG;
+    }
+    while (cBytes > 0)
+    {
+        long offset = long(pos % segment_size);
+        long cThis = min(cBytes, long(segment_size - offset));
+        CopyMemory(m_Segments[long(pos / segment_size)] + offset, pBuffer, cThis);
+        pos += cThis;
+        pBuffer += cThis;
+        cBytes -= cThis;
+    }
+    return S_OK;
+}
+
+HRESULT
+MemorySink::Append(const BYTE* pBuffer, long cBytes)
+{
+    while (cBytes > 0)
+    {
+        long offset = long(m_llBytes % segment_size);
+        if (offset == 0)
+        {
+            m_Segments.push_back(new BYTE[segment_size]);
+        }
+        long cThis = min(cBytes, long(segment_size - offset));
+        CopyMemory(m_Segments.back() + offset, pBuffer, cThis);
+        m_llBytes += cThis;
+        pBuffer += cThis;
+        cBytes -= cThis;
+    }
+    return S_OK;
+}
+
+HRESULT
+MemorySink::CopyTo(AtomWriter* pTarget)
+{
+    HRESULT hr = S_OK;
+    LONGLONG llLeft = m_llBytes;
+    for (UINT i = 0; SUCCEEDED(hr) && (llLeft > 0); i++)
+    {
+        long cThis = long(min(llLeft, LONGLONG(segment_size)));
+        hr = pTarget->Append(m_Segments[i], cThis);
+        llLeft -= cThis;
+    }
+    return hr;
+}
+
+#ifdef _WIN32
+
+//static
+HRESULT
+FileSink::Delete(LPCWSTR pszFile)
+{
+    if (!DeleteFile(pszFile))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    return S_OK;
+}
+
+HRESULT
+FileSink::Create(LPCWSTR pszFile)
+{
+    CAutoLock lock(&m_csFile);
+    if (IsOpen())
+    {
+        return VFW_E_WRONG_STATE;
+    }
+    m_hFile = CreateFile(pszFile, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    m_llBytes = 0;
+    return S_OK;
+}
+
+HRESULT
+FileSink::Open(LPCWSTR pszFile, bool bReadOnly)
+{
+    CAutoLock lock(&m_csFile);
+    if (IsOpen())
+    {
+        return VFW_E_WRONG_STATE;
+    }
+    DWORD dwAccess = bReadOnly ? GENERIC_READ : (GENERIC_READ | GENERIC_WRITE);
+    m_hFile = CreateFile(pszFile, dwAccess, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    LARGE_INTEGER liSize;
+    if (!GetFileSizeEx(m_hFile, &liSize))
+    {
+        HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+        return hr;
+    }
+    m_llBytes = liSize.QuadPart;
+    return S_OK;
+}
+
+void
+FileSink::Close()
+{
+    CAutoLock lock(&m_csFile);
+    if (IsOpen())
+    {
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
+    m_llBytes = 0;
+}
+
+HRESULT
+FileSink::Seek(LONGLONG pos)
+{
+    LARGE_INTEGER liTo;
+    liTo.QuadPart = pos;
+    if (!SetFilePointerEx(m_hFile, liTo, NULL, FILE_BEGIN))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    return S_OK;
+}
+
+HRESULT
+FileSink::Replace(LONGLONG pos, const BYTE* pBuffer, long cBytes)
+{
+    CAutoLock lock(&m_csFile);
+    if (!IsOpen())
+    {
+        return E_FAIL;
+    }
+    HRESULT hr = Seek(pos);
+    if (SUCCEEDED(hr))
+    {
+        DWORD cActual;
+        if (!WriteFile(m_hFile, pBuffer, cBytes, &cActual, NULL))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+        else if ((long)cActual != cBytes)
+        {
+            hr = E_FAIL;
+        }
+    }
+    return hr;
+}
+
+HRESULT
+FileSink::Read(LONGLONG pos, BYTE* pBuffer, long cBytes)
+{
+    CAutoLock lock(&m_csFile);
+    if (!IsOpen())
+    {
+        return E_FAIL;
+    }
+    HRESULT hr = Seek(pos);
+    if (SUCCEEDED(hr))
+    {
+        DWORD cActual;
+        if (!ReadFile(m_hFile, pBuffer, cBytes, &cActual, NULL))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+        else if ((long)cActual != cBytes)
+        {
+            hr = E_FAIL;
+        }
+    }
+    return hr;
+}
+
+HRESULT
+FileSink::Flush()
+{
+    HANDLE hFile;
+    {
+        CAutoLock lock(&m_csFile);
+        if (!IsOpen())
+        {
+            return E_FAIL;
+        }
+        hFile = m_hFile;
+    }
+
+    // the flush may take some time: don't hold up writes while it
+    // completes. The file must not be closed during a Flush call.
+    if (!FlushFileBuffers(hFile))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    return S_OK;
+}
+
+HRESULT
+FileSink::SetLength(LONGLONG llBytes)
+{
+    CAutoLock lock(&m_csFile);
+    if (!IsOpen())
+    {
+        return E_FAIL;
+    }
+    HRESULT hr = Seek(llBytes);
+    if (SUCCEEDED(hr))
+    {
+        if (!SetEndOfFile(m_hFile))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+        else
+        {
+            m_llBytes = llBytes;
+        }
+    }
+    return hr;
+}
+
+// --- IStream container -------------------------------------------
+
+StreamSink::StreamSink(IStream* pStream)
+: m_pStream(pStream),
+  m_llBytes(0)
+{
+}
+
+HRESULT
+StreamSink::Replace(LONGLONG pos, const BYTE* pBuffer, long cBytes)
+{
+    CAutoLock lock(&m_csWrite);
+    LARGE_INTEGER liTo;
+    liTo.QuadPart = pos;
+    ULARGE_INTEGER uliUnused;
+    HRESULT hr = m_pStream->Seek(liTo, STREAM_SEEK_SET, &uliUnused);
+    if (SUCCEEDED(hr))
+    {
+        ULONG cActual;
+        hr = m_pStream->Write(pBuffer, cBytes, &cActual);
+        if (SUCCEEDED(hr) && ((long)cActual != cBytes))
+        {
+            hr = E_FAIL;
+        }
+    }
+    return hr;
+}
+
+HRESULT
+StreamSink::Append(const BYTE* pBuffer, long cBytes)
+{
+    CAutoLock lock(&m_csWrite);
+    HRESULT hr = Replace(m_llBytes, pBuffer, cBytes);
+    if (SUCCEEDED(hr))
+    {
+        m_llBytes += cBytes;
+    }
+    return hr;
+}
+
+HRESULT
+StreamSink::Flush()
+{
+    // not under the write lock: writing continues during the commit
+    return m_pStream->Commit(STGC_DEFAULT);
+}
+
+#else // _WIN32
+
+// --- file descriptor ---------------------------------------------
+
+// paths are converted in the current locale
+static string NarrowPath(LPCWSTR pszFile)
+{
+    size_t cch = wcstombs(NULL, pszFile, 0);
+    if (cch == (size_t)-1)
+    {
+        return string();
+    }
+    string strPath(cch, '\0');
+    wcstombs(&strPath[0], pszFile, cch);
+    return strPath;
+}
+
+//static
+HRESULT
+FileSink::Delete(LPCWSTR pszFile)
+{
+    if (unlink(NarrowPath(pszFile).c_str()) != 0)
+    {
+        return HRESULT_FROM_ERRNO(errno);
+    }
+    return S_OK;
+}
+
+HRESULT
+FileSink::Create(LPCWSTR pszFile)
+{
+    CAutoLock lock(&m_csFile);
+    if (IsOpen())
+    {
+        return VFW_E_WRONG_STATE;
+    }
+    m_fd = open(NarrowPath(pszFile).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (m_fd < 0)
+    {
+        return HRESULT_FROM_ERRNO(errno);
+    }
+    m_llBytes = 0;
+    return S_OK;
+}
+
+HRESULT
+FileSink::Open(LPCWSTR pszFile, bool bReadOnly)
+{
+    CAutoLock lock(&m_csFile);
+    if (IsOpen())
+    {
+        return VFW_E_WRONG_STATE;
+    }
+    m_fd = open(NarrowPath(pszFile).c_str(), bReadOnly ? O_RDONLY : O_RDWR);
+    if (m_fd < 0)
+    {
+        return HRESULT_FROM_ERRNO(errno);
+    }
+    off_t size = lseek(m_fd, 0, SEEK_END);
+    if (size < 0)
+    {
+        HRESULT hr = HRESULT_FROM_ERRNO(errno);
+        close(m_fd);
+        m_fd = -1;
+        return hr;
+    }
+    m_llBytes = size;
+    return S_OK;
+}
+
+void
+FileSink::Close()
+{
+    CAutoLock lock(&m_csFile);
+    if (IsOpen())
+    {
+        close(m_fd);
+        m_fd = -1;
+    }
+    m_llBytes = 0;
+}
+
+HRESULT
+FileSink::Replace(LONGLONG pos, const BYTE* pBuffer, long cBytes)
+{
+    CAutoLock lock(&m_csFile);
+    if (!IsOpen())
+    {
+        return E_FAIL;
+    }
+    while (cBytes > 0)
+    {
+        ssize_t cActual = pwrite(m_fd, pBuffer, cBytes, pos);
+        if (cActual < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return HRESULT_FROM_ERRNO(errno);
+        }
+        pBuffer += cActual;
+        cBytes -= long(cActual);
+        pos += cActual;
+    }
+    return S_OK;
+}
+
+HRESULT
+FileSink::Read(LONGLONG pos, BYTE* pBuffer, long cBytes)
+{
+    CAutoLock lock(&m_csFile);
+    if (!IsOpen())
+    {
+        return E_FAIL;
+    }
+    while (cBytes > 0)
+    {
+        ssize_t cActual = pread(m_fd, pBuffer, cBytes, pos);
+        if (cActual < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return HRESULT_FROM_ERRNO(errno);
+        }
+        if (cActual == 0)
+        {
+            // beyond the end of the file
+            return E_FAIL;
+        }
+        pBuffer += cActual;
+        cBytes -= long(cActual);
+        pos += cActual;
+    }
+    return S_OK;
+}
+
+HRESULT
+FileSink::Flush()
+{
+    int fd;
+    {
+        CAutoLock lock(&m_csFile);
+        if (!IsOpen())
+        {
+            return E_FAIL;
+        }
+        fd = m_fd;
+    }
+
+    // as on Windows, writes continue while the flush completes
+    if (fdatasync(fd) != 0)
+    {
+        return HRESULT_FROM_ERRNO(errno);
+    }
+    return S_OK;
+}
+
+HRESULT
+FileSink::SetLength(LONGLONG llBytes)
+{
+    CAutoLock lock(&m_csFile);
+    if (!IsOpen())
+    {
+        return E_FAIL;
+    }
+    if (ftruncate(m_fd, llBytes) != 0)
+    {
+        return HRESULT_FROM_ERRNO(errno);
+    }
+    m_llBytes = llBytes;
+    return S_OK;
+}
+
+#endif // _WIN32
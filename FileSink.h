@@ -0,0 +1,194 @@
+// FileSink.h: AtomWriter container over a plain file handle.
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "MovieWriter.h"
+
+// The filter normally writes through its output pin, but
+// side files (journal, recovery) and tools need to write
+// directly to a file. This is the outermost container for
+// those cases, equivalent to the output pin. Without DirectShow,
+// it is the output of the engine: a Win32 file handle on Windows,
+// or a file descriptor elsewhere.
+class FileSink : public AtomWriter
+{
+public:
+    FileSink();
+    ~FileSink();
+
+    // create new (truncating any existing file) or open existing for update
+    HRESULT Create(LPCWSTR pszFile);
+    HRESULT Open(LPCWSTR pszFile, bool bReadOnly = false);
+    void Close();
+    bool IsOpen()
+    {
+#ifdef _WIN32
+        return (m_hFile != INVALID_HANDLE_VALUE);
+#else
+        return (m_fd >= 0);
+#endif
+    }
+    static HRESULT Delete(LPCWSTR pszFile);
+
+    // AtomWriter methods
+    LONGLONG Length()
+    {
+        return m_llBytes;
+    }
+    LONGLONG Position()
+    {
+        return 0;
+    }
+    HRESULT Replace(LONGLONG pos, const BYTE* pBuffer, long cBytes);
+    HRESULT Append(const BYTE* pBuffer, long cBytes);
+
+    // direct file access
+    HRESULT Read(LONGLONG pos, BYTE* pBuffer, long cBytes);
+    HRESULT Flush();
+
+    // appends cBytes from pos in another file without passing them
+    // through the caller. On Linux the copy is made in the kernel, and
+    // filesystems with shared extents (btrfs, xfs) can reflink it.
+    // The source can be written to meanwhile.
+    HRESULT CopyFrom(FileSink* pSource, LONGLONG pos, LONGLONG cBytes);
+
+    // discard anything beyond llBytes; subsequent
+    // appends are written from this point
+    HRESULT SetLength(LONGLONG llBytes);
+
+private:
+#ifdef _WIN32
+    HRESULT Seek(LONGLONG pos);
+#endif
+
+private:
+    CCritSec m_csFile;
+#ifdef _WIN32
+    HANDLE m_hFile;
+#else
+    int m_fd;
+#endif
+    LONGLONG m_llBytes;
+};
+
+// Coalesces small appends (eg a length field and payload for each
+// NALU) into large writes to another container. A Replace of data that
+// is still buffered patches the buffer.
+class BufferedSink : public AtomWriter
+{
+public:
+    BufferedSink(AtomWriter* pTarget, long cBuffer);
+
+    // uses a buffer supplied by the caller, eg from a pool
+    // shared between sessions
+    BufferedSink(AtomWriter* pTarget, smart_array<BYTE> pBuffer, long cBuffer);
+
+    LONGLONG Length()
+    {
+        CAutoLock lock(&m_csBuffer);
+        return m_llWritten + m_cValid;
+    }
+    LONGLONG Position()
+    {
+        return m_pTarget->Position();
+    }
+    HRESULT Replace(LONGLONG pos, const BYTE* pBuffer, long cBytes);
+    HRESULT Append(const BYTE* pBuffer, long cBytes);
+
+    // writes out the buffer and commits the target
+    HRESULT Flush();
+
+    // writes out the buffer without committing: call before
+    // closing the target
+    HRESULT WriteBuffer();
+
+private:
+    CCritSec m_csBuffer;
+    AtomWriter* m_pTarget;
+    smart_array<BYTE> m_pBuffer;
+    long m_cBuffer;
+    long m_cValid;
+    LONGLONG m_llWritten;
+};
+
+// A growable buffer in memory, so that an atom can be built on one
+// thread and appended to its container on another (eg the traks,
+// built in parallel when the movie is closed). It is held in
+// fixed-size segments, so growing it does not copy what is written.
+class MemorySink : public AtomWriter
+{
+public:
+    MemorySink()
+    : m_llBytes(0)
+    {
+    }
+
+    LONGLONG Length()
+    {
+        return m_llBytes;
+    }
+    LONGLONG Position()
+    {
+        return 0;
+    }
+    HRESULT Replace(LONGLONG pos, const BYTE* pBuffer, long cBytes);
+    HRESULT Append(const BYTE* pBuffer, long cBytes);
+
+    // appends the contents to pTarget, a segment at a time
+    HRESULT CopyTo(AtomWriter* pTarget);
+
+    // release the memory
+    void Clear()
+    {
+        m_Segments.clear();
+        m_llBytes = 0;
+    }
+
+    enum {
+        segment_size = 256 * 1024,
+    };
+
+private:
+    vector<smart_array<BYTE> > m_Segments;
+    LONGLONG m_llBytes;
+};
+
+#ifdef _WIN32
+
+// AtomWriter over a caller-supplied IStream, eg for the
+// files of a rolling recording. The stream is written from
+// the start, so it should be empty.
+class StreamSink : public AtomWriter
+{
+public:
+    StreamSink(IStream* pStream);
+
+    LONGLONG Length()
+    {
+        return m_llBytes;
+    }
+    LONGLONG Position()
+    {
+        return 0;
+    }
+    HRESULT Replace(LONGLONG pos, const BYTE* pBuffer, long cBytes);
+    HRESULT Append(const BYTE* pBuffer, long cBytes);
+    HRESULT Flush();
+
+    IStream* Stream()
+    {
+        return m_pStream;
+    }
+
+private:
+    CCritSec m_csWrite;
+    IStreamPtr m_pStream;
+    LONGLONG m_llBytes;
+};
+#endif // _WIN32
@@ -0,0 +1,503 @@
+// HashSink.cpp: digests of the output computed as it is written
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "HashSink.h"
+#include <intrin.h>
+#include <nmmintrin.h>
+
+// --- CRC32C -----------------------------------------------------
+
+// Castagnoli polynomial, bit-reversed
+static const DWORD crc32c_poly = 0x82f63b78;
+
+static DWORD crc32c_table[256];
+static DWORD crc32c_x2n[32];        // x^(2^n) mod p
+static bool bHardwareCRC = false;
+
+// built once at load time
+static struct CRC32CTables
+{
+    CRC32CTables()
+    {
+        for (DWORD n = 0; n < 256; n++)
+        {
+            DWORD crc = n;
+            for (int k = 0; k < 8; k++)
+            {
+                crc = (crc & 1) ? ((crc >> 1) ^ crc32c_poly) : (crc >> 1);
+            }
+            crc32c_table[n] = crc;
+        }
+
+        DWORD p = DWORD(1) << 30;       // x^1
+        crc32c_x2n[0] = p;
+        for (int n = 1; n < 32; n++)
+        {
+            crc32c_x2n[n] = p = CRC32C_MultModP(p, p);
+        }
+
+        // SSE4.2 has the crc32 instruction, which uses this polynomial
+        int info[4];
+        __cpuid(info, 1);
+        bHardwareCRC = (info[2] & (1 << 20)) != 0;
+    }
+
+    static DWORD CRC32C_MultModP(DWORD a, DWORD b);
+} tables;
+
+// a * b modulo p, in the bit-reversed representation
+//static
+DWORD
+CRC32CTables::CRC32C_MultModP(DWORD a, DWORD b)
+{
+    DWORD m = DWORD(1) << 31;
+    DWORD p = 0;
+    for (;;)
+    {
+        if (a & m)
+        {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+            {
+                break;
+            }
+        }
+        m >>= 1;
+        b = (b & 1) ? ((b >> 1) ^ crc32c_poly) : (b >> 1);
+    }
+    return p;
+}
+
+//static
+DWORD
+CRC32C::MultModP(DWORD a, DWORD b)
+{
+    return CRC32CTables::CRC32C_MultModP(a, b);
+}
+
+// x^(8 * cBytes) modulo p: the effect of cBytes of zeros
+//static
+DWORD
+CRC32C::X8NModP(LONGLONG cBytes)
+{
+    DWORD p = DWORD(1) << 31;       // x^0
+    int k = 3;
+    while (cBytes)
+    {
+        if (cBytes & 1)
+        {
+            p = MultModP(crc32c_x2n[k & 31], p);
+        }
+        cBytes >>= 1;
+        k++;
+    }
+    return p;
+}
+
+//static
+DWORD
+CRC32C::Update(DWORD crc, const BYTE* pData, long cBytes)
+{
+    if (bHardwareCRC)
+    {
+        while ((cBytes > 0) && ((UINT_PTR(pData) & 7) != 0))
+        {
+            crc = _mm_crc32_u8(crc, *pData++);
+            cBytes--;
+        }
+#ifdef _M_X64
+        while (cBytes >= 8)
+        {
+            crc = DWORD(_mm_crc32_u64(crc, *(const unsigned __int64*)pData));
+            pData += 8;
+            cBytes -= 8;
+        }
+#endif
+        while (cBytes >= 4)
+        {
+            crc = _mm_crc32_u32(crc, *(const unsigned int*)pData);
+            pData += 4;
+            cBytes -= 4;
+        }
+        while (cBytes > 0)
+        {
+            crc = _mm_crc32_u8(crc, *pData++);
+            cBytes--;
+        }
+    }
+    else
+    {
+        while (cBytes > 0)
+        {
+            crc = crc32c_table[(crc ^ *pData++) & 0xff] ^ (crc >> 8);
+            cBytes--;
+        }
+    }
+    return crc;
+}
+
+//static
+DWORD
+CRC32C::Patch(const BYTE* pDelta, long cBytes, LONGLONG cFollowing)
+{
+    // crc of the delta from a zero register, moved
+    // past the following bytes
+    DWORD crc = Update(0, pDelta, cBytes);
+    return MultModP(X8NModP(cFollowing), crc);
+}
+
+// --- SHA-256 ----------------------------------------------------
+
+SHA256Hash::SHA256Hash()
+: m_hAlg(NULL),
+  m_hHash(NULL)
+{
+    if (BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&m_hAlg, BCRYPT_SHA256_ALGORITHM, NULL, 0)))
+    {
+        DWORD cbObject = 0;
+        ULONG cbResult;
+        BCryptGetProperty(m_hAlg, BCRYPT_OBJECT_LENGTH, (PUCHAR)&cbObject, sizeof(cbObject), &cbResult, 0);
+        m_pObject = new BYTE[cbObject];
+        if (!BCRYPT_SUCCESS(BCryptCreateHash(m_hAlg, &m_hHash, m_pObject, cbObject, NULL, 0, 0)))
+        {
+            m_hHash = NULL;
+        }
+    }
+}
+
+SHA256Hash::~SHA256Hash()
+{
+    if (m_hHash)
+    {
+        BCryptDestroyHash(m_hHash);
+    }
+    if (m_hAlg)
+    {
+        BCryptCloseAlgorithmProvider(m_hAlg, 0);
+    }
+}
+
+void
+SHA256Hash::Update(const BYTE* pData, long cBytes)
+{
+    if (m_hHash && (cBytes > 0))
+    {
+        BCryptHashData(m_hHash, const_cast<PUCHAR>(pData), cBytes, 0);
+    }
+}
+
+void
+SHA256Hash::Final(BYTE* pDigest)
+{
+    ZeroMemory(pDigest, digest_size);
+    if (m_hHash)
+    {
+        BCryptFinishHash(m_hHash, pDigest, digest_size, 0);
+    }
+}
+
+// --- hashing container ------------------------------------------
+
+HashSink::HashSink(AtomWriter* pContainer)
+: m_pContainer(pContainer),
+  m_crc(CRC32C::Init()),
+  m_bCRCValid(true),
+  m_bSHAValid(true),
+  m_bClosed(false),
+  m_crcFinal(0)
+{
+    ZeroMemory(m_SHAFinal, sizeof(m_SHAFinal));
+    m_Regions.push_back(new Region(pContainer->Length()));
+}
+
+HashSink::~HashSink()
+{
+}
+
+bool
+HashSink::OnAppend(const BYTE* pBuffer, long cBytes, HRESULT hr)
+{
+    if (FAILED(hr) || m_bClosed)
+    {
+        // the file contents are no longer known
+        m_bCRCValid = false;
+        m_bSHAValid = false;
+        return false;
+    }
+    m_crc = CRC32C::Update(m_crc, pBuffer, cBytes);
+    return true;
+}
+
+HRESULT
+HashSink::Append(const BYTE* pBuffer, long cBytes)
+{
+    CAutoLock lock(&m_csHash);
+    LONGLONG pos = Length();
+    HRESULT hr = m_pContainer->Append(pBuffer, cBytes);
+    if (OnAppend(pBuffer, cBytes, hr))
+    {
+        m_Regions.back()->Write(pos, pBuffer, cBytes);
+    }
+    return hr;
+}
+
+HRESULT
+HashSink::AppendHeader(const BYTE* pHeader)
+{
+    CAutoLock lock(&m_csHash);
+    LONGLONG pos = Length();
+    HRESULT hr = m_pContainer->AppendHeader(pHeader);
+    if (!OnAppend(pHeader, 8, hr))
+    {
+        return hr;
+    }
+
+    // the length is replaced when the atom is closed
+    Header h;
+    h.pos = pos;
+    CopyMemory(h.b, pHeader, 8);
+    m_Headers.push_back(h);
+
+    if (DWORD(ReadLong(pHeader + 4)) == DWORD('mdat'))
+    {
+        // the mdat header is hashed on its own, and
+        // the payload starts a new region
+        StartRegion(pos);
+        m_Regions.back()->Hold(pos);
+        m_Regions.back()->Write(pos, pHeader, 8);
+        StartRegion(pos + 8);
+    }
+    else
+    {
+        m_Regions.back()->Hold(pos);
+        m_Regions.back()->Write(pos, pHeader, 8);
+    }
+    return hr;
+}
+
+HRESULT
+HashSink::Replace(LONGLONG pos, const BYTE* pBuffer, long cBytes)
+{
+    CAutoLock lock(&m_csHash);
+    HRESULT hr = m_pContainer->Replace(pos, pBuffer, cBytes);
+    if (FAILED(hr) || m_bClosed)
+    {
+        m_bCRCValid = false;
+        m_bSHAValid = false;
+        return hr;
+    }
+
+    // crc: patch the change into the register
+    bool bFound = false;
+    list<Header>::iterator it;
+    for (it = m_Headers.begin(); it != m_Headers.end(); it++)
+    {
+        if ((it->pos <= pos) && ((pos + cBytes) <= (it->pos + 8)))
+        {
+            BYTE delta[8];
+            const BYTE* pOld = it->b + (pos - it->pos);
+            for (long i = 0; i < cBytes; i++)
+            {
+                delta[i] = pOld[i] ^ pBuffer[i];
+            }
+            m_crc ^= CRC32C::Patch(delta, cBytes, Length() - (pos + cBytes));
+            m_Headers.erase(it);
+            bFound = true;
+            break;
+        }
+    }
+    if (!bFound)
+    {
+        m_bCRCValid = false;
+    }
+
+    // sha: patch the held data in the region
+    list<RegionPtr>::reverse_iterator itRegion;
+    for (itRegion = m_Regions.rbegin(); itRegion != m_Regions.rend(); itRegion++)
+    {
+        if ((*itRegion)->Contains(pos))
+        {
+            if (!(*itRegion)->Patch(pos, pBuffer, cBytes))
+            {
+                m_bSHAValid = false;
+            }
+            break;
+        }
+    }
+    if (itRegion == m_Regions.rend())
+    {
+        // in a region already complete
+        m_bSHAValid = false;
+    }
+    CompleteRegions(false);
+    return hr;
+}
+
+void
+HashSink::StartRegion(LONGLONG pos)
+{
+    m_Regions.back()->End(pos);
+    CompleteRegions(false);
+    m_Regions.push_back(new Region(pos));
+}
+
+void
+HashSink::CompleteRegions(bool bAll)
+{
+    // the region digests go into the file digest in order
+    while ((m_Regions.size() > 0) && (bAll || m_Regions.front()->IsComplete()))
+    {
+        RegionDigest digest;
+        m_Regions.front()->Final(&digest);
+        m_File.Update(digest.digest, sizeof(digest.digest));
+        m_Digests.push_back(digest);
+        m_Regions.pop_front();
+    }
+}
+
+void
+HashSink::Close()
+{
+    CAutoLock lock(&m_csHash);
+    if (!m_bClosed)
+    {
+        // any header still held is in the file as written
+        m_Regions.back()->End(Length());
+        CompleteRegions(true);
+        m_File.Final(m_SHAFinal);
+        m_crcFinal = CRC32C::Final(m_crc);
+        m_bClosed = true;
+    }
+}
+
+HRESULT
+HashSink::GetDigests(DWORD* pCRC32C, BYTE* pSHA256)
+{
+    CAutoLock lock(&m_csHash);
+    if (!m_bClosed)
+    {
+        return VFW_E_WRONG_STATE;
+    }
+    if (!m_bCRCValid || !m_bSHAValid)
+    {
+        return E_FAIL;
+    }
+    *pCRC32C = m_crcFinal;
+    CopyMemory(pSHA256, m_SHAFinal, sizeof(m_SHAFinal));
+    return S_OK;
+}
+
+HRESULT
+HashSink::GetRegionDigests(vector<RegionDigest>* pRegions)
+{
+    CAutoLock lock(&m_csHash);
+    if (!m_bClosed)
+    {
+        return VFW_E_WRONG_STATE;
+    }
+    if (!m_bSHAValid)
+    {
+        return E_FAIL;
+    }
+    *pRegions = m_Digests;
+    return S_OK;
+}
+
+// --- SHA-256 region ---------------------------------------------
+
+HashSink::Region::Region(LONGLONG posStart)
+: m_posStart(posStart),
+  m_posEnd(posStart),
+  m_posHashed(posStart),
+  m_bEnded(false),
+  m_iPending(0)
+{
+}
+
+void
+HashSink::Region::Write(LONGLONG pos, const BYTE* pData, long cBytes)
+{
+    ASSERT(pos == (m_posHashed + LONGLONG(m_Pending.size() - m_iPending)));
+    UNREFERENCED_PARAMETER(pos);
+    if (m_Held.size() == 0)
+    {
+        m_Hash.Update(pData, cBytes);
+        m_posHashed += cBytes;
+    }
+    else
+    {
+        m_Pending.insert(m_Pending.end(), pData, pData + cBytes);
+    }
+}
+
+bool
+HashSink::Region::Patch(LONGLONG pos, const BYTE* pData, long cBytes)
+{
+    if ((pos < m_posHashed) || ((pos + cBytes) > (m_posHashed + LONGLONG(m_Pending.size() - m_iPending))))
+    {
+        // already hashed
+        return false;
+    }
+    CopyMemory(&m_Pending[m_iPending + size_t(pos - m_posHashed)], pData, cBytes);
+
+    // the header is final once its length is replaced
+    list<LONGLONG>::iterator it;
+    for (it = m_Held.begin(); it != m_Held.end(); it++)
+    {
+        if (*it == pos)
+        {
+            m_Held.erase(it);
+            break;
+        }
+    }
+    Advance();
+    return true;
+}
+
+void
+HashSink::Region::Advance()
+{
+    // hash up to the first header still open
+    long cReady = long(m_Pending.size() - m_iPending);
+    if (m_Held.size() > 0)
+    {
+        cReady = long(m_Held.front() - m_posHashed);
+    }
+    if (cReady > 0)
+    {
+        m_Hash.Update(&m_Pending[m_iPending], cReady);
+        m_iPending += cReady;
+        m_posHashed += cReady;
+    }
+    if (m_iPending == m_Pending.size())
+    {
+        m_Pending.clear();
+        m_iPending = 0;
+    }
+    else if (m_iPending > (m_Pending.size() / 2))
+    {
+        m_Pending.erase(m_Pending.begin(), m_Pending.begin() + m_iPending);
+        m_iPending = 0;
+    }
+}
+
+void
+HashSink::Region::Final(RegionDigest* pDigest)
+{
+    pDigest->pos = m_posStart;
+    pDigest->cBytes = m_posEnd - m_posStart;
+    if (m_Pending.size() > m_iPending)
+    {
+        m_Hash.Update(&m_Pending[m_iPending], long(m_Pending.size() - m_iPending));
+    }
+    m_Pending.clear();
+    m_iPending = 0;
+    m_Held.clear();
+    m_Hash.Final(pDigest->digest);
+}
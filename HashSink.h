@@ -0,0 +1,190 @@
+// HashSink.h: digests of the output computed as it is written
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "MovieWriter.h"
+#include <bcrypt.h>
+
+// CRC32C (Castagnoli), using the SSE4.2 crc32 instruction where available.
+// Values are the raw register (start with Init, and use Final for the result).
+class CRC32C
+{
+public:
+    static DWORD Init()
+    {
+        return 0xffffffff;
+    }
+    static DWORD Final(DWORD crc)
+    {
+        return ~crc;
+    }
+    static DWORD Update(DWORD crc, const BYTE* pData, long cBytes);
+
+    // the change to the register when the cBytes of delta (old xor new) are
+    // followed by cFollowing bytes. The crc is linear, so this can be
+    // xor-ed into the register to patch data that has already been hashed.
+    static DWORD Patch(const BYTE* pDelta, long cBytes, LONGLONG cFollowing);
+
+private:
+    static DWORD MultModP(DWORD a, DWORD b);
+    static DWORD X8NModP(LONGLONG cBytes);
+};
+
+// SHA-256 through CNG, which uses the SHA extensions where available
+class SHA256Hash
+{
+public:
+    SHA256Hash();
+    ~SHA256Hash();
+
+    enum { digest_size = 32 };
+
+    void Update(const BYTE* pData, long cBytes);
+    void Final(BYTE* pDigest);
+
+private:
+    BCRYPT_ALG_HANDLE m_hAlg;
+    BCRYPT_HASH_HANDLE m_hHash;
+    smart_array<BYTE> m_pObject;
+};
+
+// Container that computes the CRC32C and SHA-256 of the file as the
+// data is appended, so that the file does not have to be read back.
+//
+// Atom headers are written (through AppendHeader, so that they are
+// known as headers whatever the data) with a placeholder length that is
+// replaced when the atom is closed, by which time it has been hashed.
+// The CRC32C is linear, so the change is patched into the register, and
+// the CRC32C is of the whole file. SHA-256 is not; data following an
+// open atom header is held back until the header is replaced, which is
+// fine for the moov but not for an mdat (the size of the payload).
+// So the SHA-256 is of the file divided at each mdat header:
+//      SHA-256(SHA-256(bytes before first mdat header) ||
+//              SHA-256(first mdat header, 8 bytes) ||
+//              SHA-256(bytes up to next mdat header, or end of file) || ...)
+// Each of these parts is hashed as the data is written. The digest of
+// each part is kept with its byte range (GetRegionDigests), so that a
+// reader can check the file against them with a plain SHA-256 of each
+// range, without knowing where the mdat headers are.
+class HashSink : public AtomWriter
+{
+public:
+    HashSink(AtomWriter* pContainer);
+    ~HashSink();
+
+    // AtomWriter methods
+    LONGLONG Length()
+    {
+        return m_pContainer->Length();
+    }
+    LONGLONG Position()
+    {
+        return m_pContainer->Position();
+    }
+    HRESULT Replace(LONGLONG pos, const BYTE* pBuffer, long cBytes);
+    HRESULT Append(const BYTE* pBuffer, long cBytes);
+    HRESULT AppendHeader(const BYTE* pHeader);
+    HRESULT Flush()
+    {
+        return m_pContainer->Flush();
+    }
+
+    // no more writes: complete the digests
+    void Close();
+
+    // VFW_E_WRONG_STATE before Close, or E_FAIL if a replaced
+    // region could not be accounted for
+    HRESULT GetDigests(DWORD* pCRC32C, BYTE* pSHA256);
+
+    // SHA-256 of a part of the file, in the order they go
+    // into the file digest. The parts cover the hashed length
+    struct RegionDigest
+    {
+        LONGLONG pos;
+        LONGLONG cBytes;
+        BYTE digest[SHA256Hash::digest_size];
+    };
+    HRESULT GetRegionDigests(vector<RegionDigest>* pRegions);
+
+private:
+    // part of the file hashed separately for SHA-256
+    class Region
+    {
+    public:
+        Region(LONGLONG posStart);
+
+        void Write(LONGLONG pos, const BYTE* pData, long cBytes);
+        bool Patch(LONGLONG pos, const BYTE* pData, long cBytes);
+        void Hold(LONGLONG pos)
+        {
+            m_Held.push_back(pos);
+        }
+        void End(LONGLONG posEnd)
+        {
+            m_posEnd = posEnd;
+            m_bEnded = true;
+        }
+        bool Contains(LONGLONG pos)
+        {
+            return pos >= m_posStart;
+        }
+        bool IsComplete()
+        {
+            return m_bEnded && (m_Held.size() == 0);
+        }
+        void Final(RegionDigest* pDigest);
+
+    private:
+        void Advance();
+
+    private:
+        LONGLONG m_posStart;
+        LONGLONG m_posEnd;
+        LONGLONG m_posHashed;       // everything before this is hashed
+        bool m_bEnded;
+        SHA256Hash m_Hash;
+
+        // data from m_posHashed (at m_iPending), held for an open header.
+        // Hashed data is removed from the front only once it is at least
+        // half the buffer, so that each byte is moved at most once or so
+        vector<BYTE> m_Pending;
+        size_t m_iPending;
+        list<LONGLONG> m_Held;      // open header positions
+    };
+    typedef smart_ptr<Region> RegionPtr;
+
+    // original atom header, for patching the crc
+    struct Header
+    {
+        LONGLONG pos;
+        BYTE b[8];
+    };
+
+    // after the container has accepted the data
+    bool OnAppend(const BYTE* pBuffer, long cBytes, HRESULT hr);
+    void StartRegion(LONGLONG pos);
+    void CompleteRegions(bool bAll);
+
+private:
+    AtomWriter* m_pContainer;
+    CCritSec m_csHash;
+
+    DWORD m_crc;
+    list<Header> m_Headers;
+    bool m_bCRCValid;
+
+    SHA256Hash m_File;
+    list<RegionPtr> m_Regions;
+    vector<RegionDigest> m_Digests;
+    bool m_bSHAValid;
+
+    bool m_bClosed;
+    DWORD m_crcFinal;
+    BYTE m_SHAFinal[SHA256Hash::digest_size];
+};
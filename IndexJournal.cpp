@@ -0,0 +1,489 @@
+// IndexJournal.cpp: append-only journal of index entries, for crash recovery
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "IndexJournal.h"
+#include "MuxEngine.h"
+
+// codec config fields, in the order stored in the trak record
+static void WriteConfig(const MuxCodecConfig* pConfig, BYTE* pBuffer)
+{
+    WriteLong(pConfig->codec, pBuffer);
+    WriteLong(pConfig->width, pBuffer + 4);
+    WriteLong(pConfig->height, pBuffer + 8);
+    WriteLong(pConfig->bitcount, pBuffer + 12);
+    WriteLong(pConfig->fourcc, pBuffer + 16);
+    WriteI64(pConfig->tFrame, pBuffer + 20);
+    WriteLong(pConfig->profile, pBuffer + 28);
+    WriteLong(pConfig->level, pBuffer + 32);
+    WriteLong(pConfig->nalLength, pBuffer + 36);
+    WriteLong(pConfig->sampleRate, pBuffer + 40);
+    WriteLong(pConfig->channels, pBuffer + 44);
+    WriteLong(pConfig->bitsPerSample, pBuffer + 48);
+    WriteLong(pConfig->blockAlign, pBuffer + 52);
+    WriteLong(pConfig->bytesPerSec, pBuffer + 56);
+}
+
+static void ReadConfig(const BYTE* pBuffer, MuxCodecConfig* pConfig)
+{
+    pConfig->codec = ReadLong(pBuffer);
+    pConfig->width = ReadLong(pBuffer + 4);
+    pConfig->height = ReadLong(pBuffer + 8);
+    pConfig->bitcount = ReadLong(pBuffer + 12);
+    pConfig->fourcc = ReadLong(pBuffer + 16);
+    pConfig->tFrame = ReadI64(pBuffer + 20);
+    pConfig->profile = ReadLong(pBuffer + 28);
+    pConfig->level = ReadLong(pBuffer + 32);
+    pConfig->nalLength = ReadLong(pBuffer + 36);
+    pConfig->sampleRate = ReadLong(pBuffer + 40);
+    pConfig->channels = ReadLong(pBuffer + 44);
+    pConfig->bitsPerSample = ReadLong(pBuffer + 48);
+    pConfig->blockAlign = ReadLong(pBuffer + 52);
+    pConfig->bytesPerSec = ReadLong(pBuffer + 56);
+}
+
+IndexJournal::IndexJournal()
+: m_pData(NULL),
+  m_bExit(false)
+{
+}
+
+IndexJournal::~IndexJournal()
+{
+    // if not discarded, keep whatever was committed for recovery. Records
+    // not yet committed are dropped: the media file may already be gone,
+    // so their data cannot be synced first.
+    StopWorker();
+    CAutoLock lock(&m_csCommit);
+    if (m_File.IsOpen())
+    {
+        m_File.Close();
+    }
+}
+
+//static
+wstring
+IndexJournal::DefaultPath(LPCWSTR pszFile)
+{
+    wstring strPath = pszFile;
+    strPath += L".journal";
+    return strPath;
+}
+
+HRESULT
+IndexJournal::Create(LPCWSTR pszFile)
+{
+    {
+        CAutoLock lock(&m_csCommit);
+        HRESULT hr = m_File.Create(pszFile);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+        m_strFile = pszFile;
+    }
+
+    {
+        CAutoLock lock(&m_csJournal);
+        BYTE b[4];
+        WriteLong(journal_version, b);
+        AppendRecord(DWORD('jrnl'), b, 4, NULL, 0);
+    }
+    return Commit();
+}
+
+HRESULT
+IndexJournal::Start(AtomWriter* pData)
+{
+    {
+        CAutoLock lock(&m_csCommit);
+        m_pData = pData;
+    }
+    m_bExit = false;
+    if (!CAMThread::Create())
+    {
+        return E_FAIL;
+    }
+    return S_OK;
+}
+
+HRESULT
+IndexJournal::Stop()
+{
+    StopWorker();
+    HRESULT hr = Commit();
+    CAutoLock lock(&m_csCommit);
+    m_pData = NULL;
+    return hr;
+}
+
+void
+IndexJournal::StopWorker()
+{
+    if (ThreadExists())
+    {
+        {
+            CAutoLock lock(&m_csJournal);
+            m_bExit = true;
+        }
+        m_evWake.Set();
+        Close();
+    }
+}
+
+DWORD
+IndexJournal::ThreadProc()
+{
+    for (;;)
+    {
+        m_evWake.Wait(commit_interval_ms);
+        {
+            CAutoLock lock(&m_csJournal);
+            if (m_bExit)
+            {
+                break;
+            }
+        }
+        HRESULT hr = Commit();
+        if (FAILED(hr))
+        {
+            DbgLog((LOG_ERROR, 0, TEXT("Mux journal commit failed 0x%x"), hr));
+        }
+    }
+    return 0;
+}
+
+void
+IndexJournal::Discard()
+{
+    StopWorker();
+    {
+        CAutoLock lock(&m_csCommit);
+        if (m_File.IsOpen())
+        {
+            m_File.Close();
+            FileSink::Delete(m_strFile.c_str());
+        }
+        m_pData = NULL;
+    }
+    CAutoLock lock(&m_csJournal);
+    m_Pending.Done();
+    m_Samples.Done();
+}
+
+void
+IndexJournal::AppendRecord(DWORD type, const BYTE* pHdr, long cHdr, const BYTE* pPayload, long cPayload)
+{
+    BYTE b[8];
+    WriteLong(8 + cHdr + cPayload, b);
+    WriteLong(type, b+4);
+    m_Pending.Append(b, 8);
+    if (cHdr > 0)
+    {
+        m_Pending.Append(pHdr, cHdr);
+    }
+    if (cPayload > 0)
+    {
+        m_Pending.Append(pPayload, cPayload);
+    }
+}
+
+void
+IndexJournal::AddTrack(long id, const MuxCodecConfig* pConfig)
+{
+    CAutoLock lock(&m_csJournal);
+
+    // id, config fields, config bytes
+    BYTE b[4 + config_size];
+    WriteLong(id, b);
+    WriteConfig(pConfig, b+4);
+    AppendRecord(DWORD('trak'), b, sizeof(b), pConfig->pConfig, pConfig->cConfig);
+}
+
+void
+IndexJournal::AddMDAT(LONGLONG pos)
+{
+    CAutoLock lock(&m_csJournal);
+    BYTE b[8];
+    WriteI64(pos, b);
+    AppendRecord(DWORD('mdat'), b, 8, NULL, 0);
+}
+
+void
+IndexJournal::AddSample(bool bSync, const MuxSample* pTimes, long cBytes)
+{
+    CAutoLock lock(&m_csJournal);
+    BYTE b[sample_entry_size];
+    WriteLong(cBytes, b);
+    WriteI64(pTimes->tStart, b+4);
+    WriteI64(pTimes->tStop, b+12);
+    WriteI64(pTimes->tDecode, b+20);
+    b[28] = 0;
+    if (bSync)
+    {
+        b[28] |= sample_sync;
+    }
+    if (pTimes->HasDecodeTime())
+    {
+        b[28] |= sample_decode_time;
+    }
+    m_Samples.Append(b, sample_entry_size);
+}
+
+void
+IndexJournal::AddChunk(long id, LONGLONG posChunk, long nSamples)
+{
+    CAutoLock lock(&m_csJournal);
+    BYTE b[4 + 8 + 4];
+    WriteLong(id, b);
+    WriteI64(posChunk, b+4);
+    WriteLong(nSamples, b+12);
+    AppendRecord(DWORD('chnk'), b, sizeof(b), m_Samples.Data(), m_Samples.Size());
+    m_Samples.Consume(m_Samples.Size());
+
+    // group commit: one write and flush for many chunks, by the
+    // worker, at the interval or sooner once enough is pending
+    if (m_Pending.Size() >= commit_bytes)
+    {
+        m_evWake.Set();
+    }
+}
+
+HRESULT
+IndexJournal::Commit()
+{
+    CAutoLock lockCommit(&m_csCommit);
+    if (!m_File.IsOpen())
+    {
+        return E_FAIL;
+    }
+
+    // the records made so far: each chunk's data was appended to the
+    // media file before its record was made
+    smart_array<BYTE> pRecords;
+    long cRecords;
+    {
+        CAutoLock lock(&m_csJournal);
+        cRecords = m_Pending.Size();
+        if (cRecords == 0)
+        {
+            return S_OK;
+        }
+        pRecords = new BYTE[cRecords];
+        CopyMemory(pRecords, m_Pending.Data(), cRecords);
+    }
+
+    // so once the media file is synced, they describe data on the
+    // disk. If the sync fails, they are kept for the next commit.
+    HRESULT hr = S_OK;
+    if (m_pData)
+    {
+        hr = m_pData->Flush();
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = m_File.Append(pRecords, cRecords);
+        if (SUCCEEDED(hr))
+        {
+            hr = m_File.Flush();
+        }
+        CAutoLock lock(&m_csJournal);
+        m_Pending.Consume(cRecords);
+    }
+    return hr;
+}
+
+// --- recovery ---------------------------------------------------
+
+HRESULT
+RecoverMovie(LPCWSTR pszFile, LPCWSTR pszJournal)
+{
+    wstring strJournal = pszJournal ? wstring(pszJournal) : IndexJournal::DefaultPath(pszFile);
+
+    // read the whole journal
+    FileSink journal;
+    HRESULT hr = journal.Open(strJournal.c_str(), true);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+    if (journal.Length() > 0x7fffffff)
+    {
+        return E_OUTOFMEMORY;
+    }
+    long cJournal = long(journal.Length());
+    smart_array<BYTE> pJournal = new BYTE[cJournal];
+    hr = journal.Read(0, pJournal, cJournal);
+    journal.Close();
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    FileSink file;
+    hr = file.Open(pszFile);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+    LONGLONG llFile = file.Length();
+
+    MovieWriter movie(&file);
+    vector<TrackWriter*> tracks;        // indexed by journal track id
+    vector<bool> configured;
+    vector<LONGLONG> mdats;
+    LONGLONG llEnd = 0;                 // end of last complete chunk
+
+    const BYTE* p = pJournal;
+    long cRemain = cJournal;
+    while (cRemain >= 8)
+    {
+        long cRec = ReadLong(p);
+        DWORD type = ReadLong(p+4);
+        if ((cRec < 8) || (cRec > cRemain))
+        {
+            // incomplete final record
+            break;
+        }
+        const BYTE* pRec = p + 8;
+        long cPayload = cRec - 8;
+
+        if ((type == DWORD('jrnl')) && (cPayload >= 4))
+        {
+            if (ReadLong(pRec) != IndexJournal::journal_version)
+            {
+                return E_FAIL;
+            }
+        }
+        else if ((type == DWORD('trak')) && (cPayload >= (4 + IndexJournal::config_size)))
+        {
+            long id = ReadLong(pRec);
+            MuxCodecConfig config;
+            ReadConfig(pRec+4, &config);
+            long cHdr = 4 + IndexJournal::config_size;
+            if (cPayload > cHdr)
+            {
+                config.pConfig = pRec + cHdr;
+                config.cConfig = cPayload - cHdr;
+            }
+            if (id >= (long)tracks.size())
+            {
+                tracks.resize(id+1, NULL);
+                configured.resize(id+1, false);
+            }
+            tracks[id] = movie.MakeTrack(&config);
+        }
+        else if ((type == DWORD('mdat')) && (cPayload >= 8))
+        {
+            LONGLONG pos = ReadI64(pRec);
+            if ((pos + 8) > llFile)
+            {
+                break;
+            }
+            mdats.push_back(pos);
+        }
+        else if ((type == DWORD('chnk')) && (cPayload >= 16))
+        {
+            long id = ReadLong(pRec);
+            LONGLONG posChunk = ReadI64(pRec+4);
+            long nSamples = ReadLong(pRec+12);
+            if ((nSamples < 0) || (cPayload != (16 + nSamples * IndexJournal::sample_entry_size)))
+            {
+                break;
+            }
+            const BYTE* pEntries = pRec + 16;
+            LONGLONG cChunk = 0;
+            for (long i = 0; i < nSamples; i++)
+            {
+                cChunk += ReadLong(pEntries + (i * IndexJournal::sample_entry_size));
+            }
+            if ((posChunk + cChunk) > llFile)
+            {
+                // journal is ahead of the data that reached the disk
+                break;
+            }
+
+            TrackWriter* pTrack = (id < (long)tracks.size()) ? tracks[id] : NULL;
+            if (pTrack != NULL)
+            {
+                LONGLONG pos = posChunk;
+                for (long i = 0; i < nSamples; i++)
+                {
+                    const BYTE* pEntry = pEntries + (i * IndexJournal::sample_entry_size);
+                    long cBytes = ReadLong(pEntry);
+                    BYTE flags = pEntry[28];
+                    bool bSync = (flags & IndexJournal::sample_sync) ? true : false;
+
+                    // some codec configuration is only found in the media data
+                    // (eg param sets in H264 byte stream), so give the handler
+                    // the first sync sample only -- no further scanning of mdat
+                    if (bSync && !configured[id] && (cBytes > 0))
+                    {
+                        smart_array<BYTE> pSample = new BYTE[cBytes];
+                        if (SUCCEEDED(file.Read(pos, pSample, cBytes)))
+                        {
+                            pTrack->Handler()->RecoverConfig(pSample, cBytes);
+                        }
+                        configured[id] = true;
+                    }
+                    MuxSample times;
+                    times.tStart = ReadI64(pEntry+4);
+                    times.tStop = ReadI64(pEntry+12);
+                    times.tDecode = ReadI64(pEntry+20);
+                    times.dwFlags = MuxSample_Time;
+                    if (flags & IndexJournal::sample_decode_time)
+                    {
+                        times.dwFlags |= MuxSample_DecodeTime;
+                    }
+                    pTrack->IndexSample(bSync, &times, cBytes);
+                    pos += cBytes;
+                }
+                pTrack->IndexChunk(posChunk, nSamples);
+                if ((posChunk + cChunk) > llEnd)
+                {
+                    llEnd = posChunk + cChunk;
+                }
+            }
+        }
+        p += cRec;
+        cRemain -= cRec;
+    }
+
+    if (llEnd == 0)
+    {
+        // nothing recoverable
+        return E_FAIL;
+    }
+
+    // each mdat extends to the start of the next, and the
+    // last to the end of the last complete chunk
+    while ((mdats.size() > 0) && (mdats[mdats.size() - 1] >= llEnd))
+    {
+        mdats.pop_back();
+    }
+    for (UINT i = 0; i < mdats.size(); i++)
+    {
+        LONGLONG llNext = ((i+1) < mdats.size()) ? mdats[i+1] : llEnd;
+        BYTE b[4];
+        WriteLong(long(llNext - mdats[i]), b);
+        file.Replace(mdats[i], b, 4);
+    }
+
+    // discard any partial chunk and append the moov
+    hr = file.SetLength(llEnd);
+    if (SUCCEEDED(hr))
+    {
+        REFERENCE_TIME tDur;
+        hr = movie.Close(&tDur);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = file.Flush();
+    }
+    return hr;
+}
@@ -0,0 +1,106 @@
+// IndexJournal.h: append-only journal of index entries, for crash recovery
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "FileSink.h"
+#include "ParseBuffer.h"
+
+class AtomWriter;
+
+// The index tables are held in memory until the moov atom is written
+// at Stop. If the process dies before then, the media data is in the
+// file but nothing describes it. The journal is a side file to which
+// each chunk's index entries are appended as they are indexed, so that
+// the moov can be rebuilt without scanning the mdat payload.
+//
+// The journal is a sequence of records laid out like atoms
+// (32-bit length, 32-bit type, payload), all values big-endian:
+//      'jrnl'  version
+//      'trak'  track id, codec config fields, codec config bytes
+//      'mdat'  file offset of a new mdat atom
+//      'chnk'  track id, 64-bit file offset, sample count, then
+//              for each sample: size, start, stop, decode time,
+//              flags (sync, decode time valid)
+//
+// Records are buffered, and written and flushed in groups (group commit)
+// by a worker thread, so the writer never waits for the disk and only
+// the last fraction of a second is at risk. Each commit first syncs the
+// media file, and then writes only the records made before that sync
+// started: a chunk is recorded only once its data is on the disk, so
+// recovery never indexes data that did not reach it. A truncated final
+// record, or chunks that lie beyond the end of the media file, are
+// ignored on recovery.
+class IndexJournal : public CAMThread
+{
+public:
+    IndexJournal();
+    ~IndexJournal();
+
+    HRESULT Create(LPCWSTR pszFile);
+
+    // starts the commit worker. pData is the media file that the
+    // journalled chunks are written to.
+    HRESULT Start(AtomWriter* pData);
+
+    // stops the worker after a final commit. Records made after this
+    // are not written.
+    HRESULT Stop();
+
+    // the moov is safely written, so the journal is no longer needed
+    void Discard();
+
+    void AddTrack(long id, const MuxCodecConfig* pConfig);
+    void AddMDAT(LONGLONG pos);
+
+    // sample entries are held until the chunk containing them is complete
+    void AddSample(bool bSync, const MuxSample* pTimes, long cBytes);
+    void AddChunk(long id, LONGLONG posChunk, long nSamples);
+
+    // sync the media file, then write and flush the records made before it
+    HRESULT Commit();
+
+    // <media file>.journal
+    static wstring DefaultPath(LPCWSTR pszFile);
+
+    enum {
+        journal_version = 3,
+        commit_bytes = 64 * 1024,
+        commit_interval_ms = 500,
+        sample_entry_size = 4 + 8 + 8 + 8 + 1,
+
+        // sample entry flags
+        sample_sync = 1,
+        sample_decode_time = 2,
+        config_size = (13 * 4) + 8,     // 13 longs and one 64-bit time
+    };
+
+private:
+    void AppendRecord(DWORD type, const BYTE* pHdr, long cHdr, const BYTE* pPayload, long cPayload);
+    DWORD ThreadProc();
+    void StopWorker();
+
+private:
+    CCritSec m_csJournal;
+    ParseBuffer m_Pending;      // records not yet written
+    ParseBuffer m_Samples;      // sample entries for the current chunk
+
+    // one commit at a time; the file is only written by commits
+    CCritSec m_csCommit;
+    FileSink m_File;
+    wstring m_strFile;
+    AtomWriter* m_pData;
+
+    CAMEvent m_evWake;
+    bool m_bExit;
+};
+
+// rebuild the index for an interrupted recording from its journal,
+// truncate any incomplete chunk and append the moov atom.
+// If pszJournal is NULL, the default journal location is used.
+HRESULT RecoverMovie(LPCWSTR pszFile, LPCWSTR pszJournal);
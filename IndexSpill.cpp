@@ -0,0 +1,111 @@
+// IndexSpill.cpp: temporary file for sealed blocks of the sample index
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "IndexSpill.h"
+
+IndexSpill::IndexSpill()
+: m_nRetiring(0),
+  m_llRetire(0),
+  m_llReleased(0)
+{
+}
+
+IndexSpill::~IndexSpill()
+{
+    if (m_File.IsOpen())
+    {
+        m_File.Close();
+        FileSink::Delete(m_strFile.c_str());
+    }
+}
+
+//static
+wstring
+IndexSpill::DefaultPath(LPCWSTR pszFile)
+{
+    wstring strPath = pszFile;
+    strPath += L".spill";
+    return strPath;
+}
+
+HRESULT
+IndexSpill::Create(LPCWSTR pszFile)
+{
+    CAutoLock lock(&m_csSpill);
+    HRESULT hr = m_File.Create(pszFile);
+    if (SUCCEEDED(hr))
+    {
+        m_strFile = pszFile;
+    }
+    return hr;
+}
+
+HRESULT
+IndexSpill::Write(const BYTE* pData, long cBytes, LONGLONG* pPos)
+{
+    CAutoLock lock(&m_csSpill);
+    if (!m_File.IsOpen())
+    {
+        return VFW_E_WRONG_STATE;
+    }
+    EmptyIfReleased();
+    *pPos = m_File.Length();
+    return m_File.Append(pData, cBytes);
+}
+
+HRESULT
+IndexSpill::Read(LONGLONG pos, BYTE* pData, long cBytes)
+{
+    CAutoLock lock(&m_csSpill);
+    return m_File.Read(pos, pData, cBytes);
+}
+
+void
+IndexSpill::Retire()
+{
+    CAutoLock lock(&m_csSpill);
+    m_nRetiring++;
+    m_llRetire = m_File.Length();
+}
+
+void
+IndexSpill::Release()
+{
+    CAutoLock lock(&m_csSpill);
+    m_nRetiring--;
+    if (m_nRetiring == 0)
+    {
+        // files are finished in order, so the last
+        // to be retired is the last released
+        m_llReleased = m_llRetire;
+        EmptyIfReleased();
+    }
+}
+
+void
+IndexSpill::EmptyIfReleased()
+{
+    // once no retired file is still being finished, and the current
+    // tables have not spilled since the last was retired, none of the
+    // file is needed: start again from the beginning
+    if ((m_nRetiring == 0) && (m_llReleased > 0) && (m_llReleased >= m_File.Length()))
+    {
+        if (SUCCEEDED(m_File.SetLength(0)))
+        {
+            m_llReleased = 0;
+        }
+    }
+}
+
+LONGLONG
+IndexSpill::Length()
+{
+    CAutoLock lock(&m_csSpill);
+    return m_File.Length();
+}
@@ -0,0 +1,65 @@
+// IndexSpill.h: temporary file for sealed blocks of the sample index
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "FileSink.h"
+
+// The index tables are held until the moov is written at Close, so
+// without a limit they grow with the length of the recording. With a
+// spill file, each table (see PackedList) keeps only its open block and
+// the last few sealed ones in memory: once spill_unit bytes of sealed
+// blocks have accumulated, they are appended to this file as one write,
+// and read back a unit at a time (so each read is a large sequential
+// read) when the tables are streamed into the moov, or read for clip
+// export. One spill file serves all the tables of a movie.
+//
+// The file is deleted when the movie is done with it. If the process
+// dies, it is left behind (it is not needed for recovery: see
+// IndexJournal).
+class IndexSpill
+{
+public:
+    IndexSpill();
+    ~IndexSpill();
+
+    HRESULT Create(LPCWSTR pszFile);
+
+    // appends, returning the position written
+    HRESULT Write(const BYTE* pData, long cBytes, LONGLONG* pPos);
+    HRESULT Read(LONGLONG pos, BYTE* pData, long cBytes);
+
+    LONGLONG Length();
+
+    // Rolling output: the tables spilled so far belong to a file that
+    // is being finished, and Release is called once its moov is written.
+    // When every Retire has been released, nothing before the last Retire
+    // is needed, and the file is emptied as soon as nothing after it is
+    // needed either (usually before the next file's tables first spill).
+    void Retire();
+    void Release();
+
+    // <media file>.spill
+    static wstring DefaultPath(LPCWSTR pszFile);
+
+    enum {
+        spill_unit = 32 * 1024,
+    };
+
+private:
+    // call with m_csSpill held
+    void EmptyIfReleased();
+
+private:
+    CCritSec m_csSpill;
+    FileSink m_File;
+    wstring m_strFile;
+    long m_nRetiring;           // files being finished
+    LONGLONG m_llRetire;        // end of their tables
+    LONGLONG m_llReleased;      // nothing before this is needed
+};
@@ -0,0 +1,140 @@
+// MappedFile.cpp: read-only file mapping for muxing without copying
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "MappedFile.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile()
+: m_pData(NULL),
+  m_cBytes(0),
+  m_hFile(INVALID_HANDLE_VALUE),
+  m_hMapping(NULL)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    if (m_pData != NULL)
+    {
+        UnmapViewOfFile(m_pData);
+    }
+    if (m_hMapping != NULL)
+    {
+        CloseHandle(m_hMapping);
+    }
+    if (m_hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_hFile);
+    }
+}
+
+HRESULT
+MappedFile::Open(const char* pszPath)
+{
+    if (m_pData != NULL)
+    {
+        return VFW_E_WRONG_STATE;
+    }
+    m_hFile = CreateFileA(pszPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    LARGE_INTEGER li;
+    if (!GetFileSizeEx(m_hFile, &li))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    if (li.QuadPart == 0)
+    {
+        // an empty file cannot be mapped
+        return S_OK;
+    }
+    m_hMapping = CreateFileMapping(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (m_hMapping == NULL)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    m_pData = (BYTE*)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (m_pData == NULL)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    m_cBytes = li.QuadPart;
+    return S_OK;
+}
+
+#else // _WIN32
+
+MappedFile::MappedFile()
+: m_pData(NULL),
+  m_cBytes(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    if (m_pData != NULL)
+    {
+        munmap(m_pData, size_t(m_cBytes));
+    }
+}
+
+HRESULT
+MappedFile::Open(const char* pszPath)
+{
+    if (m_pData != NULL)
+    {
+        return VFW_E_WRONG_STATE;
+    }
+    int fd = open(pszPath, O_RDONLY);
+    if (fd < 0)
+    {
+        return HRESULT_FROM_ERRNO(errno);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        HRESULT hr = HRESULT_FROM_ERRNO(errno);
+        close(fd);
+        return hr;
+    }
+    if (st.st_size == 0)
+    {
+        // an empty file cannot be mapped
+        close(fd);
+        return S_OK;
+    }
+    void* p = mmap(NULL, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+
+    // the mapping keeps the file open
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        return HRESULT_FROM_ERRNO(errno);
+    }
+    m_pData = (BYTE*)p;
+    m_cBytes = st.st_size;
+
+    // the file is read once, front to back: read ahead aggressively
+    // and let the kernel drop pages behind us
+    madvise(m_pData, size_t(m_cBytes), MADV_SEQUENTIAL);
+    return S_OK;
+}
+
+#endif // _WIN32
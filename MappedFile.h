@@ -0,0 +1,44 @@
+// MappedFile.h: read-only file mapping for muxing without copying
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "MuxEngine.h"
+
+// Maps a whole input file. Samples point directly into the mapped
+// pages and hold a reference to the mapping (as their MuxBuffer),
+// so it is unmapped only when the last sample has been written.
+class MappedFile : public MuxBuffer
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    HRESULT Open(const char* pszPath);
+
+    const BYTE* Data()
+    {
+        return m_pData;
+    }
+    LONGLONG Size()
+    {
+        return m_cBytes;
+    }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+private:
+    BYTE* m_pData;
+    LONGLONG m_cBytes;
+#ifdef _WIN32
+    HANDLE m_hFile;
+    HANDLE m_hMapping;
+#endif
+};
@@ -0,0 +1,236 @@
+// MediaTypes.cpp: DirectShow media types and samples for the mux engine
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "MediaTypes.h"
+#include <dvdmedia.h>
+#include <mmreg.h>  // for a-law and u-law G.711 audio types
+
+const int WAVE_FORMAT_AAC = 0x00ff;
+const int WAVE_FORMAT_AACEncoder = 0x1234;
+
+// Broadcom/Cyberlink Byte-Stream H264 subtype
+// CLSID_H264
+class DECLSPEC_UUID("8D2D71CB-243F-45E3-B2D8-5FD7967EC09B") CLSID_H264_BSF;
+
+inline DWORD Swap4Bytes(DWORD x)
+{
+    return ((x & 0xff) << 24) |
+           ((x & 0xff00) << 8) |
+           ((x & 0xff0000) >> 8) |
+           ((x >> 24) & 0xff);
+}
+
+static void ConfigFromVideoInfo(const VIDEOINFOHEADER* pvi, MuxCodecConfig* pConfig)
+{
+    pConfig->width = pvi->bmiHeader.biWidth;
+    pConfig->height = abs(pvi->bmiHeader.biHeight);
+    pConfig->bitcount = pvi->bmiHeader.biBitCount;
+    pConfig->tFrame = pvi->AvgTimePerFrame;
+}
+
+static void ConfigFromVideoInfo2(const VIDEOINFOHEADER2* pvi, MuxCodecConfig* pConfig)
+{
+    pConfig->width = pvi->bmiHeader.biWidth;
+    pConfig->height = abs(pvi->bmiHeader.biHeight);
+    pConfig->bitcount = pvi->bmiHeader.biBitCount;
+    pConfig->tFrame = pvi->AvgTimePerFrame;
+}
+
+static void ConfigFromWaveFormat(const WAVEFORMATEX* pwfx, MuxCodecConfig* pConfig)
+{
+    pConfig->sampleRate = pwfx->nSamplesPerSec;
+    pConfig->channels = pwfx->nChannels;
+    pConfig->bitsPerSample = pwfx->wBitsPerSample;
+    pConfig->blockAlign = pwfx->nBlockAlign;
+    pConfig->bytesPerSec = pwfx->nAvgBytesPerSec;
+}
+
+bool
+ConfigFromMediaType(const CMediaType* pmt, MuxCodecConfig* pConfig)
+{
+    *pConfig = MuxCodecConfig();
+    if (*pmt->Type() == MEDIATYPE_Video)
+    {
+        // divx
+        FOURCCMap divx(DWORD('xvid'));
+        FOURCCMap xvidCaps(DWORD('XVID'));
+        FOURCCMap divxCaps(DWORD('DIVX'));
+        FOURCCMap dx50(DWORD('05XD'));
+        if (((*pmt->Subtype() == divx) ||
+            (*pmt->Subtype() == divxCaps) ||
+            (*pmt->Subtype() == xvidCaps) ||
+            (*pmt->Subtype() == dx50))
+                &&
+                (*pmt->FormatType() == FORMAT_VideoInfo))
+        {
+            pConfig->codec = MuxCodec_MPEG4Video;
+            ConfigFromVideoInfo((const VIDEOINFOHEADER*)pmt->Format(), pConfig);
+            if (pmt->FormatLength() > sizeof(VIDEOINFOHEADER))
+            {
+                // VOL header
+                pConfig->pConfig = pmt->Format() + sizeof(VIDEOINFOHEADER);
+                pConfig->cConfig = pmt->FormatLength() - sizeof(VIDEOINFOHEADER);
+            }
+            return true;
+        }
+
+        FOURCCMap x264(DWORD('462x'));
+        FOURCCMap H264(DWORD('462H'));
+        FOURCCMap h264(DWORD('462h'));
+        FOURCCMap avc1(DWORD('1CVA'));
+
+        // H264
+        if ((*pmt->Subtype() == x264) ||
+            (*pmt->Subtype() == H264) ||
+            (*pmt->Subtype() == h264) ||
+            (*pmt->Subtype() == avc1) ||
+            (*pmt->Subtype() == __uuidof(CLSID_H264_BSF)))
+        {
+            // BSF
+            if (*pmt->FormatType() == FORMAT_VideoInfo)
+            {
+                pConfig->codec = MuxCodec_H264ByteStream;
+                ConfigFromVideoInfo((const VIDEOINFOHEADER*)pmt->Format(), pConfig);
+                return true;
+            }
+            if (*pmt->FormatType() == FORMAT_VideoInfo2)
+            {
+                pConfig->codec = MuxCodec_H264ByteStream;
+                ConfigFromVideoInfo2((const VIDEOINFOHEADER2*)pmt->Format(), pConfig);
+                return true;
+            }
+            // length-prepended
+            if (*pmt->FormatType() == FORMAT_MPEG2Video)
+            {
+                const MPEG2VIDEOINFO* pvi = (const MPEG2VIDEOINFO*)pmt->Format();
+                pConfig->codec = MuxCodec_H264;
+                ConfigFromVideoInfo2(&pvi->hdr, pConfig);
+                pConfig->profile = pvi->dwProfile;
+                pConfig->level = pvi->dwLevel;
+                pConfig->nalLength = pvi->dwFlags;
+                pConfig->pConfig = (const BYTE*)&pvi->dwSequenceHeader;
+                pConfig->cConfig = pvi->cbSequenceHeader;
+                return true;
+            }
+        }
+
+        // uncompressed
+        // it would be nice to select any uncompressed type eg by checking that
+        // the bitcount and biSize match up with the dimensions, but that
+        // also works for ffdshow encoder outputs, so I'm returning to an
+        // explicit list.
+        FOURCCMap fcc(pmt->subtype.Data1);
+        if ((fcc == *pmt->Subtype()) && (*pmt->FormatType() == FORMAT_VideoInfo))
+        {
+            VIDEOINFOHEADER* pvi = (VIDEOINFOHEADER*)pmt->Format();
+            if ((pvi->bmiHeader.biBitCount > 0) && (DIBSIZE(pvi->bmiHeader) == pmt->GetSampleSize()))
+            {
+                FOURCCMap yuy2(DWORD('2YUY'));
+                FOURCCMap uyvy(DWORD('YVYU'));
+                FOURCCMap yv12(DWORD('21VY'));
+                FOURCCMap nv12(DWORD('21VN'));
+                FOURCCMap i420(DWORD('024I'));
+                if ((*pmt->Subtype() == yuy2) ||
+                    (*pmt->Subtype() == uyvy) ||
+                    (*pmt->Subtype() == yv12) ||
+                    (*pmt->Subtype() == nv12) ||
+//                  (*pmt->Subtype() == MEDIASUBTYPE_RGB32) ||
+//                  (*pmt->Subtype() == MEDIASUBTYPE_RGB24) ||
+                    (*pmt->Subtype() == i420)
+                    )
+                {
+                    pConfig->codec = MuxCodec_Uncompressed;
+                    pConfig->fourcc = Swap4Bytes(fcc.GetFOURCC());
+                    ConfigFromVideoInfo(pvi, pConfig);
+                    return true;
+                }
+            }
+        }
+    } else if (*pmt->Type() == MEDIATYPE_Audio)
+    {
+        // rely on format tag to identify formats -- for
+        // this, subtype adds nothing
+
+        if (*pmt->FormatType() == FORMAT_WaveFormatEx)
+        {
+            // CoreAAC decoder
+            WAVEFORMATEX* pwfx = (WAVEFORMATEX*)pmt->Format();
+            if ((pwfx->wFormatTag == WAVE_FORMAT_AAC) ||
+                (pwfx->wFormatTag == WAVE_FORMAT_AACEncoder))
+            {
+                pConfig->codec = MuxCodec_AAC;
+                ConfigFromWaveFormat(pwfx, pConfig);
+                if (pmt->FormatLength() > sizeof(WAVEFORMATEX))
+                {
+                    // AudioSpecificConfig
+                    pConfig->pConfig = pmt->Format() + sizeof(WAVEFORMATEX);
+                    pConfig->cConfig = pmt->FormatLength() - sizeof(WAVEFORMATEX);
+                }
+                return true;
+            }
+
+            if ((pwfx->wFormatTag == WAVE_FORMAT_PCM) ||
+                (pwfx->wFormatTag == WAVE_FORMAT_ALAW) ||
+                (pwfx->wFormatTag == WAVE_FORMAT_MULAW))
+            {
+                if (pwfx->wFormatTag == WAVE_FORMAT_PCM)
+                {
+                    pConfig->codec = MuxCodec_PCM;
+                }
+                else if (pwfx->wFormatTag == WAVE_FORMAT_ALAW)
+                {
+                    pConfig->codec = MuxCodec_ALaw;
+                }
+                else
+                {
+                    pConfig->codec = MuxCodec_MuLaw;
+                }
+                ConfigFromWaveFormat(pwfx, pConfig);
+                long cExtra = long(pmt->FormatLength() - sizeof(WAVEFORMATEX));
+                if ((pwfx->cbSize > 0) && (cExtra > 0))
+                {
+                    pConfig->pConfig = pmt->Format() + sizeof(WAVEFORMATEX);
+                    pConfig->cConfig = min(long(pwfx->cbSize), cExtra);
+                }
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void
+SampleFromMediaSample(IMediaSample* pSample, MuxSample* pOut, bool bHold)
+{
+    BYTE* pBuffer;
+    pSample->GetPointer(&pBuffer);
+    pOut->pData = pBuffer;
+    pOut->cBytes = pSample->GetActualDataLength();
+    pOut->dwFlags = 0;
+    if (pSample->GetTime(&pOut->tStart, &pOut->tStop) == S_OK)
+    {
+        pOut->dwFlags |= MuxSample_Time;
+    }
+    else
+    {
+        pOut->tStart = pOut->tStop = 0;
+    }
+    if (pSample->IsSyncPoint() == S_OK)
+    {
+        pOut->dwFlags |= MuxSample_Sync;
+    }
+    if (bHold)
+    {
+        pOut->pBuffer = new MediaSampleBuffer(pSample);
+    }
+    else
+    {
+        pOut->pBuffer = NULL;
+    }
+}
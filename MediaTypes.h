@@ -0,0 +1,32 @@
+// MediaTypes.h: DirectShow media types and samples for the mux engine
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "MuxEngine.h"
+
+// Describes the media type for the engine, or returns false if the type
+// is not supported. The config bytes point into the format block, so the
+// media type must remain valid while the config is used.
+bool ConfigFromMediaType(const CMediaType* pmt, MuxCodecConfig* pConfig);
+
+// keeps a media sample until the engine has written its data
+class MediaSampleBuffer : public MuxBuffer
+{
+public:
+    MediaSampleBuffer(IMediaSample* pSample)
+    : m_pSample(pSample)
+    {
+    }
+private:
+    IMediaSamplePtr m_pSample;
+};
+
+// describes a media sample for the engine, without copying the data.
+// bHold false: the caller sets the buffer that keeps the data.
+void SampleFromMediaSample(IMediaSample* pSample, MuxSample* pOut, bool bHold = true);
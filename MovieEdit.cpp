@@ -0,0 +1,592 @@
+// MovieEdit.cpp: trim and concatenation of finished MP4 files by index rewrite
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "MovieEdit.h"
+#include "FileSink.h"
+
+inline long ReadShort(const BYTE* pByte)
+{
+    return (pByte[0] << 8) | pByte[1];
+}
+
+// rounded up, as DurationIndex::FromScale, so that
+// the writer's tables come out the same
+inline REFERENCE_TIME TimeFromScale(LONGLONG t, long scale)
+{
+    return ((t * UNITS) + scale - 1) / scale;
+}
+
+// the body of the first child atom of this type
+static const BYTE*
+FindChild(const BYTE* p, long cBytes, DWORD type, long* pcBody)
+{
+    while (cBytes >= 8)
+    {
+        long cAtom = ReadLong(p);
+        if ((cAtom < 8) || (cAtom > cBytes))
+        {
+            break;
+        }
+        if (DWORD(ReadLong(p + 4)) == type)
+        {
+            *pcBody = cAtom - 8;
+            return p + 8;
+        }
+        p += cAtom;
+        cBytes -= cAtom;
+    }
+    return NULL;
+}
+
+// the entries are within the atom (or the table is absent)
+bool
+MovieReader::TableFits(const Table& table, long nEntries, long cEntry)
+{
+    if (table.pData == NULL)
+    {
+        return true;
+    }
+    return (nEntries >= 0) && (nEntries <= ((table.cBytes - 4) / cEntry));
+}
+
+MovieReader::MovieReader()
+: m_posMoov(-1),
+  m_tDuration(0)
+{
+}
+
+HRESULT
+MovieReader::Open(FileSink* pFile)
+{
+    // find the moov among the top-level atoms
+    LONGLONG pos = 0;
+    LONGLONG cMoov = 0;
+    while ((pos + 8) <= pFile->Length())
+    {
+        BYTE b[16];
+        HRESULT hr = pFile->Read(pos, b, 8);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+        LONGLONG cAtom = ReadLong(b) & 0xffffffff;
+        long cHeader = 8;
+        if (cAtom == 1)
+        {
+            hr = pFile->Read(pos + 8, b + 8, 8);
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+            cAtom = ReadI64(b + 8);
+            cHeader = 16;
+        }
+        else if (cAtom == 0)
+        {
+            // to the end of the file
+            cAtom = pFile->Length() - pos;
+        }
+        if (cAtom < cHeader)
+        {
+            return VFW_E_INVALID_FILE_FORMAT;
+        }
+        if ((DWORD(ReadLong(b + 4)) == DWORD('moov')) && (cHeader == 8))
+        {
+            m_posMoov = pos;
+            cMoov = cAtom;
+            break;
+        }
+        pos += cAtom;
+    }
+    if ((m_posMoov < 0) || (cMoov > 0x7fffffff) || ((m_posMoov + cMoov) > pFile->Length()))
+    {
+        return VFW_E_INVALID_FILE_FORMAT;
+    }
+
+    long cBody = long(cMoov) - 8;
+    m_pMoov = new BYTE[cBody];
+    HRESULT hr = pFile->Read(m_posMoov + 8, m_pMoov, cBody);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    long cmvhd;
+    const BYTE* pmvhd = FindChild(m_pMoov, cBody, 'mvhd', &cmvhd);
+    if ((pmvhd == NULL) || (cmvhd < 24))
+    {
+        return VFW_E_INVALID_FILE_FORMAT;
+    }
+    long movieScale = ReadLong(pmvhd + ((pmvhd[0] == 1) ? 20 : 12));
+
+    const BYTE* p = m_pMoov;
+    while (cBody >= 8)
+    {
+        long cAtom = ReadLong(p);
+        if ((cAtom < 8) || (cAtom > cBody))
+        {
+            return VFW_E_INVALID_FILE_FORMAT;
+        }
+        if (DWORD(ReadLong(p + 4)) == DWORD('trak'))
+        {
+            hr = ReadTrack(p + 8, cAtom - 8, movieScale);
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+        }
+        p += cAtom;
+        cBody -= cAtom;
+    }
+    if (m_Tracks.empty())
+    {
+        return VFW_E_INVALID_FILE_FORMAT;
+    }
+    return S_OK;
+}
+
+HRESULT
+MovieReader::ReadTrack(const BYTE* pTrak, long cTrak, long movieScale)
+{
+    Track track;
+    ZeroMemory(&track.stts, sizeof(Table));
+    track.ctts = track.stss = track.stsz = track.stz2 = track.stsc = track.stco = track.co64 = track.stts;
+    track.tEdit = 0;
+
+    long cmdia, cmdhd, chdlr, cminf, cstbl, cstsd;
+    const BYTE* pmdia = FindChild(pTrak, cTrak, 'mdia', &cmdia);
+    const BYTE* pmdhd = pmdia ? FindChild(pmdia, cmdia, 'mdhd', &cmdhd) : NULL;
+    const BYTE* phdlr = pmdia ? FindChild(pmdia, cmdia, 'hdlr', &chdlr) : NULL;
+    const BYTE* pminf = pmdia ? FindChild(pmdia, cmdia, 'minf', &cminf) : NULL;
+    const BYTE* pstbl = pminf ? FindChild(pminf, cminf, 'stbl', &cstbl) : NULL;
+    const BYTE* pstsd = pstbl ? FindChild(pstbl, cstbl, 'stsd', &cstsd) : NULL;
+    if ((pmdhd == NULL) || (cmdhd < 24) || (phdlr == NULL) || (chdlr < 12) ||
+        (pstsd == NULL) || (cstsd < 16))
+    {
+        return VFW_E_INVALID_FILE_FORMAT;
+    }
+    if (ReadLong(pstsd + 4) != 1)
+    {
+        // more than one sample description
+        return VFW_E_TYPE_NOT_ACCEPTED;
+    }
+
+    MuxCodecConfig& config = track.config;
+    config.codec = MuxCodec_SampleEntry;
+    config.fourcc = ReadLong(phdlr + 8);
+    config.sampleRate = ReadLong(pmdhd + ((pmdhd[0] == 1) ? 20 : 12));
+    config.pConfig = pstsd + 8;
+    config.cConfig = ReadLong(config.pConfig);
+    if ((config.sampleRate <= 0) || (config.cConfig < 16) || (config.cConfig > (cstsd - 8)))
+    {
+        return VFW_E_INVALID_FILE_FORMAT;
+    }
+    long ctkhd;
+    const BYTE* ptkhd = FindChild(pTrak, cTrak, 'tkhd', &ctkhd);
+    if (ptkhd != NULL)
+    {
+        long cHdr = (ptkhd[0] == 1) ? (9 * 4) : (6 * 4);
+        if (ctkhd >= (cHdr + 60))
+        {
+            config.width = ReadShort(ptkhd + cHdr + 52);
+            config.height = ReadShort(ptkhd + cHdr + 56);
+        }
+    }
+
+    struct
+    {
+        DWORD type;
+        Table* pTable;
+    } tables[] = {
+        { 'stts', &track.stts },
+        { 'ctts', &track.ctts },
+        { 'stss', &track.stss },
+        { 'stsz', &track.stsz },
+        { 'stz2', &track.stz2 },
+        { 'stsc', &track.stsc },
+        { 'stco', &track.stco },
+        { 'co64', &track.co64 },
+    };
+    for (int i = 0; i < int(sizeof(tables) / sizeof(tables[0])); i++)
+    {
+        long cTable;
+        const BYTE* pTable = FindChild(pstbl, cstbl, tables[i].type, &cTable);
+        if ((pTable != NULL) && (cTable >= 8))
+        {
+            tables[i].pTable->pData = pTable + 4;
+            tables[i].pTable->cBytes = cTable - 4;
+            tables[i].pTable->bVersion1 = (pTable[0] == 1);
+        }
+    }
+    if ((track.stts.pData == NULL) || (track.stsc.pData == NULL) ||
+        ((track.stsz.pData == NULL) && (track.stz2.pData == NULL)) ||
+        ((track.stco.pData == NULL) && (track.co64.pData == NULL)))
+    {
+        return VFW_E_INVALID_FILE_FORMAT;
+    }
+
+    // an empty edit first is the start offset
+    long cedts, celst;
+    const BYTE* pedts = FindChild(pTrak, cTrak, 'edts', &cedts);
+    const BYTE* pelst = pedts ? FindChild(pedts, cedts, 'elst', &celst) : NULL;
+    if ((pelst != NULL) && (celst >= 8) && (ReadLong(pelst + 4) > 0))
+    {
+        LONGLONG duration = -1;
+        LONGLONG mediaTime = 0;
+        if ((pelst[0] == 1) && (celst >= 28))
+        {
+            duration = ReadI64(pelst + 8);
+            mediaTime = ReadI64(pelst + 16);
+        }
+        else if ((pelst[0] == 0) && (celst >= 20))
+        {
+            duration = ReadLong(pelst + 8) & 0xffffffff;
+            mediaTime = ReadLong(pelst + 12);
+        }
+        if ((mediaTime == -1) && (duration > 0) && (movieScale > 0))
+        {
+            track.tEdit = duration * config.sampleRate / movieScale;
+        }
+    }
+
+    // the end of decoding, for the duration
+    LONGLONG tEnd = track.tEdit;
+    long nPairs = ReadLong(track.stts.pData);
+    if (!TableFits(track.stts, nPairs, 8))
+    {
+        return VFW_E_INVALID_FILE_FORMAT;
+    }
+    for (long i = 0; i < nPairs; i++)
+    {
+        const BYTE* pPair = track.stts.pData + 4 + (i * 8);
+        tEnd += LONGLONG(ReadLong(pPair) & 0xffffffff) * (ReadLong(pPair + 4) & 0xffffffff);
+    }
+    m_tDuration = max(m_tDuration, TimeFromScale(tEnd, config.sampleRate));
+
+    if ((nPairs > 0) && (ReadLong(track.stts.pData + 8) > 0))
+    {
+        config.tFrame = TimeFromScale(ReadLong(track.stts.pData + 8), config.sampleRate);
+    }
+
+    track.pType = TypeHandler::Make(&config);
+    if (!track.pType)
+    {
+        return VFW_E_TYPE_NOT_ACCEPTED;
+    }
+    m_Tracks.push_back(track);
+    return S_OK;
+}
+
+HRESULT
+MovieReader::Samples(long nTrack, long idxSource, REFERENCE_TIME tOffset, vector<ClipSample>* pSamples)
+{
+    pSamples->clear();
+    Track& track = m_Tracks[nTrack];
+    long scale = track.config.sampleRate;
+
+    // sizes: one for all, or a table of 32-bit or packed fields
+    const Table& sizes = track.stsz.pData ? track.stsz : track.stz2;
+    if (sizes.cBytes < 8)
+    {
+        return VFW_E_INVALID_FILE_FORMAT;
+    }
+    long cSizeAll = 0;
+    long nFieldBits = 32;
+    if (track.stsz.pData)
+    {
+        cSizeAll = ReadLong(sizes.pData);
+    }
+    else
+    {
+        nFieldBits = sizes.pData[3];
+    }
+    long nSamples = ReadLong(sizes.pData + 4);
+    const BYTE* pSizes = sizes.pData + 8;
+    if ((nSamples < 0) ||
+        ((nFieldBits != 4) && (nFieldBits != 8) && (nFieldBits != 16) && (nFieldBits != 32)) ||
+        ((cSizeAll == 0) && (((LONGLONG(nSamples) * nFieldBits) + 7) / 8) > (sizes.cBytes - 8)))
+    {
+        return VFW_E_INVALID_FILE_FORMAT;
+    }
+
+    const Table& offsets = track.stco.pData ? track.stco : track.co64;
+    long cOffset = track.stco.pData ? 4 : 8;
+    long nChunks = ReadLong(offsets.pData);
+    long nEntriesSC = ReadLong(track.stsc.pData);
+    long nSTTS = ReadLong(track.stts.pData);
+    long nCTTS = track.ctts.pData ? ReadLong(track.ctts.pData) : 0;
+    long nSyncs = track.stss.pData ? ReadLong(track.stss.pData) : 0;
+    if (!TableFits(offsets, nChunks, cOffset) ||
+        !TableFits(track.stsc, nEntriesSC, 12) ||
+        !TableFits(track.stts, nSTTS, 8) ||
+        !TableFits(track.ctts, nCTTS, 8) ||
+        !TableFits(track.stss, nSyncs, 4))
+    {
+        return VFW_E_INVALID_FILE_FORMAT;
+    }
+
+    // one pass through all the tables together
+    pSamples->reserve(nSamples);
+    LONGLONG tDecode = track.tEdit + (tOffset * scale / UNITS);
+    long nPairSTTS = 0, cSTTS = 0, lDuration = 0;
+    long nPairCTTS = 0, cCTTS = 0, lOffset = 0;
+    long nEntrySC = 0, cPerChunk = 0, nInChunk = 0;
+    long nChunk = -1;
+    long nEntrySync = 0;
+    LONGLONG pos = 0;
+    for (long n = 0; n < nSamples; n++)
+    {
+        if (nInChunk == cPerChunk)
+        {
+            // next chunk that has samples
+            do
+            {
+                nChunk++;
+                if (nChunk >= nChunks)
+                {
+                    return VFW_E_INVALID_FILE_FORMAT;
+                }
+                while (((nEntrySC + 1) < nEntriesSC) &&
+                       (ReadLong(track.stsc.pData + 4 + ((nEntrySC + 1) * 12)) <= (nChunk + 1)))
+                {
+                    nEntrySC++;
+                }
+                cPerChunk = (nEntriesSC > 0) ? ReadLong(track.stsc.pData + 4 + (nEntrySC * 12) + 4) : 0;
+            } while (cPerChunk <= 0);
+
+            const BYTE* pOffset = offsets.pData + 4 + (nChunk * cOffset);
+            pos = (cOffset == 4) ? (ReadLong(pOffset) & 0xffffffff) : ReadI64(pOffset);
+            nInChunk = 0;
+        }
+
+        ClipSample sample;
+        sample.idxSource = idxSource;
+        sample.pos = pos;
+        sample.nChunk = nChunk;
+        if (cSizeAll != 0)
+        {
+            sample.cBytes = cSizeAll;
+        }
+        else if (nFieldBits == 32)
+        {
+            sample.cBytes = ReadLong(pSizes + (n * 4));
+        }
+        else if (nFieldBits == 16)
+        {
+            sample.cBytes = ReadShort(pSizes + (n * 2));
+        }
+        else if (nFieldBits == 8)
+        {
+            sample.cBytes = pSizes[n];
+        }
+        else
+        {
+            sample.cBytes = (pSizes[n / 2] >> ((n & 1) ? 0 : 4)) & 0xf;
+        }
+        pos += sample.cBytes;
+        nInChunk++;
+
+        if (cSTTS == 0)
+        {
+            if (nPairSTTS >= nSTTS)
+            {
+                return VFW_E_INVALID_FILE_FORMAT;
+            }
+            cSTTS = ReadLong(track.stts.pData + 4 + (nPairSTTS * 8));
+            lDuration = ReadLong(track.stts.pData + 4 + (nPairSTTS * 8) + 4);
+            nPairSTTS++;
+            if (cSTTS <= 0)
+            {
+                return VFW_E_INVALID_FILE_FORMAT;
+            }
+        }
+        cSTTS--;
+        if (nCTTS > 0)
+        {
+            if (cCTTS == 0)
+            {
+                if (nPairCTTS >= nCTTS)
+                {
+                    return VFW_E_INVALID_FILE_FORMAT;
+                }
+                cCTTS = ReadLong(track.ctts.pData + 4 + (nPairCTTS * 8));
+                lOffset = ReadLong(track.ctts.pData + 4 + (nPairCTTS * 8) + 4);
+                nPairCTTS++;
+                if (cCTTS <= 0)
+                {
+                    return VFW_E_INVALID_FILE_FORMAT;
+                }
+            }
+            cCTTS--;
+        }
+        if (track.stss.pData == NULL)
+        {
+            sample.bSync = true;
+        }
+        else
+        {
+            sample.bSync = (nEntrySync < nSyncs) && (ReadLong(track.stss.pData + 4 + (nEntrySync * 4)) == (n + 1));
+            if (sample.bSync)
+            {
+                nEntrySync++;
+            }
+        }
+
+        sample.tDecode = TimeFromScale(tDecode, scale);
+        sample.tStart = TimeFromScale(tDecode + lOffset, scale);
+        sample.tStop = sample.tStart + TimeFromScale(lDuration, scale);
+        tDecode += lDuration;
+        pSamples->push_back(sample);
+    }
+    return S_OK;
+}
+
+// --- edits -----------------------------------------------
+
+// once the new moov is written, the old one is no longer used
+static HRESULT
+FreeMoov(FileSink* pFile, LONGLONG posMoov)
+{
+    BYTE b[4];
+    WriteLong(DWORD('free'), b);
+    return pFile->Replace(posMoov + 4, b, 4);
+}
+
+HRESULT
+TrimMovie(FileSink* pIn, FileSink* pOut, REFERENCE_TIME tFrom, REFERENCE_TIME tTo,
+          REFERENCE_TIME* ptFrom, REFERENCE_TIME* ptTo)
+{
+    MovieReader reader;
+    HRESULT hr = reader.Open(pIn);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    vector<vector<ClipSample> > tracks(reader.Tracks());
+    long idxKey = -1;
+    for (long i = 0; i < reader.Tracks(); i++)
+    {
+        hr = reader.Samples(i, 0, 0, &tracks[i]);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+        if ((idxKey < 0) && reader.Handler(i)->IsVideo())
+        {
+            idxKey = i;
+        }
+    }
+
+    REFERENCE_TIME tKeptFrom, tKeptTo;
+    if (!SelectClip(&tracks, max(idxKey, 0L), tFrom, tTo, &tKeptFrom, &tKeptTo))
+    {
+        return E_INVALIDARG;
+    }
+    if (ptFrom)
+    {
+        *ptFrom = tKeptFrom;
+    }
+    if (ptTo)
+    {
+        *ptTo = tKeptTo;
+    }
+
+    MovieWriter movie(pOut);
+    vector<vector<ClipSample> > slices;
+    for (long i = 0; i < (long)tracks.size(); i++)
+    {
+        if (!tracks[i].empty())
+        {
+            movie.MakeTrack(reader.Handler(i));
+            slices.push_back(tracks[i]);
+        }
+    }
+    vector<FileSink*> sources(1, pIn);
+    REFERENCE_TIME tDuration;
+    hr = movie.WriteFromFiles(slices, sources, pOut, &tDuration);
+    if (SUCCEEDED(hr) && (pOut == pIn))
+    {
+        hr = FreeMoov(pOut, reader.MoovPosition());
+    }
+    return hr;
+}
+
+HRESULT
+ConcatMovies(const vector<FileSink*>& inputs, FileSink* pOut)
+{
+    if (inputs.empty())
+    {
+        return E_INVALIDARG;
+    }
+    vector<smart_ptr<MovieReader> > readers;
+    for (size_t k = 0; k < inputs.size(); k++)
+    {
+        smart_ptr<MovieReader> pReader = new MovieReader;
+        HRESULT hr = pReader->Open(inputs[k]);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+        readers.push_back(pReader);
+    }
+
+    // the sample descriptions of each track must match, since
+    // only one is written
+    MovieReader* pFirst = readers[0];
+    for (size_t k = 1; k < readers.size(); k++)
+    {
+        if (readers[k]->Tracks() != pFirst->Tracks())
+        {
+            return VFW_E_TYPE_NOT_ACCEPTED;
+        }
+        for (long i = 0; i < pFirst->Tracks(); i++)
+        {
+            const MuxCodecConfig* pThis = readers[k]->Config(i);
+            const MuxCodecConfig* pConfig = pFirst->Config(i);
+            if ((pThis->fourcc != pConfig->fourcc) ||
+                (pThis->sampleRate != pConfig->sampleRate) ||
+                (pThis->cConfig != pConfig->cConfig) ||
+                (memcmp(pThis->pConfig + 16, pConfig->pConfig + 16, pConfig->cConfig - 16) != 0))
+            {
+                return VFW_E_TYPE_NOT_ACCEPTED;
+            }
+        }
+    }
+
+    vector<vector<ClipSample> > tracks(pFirst->Tracks());
+    REFERENCE_TIME tOffset = 0;
+    vector<ClipSample> samples;
+    for (long k = 0; k < (long)readers.size(); k++)
+    {
+        for (long i = 0; i < pFirst->Tracks(); i++)
+        {
+            HRESULT hr = readers[k]->Samples(i, k, tOffset, &samples);
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+            tracks[i].insert(tracks[i].end(), samples.begin(), samples.end());
+        }
+        tOffset += readers[k]->Duration();
+    }
+
+    MovieWriter movie(pOut);
+    for (long i = 0; i < pFirst->Tracks(); i++)
+    {
+        movie.MakeTrack(pFirst->Handler(i));
+    }
+    REFERENCE_TIME tDuration;
+    HRESULT hr = movie.WriteFromFiles(tracks, inputs, pOut, &tDuration);
+    if (SUCCEEDED(hr) && (pOut == inputs[0]))
+    {
+        hr = FreeMoov(pOut, pFirst->MoovPosition());
+    }
+    return hr;
+}
@@ -0,0 +1,100 @@
+// MovieEdit.h: trim and concatenation of finished MP4 files by index rewrite
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "MovieWriter.h"
+
+class FileSink;
+
+// Reads the moov of an existing file: the format and sample tables of
+// each track, for editing without re-muxing. Each track must have a
+// single sample description. An empty edit at the start of a track (as
+// written by TrackWriter) is kept as the track's start time; other edits
+// are ignored.
+class MovieReader
+{
+public:
+    MovieReader();
+
+    HRESULT Open(FileSink* pFile);
+
+    long Tracks()
+    {
+        return (long)m_Tracks.size();
+    }
+    const MuxCodecConfig* Config(long nTrack)
+    {
+        return &m_Tracks[nTrack].config;
+    }
+    smart_ptr<TypeHandler> Handler(long nTrack)
+    {
+        return m_Tracks[nTrack].pType;
+    }
+
+    // the samples of a track in decode order, with times moved by
+    // tOffset (rounded to the track's timescale)
+    HRESULT Samples(long nTrack, long idxSource, REFERENCE_TIME tOffset, vector<ClipSample>* pSamples);
+
+    // the end of the last sample of any track
+    REFERENCE_TIME Duration()
+    {
+        return m_tDuration;
+    }
+
+    // position of the moov atom in the file
+    LONGLONG MoovPosition()
+    {
+        return m_posMoov;
+    }
+
+private:
+    struct Table
+    {
+        const BYTE* pData;      // the atom body, after the version and flags
+        long cBytes;
+        bool bVersion1;
+    };
+    struct Track
+    {
+        MuxCodecConfig config;
+        smart_ptr<TypeHandler> pType;
+        LONGLONG tEdit;         // start offset, in track timescale
+        Table stts;
+        Table ctts;
+        Table stss;
+        Table stsz;
+        Table stz2;
+        Table stsc;
+        Table stco;
+        Table co64;
+    };
+    HRESULT ReadTrack(const BYTE* pTrak, long cTrak, long movieScale);
+    static bool TableFits(const Table& table, long nEntries, long cEntry);
+
+private:
+    smart_array<BYTE> m_pMoov;
+    LONGLONG m_posMoov;
+    vector<Track> m_Tracks;
+    REFERENCE_TIME m_tDuration;
+};
+
+// Keeps the part of pIn from the last video key frame at or before tFrom up
+// to the first at or after tTo, writing a new moov whose tables are built as
+// TrackWriter builds them. The payload is copied to pOut (which should be
+// empty) with FileSink::CopyFrom; if pOut is pIn, the payload stays in place,
+// a new moov is appended and the old one becomes a free atom.
+// *ptFrom and *ptTo (optional) receive the range kept.
+HRESULT TrimMovie(FileSink* pIn, FileSink* pOut, REFERENCE_TIME tFrom, REFERENCE_TIME tTo,
+                  REFERENCE_TIME* ptFrom = NULL, REFERENCE_TIME* ptTo = NULL);
+
+// Joins files end to end, each starting where the previous one ends. The files
+// must have the same tracks, with identical sample descriptions (eg the files
+// of one rolling recording). If pOut is inputs[0], that file's payload stays
+// in place and the rest is appended to it.
+HRESULT ConcatMovies(const vector<FileSink*>& inputs, FileSink* pOut);
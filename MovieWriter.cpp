@@ -12,6 +12,16 @@
 #include "stdafx.h"
 #include "MovieWriter.h"
 #include "TypeHandler.h"
+#include "IndexJournal.h"
+#include "SeekIndex.h"
+#include "IndexSpill.h"
+#include "QueueSpill.h"
+#include "FileSink.h"
+#include <algorithm>
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define SWAP_SSE2
+#endif
     
 Atom::Atom(AtomWriter* pContainer, LONGLONG llOffset, DWORD type)
 : m_pContainer(pContainer),
@@ -23,7 +33,7 @@ Atom::Atom(AtomWriter* pContainer, LONGLONG llOffset, DWORD type)
     BYTE b[8];
     WriteLong(8, b);
     WriteLong(type, b+4);
-    Append(b, 8);
+    AppendHeader(b);
 }
 
 HRESULT 
@@ -51,28 +61,277 @@ Atom::CreateAtom(DWORD type)
 
 // --------------------------------------------------------------------
 
+// Rolling output: finishes each old file on a worker thread, so that
+// the writer does not wait while the moov (and seek index) are written,
+// or for a sync of the old file to complete. Each old file is handed
+// over as a movie of its own, with the index of the samples written to
+// it, and files are finished in the order they were split.
+class SegmentCloser : public CAMThread
+{
+public:
+    SegmentCloser(WriteObserver* pSync)
+    : m_pSync(pSync),
+      m_bExit(false)
+    {
+    }
+
+    HRESULT Start()
+    {
+        if (!Create())
+        {
+            return E_FAIL;
+        }
+        return S_OK;
+    }
+
+    // takes ownership of pOld, so that it is always released here.
+    // pNext is the container that syncs go to once pOld is finished.
+    void Add(MovieWriter* pOld, AtomWriter* pNext)
+    {
+        CAutoLock lock(&m_csJobs);
+        Job job;
+        job.pOld = pOld;
+        job.pNext = pNext;
+        m_Jobs.push_back(job);
+        m_evWork.Set();
+    }
+
+    // finishes any files not yet finished, and stops the worker
+    void Finish()
+    {
+        if (ThreadExists())
+        {
+            {
+                CAutoLock lock(&m_csJobs);
+                m_bExit = true;
+            }
+            m_evWork.Set();
+            Close();
+        }
+    }
+
+private:
+    DWORD ThreadProc()
+    {
+        for (;;)
+        {
+            Job job;
+            {
+                CAutoLock lock(&m_csJobs);
+                if (!m_Jobs.empty())
+                {
+                    job = m_Jobs.front();
+                    m_Jobs.pop_front();
+                }
+                else if (m_bExit)
+                {
+                    break;
+                }
+            }
+            if (job.pOld)
+            {
+                FinishFile(job.pOld, job.pNext);
+            }
+            else
+            {
+                m_evWork.Wait();
+            }
+        }
+        return 0;
+    }
+
+    void FinishFile(MovieWriter* pOld, AtomWriter* pNext)
+    {
+        REFERENCE_TIME tDur;
+        HRESULT hr = pOld->Close(&tDur);
+        if (FAILED(hr))
+        {
+            DbgLog((LOG_ERROR, 0, TEXT("Mux: failed to complete file at split 0x%x"), hr));
+        }
+        IndexSpill* pSpill = pOld->Spill();
+        if (pSpill)
+        {
+            pSpill->Release();
+        }
+
+        // syncs go to the new file from now on. This waits for any
+        // sync of the old file, which must complete before its
+        // container is released (with the movie).
+        if (m_pSync)
+        {
+            m_pSync->SetTarget(pNext);
+        }
+    }
+
+private:
+    struct Job
+    {
+        Job()
+        : pNext(NULL)
+        {
+        }
+        smart_ptr<MovieWriter> pOld;
+        AtomWriter* pNext;
+    };
+
+    WriteObserver* m_pSync;
+    CCritSec m_csJobs;
+    list<Job> m_Jobs;
+    CAMEvent m_evWork;
+    bool m_bExit;
+};
+
 MovieWriter::MovieWriter(AtomWriter* pContainer)
 : m_pContainer(pContainer),
   m_bStopped(false),
-  m_bFTYPInserted(false)
+  m_bFTYPInserted(false),
+  m_bCompactSizes(false),
+  m_llQueueBytes(0),
+  m_tQueueDuration(0),
+  m_pSync(NULL),
+  m_pSegments(NULL),
+  m_llMaxBytes(0),
+  m_tMaxDuration(0),
+  m_bSegmentContainer(false),
+  m_tFileStart(-1),
+  m_bSplitPending(false),
+  m_pKeyTrack(NULL),
+  m_pNext(NULL),
+  m_tSplit(-1)
+{
+}
+
+MovieWriter::~MovieWriter()
 {
+    // defined here where IndexJournal, SeekIndex, IndexSpill and QueueSpill are complete types
+
+    // old files still being finished refer to the segment source
+    if (m_pCloser)
+    {
+        m_pCloser->Finish();
+    }
+
+    if (m_pSegments)
+    {
+        if (m_bSegmentContainer)
+        {
+            m_pSegments->Release(m_pContainer);
+        }
+        if (m_pNext)
+        {
+            m_pSegments->Release(m_pNext);
+        }
+    }
+}
+
+void
+MovieWriter::SetJournal(IndexJournal* pJournal)
+{
+    m_pJournal = pJournal;
+
+    // the journal's commits sync the data before recording it
+    if (m_pJournal && FAILED(m_pJournal->Start(m_pContainer)))
+    {
+        DbgLog((LOG_ERROR, 0, TEXT("Mux: journal worker not started")));
+    }
+}
+
+void
+MovieWriter::SetSeekIndex(SeekIndex* pSeekIndex)
+{
+    m_pSeekIndex = pSeekIndex;
+}
+
+void
+MovieWriter::SetIndexSpill(IndexSpill* pSpill)
+{
+    // tracks pick this up when they are made
+    ASSERT(m_Tracks.empty());
+    m_pSpill = pSpill;
+}
+
+void
+MovieWriter::SetQueueSpill(QueueSpill* pSpill, LONGLONG llMaxBytes, REFERENCE_TIME tMaxDuration)
+{
+    m_pQueueSpill = pSpill;
+    m_llQueueBytes = llMaxBytes;
+    m_tQueueDuration = tMaxDuration;
+}
+
+void
+MovieWriter::SetRolling(SegmentSource* pSource, LONGLONG llMaxBytes, REFERENCE_TIME tMaxDuration)
+{
+    m_pSegments = pSource;
+    m_llMaxBytes = llMaxBytes;
+    m_tMaxDuration = tMaxDuration;
 }
 
 TrackWriter* 
-MovieWriter::MakeTrack(const CMediaType* pmt)
+MovieWriter::MakeTrack(const MuxCodecConfig* pConfig)
 {
-    TypeHandler* ph = TypeHandler::Make(pmt);
+    TypeHandler* ph = TypeHandler::Make(pConfig);
     if (!ph)
     {
         return NULL;
     }
     TrackWriter* pTrack = new TrackWriter(this, (long)m_Tracks.size(), ph);
     m_Tracks.push_back(pTrack);
+    if (m_pJournal)
+    {
+        m_pJournal->AddTrack(pTrack->ID(), pConfig);
+    }
+    return pTrack;
+}
+
+TrackWriter*
+MovieWriter::MakeTrack(smart_ptr<TypeHandler> pType)
+{
+    TrackWriter* pTrack = new TrackWriter(this, (long)m_Tracks.size(), pType);
+    m_Tracks.push_back(pTrack);
     return pTrack;
 }
 
 HRESULT 
 MovieWriter::Close(REFERENCE_TIME* pDuration)
+{
+    // rolling output: the earlier files are finished first
+    if (m_pCloser)
+    {
+        m_pCloser->Finish();
+    }
+
+    // commit the journal for the data written so far, while the
+    // container is certain to be valid, in case the moov fails
+    if (m_pJournal)
+    {
+        m_pJournal->Stop();
+    }
+
+    HRESULT hr = WriteMOOV(pDuration);
+
+    // the index is now in the file, so the journal is not needed
+    if (SUCCEEDED(hr) && m_pJournal)
+    {
+        m_pJournal->Discard();
+        m_pJournal = NULL;
+    }
+
+    // the sidecar is optional: failure to write it does not fail the file
+    if (SUCCEEDED(hr) && m_pSeekIndex)
+    {
+        HRESULT hrSeek = m_pSeekIndex->Write(this);
+        if (FAILED(hrSeek))
+        {
+            DbgLog((LOG_ERROR, 0, TEXT("Mux: failed to write seek index 0x%x"), hrSeek));
+        }
+    }
+    m_pSeekIndex = NULL;
+
+    return hr;
+}
+
+HRESULT
+MovieWriter::WriteMOOV(REFERENCE_TIME* pDuration)
 {
     // get longest duration of all tracks
     // also get earliest sample
@@ -155,18 +414,135 @@ MovieWriter::Close(REFERENCE_TIME* pDuration)
 
     MakeIODS(pmoov);
 
-    for (it = m_Tracks.begin(); it != m_Tracks.end(); it++)
+    hr = WriteTraks(pmoov);
+    
+    pmoov->Close();
+
+    return hr;
+}
+
+#ifdef _WIN32
+static long
+ProcessorCount()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return max(long(info.dwNumberOfProcessors), 1L);
+}
+#else
+static long
+ProcessorCount()
+{
+    return max(long(sysconf(_SC_NPROCESSORS_ONLN)), 1L);
+}
+#endif
+
+// The traks of a large movie with several tracks are built in
+// parallel by the closing thread and a worker per additional processor.
+// The closing thread builds the first trak straight into the moov, and
+// each of the others is built into its own buffer by the next thread
+// free, to be copied into the moov in turn.
+class TrakBuilder : public CAMThread
+{
+public:
+    TrakBuilder(vector<TrackWriterPtr>* pTracks, vector<MemorySink>* pTraks, vector<HRESULT>* pResults, long* pnNext)
+    : m_pTracks(pTracks),
+      m_pTraks(pTraks),
+      m_pResults(pResults),
+      m_pnNext(pnNext)
     {
-        TrackWriter* pTrack = *it;
-        hr = pTrack->Close(pmoov);
-        if (FAILED(hr))
+    }
+
+    void Build()
+    {
+        for (;;)
         {
-            break;
+            long n = InterlockedIncrement(m_pnNext) - 1;
+            if (n >= (long)m_pTracks->size())
+            {
+                break;
+            }
+            (*m_pResults)[n] = (*m_pTracks)[n]->Close(&(*m_pTraks)[n]);
         }
     }
-    
-    pmoov->Close();
 
+private:
+    DWORD ThreadProc()
+    {
+        Build();
+        return 0;
+    }
+
+private:
+    vector<TrackWriterPtr>* m_pTracks;
+    vector<MemorySink>* m_pTraks;
+    vector<HRESULT>* m_pResults;
+    long* m_pnNext;
+};
+
+HRESULT
+MovieWriter::WriteTraks(Atom* pmoov)
+{
+    HRESULT hr = S_OK;
+    long nTracks = (long)m_Tracks.size();
+    long nThreads = min(ProcessorCount(), nTracks);
+
+    // Close cannot be quicker than the largest trak, so building in
+    // parallel saves at most the time of the others, and that must be
+    // worth the threads and the copying of the buffered traks
+    long cSamples = 0;
+    long cLargest = 0;
+    for (long n = 0; n < nTracks; n++)
+    {
+        long c = m_Tracks[n]->IndexedSamples();
+        cSamples += c;
+        cLargest = max(cLargest, c);
+    }
+    if ((nThreads <= 1) || ((cSamples - cLargest) < parallel_trak_samples))
+    {
+        // straight into the moov
+        for (long n = 0; n < nTracks; n++)
+        {
+            hr = m_Tracks[n]->Close(pmoov);
+            if (FAILED(hr))
+            {
+                break;
+            }
+        }
+        return hr;
+    }
+
+    vector<MemorySink> traks(nTracks);
+    vector<HRESULT> results(nTracks, S_OK);
+    long nNext = 1;
+    vector<smart_ptr<TrakBuilder> > workers;
+    for (long i = 1; i < nThreads; i++)
+    {
+        smart_ptr<TrakBuilder> pWorker = new TrakBuilder(&m_Tracks, &traks, &results, &nNext);
+        if (pWorker->Create())
+        {
+            workers.push_back(pWorker);
+        }
+    }
+    results[0] = m_Tracks[0]->Close(pmoov);
+    TrakBuilder self(&m_Tracks, &traks, &results, &nNext);
+    self.Build();
+    for (UINT i = 0; i < workers.size(); i++)
+    {
+        workers[i]->Close();
+    }
+
+    // the rest follow it in track order, as if written in turn
+    hr = results[0];
+    for (long n = 1; SUCCEEDED(hr) && (n < nTracks); n++)
+    {
+        hr = results[n];
+        if (SUCCEEDED(hr))
+        {
+            hr = traks[n].CopyTo(pmoov);
+        }
+        traks[n].Clear();
+    }
     return hr;
 }
 
@@ -277,7 +653,7 @@ MovieWriter::CheckQueues()
         }
         
         // mustn't get too far ahead of any blocked tracks (unless we have reached EOS)
-        if (!bSomeAtEOS && bSomeNotReady && ((tEarliestReady - tEarliestNotReady) > UNITS))
+        if (!bSomeAtEOS && bSomeNotReady && ((tEarliestReady - tEarliestNotReady) > InterleaveLead()))
         {
             // wait for more data on earliest-not-ready track
             break;
@@ -292,6 +668,14 @@ MovieWriter::CheckQueues()
 void
 MovieWriter::WriteTrack(int indexReady)
 {
+    // a chunk starting at the split point begins the next file
+    if (m_pSegments && m_Tracks[indexReady]->HeadIsSplit())
+    {
+        NextFile();
+    }
+
+    LONGLONG llBefore = m_pContainer->Length();
+
     // make sure we have space in an mdat atom
     // -- make a new atom every 1Gb
     if ((m_patmMDAT) && (m_patmMDAT->Length() >= 1024*1024*1024))
@@ -305,11 +689,214 @@ MovieWriter::WriteTrack(int indexReady)
         {
             InsertFTYP(m_pContainer);
         }
-        m_patmMDAT = new Atom(m_pContainer, m_pContainer->Length(), DWORD('mdat'));
+        LONGLONG posMDAT = m_pContainer->Length();
+        m_patmMDAT = new Atom(m_pContainer, posMDAT, DWORD('mdat'));
+        if (m_pJournal)
+        {
+            m_pJournal->AddMDAT(posMDAT);
+        }
     }
 
     // write earliest block
-    m_Tracks[indexReady]->WriteHead(m_patmMDAT);
+    bool bSync = false;
+    m_Tracks[indexReady]->WriteHead(m_patmMDAT, &bSync);
+
+    if (m_pSync)
+    {
+        // key frame chunks are video key frames, unless there is no video
+        bool bKey = false;
+        if (bSync)
+        {
+            bKey = true;
+            if (!m_Tracks[indexReady]->IsVideo())
+            {
+                for (UINT i = 0; i < m_Tracks.size(); i++)
+                {
+                    if (m_Tracks[i]->IsVideo())
+                    {
+                        bKey = false;
+                        break;
+                    }
+                }
+            }
+        }
+        m_pSync->OnWrite(long(m_pContainer->Length() - llBefore), bKey);
+    }
+
+    if (m_pSegments)
+    {
+        CheckSplit(m_Tracks[indexReady]->LastWrite());
+    }
+}
+
+void
+MovieWriter::CheckSplit(LONGLONG tWritten)
+{
+    if (m_tFileStart < 0)
+    {
+        m_tFileStart = tWritten;
+    }
+    if ((m_llMaxBytes > 0 && (m_pContainer->Length() >= m_llMaxBytes)) ||
+        (m_tMaxDuration > 0 && ((tWritten - m_tFileStart) >= m_tMaxDuration)))
+    {
+        CAutoLock lock(&m_csSplit);
+        if (!m_bSplitPending)
+        {
+            // the split is at the next key frame on the first
+            // video track (or any track if there is no video)
+            m_pKeyTrack = m_Tracks[0];
+            for (UINT i = 0; i < m_Tracks.size(); i++)
+            {
+                if (m_Tracks[i]->IsVideo())
+                {
+                    m_pKeyTrack = m_Tracks[i];
+                    break;
+                }
+            }
+            m_bSplitPending = true;
+
+            // the next container is prepared while we wait for the key
+            // frame; if it is not ready by then, we split at a later one.
+            m_pSegments->Prepare();
+        }
+    }
+}
+
+bool
+MovieWriter::IsSplitPoint(TrackWriter* pTrack, const MuxSample* pSample, MediaChunk* pCurrent, bool* pbNewFile)
+{
+    CAutoLock lock(&m_csSplit);
+    if (!m_bSplitPending)
+    {
+        return false;
+    }
+    if (pTrack == m_pKeyTrack)
+    {
+        if ((m_pNext != NULL) || !pSample->IsSync())
+        {
+            return false;
+        }
+        m_pNext = m_pSegments->Next();
+        if (m_pNext == NULL)
+        {
+            // not ready: never wait for it. This is a no-op if
+            // still being prepared, or retries if that failed.
+            m_pSegments->Prepare();
+            return false;
+        }
+        *pbNewFile = true;
+        return true;
+    }
+
+    // other tracks break their chunk at the split time, so that samples
+    // from after the split are not written to the old file.
+    // Samples queued before the split time is known remain where they are.
+    if ((m_tSplit < 0) || (pCurrent == NULL) || (pCurrent->Samples() == 0))
+    {
+        return false;
+    }
+    REFERENCE_TIME tChunk, tChunkEnd;
+    pCurrent->GetTime(&tChunk, &tChunkEnd);
+    if (pSample->HasTime() && (pSample->tStart >= m_tSplit) && (tChunk < m_tSplit))
+    {
+        return true;
+    }
+    return false;
+}
+
+void
+MovieWriter::SetSplitTime(REFERENCE_TIME tSplit)
+{
+    // for key frames spread across several buffers, the
+    // time is not known until the last buffer
+    CAutoLock lock(&m_csSplit);
+    if (m_tSplit < 0)
+    {
+        m_tSplit = tSplit;
+    }
+}
+
+void
+MovieWriter::NextFile()
+{
+    // The current file, with the index of the samples written to it, is
+    // handed to a movie of its own, which the closer finishes on its
+    // worker: each track's start is rebased (AdjustStart) to the earliest
+    // sample in that file when its moov is written there. Here, under the
+    // write lock, new chunks are only redirected to the next file, which
+    // starts again from zero.
+    MovieWriter* pOld = new MovieWriter(m_pContainer);
+    pOld->m_bCompactSizes = m_bCompactSizes;
+    pOld->m_pSpill = m_pSpill;
+    for (UINT i = 0; i < m_Tracks.size(); i++)
+    {
+        m_Tracks[i]->MoveIndex(pOld->MakeTrack(m_Tracks[i]->SharedHandler()));
+    }
+    pOld->m_patmMDAT = m_patmMDAT;
+    m_patmMDAT = NULL;
+    if (m_bSegmentContainer)
+    {
+        // released when the old movie is done
+        pOld->m_pSegments = m_pSegments;
+        pOld->m_bSegmentContainer = true;
+    }
+
+    // journal offsets refer to the first file only,
+    // and so does the seek index
+    pOld->m_pJournal = m_pJournal;
+    m_pJournal = NULL;
+    pOld->m_pSeekIndex = m_pSeekIndex;
+    m_pSeekIndex = NULL;
+
+    // the old tables' spilled blocks are needed until the moov is written
+    if (m_pSpill)
+    {
+        m_pSpill->Retire();
+    }
+
+    AtomWriter* pNext;
+    {
+        CAutoLock lock(&m_csSplit);
+        pNext = m_pNext;
+        m_pNext = NULL;
+        m_bSplitPending = false;
+        m_pKeyTrack = NULL;
+        m_tSplit = -1;
+    }
+
+    if (!m_pCloser)
+    {
+        m_pCloser = new SegmentCloser(m_pSync);
+        if (FAILED(m_pCloser->Start()))
+        {
+            // finish the file here instead
+            DbgLog((LOG_ERROR, 0, TEXT("Mux: no worker to complete files at split")));
+            m_pCloser = NULL;
+        }
+    }
+    if (m_pCloser)
+    {
+        m_pCloser->Add(pOld, pNext);
+    }
+    else
+    {
+        smart_ptr<MovieWriter> pFinish = pOld;
+        REFERENCE_TIME tDur;
+        pFinish->Close(&tDur);
+        if (m_pSpill)
+        {
+            m_pSpill->Release();
+        }
+        if (m_pSync)
+        {
+            m_pSync->SetTarget(pNext);
+        }
+    }
+
+    m_pContainer = pNext;
+    m_bSegmentContainer = true;
+    m_bFTYPInserted = false;
+    m_tFileStart = -1;
 }
 
 void
@@ -351,7 +938,6 @@ MovieWriter::WriteOnStop()
 REFERENCE_TIME 
 MovieWriter::CurrentPosition()
 {
-    CAutoLock lock(&m_csWrite);
     LONGLONG tEarliest = -1;
     for (UINT i = 0; i < m_Tracks.size(); i++)
     {
@@ -364,6 +950,278 @@ MovieWriter::CurrentPosition()
     return tEarliest;
 }
 
+// the clip of one track: from the last sync sample presented at or
+// before tFrom up to (not including) the first presented at or after tTo
+static void
+SelectTrackClip(vector<ClipSample>* pSamples, REFERENCE_TIME tFrom, REFERENCE_TIME tTo,
+                REFERENCE_TIME* ptFrom, REFERENCE_TIME* ptTo)
+{
+    vector<ClipSample>& samples = *pSamples;
+    *ptFrom = -1;
+    *ptTo = -1;
+    long nStart = -1;
+    for (long n = 0; n < (long)samples.size(); n++)
+    {
+        if (samples[n].bSync)
+        {
+            if ((nStart < 0) || (samples[n].tStart <= tFrom))
+            {
+                nStart = n;
+            }
+            if (samples[n].tStart >= tFrom)
+            {
+                break;
+            }
+        }
+    }
+    if (nStart < 0)
+    {
+        samples.clear();
+        return;
+    }
+    long nStop = (long)samples.size();
+    for (long n = nStart + 1; n < (long)samples.size(); n++)
+    {
+        if (samples[n].bSync && (samples[n].tStart >= tTo))
+        {
+            nStop = n;
+            break;
+        }
+    }
+
+    *ptFrom = samples[nStart].tStart;
+    if (nStop < (long)samples.size())
+    {
+        *ptTo = samples[nStop].tStart;
+    }
+    else
+    {
+        for (long n = nStart; n < nStop; n++)
+        {
+            *ptTo = max(*ptTo, samples[n].tStop);
+        }
+    }
+    samples.erase(samples.begin() + nStop, samples.end());
+    samples.erase(samples.begin(), samples.begin() + nStart);
+}
+
+bool
+SelectClip(vector<vector<ClipSample> >* pTracks, long idxKey, REFERENCE_TIME tFrom, REFERENCE_TIME tTo,
+           REFERENCE_TIME* ptFrom, REFERENCE_TIME* ptTo)
+{
+    vector<vector<ClipSample> >& tracks = *pTracks;
+    SelectTrackClip(&tracks[idxKey], tFrom, tTo, ptFrom, ptTo);
+    if (tracks[idxKey].empty())
+    {
+        return false;
+    }
+    for (long i = 0; i < (long)tracks.size(); i++)
+    {
+        if (i != idxKey)
+        {
+            REFERENCE_TIME tTrackFrom, tTrackTo;
+            SelectTrackClip(&tracks[i], *ptFrom, *ptTo, &tTrackFrom, &tTrackTo);
+        }
+    }
+    return true;
+}
+
+// the samples of one track from one chunk of a source file
+struct ClipPiece
+{
+    long idxSource;
+    LONGLONG pos;
+    LONGLONG cBytes;
+    long idxTrack;
+    long nFirst;
+    long nSamples;
+    LONGLONG posOut;
+
+    static bool FileOrder(const ClipPiece* p1, const ClipPiece* p2)
+    {
+        if (p1->idxSource != p2->idxSource)
+        {
+            return p1->idxSource < p2->idxSource;
+        }
+        return p1->pos < p2->pos;
+    }
+};
+
+HRESULT
+MovieWriter::ExportClip(REFERENCE_TIME tFrom, REFERENCE_TIME tTo, FileSink* pRecording, FileSink* pClip,
+                        REFERENCE_TIME* ptFrom, REFERENCE_TIME* ptTo)
+{
+    // the index is only held long enough to read it: the
+    // samples it lists are then fixed in the file
+    vector<vector<ClipSample> > tracks(m_Tracks.size());
+    long idxKey = -1;
+    {
+        CAutoLock lock(&m_csWrite);
+        if (m_Tracks.empty())
+        {
+            return VFW_E_WRONG_STATE;
+        }
+        LONGLONG llAvailable = pRecording->Length();
+        for (long i = 0; i < (long)m_Tracks.size(); i++)
+        {
+            m_Tracks[i]->ReadIndex(llAvailable, &tracks[i]);
+            if ((idxKey < 0) && m_Tracks[i]->IsVideo())
+            {
+                idxKey = i;
+            }
+        }
+    }
+
+    // the clip is cut at key frames on the first video track,
+    // and the other tracks cover the same range
+    REFERENCE_TIME tClipFrom, tClipTo;
+    if (!SelectClip(&tracks, max(idxKey, 0L), tFrom, tTo, &tClipFrom, &tClipTo))
+    {
+        return E_INVALIDARG;
+    }
+    if (ptFrom)
+    {
+        *ptFrom = tClipFrom;
+    }
+    if (ptTo)
+    {
+        *ptTo = tClipTo;
+    }
+
+    MovieWriter clip(pClip);
+    vector<vector<ClipSample> > slices;
+    for (long i = 0; i < (long)tracks.size(); i++)
+    {
+        if (!tracks[i].empty())
+        {
+            clip.MakeTrack(m_Tracks[i]->SharedHandler());
+            slices.push_back(tracks[i]);
+        }
+    }
+    vector<FileSink*> sources(1, pRecording);
+    REFERENCE_TIME tDuration;
+    return clip.WriteFromFiles(slices, sources, pClip, &tDuration);
+}
+
+HRESULT
+MovieWriter::WriteFromFiles(const vector<vector<ClipSample> >& tracks, const vector<FileSink*>& sources,
+                            FileSink* pOut, REFERENCE_TIME* pDuration)
+{
+    if (tracks.size() != m_Tracks.size())
+    {
+        return E_INVALIDARG;
+    }
+
+    // each run of samples from one chunk is a chunk in the new file
+    vector<ClipPiece> pieces;
+    for (long i = 0; i < (long)tracks.size(); i++)
+    {
+        const vector<ClipSample>& samples = tracks[i];
+        for (long n = 0; n < (long)samples.size(); n++)
+        {
+            if ((n == 0) || (samples[n].nChunk != samples[n-1].nChunk) ||
+                (samples[n].idxSource != samples[n-1].idxSource))
+            {
+                ClipPiece piece;
+                piece.idxSource = samples[n].idxSource;
+                piece.pos = samples[n].pos;
+                piece.cBytes = 0;
+                piece.idxTrack = i;
+                piece.nFirst = n;
+                piece.nSamples = 0;
+                piece.posOut = piece.pos;
+                pieces.push_back(piece);
+            }
+            pieces.back().cBytes += samples[n].cBytes;
+            pieces.back().nSamples++;
+        }
+    }
+
+    // data already in the output stays where it is. The rest is copied to
+    // a new mdat, in the order of the sources, and in file order
+    // within each, so that the interleaving is kept.
+    vector<ClipPiece*> copies;
+    LONGLONG cPayload = 0;
+    for (size_t idx = 0; idx < pieces.size(); idx++)
+    {
+        if (sources[pieces[idx].idxSource] != pOut)
+        {
+            copies.push_back(&pieces[idx]);
+            cPayload += pieces[idx].cBytes;
+        }
+    }
+    sort(copies.begin(), copies.end(), ClipPiece::FileOrder);
+
+    HRESULT hr = S_OK;
+    if (pOut->Length() == 0)
+    {
+        InsertFTYP(pOut);
+    }
+    if (!copies.empty())
+    {
+        // the mdat is written here rather than by an Atom, since the
+        // payload does not pass through Append, and may need a 64-bit size
+        BYTE b[16];
+        long cHeader = 8;
+        if ((cPayload + 8) > 0xffffffff)
+        {
+            cHeader = 16;
+            WriteLong(1, b);
+            WriteI64(cPayload + cHeader, b + 8);
+        }
+        else
+        {
+            WriteLong(long(cPayload + cHeader), b);
+        }
+        WriteLong(DWORD('mdat'), b + 4);
+        hr = pOut->Append(b, cHeader);
+    }
+
+    // pieces that were adjacent in a source are copied together
+    size_t idxRun = 0;
+    LONGLONG posOut = pOut->Length();
+    for (size_t idx = 0; SUCCEEDED(hr) && (idx < copies.size()); idx++)
+    {
+        ClipPiece* pPiece = copies[idx];
+        pPiece->posOut = posOut;
+        posOut += pPiece->cBytes;
+        if (((idx + 1) == copies.size()) ||
+            (copies[idx + 1]->idxSource != pPiece->idxSource) ||
+            (copies[idx + 1]->pos != (pPiece->pos + pPiece->cBytes)))
+        {
+            ClipPiece* pFirst = copies[idxRun];
+            LONGLONG cRun = pPiece->pos + pPiece->cBytes - pFirst->pos;
+            hr = pOut->CopyFrom(sources[pFirst->idxSource], pFirst->pos, cRun);
+            idxRun = idx + 1;
+        }
+    }
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    // the index is built as if the samples had been written here,
+    // with the decode times, so that the tables match the sources
+    for (size_t idx = 0; idx < pieces.size(); idx++)
+    {
+        const ClipPiece& piece = pieces[idx];
+        TrackWriter* pTrack = m_Tracks[piece.idxTrack];
+        for (long n = piece.nFirst; n < (piece.nFirst + piece.nSamples); n++)
+        {
+            const ClipSample& sample = tracks[piece.idxTrack][n];
+            MuxSample times;
+            times.tStart = sample.tStart;
+            times.tStop = sample.tStop;
+            times.tDecode = sample.tDecode;
+            times.dwFlags = MuxSample_Time | MuxSample_DecodeTime;
+            pTrack->IndexSample(sample.bSync, &times, sample.cBytes);
+        }
+        pTrack->IndexChunk(piece.posOut, piece.nSamples);
+    }
+
+    return WriteMOOV(pDuration);
+}
+
 void 
 MovieWriter::MakeIODS(Atom* pmoov)
 {
@@ -399,12 +1257,11 @@ MovieWriter::MakeIODS(Atom* pmoov)
 
 // -------- Track -------------------------------------------------------
 
-TrackWriter::TrackWriter(MovieWriter* pMovie, int index, TypeHandler* pType)
+TrackWriter::TrackWriter(MovieWriter* pMovie, int index, smart_ptr<TypeHandler> pType)
 : m_bEOS(false),
   m_bStopped(false),
   m_index(index),
   m_pType(pType),
-  m_tLast(0),
   m_StartAt(0),
   m_pMovie(pMovie),
   m_Durations(90000),     // scale: 90KHz
@@ -413,12 +1270,43 @@ TrackWriter::TrackWriter(MovieWriter* pMovie, int index, TypeHandler* pType)
     // adjust scale to media type (mostly because audio scales must be 16 bits);
     m_Durations.SetScale(pType->Scale());
     m_Durations.SetFrameDuration(m_pType->FrameDuration());
+    UseSpill(pMovie->Spill());
+
+    ZeroMemory(&m_Written, sizeof(m_Written));
+    m_Progress.Publish(m_Written);
 }
 
 HRESULT 
-TrackWriter::Add(IMediaSample* pSample)
+TrackWriter::Add(const MuxSample* pAdded)
+{
+    // convert the payload to the form written, if the type needs it,
+    // before taking any lock: the streams do this in parallel, and
+    // the chunk then holds the exact size written
+    MuxSample converted = *pAdded;
+    m_pType->Transform(&converted);
+    return Queue(&converted, 1);
+}
+
+HRESULT
+TrackWriter::Add(const MuxSample* pSamples, long nSamples)
+{
+    if (nSamples <= 0)
+    {
+        return S_OK;
+    }
+    vector<MuxSample> converted(pSamples, pSamples + nSamples);
+    for (long i = 0; i < nSamples; i++)
+    {
+        m_pType->Transform(&converted[i]);
+    }
+    return Queue(&converted[0], nSamples);
+}
+
+HRESULT
+TrackWriter::Queue(const MuxSample* pSamples, long nSamples)
 {
     HRESULT hr = S_OK;
+    bool bQueued = false;
     { 
         // restrict scope of cs so we don't hold it
         // during the CheckQueues call
@@ -428,24 +1316,93 @@ TrackWriter::Add(IMediaSample* pSample)
         {
             hr = VFW_E_WRONG_STATE;
         } else {
-            if (m_pCurrent == NULL)
-            {
-                m_pCurrent = new MediaChunk(this);
-            }
-            m_pCurrent->AddSample(pSample);
-            if (m_pCurrent->IsFull())
+            for (long i = 0; i < nSamples; i++)
             {
-                m_Queue.push_back(m_pCurrent);
-                m_pCurrent = NULL;
+                if (QueueSample(&pSamples[i]))
+                {
+                    bQueued = true;
+                }
             }
+            PublishProgress();
         }
     }
 
-    m_pMovie->CheckQueues();
+    // the queues can only become ready to write
+    // when a chunk is completed
+    if (bQueued)
+    {
+        m_pMovie->CheckQueues();
+    }
 
     return hr;
 }
 
+bool
+TrackWriter::QueueSample(const MuxSample* pSample)
+{
+    bool bQueued = false;
+
+    // rolling output: a new file starts with this sample
+    bool bNewFile = false;
+    if (m_pMovie->IsSplitPoint(this, pSample, m_pCurrent, &bNewFile) &&
+        m_pCurrent && (m_pCurrent->Samples() > 0))
+    {
+        QueueCurrent();
+        bQueued = true;
+    }
+    if (m_pCurrent == NULL)
+    {
+        m_pCurrent = new MediaChunk(this);
+    }
+    if (bNewFile)
+    {
+        m_pCurrent->SetSplit();
+    }
+    m_pCurrent->AddSample(pSample);
+    m_Written.llQueued += pSample->cBytes;
+    if (m_pCurrent->IsSplit())
+    {
+        if (pSample->HasTime())
+        {
+            REFERENCE_TIME tStart, tEnd;
+            m_pCurrent->GetTime(&tStart, &tEnd);
+            m_pMovie->SetSplitTime(tStart);
+        }
+    }
+    if (m_pCurrent->IsFull())
+    {
+        QueueCurrent();
+        bQueued = true;
+    }
+    return bQueued;
+}
+
+// Queues the completed chunk. Once the queue is over the movie's limits
+// (while another track is stalled), its payload goes to the spill file,
+// so that the source's buffers are not held for the stall.
+void
+TrackWriter::QueueCurrent()
+{
+    MediaChunkPtr pChunk = m_pCurrent;
+    m_Queue.push_back(pChunk);
+    m_pCurrent = NULL;
+
+    QueueSpill* pSpill = m_pMovie->QueueSpillFile();
+    if (pSpill == NULL)
+    {
+        return;
+    }
+    REFERENCE_TIME tHead, tStart, tEnd;
+    m_Queue.front()->GetTime(&tHead, &tEnd);
+    pChunk->GetTime(&tStart, &tEnd);
+    if (m_pMovie->IsQueueOverLimit(m_Written.llQueued - m_Written.llSpilled, tEnd - tHead) &&
+        SUCCEEDED(pChunk->Spill(pSpill)))
+    {
+        m_Written.cChunksSpilled++;
+        m_Written.llSpilled += pChunk->Length();
+    }
+}
+
 // returns true if all tracks now at end
 bool 
 TrackWriter::OnEOS()
@@ -459,6 +1416,7 @@ TrackWriter::OnEOS()
             m_Queue.push_back(m_pCurrent);
             m_pCurrent = NULL;
         }
+        PublishProgress();
     }
     return m_pMovie->CheckQueues();
 }
@@ -477,6 +1435,9 @@ TrackWriter::Stop(bool bFlush)
         // discard queued but unwritten samples
         m_pCurrent = NULL;
         m_Queue.clear();
+        m_Written.llQueued = 0;
+        m_Written.cChunksSpilled = 0;
+        m_Written.llSpilled = 0;
     }
     else
     {
@@ -488,6 +1449,18 @@ TrackWriter::Stop(bool bFlush)
         }
 
     }
+    PublishProgress();
+}
+
+bool
+TrackWriter::HeadIsSplit()
+{
+    CAutoLock lock(&m_csQueue);
+    if (m_Queue.size() == 0)
+    {
+        return false;
+    }
+    return (*m_Queue.begin())->IsSplit();
 }
 
 bool 
@@ -505,7 +1478,7 @@ TrackWriter::GetHeadTime(LONGLONG* ptHead)
 }
 
 HRESULT 
-TrackWriter::WriteHead(Atom* patm)
+TrackWriter::WriteHead(Atom* patm, bool* pbSync)
 {
     CAutoLock lock(&m_csQueue);
     if (m_Queue.size() == 0)
@@ -517,23 +1490,33 @@ TrackWriter::WriteHead(Atom* patm)
 
     REFERENCE_TIME tStart, tEnd;
     pChunk->GetTime(&tStart, &tEnd);
+    *pbSync = pChunk->HasSync();
 
     // the chunk will call back to us to index
     // the samples during this call, once
     // the media data is successfully written
     HRESULT hr = pChunk->Write(patm);
+    m_Written.llQueued -= pChunk->Length();
+    if (pChunk->IsSpilled())
+    {
+        m_Written.cChunksSpilled--;
+        m_Written.llSpilled -= pChunk->Length();
+    }
     if (SUCCEEDED(hr))
     {
-        m_tLast = tEnd;
+        m_Written.tWritten = tEnd;
+        m_Written.llWritten += pChunk->Length();
+        m_Written.cChunksWritten++;
     }
+    PublishProgress();
     return hr;
 }
 
-REFERENCE_TIME 
-TrackWriter::LastWrite()
+void
+TrackWriter::PublishProgress()
 {
-    CAutoLock lock(&m_csQueue);
-    return m_tLast;
+    m_Written.cChunksQueued = (long)m_Queue.size();
+    m_Progress.Publish(m_Written);
 }
 
 void 
@@ -541,24 +1524,91 @@ TrackWriter::IndexChunk(LONGLONG posChunk, long nSamples)
 {
     m_SC.Add(nSamples);
     m_CO.Add(posChunk);
+    m_Keys.AddChunk(posChunk);
+
+    IndexJournal* pJournal = m_pMovie->Journal();
+    if (pJournal)
+    {
+        pJournal->AddChunk(ID(), posChunk, nSamples);
+    }
 }
 
 void 
-TrackWriter::IndexSample(bool bSync, REFERENCE_TIME tStart, REFERENCE_TIME tStop, long cBytes)
+TrackWriter::IndexSample(bool bSync, const MuxSample* pTimes, long cBytes)
 {
     // CTS offset means ES type-specific content parser?
     // -- this is done now by calculation from the frames start time (heuristically!)
+    // unless the source knows the decode time (eg TS DTS)
 
     m_Sizes.Add(cBytes);
-    m_Durations.Add(tStart, tStop);
+    if (pTimes->HasDecodeTime())
+    {
+        m_Durations.AddDecode(pTimes->tDecode, pTimes->tStart, pTimes->tStop);
+    }
+    else
+    {
+        m_Durations.Add(pTimes->tStart, pTimes->tStop);
+    }
     m_Syncs.Add(bSync);
+    m_Keys.AddSample(bSync, pTimes->tStart, cBytes);
+
+    IndexJournal* pJournal = m_pMovie->Journal();
+    if (pJournal)
+    {
+        pJournal->AddSample(bSync, pTimes, cBytes);
+    }
+}
+
+void
+TrackWriter::MoveIndex(TrackWriter* pTrack)
+{
+    // the tables share their sealed blocks, so this copies
+    // only the block lists and the open blocks
+    pTrack->m_Sizes = m_Sizes;
+    pTrack->m_Durations = m_Durations;
+    pTrack->m_SC = m_SC;
+    pTrack->m_CO = m_CO;
+    pTrack->m_Syncs = m_Syncs;
+    pTrack->m_Keys = m_Keys;
+    pTrack->m_StartAt = m_StartAt;
+    ResetIndex();
+}
+
+void
+TrackWriter::ResetIndex()
+{
+    m_Sizes = SizeIndex();
+    m_Durations = DurationIndex(90000);
+    m_Durations.SetScale(m_pType->Scale());
+    m_Durations.SetFrameDuration(m_pType->FrameDuration());
+    m_SC = SamplesPerChunkIndex(1);
+    m_CO = ChunkOffsetIndex();
+    m_Syncs = SyncIndex();
+    m_Keys = KeyFrameIndex();
+    UseSpill(m_pMovie->Spill());
+
+    // the stream control start time applies to the first file only
+    m_StartAt = 0;
 }
 
+void
+TrackWriter::UseSpill(IndexSpill* pSpill)
+{
+    if (pSpill)
+    {
+        m_Sizes.SetSpill(pSpill);
+        m_Durations.SetSpill(pSpill);
+        m_SC.SetSpill(pSpill);
+        m_CO.SetSpill(pSpill);
+        m_Syncs.SetSpill(pSpill);
+        m_Keys.SetSpill(pSpill);
+    }
+}
 
 HRESULT 
-TrackWriter::Close(Atom* patm)
+TrackWriter::Close(AtomWriter* pContainer)
 {
-    smart_ptr<Atom> ptrak = patm->CreateAtom('trak');
+    smart_ptr<Atom> ptrak = new Atom(pContainer, pContainer->Length(), DWORD('trak'));
 
     // track header tkhd
     smart_ptr<Atom> ptkhd = ptrak->CreateAtom('tkhd');
@@ -688,59 +1738,212 @@ TrackWriter::Close(Atom* patm)
     Handler()->WriteDescriptor(pstsd, ID(), 1, m_Durations.Scale());   // dataref = 1
     pstsd->Close();
 
-    HRESULT hr = m_Durations.WriteTable(pstbl);
-    if (SUCCEEDED(hr))
-    {
-        hr = m_Syncs.Write(pstbl);
-    }
-    if (SUCCEEDED(hr))
-    {
-        hr = m_SC.Write(pstbl);
-    }
-    if (SUCCEEDED(hr))
-    {
-        hr = m_Sizes.Write(pstbl);
+    HRESULT hr = m_Durations.WriteTable(pstbl);
+    if (SUCCEEDED(hr))
+    {
+        hr = m_Syncs.Write(pstbl);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = m_SC.Write(pstbl);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = m_Sizes.Write(pstbl, m_pMovie->CompactSizes());
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = m_CO.Write(pstbl);
+    }
+    pstbl->Close();
+    pminf->Close();
+    pmdia->Close();
+    ptrak->Close();
+
+    return hr;
+}
+
+void
+TrackWriter::ReadIndex(LONGLONG llAvailable, vector<ClipSample>* pSamples)
+{
+    pSamples->clear();
+
+    // a sample's entry is complete once its duration is known,
+    // which is usually when the next sample arrives
+    if (!m_Durations.HasDecodeTable())
+    {
+        return;
+    }
+    ListOfPairs* pSTTS = m_Durations.DecodeDurations();
+    ListOfPairs* pCTTS = m_Durations.CompositionOffsets();
+    long nSamples = min(m_Sizes.Samples(), pSTTS->Entries());
+    bool bOffsets = (pCTTS->Entries() > 0);
+
+    // one pass through all the tables together
+    pSamples->reserve(nSamples);
+    LONGLONG tDecode = m_Durations.FirstDecode();
+    long nPairSTTS = 0, cSTTS = 0, lDuration = 0;
+    long nPairCTTS = 0, cCTTS = 0, lOffset = 0;
+    long nEntrySC = 0, cPerChunk = 0, nInChunk = 0;
+    long nFirstNext = 0, cNext = 0;     // entry nEntrySC, not yet reached
+    if (m_SC.Entries() > 0)
+    {
+        m_SC.Entry(0, &nFirstNext, &cNext);
+    }
+    long nChunk = -1;
+    long nEntrySync = 0;
+    LONGLONG pos = 0;
+    for (long n = 0; n < nSamples; n++)
+    {
+        if (nInChunk == cPerChunk)
+        {
+            nChunk++;
+            if (nChunk >= m_CO.Entries())
+            {
+                break;
+            }
+            // the stsc entries are read in order, as the
+            // tables are cheapest to read sequentially
+            while ((nEntrySC < m_SC.Entries()) && (nFirstNext <= (nChunk + 1)))
+            {
+                cPerChunk = cNext;
+                nEntrySC++;
+                if (nEntrySC < m_SC.Entries())
+                {
+                    m_SC.Entry(nEntrySC, &nFirstNext, &cNext);
+                }
+            }
+            pos = m_CO.Entry(nChunk);
+            nInChunk = 0;
+        }
+
+        ClipSample sample;
+        sample.idxSource = 0;
+        sample.pos = pos;
+        sample.cBytes = m_Sizes.Size(n);
+        sample.nChunk = nChunk;
+        if ((sample.pos + sample.cBytes) > llAvailable)
+        {
+            break;
+        }
+        pos += sample.cBytes;
+        nInChunk++;
+
+        if (cSTTS == 0)
+        {
+            pSTTS->Pair(nPairSTTS++, &cSTTS, &lDuration);
+        }
+        cSTTS--;
+        if (bOffsets)
+        {
+            if (cCTTS == 0)
+            {
+                pCTTS->Pair(nPairCTTS++, &cCTTS, &lOffset);
+            }
+            cCTTS--;
+        }
+        if (m_Syncs.AllSync())
+        {
+            sample.bSync = true;
+        }
+        else
+        {
+            sample.bSync = (nEntrySync < m_Syncs.Entries()) && (m_Syncs.Entry(nEntrySync) == (n + 1));
+            if (sample.bSync)
+            {
+                nEntrySync++;
+            }
+        }
+
+        // converted so that the clip's tables come out the same
+        sample.tDecode = m_Durations.FromScale(tDecode);
+        sample.tStart = m_Durations.FromScale(tDecode + lOffset);
+        sample.tStop = sample.tStart + m_Durations.FromScale(lDuration);
+        tDecode += lDuration;
+        pSamples->push_back(sample);
     }
-    if (SUCCEEDED(hr))
-    {
-        hr = m_CO.Write(pstbl);
-    }
-    pstbl->Close();
-    pminf->Close();
-    pmdia->Close();
-    ptrak->Close();
-
-    return hr;
 }
 
+
 // -- Media Chunk ----------------------
 
 MediaChunk::MediaChunk(TrackWriter* pTrack)
 : m_cBytes(0),
+  m_bSync(false),
+  m_bSplit(false),
   m_pTrack(pTrack),
   m_tStart(0),
-  m_tEnd(0)
+  m_tEnd(0),
+  m_pSpill(NULL),
+  m_posSpill(0)
 {
     m_nSamplesPerChunk = pTrack->SampleRate();
 }
+
 MediaChunk::~MediaChunk()
 {
-    // I wanted to use list<IMediaSamplePtr> but the
-    // compiler could not handle the deep nesting of templates
-    while(m_Samples.size() > 0)
+    if (m_pSpill)
+    {
+        m_pSpill->Release(m_cBytes);
+    }
+}
+
+// the payload as written: the sample's data, or
+// the pieces its buffer describes (see MuxBuffer::Pieces)
+static const MuxPiece*
+PayloadPieces(const MuxSample* pSample, MuxPiece* pWhole, long* pcPieces)
+{
+    const MuxPiece* pPieces = NULL;
+    if (pSample->pBuffer != NULL)
+    {
+        pPieces = pSample->pBuffer->Pieces(pcPieces);
+    }
+    if (pPieces == NULL)
+    {
+        pWhole->pData = pSample->pData;
+        pWhole->cBytes = pSample->cBytes;
+        *pcPieces = 1;
+        pPieces = pWhole;
+    }
+    return pPieces;
+}
+
+HRESULT
+MediaChunk::Spill(QueueSpill* pSpill)
+{
+    // the payload as it will be written, in one write
+    smart_array<BYTE> pPayload = new BYTE[m_cBytes];
+    long cCopied = 0;
+    list<MuxSample>::iterator it;
+    for (it = m_Samples.begin(); it != m_Samples.end(); it++)
+    {
+        MuxPiece whole;
+        long cPieces;
+        const MuxPiece* pPieces = PayloadPieces(&(*it), &whole, &cPieces);
+        for (long i = 0; i < cPieces; i++)
+        {
+            CopyMemory(pPayload + cCopied, pPieces[i].pData, pPieces[i].cBytes);
+            cCopied += pPieces[i].cBytes;
+        }
+    }
+    HRESULT hr = pSpill->Write(pPayload, m_cBytes, &m_posSpill);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+    m_pSpill = pSpill;
+    for (it = m_Samples.begin(); it != m_Samples.end(); it++)
     {
-        IMediaSample* pSample = m_Samples.front();
-        pSample->Release();
-        m_Samples.pop_front();
+        it->pData = NULL;
+        it->pBuffer = NULL;
     }
+    return S_OK;
 }
 
 HRESULT 
-MediaChunk::AddSample(IMediaSample* pSample)
+MediaChunk::AddSample(const MuxSample* pSample)
 {
-    REFERENCE_TIME tStart, tEnd;
-    HRESULT hr = pSample->GetTime(&tStart, &tEnd);
-    if (hr == S_OK)
+    if (pSample->HasTime())
     {
         // H264 samples from large frames
         // may be broken across several buffers, with the
@@ -750,29 +1953,58 @@ MediaChunk::AddSample(IMediaSample* pSample)
         if (m_cBytes == 0)
         {
             // first sample
-            m_tStart = tStart;
-            m_tEnd = tEnd;
+            m_tStart = pSample->tStart;
+            m_tEnd = pSample->tStop;
         } else {
-            if (tStart < m_tStart)
+            if (pSample->tStart < m_tStart)
             {
-                m_tStart = tStart;
+                m_tStart = pSample->tStart;
             }
-            if (tEnd > m_tEnd)
+            if (pSample->tStop > m_tEnd)
             {
-                m_tEnd = tEnd;
+                m_tEnd = pSample->tStop;
             }
         }
     }
 
-    m_cBytes += pSample->GetActualDataLength();
-    pSample->AddRef();
-    m_Samples.push_back(pSample);
+    if (pSample->IsSync())
+    {
+        m_bSync = true;
+    }
+    m_cBytes += pSample->cBytes;
+    m_Samples.push_back(*pSample);
+    if (pSample->pBuffer == NULL)
+    {
+        HeapBuffer* pCopy = new HeapBuffer(pSample->pData, pSample->cBytes);
+        m_Samples.back().pBuffer = pCopy;
+        m_Samples.back().pData = pCopy->Data();
+    }
     return S_OK;
 }
 
 HRESULT 
 MediaChunk::Write(Atom* patm)
 {
+    // a spilled payload is read back in one read, and the
+    // samples written from it as before
+    smart_array<BYTE> pPayload;
+    if (m_pSpill)
+    {
+        pPayload = new BYTE[m_cBytes];
+        HRESULT hr = m_pSpill->Read(m_posSpill, pPayload, m_cBytes);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+        long cRead = 0;
+        list<MuxSample>::iterator it;
+        for (it = m_Samples.begin(); it != m_Samples.end(); it++)
+        {
+            it->pData = pPayload + cRead;
+            cRead += it->cBytes;
+        }
+    }
+
     // record chunk start position
     LONGLONG posChunk = patm->Position() + patm->Length();
 
@@ -784,31 +2016,33 @@ MediaChunk::Write(Atom* patm)
     long nSamples = 0;
 
     // loop once through the samples writing the data
-    list<IMediaSample*>::iterator it;
+    list<MuxSample>::iterator it;
     for (it = m_Samples.begin(); it != m_Samples.end(); it++)
     {
-        IMediaSample* pSample = *it;
+        const MuxSample* pSample = &(*it);
 
         // record positive sync flag, but for
         // multiple-buffer samples, only one sync flag will be present
         // so don't overwrite with later negatives.
-        if (pSample->IsSyncPoint() == S_OK)
+        if (pSample->IsSync())
         {
             bSync = true;
         }
 
-        // write payload, including any transformation (eg BSF to length-prepended)
-        BYTE* pBuffer;
-        pSample->GetPointer(&pBuffer);
-        int cActual = 0;
-        m_pTrack->Handler()->WriteData(patm, pBuffer, pSample->GetActualDataLength(), &cActual);
-        cBytes += cActual;
-        REFERENCE_TIME tStart, tEnd;
-        HRESULT hr = pSample->GetTime(&tStart, &tEnd);
-        if (hr == S_OK)
+        // write payload: any transformation (eg BSF to length-prepended)
+        // was done as the sample was added
+        MuxPiece whole;
+        long cPieces;
+        const MuxPiece* pPieces = PayloadPieces(pSample, &whole, &cPieces);
+        for (long i = 0; i < cPieces; i++)
+        {
+            patm->Append(pPieces[i].pData, pPieces[i].cBytes);
+        }
+        cBytes += pSample->cBytes;
+        if (pSample->HasTime())
         {
             // this is the last buffer in the sample
-            m_pTrack->IndexSample(bSync, tStart, tEnd, cBytes);
+            m_pTrack->IndexSample(bSync, pSample, cBytes);
 
             // reset for new sample
             bSync = false;
@@ -828,7 +2062,7 @@ MediaChunk::IsFull()
 {
     if (m_pTrack->IsAudio())
     {
-        return (m_tEnd - m_tStart) > UNITS;
+        return (m_tEnd - m_tStart) > MovieWriter::ChunkDuration();
     }
     else
     {
@@ -839,104 +2073,339 @@ MediaChunk::IsFull()
 
 // ---- index classes --------------------
 
-ListOfLongs::ListOfLongs()
-: m_nEntriesInLast(0)
+// one zigzag varint difference, advancing p past it
+inline LONGLONG
+NextDiff(const BYTE*& p)
 {
-    m_Blocks.push_back(new BYTE[EntriesPerBlock * 4]);
+    ULONGLONG u = 0;
+    int shift = 0;
+    for (;;)
+    {
+        BYTE b = *p++;
+        u |= ULONGLONG(b & 0x7f) << shift;
+        shift += 7;
+        if ((b & 0x80) == 0)
+        {
+            break;
+        }
+    }
+    return LONGLONG(u >> 1) ^ -LONGLONG(u & 1);
 }
 
-void 
-ListOfLongs::Append(long l)
+// The index tables hold native values. They are converted to the
+// file's big-endian order in place, a block at a time, as they are
+// written: with SSE2, four or two entries per instruction sequence.
+static void
+ToFileOrder32(DWORD* p, long n)
 {
-    if (m_nEntriesInLast >= EntriesPerBlock)
+    long i = 0;
+#ifdef SWAP_SSE2
+    for (; (i + 4) <= n; i += 4)
     {
-        m_Blocks.push_back(new BYTE[EntriesPerBlock * 4]);
-        m_nEntriesInLast = 0;
+        // swap the bytes of each 16-bit word, then the words of each entry
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128((__m128i*)(p + i), v);
+    }
+#endif
+    for (; i < n; i++)
+    {
+        WriteLong(long(p[i]), (BYTE*)(p + i));
     }
-    BytePtr p = m_Blocks[m_Blocks.size() - 1];
-    WriteLong(l, p + m_nEntriesInLast*4);
-    m_nEntriesInLast++;
 }
 
-HRESULT 
-ListOfLongs::Write(Atom* patm)
+static void
+ToFileOrder64(ULONGLONG* p, long n)
 {
-    // write all the full blocks
-    for (UINT i = 0; i < m_Blocks.size() -1; i++)
+    long i = 0;
+#ifdef SWAP_SSE2
+    for (; (i + 2) <= n; i += 2)
     {
-        BytePtr p = m_Blocks[i];
-        HRESULT hr = patm->Append(p, EntriesPerBlock*4);
-        if (FAILED(hr))
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        _mm_storeu_si128((__m128i*)(p + i), v);
+    }
+#endif
+    for (; i < n; i++)
+    {
+        WriteI64(LONGLONG(p[i]), (BYTE*)(p + i));
+    }
+}
+
+PackedList::PackedList(long stride)
+: m_stride(stride),
+  m_nEntries(0),
+  m_pSpill(NULL),
+  m_bSpillFailed(false),
+  m_nFirstHeld(0),
+  m_cHeld(0),
+  m_nCached(-1),
+  m_hrSpill(S_OK)
+{
+    ZeroMemory(m_Last, sizeof(m_Last));
+    Rewind(&m_Read, 0);
+}
+
+void
+PackedList::Append(LONGLONG ll)
+{
+    long idx = m_nEntries % EntriesPerBlock;
+    if ((idx == 0) && (m_nEntries > 0))
+    {
+        // keep the full block at its actual size
+        Block block;
+        block.cBytes = (long)m_Open.size();
+        block.pData = new BYTE[block.cBytes];
+        block.nUnit = -1;
+        block.offset = 0;
+        CopyMemory(block.pData, &m_Open[0], block.cBytes);
+        m_Blocks.push_back(block);
+        m_Open.clear();
+        ZeroMemory(m_Last, sizeof(m_Last));
+
+        m_cHeld += block.cBytes;
+        if ((m_pSpill != NULL) && !m_bSpillFailed && (m_cHeld >= IndexSpill::spill_unit))
         {
-            return hr;
+            Spill();
         }
     }
 
-    // partial last block
-    if (m_nEntriesInLast > 0)
+    // zigzag: small differences of either sign are small numbers
+    long col = m_nEntries % m_stride;
+    LONGLONG diff = ll - m_Last[col];
+    m_Last[col] = ll;
+    ULONGLONG u = (ULONGLONG(diff) << 1) ^ ULONGLONG(diff >> 63);
+    while (u >= 0x80)
     {
-        BytePtr p = m_Blocks[m_Blocks.size() - 1];
-        HRESULT hr = patm->Append(p, m_nEntriesInLast * 4);
-        if (FAILED(hr))
-        {
-            return hr;
-        }
+        m_Open.push_back(BYTE(u | 0x80));
+        u >>= 7;
     }
-    return S_OK;
+    m_Open.push_back(BYTE(u));
+    m_nEntries++;
 }
 
-long 
-ListOfLongs::Entry(long nEntry)
+void
+PackedList::Spill()
 {
-    // read back a value (for 32 to 64 conversion)
-    long nValue = 0;
-    if (nEntry < Entries())
+    // the sealed blocks held in memory go to the file in one write
+    Unit unit;
+    unit.cBytes = m_cHeld;
+    smart_array<BYTE> pUnit = new BYTE[unit.cBytes];
+    long offset = 0;
+    for (long n = m_nFirstHeld; n < (long)m_Blocks.size(); n++)
+    {
+        CopyMemory(pUnit + offset, m_Blocks[n].pData, m_Blocks[n].cBytes);
+        offset += m_Blocks[n].cBytes;
+    }
+    HRESULT hr = m_pSpill->Write(pUnit, unit.cBytes, &unit.pos);
+    if (FAILED(hr))
+    {
+        // keep this table in memory from now on
+        DbgLog((LOG_ERROR, 0, TEXT("Mux: index spill failed 0x%x"), hr));
+        m_bSpillFailed = true;
+        return;
+    }
+
+    offset = 0;
+    for (long n = m_nFirstHeld; n < (long)m_Blocks.size(); n++)
     {
-        BytePtr p = m_Blocks[nEntry/EntriesPerBlock];
-        nValue = ReadLong(p + (nEntry % EntriesPerBlock)*4);
+        Block& block = m_Blocks[n];
+        block.pData = NULL;
+        block.nUnit = (long)m_Units.size();
+        block.offset = offset;
+        offset += block.cBytes;
     }
-    return nValue;
+    m_Units.push_back(unit);
+    m_nFirstHeld = (long)m_Blocks.size();
+    m_cHeld = 0;
 }
 
+const BYTE*
+PackedList::BlockData(long nBlock)
+{
+    if (nBlock >= (long)m_Blocks.size())
+    {
+        return m_Open.empty() ? NULL : &m_Open[0];
+    }
+    const Block& block = m_Blocks[nBlock];
+    if (block.nUnit < 0)
+    {
+        return block.pData;
+    }
+    if (block.nUnit != m_nCached)
+    {
+        // read the whole unit: the following blocks are in it
+        const Unit& unit = m_Units[block.nUnit];
+        m_Cache.resize(unit.cBytes);
+        m_nCached = -1;
+        HRESULT hr = m_pSpill ? m_pSpill->Read(unit.pos, &m_Cache[0], unit.cBytes) : E_FAIL;
+        if (FAILED(hr))
+        {
+            m_hrSpill = hr;
+            return NULL;
+        }
+        m_nCached = block.nUnit;
+    }
+    return &m_Cache[0] + block.offset;
+}
 
-ListOfI64::ListOfI64()
-: m_nEntriesInLast(0)
+void
+PackedList::Rewind(Cursor* pCursor, long nBlock)
 {
-    m_Blocks.push_back(new BYTE[EntriesPerBlock * 8]);
+    pCursor->nEntry = nBlock * EntriesPerBlock;
+    pCursor->cbOffset = 0;
+    ZeroMemory(pCursor->prev, sizeof(pCursor->prev));
 }
 
-void 
-ListOfI64::Append(LONGLONG ll)
+LONGLONG
+PackedList::Next(Cursor* pCursor)
 {
-    if (m_nEntriesInLast >= EntriesPerBlock)
-    {
-        m_Blocks.push_back(new BYTE[EntriesPerBlock * 8]);
-        m_nEntriesInLast = 0;
-    }
-    BytePtr p = m_Blocks[m_Blocks.size() - 1];
-    WriteI64(ll, p + m_nEntriesInLast*8);
-    m_nEntriesInLast++;
+    long idx = pCursor->nEntry % EntriesPerBlock;
+    if ((idx == 0) && (pCursor->cbOffset != 0))
+    {
+        // into the next block
+        Rewind(pCursor, pCursor->nEntry / EntriesPerBlock);
+    }
+    const BYTE* p = BlockData(pCursor->nEntry / EntriesPerBlock);
+    if (p == NULL)
+    {
+        pCursor->nEntry++;
+        return 0;
+    }
+    p += pCursor->cbOffset;
+    const BYTE* pStart = p;
+    LONGLONG diff = NextDiff(p);
+    pCursor->cbOffset += long(p - pStart);
+    long col = pCursor->nEntry % m_stride;
+    LONGLONG ll = pCursor->prev[col] + diff;
+    pCursor->prev[col] = ll;
+    pCursor->nEntry++;
+    return ll;
 }
 
-HRESULT 
-ListOfI64::Write(Atom* patm)
+void
+PackedList::DecodeBlock(long nBlock, long cEntries, ULONGLONG* pValues)
 {
-    // write all the full blocks
-    for (UINT i = 0; i < m_Blocks.size() -1; i++)
+    // the whole block in one pass, without a cursor
+    const BYTE* p = BlockData(nBlock);
+    if (p == NULL)
     {
-        BytePtr p = m_Blocks[i];
-        HRESULT hr = patm->Append(p, EntriesPerBlock*8);
-        if (FAILED(hr))
+        ZeroMemory(pValues, cEntries * sizeof(ULONGLONG));
+        return;
+    }
+    // the running values are kept in locals, for each stride,
+    // rather than an array indexed by column: otherwise each
+    // entry waits for the store of the one before it
+    if (m_stride == 1)
+    {
+        LONGLONG prev = 0;
+        for (long i = 0; i < cEntries; i++)
         {
-            return hr;
+            prev += NextDiff(p);
+            pValues[i] = ULONGLONG(prev);
+        }
+    }
+    else if (m_stride == 2)
+    {
+        LONGLONG prev0 = 0, prev1 = 0;
+        long i = 0;
+        for (; (i + 2) <= cEntries; i += 2)
+        {
+            prev0 += NextDiff(p);
+            prev1 += NextDiff(p);
+            pValues[i] = ULONGLONG(prev0);
+            pValues[i + 1] = ULONGLONG(prev1);
+        }
+        if (i < cEntries)
+        {
+            pValues[i] = ULONGLONG(prev0 + NextDiff(p));
+        }
+    }
+    else
+    {
+        LONGLONG prev[MaxStride] = {0};
+        long col = 0;
+        for (long i = 0; i < cEntries; i++)
+        {
+            prev[col] += NextDiff(p);
+            pValues[i] = ULONGLONG(prev[col]);
+            if (++col == m_stride)
+            {
+                col = 0;
+            }
         }
     }
+}
+
+LONGLONG
+PackedList::Entry(long nEntry)
+{
+    // read back a value (for 32 to 64 conversion, and clip export)
+    if ((nEntry < 0) || (nEntry >= m_nEntries))
+    {
+        return 0;
+    }
+    // the cursor only moves forward within a block
+    long nBlock = nEntry / EntriesPerBlock;
+    if ((m_Read.nEntry > nEntry) || ((m_Read.nEntry / EntriesPerBlock) != nBlock))
+    {
+        Rewind(&m_Read, nBlock);
+    }
+    LONGLONG ll = 0;
+    while (m_Read.nEntry <= nEntry)
+    {
+        ll = Next(&m_Read);
+    }
+    return ll;
+}
 
-    // partial last block
-    if (m_nEntriesInLast > 0)
+HRESULT
+PackedList::ReadBlock(long nBlock, ULONGLONG* pValues, long* pcEntries)
+{
+    long nFirst = nBlock * EntriesPerBlock;
+    *pcEntries = max(0L, min(long(EntriesPerBlock), m_nEntries - nFirst));
+    if (*pcEntries > 0)
     {
-        BytePtr p = m_Blocks[m_Blocks.size() - 1];
-        HRESULT hr = patm->Append(p, m_nEntriesInLast * 8);
+        DecodeBlock(nBlock, *pcEntries, pValues);
+    }
+    return m_hrSpill;
+}
+
+HRESULT
+PackedList::Write(Atom* patm, int cBytesEach)
+{
+    // each block is decoded to native values in a staging
+    // buffer, and converted to file order in one pass
+    DWORD b32[EntriesPerBlock];
+    ULONGLONG b64[EntriesPerBlock];
+    for (long nFirst = 0; nFirst < m_nEntries; nFirst += EntriesPerBlock)
+    {
+        long cEntries = min(long(EntriesPerBlock), m_nEntries - nFirst);
+        DecodeBlock(nFirst / EntriesPerBlock, cEntries, b64);
+        const BYTE* pOut;
+        if (cBytesEach == 8)
+        {
+            ToFileOrder64(b64, cEntries);
+            pOut = (const BYTE*)b64;
+        }
+        else
+        {
+            for (long i = 0; i < cEntries; i++)
+            {
+                b32[i] = DWORD(b64[i]);
+            }
+            ToFileOrder32(b32, cEntries);
+            pOut = (const BYTE*)b32;
+        }
+        if (FAILED(m_hrSpill))
+        {
+            return m_hrSpill;
+        }
+        HRESULT hr = patm->Append(pOut, cEntries * cBytesEach);
         if (FAILED(hr))
         {
             return hr;
@@ -946,7 +2415,8 @@ ListOfI64::Write(Atom* patm)
 }
 
 ListOfPairs::ListOfPairs()
-: m_cEntries(0),
+: m_Table(2),
+  m_cEntries(0),
   m_lCount(0)
 {
 }
@@ -972,6 +2442,21 @@ ListOfPairs::Append(long val)
     m_cEntries++;
 }
 
+void
+ListOfPairs::Pair(long nPair, long* pCount, long* pValue)
+{
+    if (nPair < (m_Table.Entries() / 2))
+    {
+        *pCount = m_Table.Entry(nPair * 2);
+        *pValue = m_Table.Entry((nPair * 2) + 1);
+    }
+    else
+    {
+        *pCount = m_lCount;
+        *pValue = m_lValue;
+    }
+}
+
 HRESULT 
 ListOfPairs::Write(Atom* patm)
 {
@@ -1003,7 +2488,8 @@ ListOfPairs::Write(Atom* patm)
 SizeIndex::SizeIndex()
 : m_cBytesCurrent(0),
   m_nCurrent(0),
-  m_nSamples(0)
+  m_nSamples(0),
+  m_cMax(0)
 {
 }
 
@@ -1041,12 +2527,21 @@ SizeIndex::Add(long cBytes)
         // we are creating a separate entry for each sample
         m_Table.Append(cBytes);
     }
+    if (cBytes > m_cMax)
+    {
+        m_cMax = cBytes;
+    }
     m_nSamples++;
 }
 
 HRESULT 
-SizeIndex::Write(Atom* patm)
+SizeIndex::Write(Atom* patm, bool bCompact)
 {
+    if (bCompact && (m_Table.Entries() > 0) && (m_cMax <= 0xffff))
+    {
+        return WriteCompact(patm);
+    }
+
     smart_ptr<Atom> psz = patm->CreateAtom('stsz');
     BYTE b[12];
     ZeroMemory(b, 12);
@@ -1072,6 +2567,67 @@ SizeIndex::Write(Atom* patm)
     return S_OK;
 }
 
+HRESULT
+SizeIndex::WriteCompact(Atom* patm)
+{
+    smart_ptr<Atom> psz = patm->CreateAtom('stz2');
+
+    // ver/flags = 0
+    // 24 bits reserved, 8-bit field size
+    // count
+    // list of <count> sizes, 4-bit fields packed high nibble first
+    int cBits = (m_cMax <= 0xf) ? 4 : ((m_cMax <= 0xff) ? 8 : 16);
+    BYTE b[12];
+    ZeroMemory(b, 12);
+    b[7] = BYTE(cBits);
+    WriteLong(m_nSamples, b+8);
+    HRESULT hr = psz->Append(b, 12);
+
+    // a block of sizes is decoded in one pass, and
+    // packed into fields for one Append per block
+    ULONGLONG sizes[PackedList::EntriesPerBlock];
+    BYTE table[PackedList::EntriesPerBlock * 2];
+    for (long nBlock = 0; SUCCEEDED(hr); nBlock++)
+    {
+        long cEntries;
+        hr = m_Table.ReadBlock(nBlock, sizes, &cEntries);
+        if (FAILED(hr) || (cEntries == 0))
+        {
+            break;
+        }
+        long cTable = 0;
+        if (cBits == 16)
+        {
+            for (long i = 0; i < cEntries; i++)
+            {
+                WriteShort(long(sizes[i]), table + (i * 2));
+            }
+            cTable = cEntries * 2;
+        }
+        else if (cBits == 8)
+        {
+            for (long i = 0; i < cEntries; i++)
+            {
+                table[i] = BYTE(sizes[i]);
+            }
+            cTable = cEntries;
+        }
+        else
+        {
+            // EntriesPerBlock is even, so only the last
+            // block can end with a half-filled byte
+            for (long i = 0; i < cEntries; i += 2)
+            {
+                BYTE lo = ((i + 1) < cEntries) ? BYTE(sizes[i + 1] & 0xf) : 0;
+                table[cTable++] = BYTE(sizes[i] << 4) | lo;
+            }
+        }
+        hr = psz->Append(table, cTable);
+    }
+    psz->Close();
+    return hr;
+}
+
 DurationIndex::DurationIndex(long scale)
 : m_scale(scale),
   m_TotalDuration(0),
@@ -1081,7 +2637,9 @@ DurationIndex::DurationIndex(long scale)
   m_tStopLast(0),
   m_nSamples(0),
   m_bCTTS(false),
-  m_tFrame(0)
+  m_tFrame(0),
+  m_bDecodeTimes(false),
+  m_tDecodeStop(0)
 {
 }
 
@@ -1095,6 +2653,12 @@ DurationIndex::Add(REFERENCE_TIME tStart, REFERENCE_TIME tEnd)
     // not be the same as the decode time (== DTS) and we need to use both start and
     // stop time to build the CTTS table. 
     // We save the first few timestamps and then decide which mode to be in.
+    if (m_bDecodeTimes)
+    {
+        // no decode time for this sample: treat as not re-ordered
+        AddDecode(tStart, tStart, tEnd);
+        return;
+    }
     if (m_nSamples < mode_decide_count)
     {
         if (m_nSamples == 0)
@@ -1129,6 +2693,54 @@ DurationIndex::Add(REFERENCE_TIME tStart, REFERENCE_TIME tEnd)
     return;
 }
 
+void
+DurationIndex::AddDecode(REFERENCE_TIME tDecode, REFERENCE_TIME tStart, REFERENCE_TIME tEnd)
+{
+    if ((m_nSamples > 0) && !m_bDecodeTimes)
+    {
+        // the track started without decode times
+        Add(tStart, tEnd);
+        return;
+    }
+
+    if (m_nSamples == 0)
+    {
+        m_bDecodeTimes = true;
+        m_tStartFirst = tDecode;
+        m_TotalDuration = ToScale(tDecode);
+    }
+    else
+    {
+        // the previous sample lasts until this one is decoded
+        AddDuration(long(ToScale(tDecode) - m_TotalDuration));
+    }
+
+    // composition offset from the decode time. The scaled total is used,
+    // as in CTTS mode, so that rounding errors do not build up
+    long cDiff = long(ToScale(tStart) - m_TotalDuration);
+    if (cDiff < 0)
+    {
+        // presentation before decode is not valid
+        cDiff = 0;
+    }
+    if (cDiff != 0)
+    {
+        m_bCTTS = true;
+    }
+    m_CTTS.Append(cDiff);
+
+    // the stop time is often only an estimate, so it
+    // is only used for the final sample
+    REFERENCE_TIME tDur = (tEnd > tStart) ? (tEnd - tStart) : m_tFrame;
+    m_tDecodeStop = tDecode + tDur;
+    if ((m_nSamples == 0) || ((tStart + tDur) > m_tStopLast))
+    {
+        m_tStopLast = tStart + tDur;
+    }
+    m_tStartLast = tStart;
+    m_nSamples++;
+}
+
 void
 DurationIndex::AddDuration(long cThis)
 {
@@ -1330,13 +2942,18 @@ DurationIndex::WriteTable(Atom* patm)
 {
     // do nothing if no samples at all
     HRESULT hr = S_OK;
-    if (m_nSamples <= mode_decide_count)
+    if (!m_bDecodeTimes && (m_nSamples <= mode_decide_count))
     {
         ModeDecide();
     }
     if (m_nSamples > 0)
     {
-        if (!m_bCTTS)
+        if (m_bDecodeTimes)
+        {
+            // the final sample lasts for its own duration
+            AddDuration(long(ToScale(m_tDecodeStop) - m_TotalDuration));
+        }
+        else if (!m_bCTTS)
         {
             // the final sample duration has not been recorded -- use the
             // stop time
@@ -1361,6 +2978,7 @@ DurationIndex::WriteTable(Atom* patm)
 
 SamplesPerChunkIndex::SamplesPerChunkIndex(long dataref)
 : m_dataref(dataref),
+  m_Table(3),
   m_nTotalChunks(0),
   m_nSamples(0)
 {
@@ -1424,23 +3042,16 @@ ChunkOffsetIndex::Write(Atom* patm)
     // did we need 64-bit offsets?
     if (m_Table64.Entries() > 0)
     {
-        // convert 32-bit entries to 64-bit
-        ListOfI64 converted;
-        for (long idx = 0; idx < m_Table32.Entries(); idx++)
-        {
-            converted.Append(m_Table32.Entry(idx));
-        }
-
-        // create 64-bit atom co64
+        // create 64-bit atom co64. The 32-bit entries are
+        // widened as they are decoded, a block at a time.
         smart_ptr<Atom> pCO = patm->CreateAtom('co64');
         BYTE b[8];
         WriteLong(0, b);        // ver/flags
-        long nEntries = converted.Entries() + m_Table64.Entries();
-        WriteLong(nEntries, b+4);
+        WriteLong(Entries(), b+4);
         hr = pCO->Append(b, 8);
         if (SUCCEEDED(hr))
         {
-            hr = converted.Write(pCO);
+            hr = m_Table32.WriteWide(pCO);
         }
         if (SUCCEEDED(hr))
         {
@@ -1520,5 +3131,56 @@ SyncIndex::Write(Atom* patm)
     return hr;
 }
 
+KeyFrameIndex::KeyFrameIndex()
+: m_cChunkBytes(0),
+  m_nSamples(0),
+  m_bAllSync(true),
+  m_tAdjust(0)
+{
+}
+
+void
+KeyFrameIndex::AddSample(bool bSync, REFERENCE_TIME tStart, long cBytes)
+{
+    m_nSamples++;
+    if (!bSync)
+    {
+        m_bAllSync = false;
+    }
+    else if (!m_bAllSync || (m_cChunkBytes == 0))
+    {
+        Pending key;
+        key.tStart = tStart;
+        key.offset = m_cChunkBytes;
+        key.cBytes = cBytes;
+        key.nSample = m_nSamples;
+        m_Pending.push_back(key);
+    }
+    m_cChunkBytes += cBytes;
+}
+
+void
+KeyFrameIndex::AddChunk(LONGLONG posChunk)
+{
+    for (size_t i = 0; i < m_Pending.size(); i++)
+    {
+        const Pending& key = m_Pending[i];
+        m_Times.Append(key.tStart);
+        m_Positions.Append(posChunk + key.offset);
+        m_Sizes.Append(key.cBytes);
+        m_Samples.Append(key.nSample);
+    }
+    m_Pending.clear();
+    m_cChunkBytes = 0;
+}
+
+void
+KeyFrameIndex::Entry(long nEntry, REFERENCE_TIME* pTime, LONGLONG* pPos, long* pcBytes, long* pnSample)
+{
+    *pTime = m_Times.Entry(nEntry) + m_tAdjust;
+    *pPos = m_Positions.Entry(nEntry);
+    *pcBytes = m_Sizes.Entry(nEntry);
+    *pnSample = m_Samples.Entry(nEntry);
+}
 
 
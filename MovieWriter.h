@@ -10,6 +10,7 @@
 
 #pragma once
 
+#include "MuxEngine.h"
 #include "TypeHandler.h"
 
 // byte ordering to buffer
@@ -38,29 +39,27 @@ inline long ReadLong(const BYTE* pByte)
             (pByte[2] << 8)  |
             pByte[3];
 }
+inline LONGLONG ReadI64(const BYTE* pByte)
+{
+    return (LONGLONG(ReadLong(pByte)) << 32) |
+            (ReadLong(pByte + 4) & 0xffffffff);
+}
 
 // forward references
 class Atom;
 class AtomWriter;
+class FileSink;
 class MovieWriter;
 class TrackWriter;
+class IndexJournal;
+class SeekIndex;
+class IndexSpill;
+class QueueSpill;
+class SegmentCloser;
 // do you feel at this point there should be a class ScriptWriter?
 
 
 
-// abstract interface to atom, supported by parent
-// atom or by external container (eg output pin)
-class AtomWriter
-{
-public:
-    virtual ~AtomWriter() {}
-
-    virtual LONGLONG Length() = 0;
-    virtual LONGLONG Position() = 0;
-    virtual HRESULT Replace(LONGLONG pos, const BYTE* pBuffer, long cBytes) = 0;
-    virtual HRESULT Append(const BYTE* pBuffer, long cBytes) = 0;
-};
-
 // basic container structure for MPEG-4 file format.
 // Starts with length and FOURCC four byte type.
 // Can contain other atoms and/or payload data
@@ -88,6 +87,15 @@ public:
         m_cBytes += cBytes;
         return m_pContainer->Append(pBuffer, cBytes);
     }
+    HRESULT AppendHeader(const BYTE* pHeader)
+    {
+        m_cBytes += 8;
+        return m_pContainer->AppendHeader(pHeader);
+    }
+    HRESULT Flush()
+    {
+        return m_pContainer->Flush();
+    }
     LONGLONG Length()
     {
         return m_cBytes;
@@ -102,19 +110,53 @@ private:
     LONGLONG m_cBytes;
 };
 
+// copy of the data for a sample supplied without a buffer
+class HeapBuffer : public MuxBuffer
+{
+public:
+    HeapBuffer(const BYTE* pData, long cBytes)
+    : m_pData(new BYTE[cBytes])
+    {
+        CopyMemory(m_pData, pData, cBytes);
+    }
+    // to be filled by the caller
+    HeapBuffer(long cBytes)
+    : m_pData(new BYTE[cBytes])
+    {
+    }
+    const BYTE* Data()
+    {
+        return m_pData;
+    }
+    BYTE* Space()
+    {
+        return m_pData;
+    }
+private:
+    smart_array<BYTE> m_pData;
+};
 
 // a collection of samples, to be written as one contiguous 
 // chunk in the mdat atom. The properties will
 // be indexed once the data is written.
-// The IMediaSample object is kept here until written and indexed.
+// The sample's buffer is kept here until written and indexed.
 class MediaChunk
 {
 public:
     MediaChunk(TrackWriter* pTrack);
     ~MediaChunk();
 
-    HRESULT AddSample(IMediaSample* pSample);
+    HRESULT AddSample(const MuxSample* pSample);
     HRESULT Write(Atom* patm);
+
+    // moves the payload to the spill file and releases the samples'
+    // buffers. It is read back when the chunk is written. If this
+    // fails, the chunk is left in memory.
+    HRESULT Spill(QueueSpill* pSpill);
+    bool IsSpilled()
+    {
+        return (m_pSpill != NULL);
+    }
     long Length()
     {
         return m_cBytes;
@@ -129,6 +171,20 @@ public:
         return (long)m_Samples.size();
     }
     bool IsFull();
+    bool HasSync()
+    {
+        return m_bSync;
+    }
+
+    // first chunk of a new file
+    void SetSplit()
+    {
+        m_bSplit = true;
+    }
+    bool IsSplit()
+    {
+        return m_bSplit;
+    }
 
 private:
     TrackWriter* m_pTrack;
@@ -136,7 +192,11 @@ private:
     REFERENCE_TIME m_tStart;
     REFERENCE_TIME m_tEnd;
     long m_cBytes;
-    list<IMediaSample*> m_Samples;
+    bool m_bSync;
+    bool m_bSplit;
+    list<MuxSample> m_Samples;
+    QueueSpill* m_pSpill;
+    LONGLONG m_posSpill;
 };
 typedef smart_ptr<MediaChunk> MediaChunkPtr;
 
@@ -146,46 +206,173 @@ typedef smart_ptr<MediaChunk> MediaChunkPtr;
 
 typedef smart_array<BYTE> BytePtr;
 
-// a growable list of 32-bit values maintained in
-// file byte order for writing directly to one of the
-// index atoms
-class ListOfLongs
+// A growable list of integers, held compressed until it is written
+// out at Close. Each value is stored as a zigzag varint of its difference
+// from the value stride entries earlier (so that the tables of pairs and
+// triples are predicted column by column). Prediction restarts in each
+// block of EntriesPerBlock entries, so a read need only decode from the
+// start of its block. Reads are expected in ascending order: a cursor
+// makes each sequential read O(1). Typical index tables take 1 to 3
+// bytes per entry, against 4 or 8 in the file.
+//
+// With a spill file, sealed blocks are moved out of memory to the file
+// a spill_unit at a time, and read back a unit at a time.
+class PackedList
 {
 public:
-    ListOfLongs();
+    PackedList(long stride);
+
+    // before the first Append
+    void SetSpill(IndexSpill* pSpill)
+    {
+        m_pSpill = pSpill;
+    }
+
+    void Append(LONGLONG ll);
+    long Entries()
+    {
+        return m_nEntries;
+    }
+    LONGLONG Entry(long nEntry);
+
+    // expanded to file byte order, cBytesEach (4 or 8) per entry
+    HRESULT Write(Atom* patm, int cBytesEach);
+
+    // the entries of one block (up to EntriesPerBlock of
+    // them), decoded in one pass
+    HRESULT ReadBlock(long nBlock, ULONGLONG* pValues, long* pcEntries);
 
-    void Append(long l);
-    HRESULT Write(Atom* patm);
     enum {
-        EntriesPerBlock = 4096/4,
+        EntriesPerBlock = 512,
+        MaxStride = 3,
+        MaxBytesPerEntry = 10,
+    };
+
+private:
+    // decoding position within a block
+    struct Cursor
+    {
+        long nEntry;                // next entry to decode
+        long cbOffset;              // its offset in the block
+        LONGLONG prev[MaxStride];   // the last value in each column (entry % stride)
+    };
+    void Rewind(Cursor* pCursor, long nBlock);
+    LONGLONG Next(Cursor* pCursor);
+    void DecodeBlock(long nBlock, long cEntries, ULONGLONG* pValues);
+    const BYTE* BlockData(long nBlock);
+    void Spill();
+
+private:
+    long m_stride;
+    long m_nEntries;
+
+    // the full blocks, each trimmed to its size,
+    // and the block being appended. A spilled block
+    // has no data, but is at offset in unit nUnit.
+    struct Block
+    {
+        BytePtr pData;
+        long cBytes;
+        long nUnit;
+        long offset;
+    };
+    vector<Block> m_Blocks;
+    vector<BYTE> m_Open;
+    LONGLONG m_Last[MaxStride];
+
+    Cursor m_Read;
+
+    // spilled blocks, written together
+    struct Unit
+    {
+        LONGLONG pos;
+        long cBytes;
     };
-    long Entries() {
-        return (long)(((m_Blocks.size() - 1) * EntriesPerBlock) + m_nEntriesInLast);
+    IndexSpill* m_pSpill;
+    bool m_bSpillFailed;
+    vector<Unit> m_Units;
+    long m_nFirstHeld;          // first sealed block still in memory
+    long m_cHeld;               // bytes of sealed blocks in memory
+    vector<BYTE> m_Cache;       // one unit read back
+    long m_nCached;
+    HRESULT m_hrSpill;
+};
+
+// a growable list of 32-bit values, for writing to one of the index atoms
+class ListOfLongs
+{
+public:
+    ListOfLongs(long stride = 1)
+    : m_List(stride)
+    {
+    }
+    void SetSpill(IndexSpill* pSpill)
+    {
+        m_List.SetSpill(pSpill);
+    }
+
+    void Append(long l)
+    {
+        m_List.Append(l);
+    }
+    HRESULT Write(Atom* patm)
+    {
+        return m_List.Write(patm, 4);
+    }
+    // the same values, written as 64-bit entries
+    HRESULT WriteWide(Atom* patm)
+    {
+        return m_List.Write(patm, 8);
+    }
+    long Entries()
+    {
+        return m_List.Entries();
+    }
+    long Entry(long nEntry)
+    {
+        return long(m_List.Entry(nEntry));
+    }
+    HRESULT ReadBlock(long nBlock, ULONGLONG* pValues, long* pcEntries)
+    {
+        return m_List.ReadBlock(nBlock, pValues, pcEntries);
     }
-    long Entry(long nEntry);
 
 private:
-    vector<BytePtr> m_Blocks;
-    long m_nEntriesInLast;
+    PackedList m_List;
 };
 
 // growable list of 64-bit values
 class ListOfI64
 {
 public:
-    ListOfI64();
+    ListOfI64()
+    : m_List(1)
+    {
+    }
+    void SetSpill(IndexSpill* pSpill)
+    {
+        m_List.SetSpill(pSpill);
+    }
 
-    void Append(LONGLONG ll);
-    HRESULT Write(Atom* patm);
-    enum {
-        EntriesPerBlock = 4096/8,
-    };
-    long Entries() {
-        return (long) (((m_Blocks.size() - 1) * EntriesPerBlock) + m_nEntriesInLast);
+    void Append(LONGLONG ll)
+    {
+        m_List.Append(ll);
+    }
+    HRESULT Write(Atom* patm)
+    {
+        return m_List.Write(patm, 8);
+    }
+    long Entries()
+    {
+        return m_List.Entries();
+    }
+    LONGLONG Entry(long nEntry)
+    {
+        return m_List.Entry(nEntry);
     }
+
 private:
-    vector<BytePtr> m_Blocks;
-    long m_nEntriesInLast;
+    PackedList m_List;
 };
 
 // pairs of <count, value> longs -- this is essentially an RLE compression
@@ -196,9 +383,20 @@ class ListOfPairs
 {
 public:
     ListOfPairs();
+    void SetSpill(IndexSpill* pSpill)
+    {
+        m_Table.SetSpill(pSpill);
+    }
     void Append(long l);
     HRESULT Write(Atom* patm);
     long Entries() { return m_cEntries; }
+
+    // read back, including the current pair (not valid after Write)
+    long Pairs()
+    {
+        return (m_Table.Entries() / 2) + ((m_lCount > 0) ? 1 : 0);
+    }
+    void Pair(long nPair, long* pCount, long* pValue);
 private:
     ListOfLongs m_Table;
 
@@ -211,14 +409,36 @@ private:
 };
 
 // sample size index -- table of <count, size> pairs
-// possibly reduced to a single header
+// possibly reduced to a single header.
+// If bCompact, and every size fits in 16 bits or less, the table
+// is written as stz2 with 4, 8 or 16-bit fields instead of stsz.
 class SizeIndex
 {
 public:
     SizeIndex();
+    void SetSpill(IndexSpill* pSpill)
+    {
+        m_Table.SetSpill(pSpill);
+    }
 
     void Add(long cBytes);
-    HRESULT Write(Atom* patm);
+    HRESULT Write(Atom* patm, bool bCompact);
+
+    long Samples()
+    {
+        return m_nSamples;
+    }
+    long Size(long nSample)
+    {
+        if (m_Table.Entries() == 0)
+        {
+            return m_cBytesCurrent;
+        }
+        return m_Table.Entry(nSample);
+    }
+private:
+    HRESULT WriteCompact(Atom* patm);
+
 private:
     ListOfLongs m_Table;
 
@@ -228,6 +448,9 @@ private:
 
     // total samples
     long m_nSamples;
+
+    // largest sample, for the stz2 field size
+    long m_cMax;
 };
 
 // sample duration table -- table of <count, duration> pairs
@@ -244,8 +467,17 @@ class DurationIndex
 {
 public:
     DurationIndex(long scale);
+    void SetSpill(IndexSpill* pSpill)
+    {
+        m_STTS.SetSpill(pSpill);
+        m_CTTS.SetSpill(pSpill);
+    }
 
     void Add(REFERENCE_TIME tStart, REFERENCE_TIME tEnd);
+
+    // the decode time is known: stts and ctts are
+    // built from it rather than deduced
+    void AddDecode(REFERENCE_TIME tDecode, REFERENCE_TIME tStart, REFERENCE_TIME tEnd);
     HRESULT WriteEDTS(Atom* patm, long scale);
     HRESULT WriteTable(Atom* patm);
     REFERENCE_TIME Duration()
@@ -271,6 +503,31 @@ public:
         m_tFrame = tFrame;
     }
 
+    // read back of the tables while samples are being added:
+    // the decode time of the first sample (in track scale)
+    // and the durations known so far. Not valid after WriteTable.
+    bool HasDecodeTable()
+    {
+        return (m_tStartFirst != -1) && (m_STTS.Entries() > 0);
+    }
+    LONGLONG FirstDecode()
+    {
+        return ToScale(m_tStartFirst);
+    }
+    ListOfPairs* DecodeDurations()
+    {
+        return &m_STTS;
+    }
+    ListOfPairs* CompositionOffsets()
+    {
+        return &m_CTTS;
+    }
+    REFERENCE_TIME FromScale(LONGLONG t)
+    {
+        // rounded up, so that ToScale gives back the same value
+        return ((t * UNITS) + m_scale - 1) / m_scale;
+    }
+
     // for track start adjustment
     REFERENCE_TIME Earliest()
     {
@@ -283,6 +540,7 @@ public:
         m_tStopLast += tAdjust;
         m_TotalDuration += ToScale(tAdjust);
         m_refDuration += tAdjust;
+        m_tDecodeStop += tAdjust;
     }
 
 private:
@@ -322,6 +580,10 @@ private:
     REFERENCE_TIME m_SumDurations;
     REFERENCE_TIME m_tFrame;
     bool m_bUseFrameRate;
+
+    // decode times supplied with the samples (decided by the first sample)
+    bool m_bDecodeTimes;
+    REFERENCE_TIME m_tDecodeStop;       // decode time + duration of the last sample
 };
 
 // index of samples per chunk.
@@ -330,9 +592,28 @@ class SamplesPerChunkIndex
 {
 public:
     SamplesPerChunkIndex(long dataref);
+    void SetSpill(IndexSpill* pSpill)
+    {
+        m_Table.SetSpill(pSpill);
+    }
 
     void Add(long nSamples);
     HRESULT Write(Atom* patm);
+
+    // entries are <first chunk (1-based), samples per chunk>
+    long Entries()
+    {
+        return m_Table.Entries() / 3;
+    }
+    void Entry(long nEntry, long* pFirstChunk, long* pSamples)
+    {
+        *pFirstChunk = m_Table.Entry(nEntry * 3);
+        *pSamples = m_Table.Entry((nEntry * 3) + 1);
+    }
+    long Chunks()
+    {
+        return m_nTotalChunks;
+    }
 private:
     long m_dataref;
     ListOfLongs m_Table;
@@ -352,8 +633,26 @@ private:
 class ChunkOffsetIndex
 {
 public:
+    void SetSpill(IndexSpill* pSpill)
+    {
+        m_Table32.SetSpill(pSpill);
+        m_Table64.SetSpill(pSpill);
+    }
     void Add(LONGLONG posChunk);
     HRESULT Write(Atom* patm);
+
+    long Entries()
+    {
+        return m_Table32.Entries() + m_Table64.Entries();
+    }
+    LONGLONG Entry(long nEntry)
+    {
+        if (nEntry < m_Table32.Entries())
+        {
+            return m_Table32.Entry(nEntry) & 0xffffffff;
+        }
+        return m_Table64.Entry(nEntry - m_Table32.Entries());
+    }
 private:
     ListOfLongs m_Table32;
     ListOfI64 m_Table64;
@@ -364,22 +663,175 @@ class SyncIndex
 {
 public:
     SyncIndex();
+    void SetSpill(IndexSpill* pSpill)
+    {
+        m_Syncs.SetSpill(pSpill);
+    }
 
     void Add(bool bSync);
     HRESULT Write(Atom* patm);
+
+    // if not all sync, the 1-based sample numbers of the sync samples
+    bool AllSync()
+    {
+        return m_bAllSync;
+    }
+    long Entries()
+    {
+        return m_Syncs.Entries();
+    }
+    long Entry(long nEntry)
+    {
+        return m_Syncs.Entry(nEntry);
+    }
 private:
     long m_nSamples;
     bool m_bAllSync;
     ListOfLongs m_Syncs;
 };
 
+// the samples at which decoding can start, with their position in the
+// file, for the seek index sidecar (see SeekIndex.h). Samples are added
+// as they are indexed, and their position is known when the chunk that
+// contains them is added. On a track where every sample so far is a sync
+// sample (audio), only the first sample of each chunk is kept.
+class KeyFrameIndex
+{
+public:
+    KeyFrameIndex();
+    void SetSpill(IndexSpill* pSpill)
+    {
+        m_Times.SetSpill(pSpill);
+        m_Positions.SetSpill(pSpill);
+        m_Sizes.SetSpill(pSpill);
+        m_Samples.SetSpill(pSpill);
+    }
+
+    void AddSample(bool bSync, REFERENCE_TIME tStart, long cBytes);
+    void AddChunk(LONGLONG posChunk);
+
+    // rebased with the track's other tables when the moov is written
+    void OffsetTimes(REFERENCE_TIME tAdj)
+    {
+        m_tAdjust = tAdj;
+    }
+
+    long Entries()
+    {
+        return m_Sizes.Entries();
+    }
+    // nSample is 1-based, as in stss
+    void Entry(long nEntry, REFERENCE_TIME* pTime, LONGLONG* pPos, long* pcBytes, long* pnSample);
+
+private:
+    struct Pending
+    {
+        REFERENCE_TIME tStart;
+        long offset;            // within the chunk
+        long cBytes;
+        long nSample;
+    };
+    vector<Pending> m_Pending;
+    long m_cChunkBytes;
+    long m_nSamples;
+    bool m_bAllSync;
+    REFERENCE_TIME m_tAdjust;
+
+    ListOfI64 m_Times;
+    ListOfI64 m_Positions;
+    ListOfLongs m_Sizes;
+    ListOfLongs m_Samples;
+};
+
+// one sample already in a file, read back from an index
+// for clip export and editing
+struct ClipSample
+{
+    long idxSource;             // which file
+    LONGLONG pos;               // in that file
+    long cBytes;
+    long nChunk;                // chunk in that file
+    bool bSync;
+    REFERENCE_TIME tDecode;
+    REFERENCE_TIME tStart;
+    REFERENCE_TIME tStop;
+};
+
+// cuts a clip from the samples of each track (in decode order) at sync
+// samples of tracks[idxKey]: from the last presented at or before tFrom,
+// up to (not including) the first presented at or after tTo. The other
+// tracks are cut to the same range. false if there is nothing in range.
+bool SelectClip(vector<vector<ClipSample> >* pTracks, long idxKey, REFERENCE_TIME tFrom, REFERENCE_TIME tTo,
+                REFERENCE_TIME* ptFrom, REFERENCE_TIME* ptTo);
+
+// A value published by one writer for readers that must never wait for
+// it (a seqlock). The writer, which must already be serialised by its own
+// lock, makes the sequence count odd while it updates the copy, and even
+// again afterwards; a reader copies the value, and tries again if the count
+// was odd or changed meanwhile. Readers take no lock, so they cannot
+// delay the writer, or be delayed by whatever the writer's lock is held for.
+template<class T>
+class Published
+{
+public:
+    Published()
+    : m_nSeq(0),
+      m_Value()
+    {
+    }
+
+    void Publish(const T& value)
+    {
+        m_nSeq = m_nSeq + 1;
+        MemoryBarrier();
+        m_Value = value;
+        MemoryBarrier();
+        m_nSeq = m_nSeq + 1;
+    }
+
+    T Read() const
+    {
+        for (;;)
+        {
+            long nSeq = m_nSeq;
+            MemoryBarrier();
+            T value = m_Value;
+            MemoryBarrier();
+            if (((nSeq & 1) == 0) && (m_nSeq == nSeq))
+            {
+                return value;
+            }
+        }
+    }
+
+private:
+    volatile long m_nSeq;
+    T m_Value;
+};
+
+// a track's progress, for polling while the movie is written
+struct TrackProgress
+{
+    REFERENCE_TIME tWritten;    // end of the last chunk written
+    LONGLONG llWritten;         // media bytes written
+    long cChunksWritten;
+    long cChunksQueued;         // complete chunks waiting to be written
+    LONGLONG llQueued;          // bytes waiting, including the open chunk
+    long cChunksSpilled;        // queued chunks whose data is in the queue spill file
+    LONGLONG llSpilled;
+};
+
 // one media track within a file.
 class TrackWriter
 {
 public:
-    TrackWriter(MovieWriter* pMovie, int index, TypeHandler* ptype);
+    TrackWriter(MovieWriter* pMovie, int index, smart_ptr<TypeHandler> ptype);
+
+    HRESULT Add(const MuxSample* pSample);
 
-    HRESULT Add(IMediaSample* pSample);
+    // a batch of consecutive samples, queued under one lock,
+    // with at most one interleaving pass
+    HRESULT Add(const MuxSample* pSamples, long nSamples);
 
     // returns true if all tracks now at end
     bool OnEOS();
@@ -394,13 +846,54 @@ public:
     void Stop(bool bFlush);
 
     bool GetHeadTime(LONGLONG* ptHead);
-    HRESULT WriteHead(Atom* patm);
-    REFERENCE_TIME LastWrite();
+    bool HeadIsSplit();
+    HRESULT WriteHead(Atom* patm, bool* pbSync);
+
+    // lock-free: these never wait for the queue or the writer
+    REFERENCE_TIME LastWrite()
+    {
+        return m_Progress.Read().tWritten;
+    }
+    TrackProgress Progress()
+    {
+        return m_Progress.Read();
+    }
 
     void IndexChunk(LONGLONG posChunk, long nSamples);
-    void IndexSample(bool bSync, REFERENCE_TIME tStart, REFERENCE_TIME tStop, long cBytes);
+    // pTimes: the times of the sample (the last buffer of a split sample)
+    void IndexSample(bool bSync, const MuxSample* pTimes, long cBytes);
+
+    // appends the trak atom to pContainer. Tracks may be closed in
+    // parallel: each uses only its own index (and the spill file,
+    // which is locked).
+    HRESULT Close(AtomWriter* pContainer);
+
+    // for clip export: the indexed samples whose duration is known and
+    // whose data is below llAvailable. Call with the movie's write
+    // lock held, before Close.
+    void ReadIndex(LONGLONG llAvailable, vector<ClipSample>* pSamples);
+
+    KeyFrameIndex* KeyFrames()
+    {
+        return &m_Keys;
+    }
+
+    // a track in another movie shares the format
+    smart_ptr<TypeHandler> SharedHandler()
+    {
+        return m_pType;
+    }
 
-    HRESULT Close(Atom* patm);
+    // hands the index for the completed file to pTrack (the same
+    // track in a movie for that file alone), and starts afresh for
+    // the next file. Call with the movie's write lock held.
+    void MoveIndex(TrackWriter* pTrack);
+
+    // the samples indexed, as a measure of the work of Close
+    long IndexedSamples()
+    {
+        return m_Sizes.Samples();
+    }
 
     long SampleRate()
     {
@@ -437,6 +930,7 @@ public:
     void AdjustStart(REFERENCE_TIME tAdj)
     {
         m_Durations.OffsetTimes(tAdj);
+        m_Keys.OffsetTimes(tAdj);
     }
     void SetStartAt(REFERENCE_TIME tStart)
     {
@@ -445,6 +939,19 @@ public:
             m_StartAt = tStart;
         }
     }
+private:
+    // the index tables spill to the movie's spill file, if any
+    void UseSpill(IndexSpill* pSpill);
+    void ResetIndex();
+
+    // converted samples (see TypeHandler::Transform)
+    HRESULT Queue(const MuxSample* pSamples, long nSamples);
+
+    // call with m_csQueue held
+    bool QueueSample(const MuxSample* pSample);     // true if a chunk was completed
+    void QueueCurrent();
+    void PublishProgress();
+
 private:
     MovieWriter* m_pMovie;
     int m_index;
@@ -453,15 +960,20 @@ private:
     CCritSec m_csQueue;
     bool m_bEOS;
     bool m_bStopped;
-    REFERENCE_TIME m_tLast;
     MediaChunkPtr m_pCurrent;
     list<MediaChunkPtr> m_Queue;
 
+    // updated under m_csQueue, and published for readers
+    // that do not take it (see LastWrite and Progress)
+    TrackProgress m_Written;
+    Published<TrackProgress> m_Progress;
+
     SizeIndex m_Sizes;
     DurationIndex m_Durations;
     SamplesPerChunkIndex m_SC;
     ChunkOffsetIndex m_CO;
     SyncIndex m_Syncs;
+    KeyFrameIndex m_Keys;
 
     // IAMStreamControl start offset
     // -- set to first StartAt time, if explicit,
@@ -476,8 +988,96 @@ class MovieWriter
 {
 public:
     MovieWriter(AtomWriter* pContainer);
+    ~MovieWriter();
 
-    TrackWriter* MakeTrack(const CMediaType* pmt);
+    // optional crash-recovery journal of all index entries
+    void SetJournal(IndexJournal* pJournal);
+    IndexJournal* Journal()
+    {
+        return m_pJournal;
+    }
+
+    // optional spill file for the index tables, so that their memory
+    // does not grow with the recording. Set before the tracks are made.
+    void SetIndexSpill(IndexSpill* pSpill);
+    IndexSpill* Spill()
+    {
+        return m_pSpill;
+    }
+
+    // optional seek index sidecar, written when the file is
+    // complete (the first file only, with rolling output)
+    void SetSeekIndex(SeekIndex* pSeekIndex);
+
+    // optional durability policy: notified of each chunk written.
+    // Not owned by the movie.
+    void SetSync(WriteObserver* pSync)
+    {
+        m_pSync = pSync;
+    }
+
+    // Rolling output. Once the current file reaches llMaxBytes or
+    // tMaxDuration (either may be 0), the next file is started
+    // at the next key frame, with the container from pSource.
+    // Not owned by the movie.
+    void SetRolling(SegmentSource* pSource, LONGLONG llMaxBytes, REFERENCE_TIME tMaxDuration);
+
+    // called on input as each sample is queued: true if this sample
+    // must start a new chunk so that the files split cleanly, and
+    // *pbNewFile set if that chunk is the first of the next file
+    bool IsSplitPoint(TrackWriter* pTrack, const MuxSample* pSample, MediaChunk* pCurrent, bool* pbNewFile);
+    void SetSplitTime(REFERENCE_TIME tSplit);
+
+    // sample sizes as stz2 where they fit in 16 bits. Off by
+    // default, since some players support only stsz.
+    void SetCompactSizes(bool bCompact)
+    {
+        m_bCompactSizes = bCompact;
+    }
+    bool CompactSizes()
+    {
+        return m_bCompactSizes;
+    }
+
+    // The interleaving window. An audio chunk is complete once it spans
+    // ChunkDuration (a video chunk holds about as long, in frames), and
+    // no track is written more than InterleaveLead ahead of a track that
+    // is still waiting for data. So an input must be able to hold
+    // BufferWindow of samples before they are written, or the
+    // interleaving stalls.
+    static REFERENCE_TIME ChunkDuration()
+    {
+        return UNITS;
+    }
+    static REFERENCE_TIME InterleaveLead()
+    {
+        return UNITS;
+    }
+    static REFERENCE_TIME BufferWindow()
+    {
+        return ChunkDuration() + InterleaveLead();
+    }
+
+    // Optional limits on the chunks each track holds in memory while they
+    // wait to be interleaved: once a track's queue holds more than
+    // llMaxBytes, or spans more than tMaxDuration (either may be 0),
+    // the payload of each chunk it completes is moved to the spill file
+    // until the queue has drained (see QueueSpill.h).
+    void SetQueueSpill(QueueSpill* pSpill, LONGLONG llMaxBytes, REFERENCE_TIME tMaxDuration);
+    QueueSpill* QueueSpillFile()
+    {
+        return m_pQueueSpill;
+    }
+    bool IsQueueOverLimit(LONGLONG llQueued, REFERENCE_TIME tQueued)
+    {
+        return ((m_llQueueBytes > 0) && (llQueued > m_llQueueBytes)) ||
+               ((m_tQueueDuration > 0) && (tQueued > m_tQueueDuration));
+    }
+
+    TrackWriter* MakeTrack(const MuxCodecConfig* pConfig);
+
+    // a track with the format of a track in another movie. Not journalled.
+    TrackWriter* MakeTrack(smart_ptr<TypeHandler> pType);
     HRESULT Close(REFERENCE_TIME* pDuration);
 
     // ensures that CheckQueues is not active when
@@ -507,18 +1107,72 @@ public:
     {
         return m_Tracks[nTrack];
     }
+
+    // the earliest last-written time of any track. Takes no lock
+    // (the tracks are all made before the first sample is added), so
+    // polling never waits for, or slows, the writing of the file.
     REFERENCE_TIME CurrentPosition();
+
+    // Clip export while recording. Writes a complete file to pClip (which
+    // should be empty) with the samples between tFrom and tTo, from a key
+    // frame at or before tFrom. The index is taken from memory, and the
+    // payload is copied from pRecording (the file being written, read
+    // directly, or through a BufferedSink: data still in the buffer is not
+    // included). The recording continues meanwhile. *ptFrom and *ptTo
+    // (optional) receive the range exported. Not valid after Close.
+    HRESULT ExportClip(REFERENCE_TIME tFrom, REFERENCE_TIME tTo, FileSink* pRecording, FileSink* pClip,
+                       REFERENCE_TIME* ptFrom = NULL, REFERENCE_TIME* ptTo = NULL);
+
+    // Writes a movie of samples that are already in files, instead of
+    // samples added to the tracks: tracks[i] lists the samples of Track(i)
+    // in decode order, from sources[ClipSample::idxSource]. pOut is this
+    // movie's container. Samples already in pOut stay where they are, and
+    // the rest are copied to a new mdat at the end; then the moov is written.
+    HRESULT WriteFromFiles(const vector<vector<ClipSample> >& tracks, const vector<FileSink*>& sources,
+                           FileSink* pOut, REFERENCE_TIME* pDuration);
 private:
     void MakeIODS(Atom* pmoov);
     void InsertFTYP(AtomWriter* pFile);
     void WriteTrack(int indexReady);
+    HRESULT WriteMOOV(REFERENCE_TIME* pDuration);
+    HRESULT WriteTraks(Atom* pmoov);
+    void CheckSplit(LONGLONG tWritten);
+    void NextFile();
+
+    enum {
+        // the traks are built in parallel only if there are at least
+        // this many samples outside the largest track (see WriteTraks)
+        parallel_trak_samples = 256 * 1024,
+    };
 
 private:
     AtomWriter* m_pContainer;
     CCritSec m_csWrite;
     bool m_bStopped;
     bool m_bFTYPInserted;
+    bool m_bCompactSizes;
     smart_ptr<Atom> m_patmMDAT;
+    smart_ptr<IndexSpill> m_pSpill;     // before m_Tracks: their tables refer to it
+    smart_ptr<QueueSpill> m_pQueueSpill; // and their queued chunks to this
+    LONGLONG m_llQueueBytes;
+    REFERENCE_TIME m_tQueueDuration;
     vector<TrackWriterPtr> m_Tracks;
+    smart_ptr<IndexJournal> m_pJournal;
+    smart_ptr<SeekIndex> m_pSeekIndex;
+    WriteObserver* m_pSync;
+
+    // rolling output
+    SegmentSource* m_pSegments;
+    LONGLONG m_llMaxBytes;
+    REFERENCE_TIME m_tMaxDuration;
+    bool m_bSegmentContainer;       // m_pContainer came from m_pSegments
+    REFERENCE_TIME m_tFileStart;    // first write to current file, or -1
+    smart_ptr<SegmentCloser> m_pCloser; // finishes the old files
+
+    CCritSec m_csSplit;
+    bool m_bSplitPending;           // size/time reached: waiting for key frame
+    TrackWriter* m_pKeyTrack;
+    AtomWriter* m_pNext;            // container for the new file, once split point found
+    REFERENCE_TIME m_tSplit;        // start of new file, or -1 if not yet known
 };
 
@@ -0,0 +1,144 @@
+// Mp4Edit.cpp: command-line trim and concatenation of MP4 files
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+//
+// mp4edit trim <from> <to> input.mp4 [output.mp4]
+// mp4edit concat output.mp4 input...
+//
+// Edits finished files by rewriting the index only: the sample tables are
+// read from the moov, sliced or joined, and written as a new moov. The
+// payload is copied in the kernel where possible (see FileSink::CopyFrom),
+// or not moved at all: trim without an output edits the input in place,
+// and concat to its first input appends the others to it.
+// Cuts are made at video key frames, so nothing is decoded.
+
+#include "stdafx.h"
+#include "MovieWriter.h"
+#include "FileSink.h"
+#include "MovieEdit.h"
+#include <stdio.h>
+
+static HRESULT
+OpenFile(const string& strPath, bool bCreate, bool bReadOnly, FileSink* pFile)
+{
+    size_t cch = mbstowcs(NULL, strPath.c_str(), 0);
+    if (cch == (size_t)-1)
+    {
+        return E_INVALIDARG;
+    }
+    wstring strWide(cch, L'\0');
+    mbstowcs(&strWide[0], strPath.c_str(), cch);
+    HRESULT hr = bCreate ? pFile->Create(strWide.c_str()) : pFile->Open(strWide.c_str(), bReadOnly);
+    if (FAILED(hr))
+    {
+        fprintf(stderr, "cannot %s %s (0x%08x)\n", bCreate ? "create" : "open", strPath.c_str(), (unsigned int)hr);
+    }
+    return hr;
+}
+
+static int
+Trim(double from, double to, const string& strInput, const string& strOutput)
+{
+    bool bInPlace = strOutput.empty() || (strOutput == strInput);
+    FileSink input;
+    FileSink output;
+    HRESULT hr = OpenFile(strInput, false, !bInPlace, &input);
+    if (SUCCEEDED(hr) && !bInPlace)
+    {
+        hr = OpenFile(strOutput, true, false, &output);
+    }
+    if (FAILED(hr))
+    {
+        return 1;
+    }
+    FileSink* pOut = bInPlace ? &input : &output;
+
+    DWORD msStart = GetTickCount();
+    REFERENCE_TIME tFrom, tTo;
+    hr = TrimMovie(&input, pOut, REFERENCE_TIME(from * UNITS), REFERENCE_TIME(to * UNITS), &tFrom, &tTo);
+    if (FAILED(hr))
+    {
+        fprintf(stderr, "trim failed (0x%08x)\n", (unsigned int)hr);
+        return 1;
+    }
+    printf("kept %.3f s to %.3f s%s in %lu ms\n",
+        double(tFrom) / UNITS,
+        double(tTo) / UNITS,
+        bInPlace ? " in place" : "",
+        (unsigned long)(GetTickCount() - msStart));
+    return 0;
+}
+
+static int
+Concat(const string& strOutput, const vector<string>& inputs)
+{
+    bool bInPlace = (strOutput == inputs[0]);
+    vector<smart_ptr<FileSink> > files;
+    vector<FileSink*> sources;
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        FileSink* pFile = new FileSink;
+        files.push_back(pFile);
+        if (FAILED(OpenFile(inputs[i], false, !(bInPlace && (i == 0)), pFile)))
+        {
+            return 1;
+        }
+        sources.push_back(pFile);
+    }
+    FileSink output;
+    FileSink* pOut = sources[0];
+    if (!bInPlace)
+    {
+        if (FAILED(OpenFile(strOutput, true, false, &output)))
+        {
+            return 1;
+        }
+        pOut = &output;
+    }
+
+    DWORD msStart = GetTickCount();
+    HRESULT hr = ConcatMovies(sources, pOut);
+    if (FAILED(hr))
+    {
+        fprintf(stderr, "concat failed (0x%08x)%s\n", (unsigned int)hr,
+            (hr == VFW_E_TYPE_NOT_ACCEPTED) ? ": the tracks of the inputs do not match" : "");
+        return 1;
+    }
+    printf("joined %u files%s in %lu ms\n",
+        (unsigned int)inputs.size(),
+        bInPlace ? " in place" : "",
+        (unsigned long)(GetTickCount() - msStart));
+    return 0;
+}
+
+static void
+Usage()
+{
+    fprintf(stderr,
+        "usage: mp4edit trim <from> <to> input.mp4 [output.mp4]\n"
+        "       mp4edit concat output.mp4 input...\n"
+        "  times are in seconds; the cut is at the video key frame at or before each time\n"
+        "  trim without an output (or to the input) edits the input in place\n"
+        "  concat to the first input appends the others to it\n");
+}
+
+int
+main(int argc, char* argv[])
+{
+    string strCommand = (argc > 1) ? argv[1] : "";
+    if ((strCommand == "trim") && ((argc == 5) || (argc == 6)))
+    {
+        return Trim(atof(argv[2]), atof(argv[3]), argv[4], (argc == 6) ? argv[5] : "");
+    }
+    if ((strCommand == "concat") && (argc >= 4))
+    {
+        vector<string> inputs(argv + 3, argv + argc);
+        return Concat(argv[2], inputs);
+    }
+    Usage();
+    return 1;
+}
@@ -0,0 +1,229 @@
+//
+// MuxConfig.h
+//
+// Private configuration interface for the GDCL Mpeg-4 Multiplexor,
+// for options that are not covered by the standard DirectShow interfaces.
+// Obtain by QueryInterface on the filter.
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// durability policy for the output file: when to ask for written
+// data to be committed to stable storage
+enum MuxDurability
+{
+    MuxDurability_None = 0,     // leave it to the file system
+    MuxDurability_Bytes,        // after every dwParam MB written
+    MuxDurability_Interval,     // every dwParam ms
+    MuxDurability_Keyframe,     // after every chunk containing a video key frame
+};
+
+// reported for the current or most recent run. Times are
+// in 100ns units.
+struct MuxDurabilityStats
+{
+    DWORD dwPolicy;
+    DWORD dwParam;
+    LONGLONG cRequests;         // syncs requested by the policy
+    LONGLONG cSyncs;            // syncs performed (requests made during a sync are grouped)
+    LONGLONG llWritten;         // bytes written to the file
+    LONGLONG llSynced;          // bytes known to be on disk
+    LONGLONG llMaxAtRisk;       // most bytes written but not synced at any sync
+    REFERENCE_TIME tLatencyTotal;   // time spent in syncs
+    REFERENCE_TIME tLatencyMax;
+    REFERENCE_TIME tElapsed;        // duration of run
+    LONGLONG llBytesPerSec;         // write throughput over the run
+};
+
+// the progress of one track while running (GetTrackProgress)
+struct MuxTrackProgress
+{
+    REFERENCE_TIME tWritten;    // end time of the last chunk written
+    LONGLONG llWritten;         // media bytes written
+    long cChunksWritten;
+    long cChunksQueued;         // complete chunks waiting to be written
+    LONGLONG llQueued;          // bytes received but not yet written
+    long cChunksSpilled;        // queued chunks held in the queue spill file
+    LONGLONG llSpilled;
+};
+
+// the buffers held by one input pin (GetPinMemory)
+struct MuxPinMemory
+{
+    long cBuffers;              // the pool the pin's samples are held in
+    long cbBuffer;
+    BOOL bCopying;              // samples are copied from the upstream allocator into the pool
+    long cHeld;                 // buffers held now, waiting to be written
+    long cbHeld;                // their size in bytes, including heap copies
+    long cPeakHeld;             // the most held at once, in the current or last run
+    long cHeapCopies;           // samples copied to the heap in that run, as the pool was full
+    long cbMaxSample;           // the largest sample received
+};
+
+// the SHA-256 of one part of the output file (GetRegionDigests)
+struct MuxRegionDigest
+{
+    LONGLONG llStart;           // file offset
+    LONGLONG llLength;          // bytes
+    BYTE sha256[32];
+};
+
+// Sent to the graph when a recording stopped with asynchronous
+// finalisation is complete: param1 is the HRESULT of writing the
+// metadata, and param2 the recording's 1-based number (counting
+// each run of the filter).
+#define EC_MUX_FINALISED    (EC_USER + 0x4d31)
+
+// replica policy flags
+enum MuxReplicaFlags
+{
+    MuxReplica_WaitOnLag = 1,       // else a replica too far behind is dropped
+    MuxReplica_FailOnError = 2,     // else a replica that fails is dropped
+};
+
+// Rolling output: supplies the stream for each new file. Called on a
+// worker thread, so a slow callback delays the split but never the
+// recording.
+interface DECLSPEC_UUID("4C0B6F0E-8C55-4C5B-A4E4-5B4E2C7D9A13")
+IMuxSegmentCallback : public IUnknown
+{
+    // A new file will be needed shortly. nFile is the zero-based index of
+    // the file within the recording (file 0 is written through the output
+    // pin). The stream should be empty; it is written from the start.
+    STDMETHOD(GetNextFile)(long nFile, IStream** ppStream) PURE;
+
+    // File nFile is complete and its stream has been released
+    STDMETHOD(FileComplete)(long nFile) PURE;
+};
+
+// Settings take effect from the next transition out of the stopped state.
+interface DECLSPEC_UUID("81CEA2DA-1E71-4E50-90DE-36EE6485D2CF")
+IMuxConfig : public IUnknown
+{
+    // Crash-recovery journal. When enabled, each chunk's index entries are
+    // appended to a journal file as the chunk is written. If the recording is
+    // not stopped cleanly, RecoverMovieFile can rebuild the moov from it.
+    // Not with rolling output (see SetRollingOutput).
+    // The journal is deleted once the file is successfully completed.
+    // If pszFile is NULL, the journal is written next to the output file
+    // (requires a downstream filter supporting IFileSinkFilter).
+    STDMETHOD(SetIndexJournal)(BOOL bEnable, LPCWSTR pszFile) PURE;
+
+    // Durability policy (MuxDurability). Syncs are performed on a
+    // separate thread, so writing never waits for the disk; requests
+    // that arrive while a sync is in progress are satisfied by one
+    // further sync.
+    STDMETHOD(SetDurability)(DWORD dwPolicy, DWORD dwParam) PURE;
+    STDMETHOD(GetDurabilityStats)(MuxDurabilityStats* pStats) PURE;
+
+    // Rolling output. Once the current file reaches llMaxBytes or
+    // tMaxDuration (either may be 0), it is completed and the next file
+    // is started at the next video key frame, without stopping the graph.
+    // Each file's timestamps start from zero. A NULL callback disables.
+    // Replicas, the index journal, hashing and the seek index are built
+    // around the first file only, so they cannot be combined with rolling
+    // output: Pause fails with E_INVALIDARG if any is enabled with it.
+    STDMETHOD(SetRollingOutput)(IMuxSegmentCallback* pCallback, LONGLONG llMaxBytes, REFERENCE_TIME tMaxDuration) PURE;
+
+    // Replicas: identical copies of the output file, written from the
+    // same mux. Not with rolling output (see SetRollingOutput).
+    // Each replica is written on its own thread from its own queue;
+    // llMaxLag is the queue limit in bytes (MuxReplicaFlags for the policy).
+    // GetReplicaStatus reports S_OK, or the error that caused the replica
+    // to be dropped, and the bytes queued.
+    STDMETHOD(AddReplica)(LPCWSTR pszFile) PURE;
+    STDMETHOD(ClearReplicas)() PURE;
+    STDMETHOD(SetReplicaPolicy)(DWORD dwFlags, LONGLONG llMaxLag) PURE;
+    STDMETHOD(GetReplicaStatus)(long nReplica, HRESULT* phrStatus, LONGLONG* pllLag) PURE;
+
+    // Digests of the output, computed as it is written so the file need
+    // not be read back: the CRC32C of the whole file, and a SHA-256 over the
+    // file in parts divided at each mdat header (see HashSink.h). Not with
+    // rolling output (see SetRollingOutput). Space left over from a larger
+    // existing file, marked as free, is not included. The digests are
+    // available after stop (VFW_E_WRONG_STATE before). pSHA256 is 32 bytes.
+    STDMETHOD(SetHashing)(BOOL bEnable) PURE;
+    STDMETHOD(GetDigests)(DWORD* pCRC32C, BYTE* pSHA256) PURE;
+
+    // The parts that the SHA-256 above is computed from, in file order:
+    // each is a plain SHA-256 of the file's bytes from llStart, so a
+    // reader can check a file against them, and the SHA-256 of their
+    // 32-byte digests concatenated is the file digest. Up to cMax are
+    // returned in pRegions (which may be NULL if cMax is 0), and
+    // *pcRegions is set to the number of parts.
+    STDMETHOD(GetRegionDigests)(long cMax, long* pcRegions, MuxRegionDigest* pRegions) PURE;
+
+    // Seek index sidecar: a sorted table per track of the key frames'
+    // times and file offsets, written when the file is complete (see
+    // SeekIndex.h), so that a server can seek without walking the moov.
+    // If pszFile is NULL, it is written next to the output file as
+    // <file>.kidx (requires a downstream filter supporting IFileSinkFilter).
+    // Not with rolling output (see SetRollingOutput).
+    STDMETHOD(SetSeekIndex)(BOOL bEnable, LPCWSTR pszFile) PURE;
+
+    // If enabled, sample sizes are written as stz2 with 8 or 16-bit fields
+    // (4 for tiny samples) when every size in the track fits, and as stsz
+    // with 32-bit fields otherwise. Off by default: some players support
+    // only stsz.
+    STDMETHOD(SetCompactSizes)(BOOL bEnable) PURE;
+
+    // Index spill file: the sample index tables are held in memory until
+    // the moov is written, so for long recordings, sealed blocks of the
+    // tables can be moved to a temporary file and read back when the file
+    // is closed (see IndexSpill.h). If pszFile is NULL, the file is
+    // <file>.spill next to the output. It is deleted when the movie is
+    // closed.
+    STDMETHOD(SetIndexSpill)(BOOL bEnable, LPCWSTR pszFile) PURE;
+
+    // Asynchronous finalisation: Stop returns once the inputs are
+    // stopped, and the queued data, the moov and the rest of the file
+    // are written by a worker thread, which then sends EC_MUX_FINALISED.
+    // The worker holds its own reference to the output pin's IStream, so
+    // the filter can be paused again at once after connecting it to a new
+    // file writer: a different file means a different downstream filter
+    // instance. Calling SetFileName on the same file writer redirects
+    // the pending moov into the new file, so the writer of the finished
+    // recording must be left alone, accepting IStream writes, until it is
+    // complete; Pause fails with VFW_E_WRONG_STATE while the finaliser
+    // is still writing through the output pin's stream. Set before Pause.
+    STDMETHOD(SetAsyncFinalise)(BOOL bEnable) PURE;
+
+    // phEvent: a manual-reset event owned by the filter, set whenever no
+    // finalisation is in progress. phrResult: the result of the most
+    // recently completed one. Returns S_FALSE while any is in progress.
+    // Either pointer may be NULL.
+    STDMETHOD(GetFinaliseStatus)(HANDLE* phEvent, HRESULT* phrResult) PURE;
+
+    // Progress of each track while running. This (like IMediaSeeking::
+    // GetCurrentPosition) reads values published by the writer, without
+    // waiting for it, so it can be polled at any rate without delaying
+    // the recording. Tracks are numbered from 0 in the order of the
+    // connected input pins. VFW_E_WRONG_STATE when stopped.
+    STDMETHOD(GetTrackProgress)(long nTrack, MuxTrackProgress* pProgress) PURE;
+
+    // Each input pin holds its samples until the chunks they belong to
+    // are written, so it needs enough buffers to cover the interleaving
+    // window. The pool is sized from the media type (the duration of
+    // each buffer) and from what was held in the previous run, and is
+    // re-sized each time the filter is paused from stopped. When the
+    // pool is nearly exhausted, samples are copied to the heap (up to
+    // the size of the pool again) rather than stalling the upstream
+    // filter. Pins are numbered from 0, as in IBaseFilter::EnumPins.
+    STDMETHOD(GetPinMemory)(long nPin, MuxPinMemory* pMemory) PURE;
+
+    // Queue spill file: while one input is stalled, the other tracks
+    // are held back once they are a second ahead of it, and their
+    // queued chunks hold the upstream buffers. With limits set, once a
+    // track's queue holds more than llMaxBytes or spans more than
+    // tMaxDuration (either may be 0), the data of each further chunk is
+    // moved to a temporary file, freeing its buffers, and read back in
+    // order when the chunk is written (see QueueSpill.h). If pszFile is
+    // NULL, the file is <file>.queue next to the output. Both limits 0
+    // disables it. Set before Pause.
+    STDMETHOD(SetQueueSpill)(LONGLONG llMaxBytes, REFERENCE_TIME tMaxDuration, LPCWSTR pszFile) PURE;
+};
@@ -0,0 +1,220 @@
+// MuxEngine.h: portable interface to the mux engine
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// The engine (MovieWriter, TrackWriter and the type handlers) has no
+// dependency on DirectShow. Media types and samples are described by the
+// structures below, and the output is written to an AtomWriter. The
+// DirectShow filter is an adapter that converts media types and samples
+// (MediaTypes.h) and writes through its output pin. Without DirectShow,
+// the engine is used like this:
+//
+//      FileSink file;
+//      file.Create(L"out.mp4");
+//      MovieWriter movie(&file);
+//      TrackWriter* pVideo = movie.MakeTrack(&config);     // for each track
+//      ...
+//      pVideo->Add(&sample);           // interleaves and writes as it goes
+//      ...
+//      pVideo->OnEOS();                // for each track: true when all are written
+//      movie.Close(&tDuration);        // writes the moov
+
+// abstract interface to atom, supported by parent
+// atom or by external container (eg output pin)
+class AtomWriter
+{
+public:
+    virtual ~AtomWriter() {}
+
+    virtual LONGLONG Length() = 0;
+    virtual LONGLONG Position() = 0;
+    virtual HRESULT Replace(LONGLONG pos, const BYTE* pBuffer, long cBytes) = 0;
+    virtual HRESULT Append(const BYTE* pBuffer, long cBytes) = 0;
+
+    // appends the 8-byte header of an atom, whose length is a placeholder
+    // to be replaced when the atom is closed. Containers that only pass
+    // writes on need not distinguish it from other data; those that
+    // watch the output (see HashSink) are told which bytes are headers.
+    virtual HRESULT AppendHeader(const BYTE* pHeader)
+    {
+        return Append(pHeader, 8);
+    }
+
+    // commit written data to stable storage, where the container
+    // supports it. May be called on another thread while writing continues.
+    virtual HRESULT Flush()
+    {
+        return S_OK;
+    }
+};
+
+// rolling output: supplies the container for each new file
+// when the movie is split.
+class SegmentSource
+{
+public:
+    virtual ~SegmentSource() {}
+
+    // start preparing the container for the next file. Must not block.
+    virtual void Prepare() = 0;
+
+    // the prepared container, or NULL if it is not yet ready
+    virtual AtomWriter* Next() = 0;
+
+    // a container returned by Next is no longer used by the movie
+    // (its file is complete, or it was never used)
+    virtual void Release(AtomWriter* pContainer) = 0;
+};
+
+// notified of each chunk written, eg to schedule syncs
+class WriteObserver
+{
+public:
+    virtual ~WriteObserver() {}
+
+    // bKey is set for chunks starting with a key frame
+    virtual void OnWrite(long cBytes, bool bKey) = 0;
+
+    // writing continues in another container (rolling output)
+    virtual void SetTarget(AtomWriter* pTarget) = 0;
+};
+
+// --- samples ---
+
+// one contiguous part of a sample's payload
+struct MuxPiece
+{
+    const BYTE* pData;
+    long cBytes;
+};
+
+// Holds the payload of a sample until the engine has written it. Derive
+// from this to keep the caller's buffer (eg a DirectShow media sample, or
+// a mapped file) alive without copying.
+class MuxBuffer
+{
+public:
+    virtual ~MuxBuffer() {}
+
+    // A type handler that writes the payload in another form (see
+    // TypeHandler::Transform) can describe it as pieces, written in
+    // order, rather than copy it. NULL if the payload is just pData.
+    virtual const MuxPiece* Pieces(long* pcPieces)
+    {
+        *pcPieces = 0;
+        return NULL;
+    }
+};
+typedef smart_ptr<MuxBuffer> MuxBufferPtr;
+
+enum MuxSampleFlags
+{
+    MuxSample_Sync = 1,         // key frame
+    MuxSample_Time = 2,         // tStart and tStop are valid
+    MuxSample_DecodeTime = 4,   // tDecode is valid
+};
+
+// One buffer of media data. A frame may be split across several buffers:
+// the sync flag is on the first and the times on the last.
+// Times are presentation times in 100ns units; the decode order
+// is the order of Add calls. Where the decode time is known (eg from a
+// transport stream DTS) it is used for the sample table as it is;
+// otherwise it is deduced from the presentation times.
+struct MuxSample
+{
+    const BYTE* pData;
+    long cBytes;
+    REFERENCE_TIME tStart;
+    REFERENCE_TIME tStop;
+    REFERENCE_TIME tDecode;
+    DWORD dwFlags;
+
+    // keeps pData valid. If NULL, the engine copies the data.
+    MuxBufferPtr pBuffer;
+
+    MuxSample()
+    : pData(NULL),
+      cBytes(0),
+      tStart(0),
+      tStop(0),
+      tDecode(0),
+      dwFlags(0)
+    {
+    }
+
+    bool IsSync() const
+    {
+        return (dwFlags & MuxSample_Sync) ? true : false;
+    }
+    bool HasTime() const
+    {
+        return (dwFlags & MuxSample_Time) ? true : false;
+    }
+    bool HasDecodeTime() const
+    {
+        return (dwFlags & MuxSample_DecodeTime) ? true : false;
+    }
+};
+
+// --- codec configuration ---
+
+enum MuxCodec
+{
+    MuxCodec_None = 0,
+    MuxCodec_MPEG4Video,        // MPEG-4 part 2 (DivX, Xvid). Config: VOL header, or found in the data
+    MuxCodec_H264,              // length-prefixed NALUs. Config: SPS and PPS, each with a 2-byte length
+    MuxCodec_H264ByteStream,    // start-code NALUs. Param sets are found in the data
+    MuxCodec_Uncompressed,      // YUV video identified by fourcc
+    MuxCodec_AAC,               // raw AAC frames. Config: AudioSpecificConfig
+    MuxCodec_PCM,               // little-endian PCM. Config: any WAVEFORMATEX extra bytes
+    MuxCodec_ALaw,
+    MuxCodec_MuLaw,
+    MuxCodec_SampleEntry,       // already muxed, for editing. Config: the stsd sample entry atom;
+                                // fourcc: the handler type ('vide', 'soun'); sampleRate: the media timescale
+};
+
+// Describes the media for one track. The config bytes are
+// copied when the track is created.
+struct MuxCodecConfig
+{
+    DWORD codec;                // MuxCodec
+
+    // video
+    long width;
+    long height;
+    long bitcount;              // uncompressed
+    DWORD fourcc;               // uncompressed: sample description type, eg 'yuv2'
+    REFERENCE_TIME tFrame;      // average frame duration, or 0 if not known
+    long profile;               // H264
+    long level;                 // H264
+    long nalLength;             // H264: size of the NALU length fields
+
+    // audio
+    long sampleRate;
+    long channels;
+    long bitsPerSample;
+    long blockAlign;
+    long bytesPerSec;
+
+    const BYTE* pConfig;
+    long cConfig;
+
+    MuxCodecConfig()
+    {
+        ZeroMemory(this, sizeof(*this));
+    }
+    bool IsVideo() const
+    {
+        return (codec >= MuxCodec_MPEG4Video) && (codec <= MuxCodec_Uncompressed);
+    }
+    bool IsAudio() const
+    {
+        return (codec >= MuxCodec_AAC) && (codec <= MuxCodec_MuLaw);
+    }
+};
@@ -13,8 +13,17 @@
 
 #include "stdafx.h"
 #include "MuxFilter.h"
+#include "MediaTypes.h"
+#include "IndexJournal.h"
+#include "SeekIndex.h"
+#include "IndexSpill.h"
+#include "QueueSpill.h"
 #include <sstream>
 
+#ifdef DEBUG
+static void CheckDigests(IStream* pStream, HashSink* pHash);
+#endif
+
 // --- registration tables ----------------
 
 // filter registration -- these are the types that our
@@ -99,8 +108,29 @@ Mpeg4Mux::CreateInstance(LPUNKNOWN pUnk, HRESULT* phr)
 
 Mpeg4Mux::Mpeg4Mux(LPUNKNOWN pUnk, HRESULT* phr)
 : CBaseFilter(NAME("Mpeg4Mux"), pUnk, &m_csFilter, *m_sudFilter.clsID),
-  m_tWritten(0)
-{
+  m_tWritten(0),
+  m_bJournal(false),
+  m_dwDurability(MuxDurability_None),
+  m_dwDurabilityParam(0),
+  m_llSegmentBytes(0),
+  m_tSegmentDuration(0),
+  m_dwReplicaFlags(0),
+  m_llReplicaLag(default_replica_lag),
+  m_bHash(false),
+  m_bSeekIndex(false),
+  m_bCompactSizes(false),
+  m_bIndexSpill(false),
+  m_llQueueBytes(0),
+  m_tQueueDuration(0),
+  m_bAsyncFinalise(false),
+  m_nRecording(0),
+  m_evFinalised(TRUE),
+  m_cFinalising(0),
+  m_hrFinalised(S_OK)
+{
+    // no finalisation in progress
+    m_evFinalised.Set();
+
     // create output pin and one free input
     m_pOutput = new MuxOutput(this, &m_csFilter, phr);
     CreateInput();
@@ -108,6 +138,9 @@ Mpeg4Mux::Mpeg4Mux(LPUNKNOWN pUnk, HRESULT* phr)
 
 Mpeg4Mux::~Mpeg4Mux()
 {
+    // files still being finalised are completed first
+    ReapFinalisers(true);
+
     delete m_pOutput;
     for (UINT i = 0; i < m_pInputs.size(); i++)
     {
@@ -123,6 +156,10 @@ Mpeg4Mux::NonDelegatingQueryInterface(REFIID iid, void** ppv)
     {
         return GetInterface((IMediaSeeking*) this, ppv);
     }
+    if (iid == __uuidof(IMuxConfig))
+    {
+        return GetInterface((IMuxConfig*) this, ppv);
+    }
 
     return CBaseFilter::NonDelegatingQueryInterface(iid, ppv);
 }
@@ -195,7 +232,8 @@ Mpeg4Mux::OnConnect(int index)
 bool 
 Mpeg4Mux::CanReceive(const CMediaType* pmt)
 {
-    return TypeHandler::CanSupport(pmt);
+    MuxCodecConfig config;
+    return ConfigFromMediaType(pmt, &config);
 }
 
 TrackWriter* 
@@ -203,7 +241,12 @@ Mpeg4Mux::MakeTrack(int index, const CMediaType* pmt)
 {
     CAutoLock lock(&m_csTracks);
     UNREFERENCED_PARAMETER(index);
-    return m_pMovie->MakeTrack(pmt);
+    MuxCodecConfig config;
+    if (!ConfigFromMediaType(pmt, &config))
+    {
+        return NULL;
+    }
+    return m_pMovie->MakeTrack(&config);
 }
 
 void 
@@ -219,6 +262,11 @@ Mpeg4Mux::Stop()
     HRESULT hr = S_OK;
     if (m_State != State_Stopped)
     {
+        {
+            CAutoLock lock(&m_csProgress);
+            m_pProgress = NULL;
+        }
+
         // ensure that queue-writing is stopped
         if (m_pMovie)
         {
@@ -231,18 +279,53 @@ Mpeg4Mux::Stop()
         // stop all input pins
         hr = CBaseFilter::Stop();
 
+        if (m_pMovie && m_pStream)
+        {
+            // the rest is done on a worker thread
+            FinaliseAsync();
+            return hr;
+        }
+
         if (m_pMovie)
         {
             // write all queued data
             m_pMovie->WriteOnStop();
 
             // write all metadata
-            hr = m_pMovie->Close(&m_tWritten);
-            m_pMovie = NULL;
+            REFERENCE_TIME tWritten = 0;
+            hr = m_pMovie->Close(&tWritten);
+            {
+                CAutoLock lock(&m_csProgress);
+                m_tWritten = tWritten;
+            }
+            if (m_pHash)
+            {
+                m_pHash->Close();
+#ifdef DEBUG
+                CheckDigests(m_pOutput->Stream(), m_pHash);
+#endif
+            }
 
             // fill remaining file space
             m_pOutput->FillSpace();
         }
+        if (m_pSync)
+        {
+            m_pSync->Stop();
+        }
+        if (m_pTee)
+        {
+            // complete the replicas
+            m_pTee->Close();
+        }
+
+        // the movie releases any rolling output files when deleted
+        m_pMovie = NULL;
+        if (m_pRolling)
+        {
+            m_pRolling->Stop();
+            m_pRolling = NULL;
+        }
     }
     return hr;
 }
@@ -253,17 +336,530 @@ Mpeg4Mux::Pause()
 {
     if (m_State == State_Stopped)
     {
+        // the previous recording's finaliser may still be writing to
+        // this downstream filter: two recordings must not share its
+        // stream, so the app waits for EC_MUX_FINALISED (or the
+        // GetFinaliseStatus event) instead. We do not wait here: the
+        // finaliser needs the filter lock to send its event
+        IUnknownPtr pTarget = m_pOutput->Stream();
+        if ((pTarget != NULL) && IsFinalising(pTarget))
+        {
+            return VFW_E_WRONG_STATE;
+        }
+
+        // the replicas, digests, journal and seek index are made for the
+        // pin's file only: they would stop without notice at the first
+        // split, and the replicas would still be reported as up to date
+        if ((m_pSegmentCallback != NULL) &&
+            (!m_Replicas.empty() || m_bHash || m_bJournal || m_bSeekIndex))
+        {
+            return E_INVALIDARG;
+        }
+
         m_pOutput->Reset();
-        m_pMovie = new MovieWriter(m_pOutput);
+        m_nRecording++;
+        AtomWriter* pOutput = m_pOutput;
+        m_pStream = NULL;
+        if (m_bAsyncFinalise)
+        {
+            // the recording writes through a container of its
+            // own, which the finaliser can keep after Stop
+            IStreamPtr pStream = m_pOutput->Stream();
+            if (pStream != NULL)
+            {
+                m_pStream = new StreamSink(pStream);
+                pOutput = m_pStream;
+            }
+        }
+        AtomWriter* pContainer = CreateReplicas(pOutput);
+        m_pHash = NULL;
+        if (m_bHash)
+        {
+            m_pHash = new HashSink(pContainer);
+            pContainer = m_pHash;
+        }
+        m_pMovie = new MovieWriter(pContainer);
+        m_pMovie->SetCompactSizes(m_bCompactSizes);
+        if (m_bJournal)
+        {
+            CreateJournal();
+        }
+        if (m_bSeekIndex)
+        {
+            CreateSeekIndex();
+        }
+        if (m_bIndexSpill)
+        {
+            CreateIndexSpill();
+        }
+        if ((m_llQueueBytes > 0) || (m_tQueueDuration > 0))
+        {
+            CreateQueueSpill();
+        }
+        m_pSync = new SyncScheduler(pContainer, m_dwDurability, m_dwDurabilityParam);
+        if (SUCCEEDED(m_pSync->Start()))
+        {
+            m_pMovie->SetSync(m_pSync);
+        }
+        if (m_pSegmentCallback != NULL)
+        {
+            m_pRolling = new RollingOutput(m_pSegmentCallback);
+            if (SUCCEEDED(m_pRolling->Start()))
+            {
+                m_pMovie->SetRolling(m_pRolling, m_llSegmentBytes, m_tSegmentDuration);
+            }
+        }
+
+        // the input pins make their tracks as they are activated
+        HRESULT hr = CBaseFilter::Pause();
+        CAutoLock lock(&m_csProgress);
+        m_pProgress = m_pMovie;
+        return hr;
     }
     return CBaseFilter::Pause();
 }
+
+void
+Mpeg4Mux::CreateJournal()
+{
+    wstring strJournal = m_strJournal;
+    if (strJournal.empty())
+    {
+        wstring strFile;
+        if (!m_pOutput->GetFileName(&strFile))
+        {
+            DbgLog((LOG_ERROR, 0, "Mux: no output file name for journal"));
+            return;
+        }
+        strJournal = IndexJournal::DefaultPath(strFile.c_str());
+    }
+
+    // the journal is optional: failure to create it does not prevent recording
+    IndexJournal* pJournal = new IndexJournal();
+    if (SUCCEEDED(pJournal->Create(strJournal.c_str())))
+    {
+        m_pMovie->SetJournal(pJournal);
+    }
+    else
+    {
+        delete pJournal;
+    }
+}
+
+void
+Mpeg4Mux::CreateSeekIndex()
+{
+    wstring strSeekIndex = m_strSeekIndex;
+    if (strSeekIndex.empty())
+    {
+        wstring strFile;
+        if (!m_pOutput->GetFileName(&strFile))
+        {
+            DbgLog((LOG_ERROR, 0, "Mux: no output file name for seek index"));
+            return;
+        }
+        strSeekIndex = SeekIndex::DefaultPath(strFile.c_str());
+    }
+
+    // like the journal, optional
+    SeekIndex* pSeekIndex = new SeekIndex();
+    if (SUCCEEDED(pSeekIndex->Create(strSeekIndex.c_str())))
+    {
+        m_pMovie->SetSeekIndex(pSeekIndex);
+    }
+    else
+    {
+        delete pSeekIndex;
+    }
+}
+
+void
+Mpeg4Mux::CreateIndexSpill()
+{
+    wstring strSpill = m_strIndexSpill;
+    if (strSpill.empty())
+    {
+        wstring strFile;
+        if (!m_pOutput->GetFileName(&strFile))
+        {
+            DbgLog((LOG_ERROR, 0, "Mux: no output file name for index spill"));
+            return;
+        }
+        strSpill = IndexSpill::DefaultPath(strFile.c_str());
+    }
+
+    // without it, the index is held in memory as before
+    IndexSpill* pSpill = new IndexSpill();
+    if (SUCCEEDED(pSpill->Create(strSpill.c_str())))
+    {
+        m_pMovie->SetIndexSpill(pSpill);
+    }
+    else
+    {
+        delete pSpill;
+    }
+}
+
+void
+Mpeg4Mux::CreateQueueSpill()
+{
+    wstring strSpill = m_strQueueSpill;
+    if (strSpill.empty())
+    {
+        wstring strFile;
+        if (!m_pOutput->GetFileName(&strFile))
+        {
+            DbgLog((LOG_ERROR, 0, "Mux: no output file name for queue spill"));
+            return;
+        }
+        strSpill = QueueSpill::DefaultPath(strFile.c_str());
+    }
+
+    // without it, the queues are not limited
+    QueueSpill* pSpill = new QueueSpill();
+    if (SUCCEEDED(pSpill->Create(strSpill.c_str())))
+    {
+        m_pMovie->SetQueueSpill(pSpill, m_llQueueBytes, m_tQueueDuration);
+    }
+    else
+    {
+        delete pSpill;
+    }
+}
+
+AtomWriter*
+Mpeg4Mux::CreateReplicas(AtomWriter* pOutput)
+{
+    m_pTee = NULL;
+    if (m_Replicas.size() == 0)
+    {
+        return pOutput;
+    }
+    m_pTee = new TeeSink(pOutput, m_dwReplicaFlags, m_llReplicaLag);
+    for (UINT i = 0; i < m_Replicas.size(); i++)
+    {
+        // a replica that cannot be created fails on its first
+        // write, and is then handled according to the policy
+        FileSink* pFile = new FileSink();
+        HRESULT hr = pFile->Create(m_Replicas[i].c_str());
+        if (FAILED(hr))
+        {
+            DbgLog((LOG_ERROR, 0, TEXT("Mux: cannot create replica 0x%x"), hr));
+        }
+        m_pTee->AddReplica(pFile);
+    }
+    return m_pTee;
+}
+
+STDMETHODIMP
+Mpeg4Mux::SetIndexJournal(BOOL bEnable, LPCWSTR pszFile)
+{
+    CAutoLock lock(&m_csFilter);
+    m_bJournal = bEnable ? true : false;
+    m_strJournal = pszFile ? pszFile : L"";
+    return S_OK;
+}
+
+STDMETHODIMP
+Mpeg4Mux::SetDurability(DWORD dwPolicy, DWORD dwParam)
+{
+    if (dwPolicy > MuxDurability_Keyframe)
+    {
+        return E_INVALIDARG;
+    }
+    CAutoLock lock(&m_csFilter);
+    m_dwDurability = dwPolicy;
+    m_dwDurabilityParam = dwParam;
+    return S_OK;
+}
+
+STDMETHODIMP
+Mpeg4Mux::GetDurabilityStats(MuxDurabilityStats* pStats)
+{
+    if (pStats == NULL)
+    {
+        return E_POINTER;
+    }
+    CAutoLock lock(&m_csFilter);
+    if (m_pSync)
+    {
+        m_pSync->GetStats(pStats);
+    }
+    else
+    {
+        ZeroMemory(pStats, sizeof(MuxDurabilityStats));
+        pStats->dwPolicy = m_dwDurability;
+        pStats->dwParam = m_dwDurabilityParam;
+    }
+    return S_OK;
+}
+
+STDMETHODIMP
+Mpeg4Mux::AddReplica(LPCWSTR pszFile)
+{
+    if (pszFile == NULL)
+    {
+        return E_POINTER;
+    }
+    CAutoLock lock(&m_csFilter);
+    m_Replicas.push_back(pszFile);
+    return S_OK;
+}
+
+STDMETHODIMP
+Mpeg4Mux::ClearReplicas()
+{
+    CAutoLock lock(&m_csFilter);
+    m_Replicas.clear();
+    return S_OK;
+}
+
+STDMETHODIMP
+Mpeg4Mux::SetReplicaPolicy(DWORD dwFlags, LONGLONG llMaxLag)
+{
+    if (llMaxLag <= 0)
+    {
+        return E_INVALIDARG;
+    }
+    CAutoLock lock(&m_csFilter);
+    m_dwReplicaFlags = dwFlags;
+    m_llReplicaLag = llMaxLag;
+    return S_OK;
+}
+
+STDMETHODIMP
+Mpeg4Mux::GetReplicaStatus(long nReplica, HRESULT* phrStatus, LONGLONG* pllLag)
+{
+    if ((phrStatus == NULL) || (pllLag == NULL))
+    {
+        return E_POINTER;
+    }
+    CAutoLock lock(&m_csFilter);
+    if (!m_pTee || (nReplica < 0) || (nReplica >= m_pTee->Replicas()))
+    {
+        return E_INVALIDARG;
+    }
+    m_pTee->GetStatus(nReplica, phrStatus, pllLag);
+    return S_OK;
+}
+
+STDMETHODIMP
+Mpeg4Mux::SetHashing(BOOL bEnable)
+{
+    CAutoLock lock(&m_csFilter);
+    m_bHash = bEnable ? true : false;
+    return S_OK;
+}
+
+STDMETHODIMP
+Mpeg4Mux::GetDigests(DWORD* pCRC32C, BYTE* pSHA256)
+{
+    if ((pCRC32C == NULL) || (pSHA256 == NULL))
+    {
+        return E_POINTER;
+    }
+    CAutoLock lock(&m_csFilter);
+    if (!m_pHash)
+    {
+        return VFW_E_WRONG_STATE;
+    }
+    return m_pHash->GetDigests(pCRC32C, pSHA256);
+}
+
+STDMETHODIMP
+Mpeg4Mux::GetRegionDigests(long cMax, long* pcRegions, MuxRegionDigest* pRegions)
+{
+    if ((pcRegions == NULL) || ((pRegions == NULL) && (cMax > 0)))
+    {
+        return E_POINTER;
+    }
+    CAutoLock lock(&m_csFilter);
+    if (!m_pHash)
+    {
+        return VFW_E_WRONG_STATE;
+    }
+    vector<HashSink::RegionDigest> regions;
+    HRESULT hr = m_pHash->GetRegionDigests(&regions);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+    *pcRegions = (long)regions.size();
+    for (long i = 0; (i < cMax) && (i < (long)regions.size()); i++)
+    {
+        pRegions[i].llStart = regions[i].pos;
+        pRegions[i].llLength = regions[i].cBytes;
+        CopyMemory(pRegions[i].sha256, regions[i].digest, sizeof(pRegions[i].sha256));
+    }
+    return S_OK;
+}
+
+STDMETHODIMP
+Mpeg4Mux::SetSeekIndex(BOOL bEnable, LPCWSTR pszFile)
+{
+    CAutoLock lock(&m_csFilter);
+    m_bSeekIndex = bEnable ? true : false;
+    m_strSeekIndex = pszFile ? pszFile : L"";
+    return S_OK;
+}
+
+STDMETHODIMP
+Mpeg4Mux::SetCompactSizes(BOOL bEnable)
+{
+    CAutoLock lock(&m_csFilter);
+    m_bCompactSizes = bEnable ? true : false;
+    return S_OK;
+}
+
+STDMETHODIMP
+Mpeg4Mux::SetIndexSpill(BOOL bEnable, LPCWSTR pszFile)
+{
+    CAutoLock lock(&m_csFilter);
+    m_bIndexSpill = bEnable ? true : false;
+    m_strIndexSpill = pszFile ? pszFile : L"";
+    return S_OK;
+}
+
+STDMETHODIMP
+Mpeg4Mux::SetQueueSpill(LONGLONG llMaxBytes, REFERENCE_TIME tMaxDuration, LPCWSTR pszFile)
+{
+    if ((llMaxBytes < 0) || (tMaxDuration < 0))
+    {
+        return E_INVALIDARG;
+    }
+    CAutoLock lock(&m_csFilter);
+    m_llQueueBytes = llMaxBytes;
+    m_tQueueDuration = tMaxDuration;
+    m_strQueueSpill = pszFile ? pszFile : L"";
+    return S_OK;
+}
+
+STDMETHODIMP
+Mpeg4Mux::SetAsyncFinalise(BOOL bEnable)
+{
+    CAutoLock lock(&m_csFilter);
+    m_bAsyncFinalise = bEnable ? true : false;
+    return S_OK;
+}
+
+STDMETHODIMP
+Mpeg4Mux::GetFinaliseStatus(HANDLE* phEvent, HRESULT* phrResult)
+{
+    CAutoLock lock(&m_csFinalise);
+    if (phEvent)
+    {
+        *phEvent = m_evFinalised;
+    }
+    if (phrResult)
+    {
+        *phrResult = m_hrFinalised;
+    }
+    return (m_cFinalising > 0) ? S_FALSE : S_OK;
+}
+
+STDMETHODIMP
+Mpeg4Mux::GetTrackProgress(long nTrack, MuxTrackProgress* pProgress)
+{
+    if (pProgress == NULL)
+    {
+        return E_POINTER;
+    }
+    CAutoLock lock(&m_csProgress);
+    if (m_pProgress == NULL)
+    {
+        return VFW_E_WRONG_STATE;
+    }
+    if ((nTrack < 0) || (nTrack >= m_pProgress->TrackCount()))
+    {
+        return E_INVALIDARG;
+    }
+    TrackProgress progress = m_pProgress->Track(nTrack)->Progress();
+    pProgress->tWritten = progress.tWritten;
+    pProgress->llWritten = progress.llWritten;
+    pProgress->cChunksWritten = progress.cChunksWritten;
+    pProgress->cChunksQueued = progress.cChunksQueued;
+    pProgress->llQueued = progress.llQueued;
+    pProgress->cChunksSpilled = progress.cChunksSpilled;
+    pProgress->llSpilled = progress.llSpilled;
+    return S_OK;
+}
+
+STDMETHODIMP
+Mpeg4Mux::GetPinMemory(long nPin, MuxPinMemory* pMemory)
+{
+    if (pMemory == NULL)
+    {
+        return E_POINTER;
+    }
+    CAutoLock lock(&m_csFilter);
+    if ((nPin < 0) || (nPin >= (long)m_pInputs.size()))
+    {
+        return E_INVALIDARG;
+    }
+    m_pInputs[nPin]->Memory()->Report(pMemory);
+    return S_OK;
+}
+
+STDMETHODIMP
+Mpeg4Mux::SetRollingOutput(IMuxSegmentCallback* pCallback, LONGLONG llMaxBytes, REFERENCE_TIME tMaxDuration)
+{
+    if ((pCallback != NULL) && (llMaxBytes <= 0) && (tMaxDuration <= 0))
+    {
+        return E_INVALIDARG;
+    }
+    CAutoLock lock(&m_csFilter);
+    m_pSegmentCallback = pCallback;
+    m_llSegmentBytes = llMaxBytes;
+    m_tSegmentDuration = tMaxDuration;
+    return S_OK;
+}
+
 // ------- input pin -------------------------------------------------------
 
+// keeps a sample's data until the engine has written it -- in a media
+// sample (the source's or one of our copies) or a copy on the heap --
+// and counts it against the pin
+class HeldBuffer : public MuxBuffer
+{
+public:
+    HeldBuffer(const smart_ptr<PinMemory>& pMemory, IMediaSample* pSample, long cbSample)
+    : m_pMemory(pMemory),
+      m_pSample(pSample),
+      m_cbBuffer(pSample->GetSize()),
+      m_bHeap(false)
+    {
+        m_pMemory->OnHold(m_cbBuffer, cbSample, false);
+    }
+    HeldBuffer(const smart_ptr<PinMemory>& pMemory, long cbSample)
+    : m_pMemory(pMemory),
+      m_pHeap(new BYTE[cbSample]),
+      m_cbBuffer(cbSample),
+      m_bHeap(true)
+    {
+        m_pMemory->OnHold(m_cbBuffer, cbSample, true);
+    }
+    ~HeldBuffer()
+    {
+        m_pMemory->OnRelease(m_cbBuffer, m_bHeap);
+    }
+    BYTE* Heap()
+    {
+        return m_pHeap;
+    }
+private:
+    smart_ptr<PinMemory> m_pMemory;
+    IMediaSamplePtr m_pSample;
+    smart_array<BYTE> m_pHeap;
+    long m_cbBuffer;
+    bool m_bHeap;
+};
+
 MuxInput::MuxInput(Mpeg4Mux* pFilter, CCritSec* pLock, HRESULT* phr, LPCWSTR pName, int index)
 : m_pMux(pFilter),
   m_index(index),
   m_pTrack(NULL),
+  m_bOwnAllocator(false),
+  m_pMemory(new PinMemory),
   CBaseInputPin(NAME("MuxInput"), pFilter, pLock, phr, pName)
 {
     ZeroMemory(&m_StreamInfo, sizeof(m_StreamInfo));
@@ -302,71 +898,175 @@ MuxInput::Receive(IMediaSample* pSample)
         return E_FAIL;
     }
 
-    if (ShouldDiscard(pSample))
+    MuxSample sample;
+    SampleFromMediaSample(pSample, &sample, false);
+    if (ShouldDiscard(&sample))
+    {
+        return S_OK;
+    }
+    hr = Hold(pSample, &sample, true);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    return m_pTrack->Add(&sample);
+}
+
+// A batch from upstream is added to the track in one call: the track
+// queues it under one lock, with at most one interleaving pass, where
+// Receive takes both for each sample. Stream control is evaluated per
+// sample only while a start or stop is pending or samples are being
+// discarded.
+STDMETHODIMP
+MuxInput::ReceiveMultiple(IMediaSample** pSamples, long nSamples, long* nSamplesProcessed)
+{
+    if ((pSamples == NULL) || (nSamplesProcessed == NULL))
     {
-        return S_OK;
+        return E_POINTER;
     }
-    if (m_pCopyAlloc)
+    CAutoLock lock(&m_csStreamControl);
+    *nSamplesProcessed = 0;
+
+    const DWORD dwControl = AM_STREAM_INFO_DISCARDING | AM_STREAM_INFO_START_DEFINED | AM_STREAM_INFO_STOP_DEFINED;
+    vector<MuxSample> batch;
+    batch.reserve(nSamples);
+    HRESULT hr = S_OK;
+    long n;
+    for (n = 0; n < nSamples; n++)
     {
-        IMediaSamplePtr pOurs;
-        hr = m_pCopyAlloc->GetBuffer(&pOurs, NULL, NULL, 0);
-        if (SUCCEEDED(hr))
+        hr = CBaseInputPin::Receive(pSamples[n]);
+        if (hr != S_OK)
         {
-            hr = CopySample(pSample, pOurs);
+            break;
         }
-        if (SUCCEEDED(hr))
+        if (!m_pTrack)
         {
-            hr = m_pTrack->Add(pOurs);
+            hr = E_FAIL;
+            break;
         }
-        return hr;
+
+        MuxSample sample;
+        SampleFromMediaSample(pSamples[n], &sample, false);
+        if ((m_StreamInfo.dwFlags & dwControl) && ShouldDiscard(&sample))
+        {
+            continue;
+        }
+        hr = Hold(pSamples[n], &sample, false);
+        if (hr == S_FALSE)
+        {
+            hr = AddBatch(&batch);
+            if (FAILED(hr))
+            {
+                // the batch is dropped: only the samples before it count
+                return hr;
+            }
+            *nSamplesProcessed = n;
+            hr = Hold(pSamples[n], &sample, true);
+        }
+        if (FAILED(hr))
+        {
+            break;
+        }
+        batch.push_back(sample);
     }
 
-    return m_pTrack->Add(pSample);
+    HRESULT hrAdd = AddBatch(&batch);
+    if (FAILED(hrAdd))
+    {
+        // *nSamplesProcessed is still the count queued before this batch
+        return hrAdd;
+    }
+    *nSamplesProcessed = n;
+    return hr;
 }
 
-// copy the input buffer to the output
 HRESULT
-MuxInput::CopySample(IMediaSample* pIn, IMediaSample* pOut)
+MuxInput::AddBatch(vector<MuxSample>* pBatch)
 {
-    BYTE* pDest;
-    pOut->GetPointer(&pDest);
-    BYTE* pSrc;
-    pIn->GetPointer(&pSrc);
-
-    long cOut = pOut->GetSize();
-    long cIn = pIn->GetActualDataLength();
-    if (cIn > cOut)
+    if (pBatch->empty())
     {
-        return VFW_E_BUFFER_OVERFLOW;
+        return S_OK;
     }
-    
-    
-    CopyMemory(pDest, pSrc, cIn);
-    pOut->SetActualDataLength(cIn);
+    HRESULT hr = m_pTrack->Add(&(*pBatch)[0], (long)pBatch->size());
+    pBatch->clear();
+    return hr;
+}
 
-    REFERENCE_TIME tStart, tEnd;
-    if (SUCCEEDED(pIn->GetTime(&tStart, &tEnd)))
+// Sets the buffer that keeps the sample's data until it is written: the
+// input buffer, or a copy in one of ours if the source has too few.
+// When the pool is all but exhausted, or a sample is too large for our
+// buffers, the data is copied to the heap instead (within a limit), so
+// that the source is not stalled; the next run's pool is sized to
+// avoid it. S_FALSE if the sample could only be kept by waiting for a
+// buffer and bWait is false.
+HRESULT
+MuxInput::Hold(IMediaSample* pSample, MuxSample* pOut, bool bWait)
+{
+    if (!m_pCopyAlloc)
     {
-        pOut->SetTime(&tStart, &tEnd);
+        if (m_pMemory->PoolFull() && m_pMemory->CanCopyToHeap(pOut->cBytes))
+        {
+            return CopyToHeap(pOut);
+        }
+        pOut->pBuffer = new HeldBuffer(m_pMemory, pSample, pOut->cBytes);
+        return S_OK;
     }
 
-    if (SUCCEEDED(pIn->GetMediaTime(&tStart, &tEnd)))
+    // our buffers are only freed as queued chunks are written, so
+    // never wait for one while holding copies that are not queued
+    IMediaSamplePtr pOurs;
+    HRESULT hr = m_pCopyAlloc->GetBuffer(&pOurs, NULL, NULL, AM_GBF_NOWAIT);
+    if (hr == VFW_E_TIMEOUT)
     {
-        pOut->SetMediaTime(&tStart, &tEnd);
+        if (m_pMemory->CanCopyToHeap(pOut->cBytes))
+        {
+            return CopyToHeap(pOut);
+        }
+        if (!bWait)
+        {
+            return S_FALSE;
+        }
+        hr = m_pCopyAlloc->GetBuffer(&pOurs, NULL, NULL, 0);
     }
-
-    if (pIn->IsSyncPoint() == S_OK)
+    if (FAILED(hr))
     {
-        pOut->SetSyncPoint(true);
+        return hr;
     }
-    if (pIn->IsDiscontinuity() == S_OK)
+    if (pOut->cBytes > pOurs->GetSize())
     {
-        pOut->SetDiscontinuity(true);
+        return CopyToHeap(pOut);
     }
-    if (pIn->IsPreroll() == S_OK)
+    return CopySample(pOut, pOurs);
+}
+
+// copy the input buffer into one of ours
+HRESULT
+MuxInput::CopySample(MuxSample* pSample, IMediaSample* pOut)
+{
+    BYTE* pDest;
+    pOut->GetPointer(&pDest);
+    if (pSample->cBytes > pOut->GetSize())
     {
-        pOut->SetPreroll(true);
+        return VFW_E_BUFFER_OVERFLOW;
     }
+    CopyMemory(pDest, pSample->pData, pSample->cBytes);
+    pOut->SetActualDataLength(pSample->cBytes);
+
+    // the sample now refers to our copy
+    pSample->pData = pDest;
+    pSample->pBuffer = new HeldBuffer(m_pMemory, pOut, pSample->cBytes);
+    return S_OK;
+}
+
+// copy the input buffer to the heap, outside the pool
+HRESULT
+MuxInput::CopyToHeap(MuxSample* pSample)
+{
+    HeldBuffer* pHeld = new HeldBuffer(m_pMemory, pSample->cBytes);
+    CopyMemory(pHeld->Heap(), pSample->pData, pSample->cBytes);
+    pSample->pData = pHeld->Heap();
+    pSample->pBuffer = pHeld;
     return S_OK;
 }
 
@@ -407,6 +1107,8 @@ MuxInput::Active()
     HRESULT hr = CBaseInputPin::Active();
     if (SUCCEEDED(hr))
     {
+        ResizeBuffers();
+        m_pMemory->NewRun();
         if (m_pCopyAlloc)
         {
             m_pCopyAlloc->Commit();
@@ -417,6 +1119,30 @@ MuxInput::Active()
     return hr;
 }
 
+// Re-sizes our pool before each run, from the buffers held in the last
+// one. Not possible while buffers are still held (after a stop with
+// asynchronous finalisation), or if the source uses its own allocator
+// with enough buffers; the pool is left as it is.
+void
+MuxInput::ResizeBuffers()
+{
+    IMemAllocator* pPool = m_pCopyAlloc;
+    if ((pPool == NULL) && m_bOwnAllocator)
+    {
+        pPool = m_pAllocator;
+    }
+    if (pPool == NULL)
+    {
+        return;
+    }
+    ALLOCATOR_PROPERTIES prop = m_pMemory->Request();
+    ALLOCATOR_PROPERTIES propActual;
+    if (SUCCEEDED(pPool->SetProperties(&prop, &propActual)))
+    {
+        m_pMemory->SetPool(propActual.cBuffers, propActual.cbBuffer, (m_pCopyAlloc != NULL));
+    }
+}
+
 HRESULT 
 MuxInput::Inactive()
 {
@@ -462,7 +1188,7 @@ MuxInput::GetAllocator(IMemAllocator** ppAllocator)
     CAutoLock lock(m_pLock);
 
     HRESULT hr = S_OK;
-    MuxAllocator* pAlloc = new MuxAllocator(NULL, &hr, &m_mt);
+    MuxAllocator* pAlloc = new MuxAllocator(NULL, &hr, &m_mt, m_pMemory, false);
     if (!pAlloc)
     {
         return E_OUTOFMEMORY;
@@ -478,15 +1204,23 @@ MuxInput::NotifyAllocator(IMemAllocator* pAlloc, BOOL bReadOnly)
     ALLOCATOR_PROPERTIES propAlloc;
     pAlloc->GetProperties(&propAlloc);
 
-    if (propAlloc.cBuffers < 20)
+    // GetAllocator leaves the allocator it made in m_pAllocator
+    m_bOwnAllocator = (pAlloc == m_pAllocator);
+    m_pCopyAlloc = NULL;
+    if (propAlloc.cBuffers < PinMemory::min_buffers)
     {
-        // too few buffers -- we need to copy
+        // too few buffers -- we need to copy. Our pool is sized
+        // from the source's buffers
         HRESULT hr = S_OK;
-        m_pCopyAlloc = new MuxAllocator(NULL, &hr, &m_mt);
-        propAlloc.cBuffers = 100;
+        m_pCopyAlloc = new MuxAllocator(NULL, &hr, &m_mt, m_pMemory, true);
         ALLOCATOR_PROPERTIES propActual;
-        m_pCopyAlloc->SetProperties(&propAlloc, &propActual);
+        hr = m_pCopyAlloc->SetProperties(&propAlloc, &propActual);
+        if (SUCCEEDED(hr))
+        {
+            propAlloc = propActual;
+        }
     }
+    m_pMemory->SetPool(propAlloc.cBuffers, propAlloc.cbBuffer, (m_pCopyAlloc != NULL));
     return __super::NotifyAllocator(pAlloc, bReadOnly);
 }
     
@@ -554,16 +1288,14 @@ MuxInput::GetInfo(AM_STREAM_INFO* pInfo)
 
     
 bool 
-MuxInput::ShouldDiscard(IMediaSample* pSample)
+MuxInput::ShouldDiscard(MuxSample* pSample)
 {
-    CAutoLock lock(&m_csStreamControl);
     if (m_StreamInfo.dwFlags & AM_STREAM_INFO_DISCARDING)
     {
         if (m_StreamInfo.dwFlags & AM_STREAM_INFO_START_DEFINED)
         {
-            REFERENCE_TIME tStart, tStop;
-            if ((pSample->GetTime(&tStart, &tStop) == S_OK) &&
-                (tStop > m_StreamInfo.tStart))
+            if (pSample->HasTime() &&
+                (pSample->tStop > m_StreamInfo.tStart))
             {
                 m_StreamInfo.dwFlags &= ~(AM_STREAM_INFO_DISCARDING | AM_STREAM_INFO_START_DEFINED);
                 if (m_StreamInfo.dwStartCookie)
@@ -571,7 +1303,7 @@ MuxInput::ShouldDiscard(IMediaSample* pSample)
                     m_pMux->NotifyEvent(EC_STREAM_CONTROL_STARTED, (LONG_PTR) this, m_StreamInfo.dwStartCookie);
                     m_StreamInfo.dwStartCookie = 0;
                 }
-                if ((tStart < m_StreamInfo.tStart) && m_pTrack->Handler()->CanTruncate())
+                if ((pSample->tStart < m_StreamInfo.tStart) && m_pTrack->Handler()->CanTruncate())
                 {
                     m_pTrack->Handler()->Truncate(pSample, m_StreamInfo.tStart);
                 }
@@ -582,12 +1314,11 @@ MuxInput::ShouldDiscard(IMediaSample* pSample)
     {
         if (m_StreamInfo.dwFlags & AM_STREAM_INFO_STOP_DEFINED)
         {
-            REFERENCE_TIME tStart, tStop;
-            if (pSample->GetTime(&tStart, &tStop) == S_OK)
+            if (pSample->HasTime())
             {
-                DbgLog((LOG_TRACE, 0, "Pending stop %d ms, sample %d", long(m_StreamInfo.tStop/10000), long(tStart/10000)));
+                DbgLog((LOG_TRACE, 0, "Pending stop %d ms, sample %d", long(m_StreamInfo.tStop/10000), long(pSample->tStart/10000)));
 
-                if (tStart >= m_StreamInfo.tStop)
+                if (pSample->tStart >= m_StreamInfo.tStop)
                 {
                     m_StreamInfo.dwFlags |= AM_STREAM_INFO_DISCARDING;
                     m_StreamInfo.dwFlags &= ~(AM_STREAM_INFO_STOP_DEFINED);
@@ -606,25 +1337,204 @@ MuxInput::ShouldDiscard(IMediaSample* pSample)
 // ----------------------
 
 
-MuxAllocator::MuxAllocator(LPUNKNOWN pUnk, HRESULT* phr, const CMediaType* pmt)
+PinMemory::PinMemory()
+: m_cBuffers(0),
+  m_cbBuffer(0),
+  m_bCopying(false),
+  m_cHeld(0),
+  m_cbHeld(0),
+  m_cHeap(0),
+  m_cbHeap(0),
+  m_cPeakHeld(0),
+  m_cHeapCopies(0),
+  m_cbMaxSample(0)
+{
+    ZeroMemory(&m_Request, sizeof(m_Request));
+}
+
+void
+PinMemory::OnHold(long cbBuffer, long cbSample, bool bHeap)
+{
+    long cHeld = InterlockedIncrement(&m_cHeld);
+    InterlockedExchangeAdd(&m_cbHeld, cbBuffer);
+    if (bHeap)
+    {
+        InterlockedIncrement(&m_cHeap);
+        InterlockedExchangeAdd(&m_cbHeap, cbBuffer);
+        m_cHeapCopies++;
+    }
+    if (cHeld > m_cPeakHeld)
+    {
+        m_cPeakHeld = cHeld;
+    }
+    if (cbSample > m_cbMaxSample)
+    {
+        m_cbMaxSample = cbSample;
+    }
+}
+
+void
+PinMemory::OnRelease(long cbBuffer, bool bHeap)
+{
+    if (bHeap)
+    {
+        InterlockedExchangeAdd(&m_cbHeap, -cbBuffer);
+        InterlockedDecrement(&m_cHeap);
+    }
+    InterlockedExchangeAdd(&m_cbHeld, -cbBuffer);
+    InterlockedDecrement(&m_cHeld);
+}
+
+// the time covered by one buffer of cbSample bytes, or 0 if not known
+//static
+REFERENCE_TIME
+PinMemory::BufferDuration(const CMediaType* pmt, long cbSample)
+{
+    MuxCodecConfig config;
+    if (!ConfigFromMediaType(pmt, &config))
+    {
+        return 0;
+    }
+    if (config.IsVideo())
+    {
+        return config.tFrame;
+    }
+    if ((config.codec == MuxCodec_AAC) && (config.sampleRate > 0))
+    {
+        // one frame of 1024 samples per buffer
+        return (1024 * UNITS) / config.sampleRate;
+    }
+    if (config.IsAudio() && (config.bytesPerSec > 0))
+    {
+        return (cbSample * UNITS) / config.bytesPerSec;
+    }
+    return 0;
+}
+
+// an estimate of the largest compressed frame from the bitrate, or 0
+//static
+long
+PinMemory::FrameSize(const CMediaType* pmt)
+{
+    // dwBitRate is at the same offset in VIDEOINFOHEADER and
+    // VIDEOINFOHEADER2, and the MPEG formats begin with one of those
+    if ((*pmt->Type() != MEDIATYPE_Video) ||
+        (pmt->FormatLength() < sizeof(VIDEOINFOHEADER)) ||
+        ((*pmt->FormatType() != FORMAT_VideoInfo) &&
+         (*pmt->FormatType() != FORMAT_VideoInfo2) &&
+         (*pmt->FormatType() != FORMAT_MPEGVideo) &&
+         (*pmt->FormatType() != FORMAT_MPEG2Video)))
+    {
+        return 0;
+    }
+    const VIDEOINFOHEADER* pvi = (const VIDEOINFOHEADER*)pmt->Format();
+    if ((pvi->dwBitRate == 0) || (pvi->AvgTimePerFrame <= 0))
+    {
+        return 0;
+    }
+    LONGLONG cbFrame = (LONGLONG(pvi->dwBitRate / 8) * pvi->AvgTimePerFrame) / UNITS;
+    return long(cbFrame * key_frame_ratio);
+}
+
+void
+PinMemory::SizePool(const CMediaType* pmt, ALLOCATOR_PROPERTIES* pProp, bool bCopy)
+{
+    m_Request = *pProp;
+
+    // enough buffers to cover the window, with a margin for
+    // samples shorter than expected
+    long cbSample = (m_cbMaxSample > 0) ? m_cbMaxSample : pProp->cbBuffer;
+    REFERENCE_TIME tBuffer = BufferDuration(pmt, cbSample);
+    long cBuffers = default_buffers;
+    if (tBuffer > 0)
+    {
+        cBuffers = long(MovieWriter::BufferWindow() / tBuffer);
+        cBuffers += (cBuffers / 4) + reserve_buffers;
+    }
+
+    // and as many as the interleaving actually held last time
+    cBuffers = max(cBuffers, m_cPeakHeld + reserve_buffers);
+    cBuffers = min(max(cBuffers, (long)min_buffers), (long)max_buffers);
+    pProp->cBuffers = max(pProp->cBuffers, cBuffers);
+
+    // a copy need only be as large as the samples, not the source's
+    // buffers: anything larger goes to the heap
+    if (bCopy)
+    {
+        long cbCopy = FrameSize(pmt);
+        if (m_cbMaxSample > 0)
+        {
+            cbCopy = m_cbMaxSample + (m_cbMaxSample / 4);
+        }
+        if ((cbCopy > 0) && (cbCopy < pProp->cbBuffer))
+        {
+            pProp->cbBuffer = cbCopy;
+        }
+    }
+}
+
+void
+PinMemory::SetPool(long cBuffers, long cbBuffer, bool bCopying)
+{
+    m_cBuffers = cBuffers;
+    m_cbBuffer = cbBuffer;
+    m_bCopying = bCopying;
+}
+
+bool
+PinMemory::PoolFull()
+{
+    return (m_cHeld - m_cHeap) >= (m_cBuffers - reserve_buffers);
+}
+
+bool
+PinMemory::CanCopyToHeap(long cBytes)
+{
+    // at most the size of the pool again
+    LONGLONG cbLimit = LONGLONG(m_cBuffers) * m_cbBuffer;
+    return (m_cbHeap + cBytes) <= cbLimit;
+}
+
+void
+PinMemory::NewRun()
+{
+    m_cPeakHeld = m_cHeld;
+    m_cHeapCopies = 0;
+}
+
+void
+PinMemory::Report(MuxPinMemory* pReport)
+{
+    pReport->cBuffers = m_cBuffers;
+    pReport->cbBuffer = m_cbBuffer;
+    pReport->bCopying = m_bCopying;
+    pReport->cHeld = m_cHeld;
+    pReport->cbHeld = m_cbHeld;
+    pReport->cPeakHeld = m_cPeakHeld;
+    pReport->cHeapCopies = m_cHeapCopies;
+    pReport->cbMaxSample = m_cbMaxSample;
+}
+
+MuxAllocator::MuxAllocator(LPUNKNOWN pUnk, HRESULT* phr, const CMediaType* pmt, const smart_ptr<PinMemory>& pMemory, bool bCopy)
 : CMemAllocator(NAME("MuxAllocator"), pUnk, phr),
-  m_mt(*pmt)
+  m_mt(*pmt),
+  m_pMemory(pMemory),
+  m_bCopy(bCopy)
 {
 }
 
-// we override this just to increase the requested buffer count
+// we override this just to change the requested buffer count
 STDMETHODIMP 
 MuxAllocator::SetProperties(
         ALLOCATOR_PROPERTIES* pRequest,
         ALLOCATOR_PROPERTIES* pActual)
 {
-    // !! base buffer count on media type size?
-
-    ALLOCATOR_PROPERTIES prop = *pRequest;
-    if (prop.cBuffers < 100)
+    if (pRequest == NULL)
     {
-        prop.cBuffers = 100;
+        return E_POINTER;
     }
+    ALLOCATOR_PROPERTIES prop = *pRequest;
+    m_pMemory->SizePool(&m_mt, &prop, m_bCopy);
     return CMemAllocator::SetProperties(&prop, pActual);
 }
 
@@ -796,10 +1706,75 @@ MuxOutput::Replace(LONGLONG pos, const BYTE* pBuffer, long cBytes)
     return hr;
 }
     
-void 
-MuxOutput::FillSpace()
+#ifdef DEBUG
+// reads the finished file back through the stream and checks the
+// digests computed as it was written: the region digests, and the
+// CRC32C into which each replaced atom length was patched
+static void
+CheckDigests(IStream* pStream, HashSink* pHash)
+{
+    DWORD crc;
+    BYTE digest[SHA256Hash::digest_size];
+    vector<HashSink::RegionDigest> regions;
+    if ((pStream == NULL) ||
+        FAILED(pHash->GetDigests(&crc, digest)) ||
+        FAILED(pHash->GetRegionDigests(&regions)))
+    {
+        return;
+    }
+
+    const long cBuffer = 1024 * 1024;
+    smart_array<BYTE> pBuffer = new BYTE[cBuffer];
+    DWORD crcRead = CRC32C::Init();
+    SHA256Hash file;
+    for (size_t i = 0; i < regions.size(); i++)
+    {
+        LARGE_INTEGER li;
+        li.QuadPart = regions[i].pos;
+        if (FAILED(pStream->Seek(li, STREAM_SEEK_SET, NULL)))
+        {
+            return;
+        }
+        SHA256Hash part;
+        LONGLONG cRemaining = regions[i].cBytes;
+        while (cRemaining > 0)
+        {
+            ULONG cThis = ULONG(min(cRemaining, LONGLONG(cBuffer)));
+            ULONG cActual = 0;
+            if ((pStream->Read(pBuffer, cThis, &cActual) != S_OK) || (cActual != cThis))
+            {
+                DbgLog((LOG_ERROR, 0, "Mux: cannot read back the output to check its digests"));
+                return;
+            }
+            crcRead = CRC32C::Update(crcRead, pBuffer, cThis);
+            part.Update(pBuffer, cThis);
+            cRemaining -= cThis;
+        }
+        BYTE partDigest[SHA256Hash::digest_size];
+        part.Final(partDigest);
+        if (memcmp(partDigest, regions[i].digest, sizeof(partDigest)) != 0)
+        {
+            DbgLog((LOG_ERROR, 0, "Mux: SHA-256 of region at %I64d does not match the file", regions[i].pos));
+            ASSERT(false);
+        }
+        file.Update(regions[i].digest, sizeof(regions[i].digest));
+    }
+    if (CRC32C::Final(crcRead) != crc)
+    {
+        DbgLog((LOG_ERROR, 0, "Mux: CRC32C %08x does not match the file (%08x)", crc, CRC32C::Final(crcRead)));
+        ASSERT(false);
+    }
+    BYTE fileDigest[SHA256Hash::digest_size];
+    file.Final(fileDigest);
+    ASSERT(memcmp(fileDigest, digest, sizeof(digest)) == 0);
+}
+#endif
+
+// marks any space beyond pOut's data in an existing (larger)
+// file as a free atom
+static void
+FillSpace(IStream* pStream, AtomWriter* pOut)
 {
-    IStreamPtr pStream = GetConnected();
     if (pStream != NULL)
     {
         LARGE_INTEGER li0;
@@ -808,22 +1783,237 @@ MuxOutput::FillSpace()
         HRESULT hr = pStream->Seek(li0, STREAM_SEEK_END, &uliEnd);
         if (SUCCEEDED(hr))
         {
-            if (uliEnd.QuadPart > (ULONGLONG) m_llBytes)
+            LONGLONG llBytes = pOut->Length();
+            if (uliEnd.QuadPart > (ULONGLONG) llBytes)
             {
-                LONGLONG free = uliEnd.QuadPart - m_llBytes;
+                LONGLONG free = uliEnd.QuadPart - llBytes;
                 if ((free < 0x7fffffff) && (free >= 8))
                 {
                     // create a free chunk
                     BYTE b[8];
                     WriteLong(long(free), b);
                     WriteLong(DWORD('free'), b+4);
-                    Append(b, 8);
+                    pOut->Append(b, 8);
                 }
             }
         }
     }
 }
 
+void 
+MuxOutput::FillSpace()
+{
+    IStreamPtr pStream = GetConnected();
+    ::FillSpace(pStream, this);
+}
+
+IStreamPtr
+MuxOutput::Stream()
+{
+    CAutoLock lock(&m_csWrite);
+    return m_pIStream;
+}
+
+HRESULT
+MuxOutput::Flush()
+{
+    // ask the file writer to commit to disk. This is called
+    // from the sync thread, so don't hold the write lock while
+    // it completes.
+    IStreamPtr pStream;
+    {
+        CAutoLock lock(&m_csWrite);
+        pStream = m_pIStream;
+    }
+    if (pStream == NULL)
+    {
+        return E_NOINTERFACE;
+    }
+    return pStream->Commit(STGC_DEFAULT);
+}
+
+bool
+MuxOutput::GetFileName(wstring* pstrFile)
+{
+    // ask the downstream filter (eg the file writer)
+    IPin* pPeer = GetConnected();
+    if (pPeer == NULL)
+    {
+        return false;
+    }
+    PIN_INFO info;
+    if (FAILED(pPeer->QueryPinInfo(&info)) || (info.pFilter == NULL))
+    {
+        return false;
+    }
+    IFileSinkFilterPtr pSink = info.pFilter;
+    info.pFilter->Release();
+
+    bool bOK = false;
+    LPOLESTR pszFile = NULL;
+    if ((pSink != NULL) && SUCCEEDED(pSink->GetCurFile(&pszFile, NULL)) && (pszFile != NULL))
+    {
+        *pstrFile = pszFile;
+        CoTaskMemFree(pszFile);
+        bOK = true;
+    }
+    return bOK;
+}
+
+// ---- asynchronous finalisation --------------------------------------
+
+MovieFinaliser::MovieFinaliser(Mpeg4Mux* pMux, long nRecording,
+                               const smart_ptr<MovieWriter>& pMovie,
+                               const smart_ptr<StreamSink>& pStream,
+                               const smart_ptr<HashSink>& pHash,
+                               const smart_ptr<TeeSink>& pTee,
+                               const smart_ptr<SyncScheduler>& pSync,
+                               const smart_ptr<RollingOutput>& pRolling)
+: m_pMux(pMux),
+  m_nRecording(nRecording),
+  m_pMovie(pMovie),
+  m_pStream(pStream),
+  m_pHash(pHash),
+  m_pTee(pTee),
+  m_pSync(pSync),
+  m_pRolling(pRolling),
+  m_bDone(false)
+{
+    // the stream's identity, to check that a new
+    // recording is not started on it too soon
+    m_pTarget = IStreamPtr(m_pStream->Stream());
+}
+
+DWORD
+MovieFinaliser::ThreadProc()
+{
+    Finalise();
+    return 0;
+}
+
+void
+MovieFinaliser::Finalise()
+{
+    // as Mpeg4Mux::Stop does for a synchronous stop
+    REFERENCE_TIME tWritten = 0;
+    m_pMovie->WriteOnStop();
+    HRESULT hr = m_pMovie->Close(&tWritten);
+    if (m_pHash)
+    {
+        m_pHash->Close();
+#ifdef DEBUG
+        CheckDigests(m_pStream->Stream(), m_pHash);
+#endif
+    }
+    FillSpace(m_pStream->Stream(), m_pStream);
+    if (m_pSync)
+    {
+        m_pSync->Stop();
+    }
+    if (m_pTee)
+    {
+        m_pTee->Close();
+    }
+    m_pMovie = NULL;
+    if (m_pRolling)
+    {
+        m_pRolling->Stop();
+        m_pRolling = NULL;
+    }
+
+    // the filter keeps its own references to the
+    // hash, replicas and syncs for their stats
+    m_pHash = NULL;
+    m_pTee = NULL;
+    m_pSync = NULL;
+    m_pStream = NULL;
+
+    m_pMux->OnFinalised(m_nRecording, hr, tWritten);
+    m_bDone = true;
+}
+
+void
+Mpeg4Mux::FinaliseAsync()
+{
+    ReapFinalisers(false);
+
+    smart_ptr<MovieFinaliser> pFinaliser = new MovieFinaliser(this, m_nRecording,
+                                                              m_pMovie, m_pStream, m_pHash,
+                                                              m_pTee, m_pSync, m_pRolling);
+    m_pMovie = NULL;
+    m_pStream = NULL;
+    m_pRolling = NULL;
+    {
+        CAutoLock lock(&m_csFinalise);
+        m_cFinalising++;
+        m_evFinalised.Reset();
+    }
+
+    if (pFinaliser->Create())
+    {
+        m_Finalisers.push_back(pFinaliser);
+    }
+    else
+    {
+        pFinaliser->Finalise();
+    }
+}
+
+void
+Mpeg4Mux::ReapFinalisers(bool bWait)
+{
+    list<smart_ptr<MovieFinaliser> >::iterator it = m_Finalisers.begin();
+    while (it != m_Finalisers.end())
+    {
+        if (bWait || (*it)->IsDone())
+        {
+            (*it)->Close();
+            it = m_Finalisers.erase(it);
+        }
+        else
+        {
+            it++;
+        }
+    }
+}
+
+bool
+Mpeg4Mux::IsFinalising(IUnknown* pStream)
+{
+    ReapFinalisers(false);
+    list<smart_ptr<MovieFinaliser> >::iterator it;
+    for (it = m_Finalisers.begin(); it != m_Finalisers.end(); it++)
+    {
+        if ((*it)->Writes(pStream))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+Mpeg4Mux::OnFinalised(long nRecording, HRESULT hr, REFERENCE_TIME tWritten)
+{
+    {
+        CAutoLock lock(&m_csProgress);
+        m_tWritten = tWritten;
+    }
+    {
+        CAutoLock lock(&m_csFinalise);
+        m_hrFinalised = hr;
+        if (--m_cFinalising == 0)
+        {
+            m_evFinalised.Set();
+        }
+    }
+
+    // the filter lock keeps the graph's event sink
+    // from being released while it is used
+    CAutoLock lock(&m_csFilter);
+    NotifyEvent(EC_MUX_FINALISED, hr, nRecording);
+}
+
 // ---- seeking support ------------------------------------------------
 
 SeekingAggregator::SeekingAggregator(CBaseFilter* pFilter, bool bSetTimeFormat)
@@ -873,7 +2063,8 @@ SeekingAggregator::~SeekingAggregator()
 STDMETHODIMP 
 Mpeg4Mux::GetCurrentPosition(LONGLONG *pCurrent)
 {
-    if (m_pMovie == NULL)
+    CAutoLock lock(&m_csProgress);
+    if (m_pProgress == NULL)
     {
         // return previous total (after Stop)
         *pCurrent = m_tWritten;
@@ -881,7 +2072,7 @@ Mpeg4Mux::GetCurrentPosition(LONGLONG *pCurrent)
         // this is not passed upstream -- we report the 
         // position of the mux. Report the earliest write
         // time of any pin
-        REFERENCE_TIME tCur = m_pMovie->CurrentPosition();
+        REFERENCE_TIME tCur = m_pProgress->CurrentPosition();
         *pCurrent = tCur;
     }
 
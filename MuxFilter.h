@@ -14,6 +14,11 @@
 #pragma once
 
 #include "MovieWriter.h"
+#include "MuxConfig.h"
+#include "SyncScheduler.h"
+#include "RollingOutput.h"
+#include "TeeSink.h"
+#include "HashSink.h"
 
 // forward declarations
 class Mpeg4Mux;
@@ -22,22 +27,93 @@ class MuxOutput;
 class MuxAllocator;
 
 
-// override the standard allocator to 
-// force use of a larger number of buffers. 
-// We use the input buffers to queue the chunks for
-// interleaving, so the input connection must allow
-// us to hold at least 2 seconds of data.
+// The input buffers that one pin holds until their chunks are
+// written, counted so that the pin's buffer pool can be sized from what
+// the interleaving actually needed. Shared with the buffers, which can
+// be released after the pin has gone.
+class PinMemory
+{
+public:
+    PinMemory();
+
+    // a buffer of cbBuffer bytes is held for a sample of cbSample bytes.
+    // bHeap: a copy on the heap, outside the pool. The holds are made on
+    // the streaming thread, and released on the writing thread.
+    void OnHold(long cbBuffer, long cbSample, bool bHeap);
+    void OnRelease(long cbBuffer, bool bHeap);
+
+    // Sizes a pool for this media type: enough buffers to hold the
+    // movie's interleaving window, and at least as many as were held in
+    // the last run. A copy pool's buffers are sized from the largest
+    // sample seen (or the bitrate) rather than the upstream buffers.
+    // The request is kept, so that the pool can be re-sized later.
+    void SizePool(const CMediaType* pmt, ALLOCATOR_PROPERTIES* pProp, bool bCopy);
+    const ALLOCATOR_PROPERTIES& Request()
+    {
+        return m_Request;
+    }
+
+    // the pool that the samples are held in
+    void SetPool(long cBuffers, long cbBuffer, bool bCopying);
+
+    // all of the pool but the upstream filter's reserve is held
+    bool PoolFull();
+
+    // a heap copy of cBytes is within the limit
+    bool CanCopyToHeap(long cBytes);
+
+    // start of a run: the peak and the heap copies are counted per run
+    void NewRun();
+
+    void Report(MuxPinMemory* pReport);
+
+    enum {
+        min_buffers = 20,
+        max_buffers = 2000,
+        default_buffers = 100,  // the duration of a buffer is not known
+        reserve_buffers = 4,    // kept free for the upstream filter
+        key_frame_ratio = 8,    // size of a key frame to the average
+    };
+
+private:
+    static REFERENCE_TIME BufferDuration(const CMediaType* pmt, long cbSample);
+    static long FrameSize(const CMediaType* pmt);
+
+private:
+    ALLOCATOR_PROPERTIES m_Request;
+    long m_cBuffers;
+    long m_cbBuffer;
+    bool m_bCopying;
+
+    volatile long m_cHeld;
+    volatile long m_cbHeld;
+    volatile long m_cHeap;
+    volatile long m_cbHeap;
+
+    // streaming thread only
+    long m_cPeakHeld;
+    long m_cHeapCopies;
+    long m_cbMaxSample;
+};
+
+// Override the standard allocator to size the pool from the media type
+// and the interleaving window (see PinMemory) rather than the upstream
+// filter's request. We use the input buffers to queue the chunks for
+// interleaving, so the input connection must allow us to hold at
+// least the window's worth of data.
 class MuxAllocator : public CMemAllocator
 {
 public:
-    MuxAllocator(LPUNKNOWN pUnk, HRESULT* phr, const CMediaType* pmt);
+    MuxAllocator(LPUNKNOWN pUnk, HRESULT* phr, const CMediaType* pmt, const smart_ptr<PinMemory>& pMemory, bool bCopy);
 
-    // we override this just to increase the requested buffer count
+    // we override this just to change the requested buffer count
     STDMETHODIMP SetProperties(
             ALLOCATOR_PROPERTIES* pRequest,
             ALLOCATOR_PROPERTIES* pActual);
 private:
     CMediaType m_mt;
+    smart_ptr<PinMemory> m_pMemory;
+    bool m_bCopy;
 };
 
 // input pin, receives data corresponding to one
@@ -79,6 +155,7 @@ public:
     
     // input
     STDMETHODIMP Receive(IMediaSample* pSample);
+    STDMETHODIMP ReceiveMultiple(IMediaSample** pSamples, long nSamples, long* nSamplesProcessed);
     STDMETHODIMP EndOfStream();
     STDMETHODIMP BeginFlush();
     STDMETHODIMP EndFlush();
@@ -100,9 +177,19 @@ public:
     STDMETHOD(StopAt)(const REFERENCE_TIME* ptStop, BOOL bSendExtra, DWORD dwCookie);
     STDMETHOD(GetInfo)(AM_STREAM_INFO* pInfo);
 
+    PinMemory* Memory()
+    {
+        return m_pMemory;
+    }
+
 private:
-    bool ShouldDiscard(IMediaSample* pSample);
-    HRESULT CopySample(IMediaSample* pIn, IMediaSample* pOut);
+    // call with m_csStreamControl held
+    bool ShouldDiscard(MuxSample* pSample);
+    HRESULT Hold(IMediaSample* pSample, MuxSample* pOut, bool bWait);
+    HRESULT CopySample(MuxSample* pSample, IMediaSample* pOut);
+    HRESULT CopyToHeap(MuxSample* pSample);
+    HRESULT AddBatch(vector<MuxSample>* pBatch);
+    void ResizeBuffers();
 
 private:
     Mpeg4Mux* m_pMux;
@@ -113,6 +200,8 @@ private:
     AM_STREAM_INFO m_StreamInfo;
 
     IMemAllocatorPtr m_pCopyAlloc;  // private allocator if source has too few buffers
+    bool m_bOwnAllocator;           // the source uses our allocator
+    smart_ptr<PinMemory> m_pMemory;
 };
 
 
@@ -138,11 +227,18 @@ public:
     void UseIStream();
     void FillSpace();
 
+    // the file writer's stream, for a container of our own
+    IStreamPtr Stream();
+
+    // name of the file being written by the downstream filter, if known
+    bool GetFileName(wstring* pstrFile);
+
     // AtomWriter methods
     LONGLONG Length();
     LONGLONG Position();
     HRESULT Replace(LONGLONG pos, const BYTE* pBuffer, long cBytes);
     HRESULT Append(const BYTE* pBuffer, long cBytes);
+    HRESULT Flush();
 private:
     Mpeg4Mux* m_pMux;
     CCritSec m_csWrite;
@@ -151,6 +247,53 @@ private:
     IStreamPtr m_pIStream;
 };
 
+// Completes a stopped recording on a worker thread, for asynchronous
+// finalisation: writes the queued data and the moov, and completes the
+// hash, replicas and syncs, as Stop does otherwise. It holds everything
+// the recording writes through, down to its own container over the
+// output stream, so a new recording can start meanwhile.
+class MovieFinaliser : public CAMThread
+{
+public:
+    MovieFinaliser(Mpeg4Mux* pMux, long nRecording,
+                   const smart_ptr<MovieWriter>& pMovie,
+                   const smart_ptr<StreamSink>& pStream,
+                   const smart_ptr<HashSink>& pHash,
+                   const smart_ptr<TeeSink>& pTee,
+                   const smart_ptr<SyncScheduler>& pSync,
+                   const smart_ptr<RollingOutput>& pRolling);
+
+    // on the worker thread, or on the caller's if it cannot be created
+    void Finalise();
+
+    bool IsDone()
+    {
+        return m_bDone;
+    }
+
+    // true until it is done, if it writes through this stream
+    // (compared as IUnknown)
+    bool Writes(IUnknown* pStream)
+    {
+        return !m_bDone && (m_pTarget == pStream);
+    }
+
+private:
+    DWORD ThreadProc();
+
+private:
+    Mpeg4Mux* m_pMux;
+    long m_nRecording;
+    smart_ptr<MovieWriter> m_pMovie;
+    smart_ptr<StreamSink> m_pStream;
+    smart_ptr<HashSink> m_pHash;
+    smart_ptr<TeeSink> m_pTee;
+    smart_ptr<SyncScheduler> m_pSync;
+    smart_ptr<RollingOutput> m_pRolling;
+    IUnknownPtr m_pTarget;
+    volatile bool m_bDone;
+};
+
 // To pass seeking calls upstream we must try all connected input pins.
 // Where two input pins lead to the same splitter, only one will be
 // allowed to SetTimeFormat at once, so we must call this on all
@@ -187,7 +330,8 @@ private:
 class DECLSPEC_UUID("5FD85181-E542-4e52-8D9D-5D613C30131B")
 Mpeg4Mux 
 : public CBaseFilter,
-  public IMediaSeeking
+  public IMediaSeeking,
+  public IMuxConfig
 {
 public:
     // constructor method used by class factory
@@ -217,6 +361,9 @@ public:
     void OnEOS();
     REFERENCE_TIME Start() { return m_tStart;}
 
+    // called from the finaliser's thread
+    void OnFinalised(long nRecording, HRESULT hr, REFERENCE_TIME tWritten);
+
     // we implement IMediaSeeking to allow encoding
     // of specific portions of an input clip, and
     // to report progress via the current position.
@@ -245,12 +392,50 @@ public:
     STDMETHODIMP GetRate(double * pdRate);
     STDMETHODIMP GetPreroll(LONGLONG * pllPreroll);
 
+// IMuxConfig
+public:
+    STDMETHODIMP SetIndexJournal(BOOL bEnable, LPCWSTR pszFile);
+    STDMETHODIMP SetDurability(DWORD dwPolicy, DWORD dwParam);
+    STDMETHODIMP GetDurabilityStats(MuxDurabilityStats* pStats);
+    STDMETHODIMP SetRollingOutput(IMuxSegmentCallback* pCallback, LONGLONG llMaxBytes, REFERENCE_TIME tMaxDuration);
+    STDMETHODIMP AddReplica(LPCWSTR pszFile);
+    STDMETHODIMP ClearReplicas();
+    STDMETHODIMP SetReplicaPolicy(DWORD dwFlags, LONGLONG llMaxLag);
+    STDMETHODIMP GetReplicaStatus(long nReplica, HRESULT* phrStatus, LONGLONG* pllLag);
+    STDMETHODIMP SetHashing(BOOL bEnable);
+    STDMETHODIMP GetDigests(DWORD* pCRC32C, BYTE* pSHA256);
+    STDMETHODIMP GetRegionDigests(long cMax, long* pcRegions, MuxRegionDigest* pRegions);
+    STDMETHODIMP SetSeekIndex(BOOL bEnable, LPCWSTR pszFile);
+    STDMETHODIMP SetCompactSizes(BOOL bEnable);
+    STDMETHODIMP SetIndexSpill(BOOL bEnable, LPCWSTR pszFile);
+    STDMETHODIMP SetAsyncFinalise(BOOL bEnable);
+    STDMETHODIMP GetFinaliseStatus(HANDLE* phEvent, HRESULT* phrResult);
+    STDMETHODIMP GetTrackProgress(long nTrack, MuxTrackProgress* pProgress);
+    STDMETHODIMP GetPinMemory(long nPin, MuxPinMemory* pMemory);
+    STDMETHODIMP SetQueueSpill(LONGLONG llMaxBytes, REFERENCE_TIME tMaxDuration, LPCWSTR pszFile);
     
 private:
     // construct only via class factory
     Mpeg4Mux(LPUNKNOWN pUnk, HRESULT* phr);
     ~Mpeg4Mux();
 
+    void CreateJournal();
+    void CreateSeekIndex();
+    void CreateIndexSpill();
+    void CreateQueueSpill();
+    AtomWriter* CreateReplicas(AtomWriter* pOutput);
+    void FinaliseAsync();
+
+    // releases the finalisers that are complete, or waits for all
+    void ReapFinalisers(bool bWait);
+
+    // true if a finaliser is still writing through this stream
+    bool IsFinalising(IUnknown* pStream);
+
+    enum {
+        default_replica_lag = 64 * 1024 * 1024,
+    };
+
 private:
     CCritSec m_csFilter;
     CCritSec m_csTracks;
@@ -258,7 +443,52 @@ private:
     vector<MuxInput*> m_pInputs;
     smart_ptr<MovieWriter> m_pMovie;
 
-    // for reporting (via GetCurrentPosition) after completion
+    // the running movie, once all its tracks are made, for the
+    // progress queries. The lock guards only the pointer: the
+    // values read are published without the writer's locks
+    CCritSec m_csProgress;
+    smart_ptr<MovieWriter> m_pProgress;
+
+    // for reporting (via GetCurrentPosition) after completion,
+    // also guarded by m_csProgress
     REFERENCE_TIME m_tWritten;
+
+    // IMuxConfig settings
+    bool m_bJournal;
+    wstring m_strJournal;
+    DWORD m_dwDurability;
+    DWORD m_dwDurabilityParam;
+
+    IMuxSegmentCallbackPtr m_pSegmentCallback;
+    LONGLONG m_llSegmentBytes;
+    REFERENCE_TIME m_tSegmentDuration;
+    vector<wstring> m_Replicas;
+    DWORD m_dwReplicaFlags;
+    LONGLONG m_llReplicaLag;
+    bool m_bHash;
+    bool m_bSeekIndex;
+    wstring m_strSeekIndex;
+    bool m_bCompactSizes;
+    bool m_bIndexSpill;
+    wstring m_strIndexSpill;
+    LONGLONG m_llQueueBytes;
+    REFERENCE_TIME m_tQueueDuration;
+    wstring m_strQueueSpill;
+    bool m_bAsyncFinalise;
+
+    // asynchronous finalisation
+    smart_ptr<StreamSink> m_pStream;    // the running recording's container
+    long m_nRecording;
+    CCritSec m_csFinalise;
+    CAMEvent m_evFinalised;
+    long m_cFinalising;
+    HRESULT m_hrFinalised;
+    list<smart_ptr<MovieFinaliser> > m_Finalisers;
+
+    // kept after stop for stats
+    smart_ptr<SyncScheduler> m_pSync;
+    smart_ptr<RollingOutput> m_pRolling;
+    smart_ptr<TeeSink> m_pTee;
+    smart_ptr<HashSink> m_pHash;
 };
 
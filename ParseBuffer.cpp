@@ -22,6 +22,7 @@ ParseBuffer::~ParseBuffer()
     delete[] m_pData;
 }
 
+#ifdef _WIN32
 bool
 ParseBuffer::FillFromFile(HANDLE hFile)
 {
@@ -35,6 +36,7 @@ ParseBuffer::FillFromFile(HANDLE hFile)
     m_cValid += cActual;
     return (cActual > 0) ? true : false;
 }
+#endif
 
 bool 
 ParseBuffer::Append(const BYTE* pData, long cBytes)
@@ -40,7 +40,9 @@ public:
     }
 
     bool Append(const BYTE* pData, long cBytes);
+#ifdef _WIN32
     bool FillFromFile(HANDLE hFile);
+#endif
     void Consume(long cBytes);
     long Size()
     {
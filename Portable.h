@@ -0,0 +1,318 @@
+// Portable.h: the subset of the Windows and DirectShow base class
+// definitions used by the mux engine, for builds without them.
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#ifndef _WIN32
+
+// system headers that define NULL are included here, before it is redefined below
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+#include <assert.h>
+#include <sys/stat.h>
+
+#include <list>
+#include <vector>
+#include <string>
+using namespace std;
+
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint16_t USHORT;
+typedef uint32_t DWORD;
+typedef uint32_t ULONG;
+typedef unsigned int UINT;
+typedef int BOOL;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef LONGLONG REFERENCE_TIME;
+typedef const wchar_t* LPCWSTR;
+typedef int32_t HRESULT;
+
+// as the Windows headers: smart_ptr uses an int overload for NULL
+#undef NULL
+#define NULL    0
+
+#define TRUE    1
+#define FALSE   0
+
+#define S_OK                    ((HRESULT)0)
+#define S_FALSE                 ((HRESULT)1)
+#define E_FAIL                  ((HRESULT)0x80004005)
+#define E_POINTER               ((HRESULT)0x80004003)
+#define E_INVALIDARG            ((HRESULT)0x80070057)
+#define E_OUTOFMEMORY           ((HRESULT)0x8007000E)
+#define E_UNEXPECTED            ((HRESULT)0x8000FFFF)
+#define VFW_E_WRONG_STATE       ((HRESULT)0x80040227)
+#define VFW_E_BUFFER_OVERFLOW   ((HRESULT)0x8004020D)
+#define VFW_E_TYPE_NOT_ACCEPTED ((HRESULT)0x8004022A)
+#define VFW_E_INVALID_FILE_FORMAT ((HRESULT)0x8004022F)
+#define SUCCEEDED(hr)           (((HRESULT)(hr)) >= 0)
+#define FAILED(hr)              (((HRESULT)(hr)) < 0)
+
+// errno values are reported as win32 errors
+#define HRESULT_FROM_ERRNO(e)   ((HRESULT)(0x80070000 | ((e) & 0xffff)))
+
+#define UNITS                   10000000
+#define INFINITE                0xFFFFFFFF
+#define MAXLONGLONG             (0x7fffffffffffffffLL)
+
+#define ZeroMemory(p, c)        memset((p), 0, (c))
+#define FillMemory(p, c, v)     memset((p), (v), (c))
+#define CopyMemory(d, s, c)     memcpy((d), (s), (c))
+#define MoveMemory(d, s, c)     memmove((d), (s), (c))
+#define UNREFERENCED_PARAMETER(x)   ((void)(x))
+#define UNALIGNED
+
+#ifdef DEBUG
+#define ASSERT(x)               assert(x)
+#else
+#define ASSERT(x)
+#endif
+
+// debug logging is compiled out
+#define LOG_TRACE               1
+#define LOG_ERROR               2
+#define TEXT(s)                 s
+#define DbgLog(x)
+
+inline long InterlockedIncrement(long* p)
+{
+    return __sync_add_and_fetch(p, 1);
+}
+inline long InterlockedDecrement(long* p)
+{
+    return __sync_sub_and_fetch(p, 1);
+}
+inline void MemoryBarrier()
+{
+    __sync_synchronize();
+}
+
+inline DWORD GetTickCount()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return DWORD((ts.tv_sec * 1000) + (ts.tv_nsec / 1000000));
+}
+
+struct RECT
+{
+    long left;
+    long top;
+    long right;
+    long bottom;
+};
+
+inline void SetRect(RECT* prc, long left, long top, long right, long bottom)
+{
+    prc->left = left;
+    prc->top = top;
+    prc->right = right;
+    prc->bottom = bottom;
+}
+
+inline BOOL IsRectEmpty(const RECT* prc)
+{
+    return (prc->right <= prc->left) || (prc->bottom <= prc->top);
+}
+
+inline int lstrlenA(const char* psz)
+{
+    return (int)strlen(psz);
+}
+
+// recursive lock, as the DirectShow base class CCritSec
+class CCritSec
+{
+public:
+    CCritSec()
+    {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&m_mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+    ~CCritSec()
+    {
+        pthread_mutex_destroy(&m_mutex);
+    }
+    void Lock()
+    {
+        pthread_mutex_lock(&m_mutex);
+    }
+    void Unlock()
+    {
+        pthread_mutex_unlock(&m_mutex);
+    }
+private:
+    CCritSec(const CCritSec&);
+    CCritSec& operator=(const CCritSec&);
+
+    pthread_mutex_t m_mutex;
+};
+
+class CAutoLock
+{
+public:
+    CAutoLock(CCritSec* plock)
+    : m_pLock(plock)
+    {
+        m_pLock->Lock();
+    }
+    ~CAutoLock()
+    {
+        m_pLock->Unlock();
+    }
+private:
+    CCritSec* m_pLock;
+};
+
+// event, as the DirectShow base class CAMEvent
+class CAMEvent
+{
+public:
+    CAMEvent(BOOL fManualReset = FALSE)
+    : m_bManual(fManualReset ? true : false),
+      m_bSignalled(false)
+    {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&m_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        pthread_mutex_init(&m_mutex, NULL);
+    }
+    ~CAMEvent()
+    {
+        pthread_cond_destroy(&m_cond);
+        pthread_mutex_destroy(&m_mutex);
+    }
+    void Set()
+    {
+        pthread_mutex_lock(&m_mutex);
+        m_bSignalled = true;
+        if (m_bManual)
+        {
+            pthread_cond_broadcast(&m_cond);
+        }
+        else
+        {
+            pthread_cond_signal(&m_cond);
+        }
+        pthread_mutex_unlock(&m_mutex);
+    }
+    void Reset()
+    {
+        pthread_mutex_lock(&m_mutex);
+        m_bSignalled = false;
+        pthread_mutex_unlock(&m_mutex);
+    }
+    BOOL Wait(DWORD dwTimeout = INFINITE)
+    {
+        timespec tsEnd;
+        clock_gettime(CLOCK_MONOTONIC, &tsEnd);
+        tsEnd.tv_sec += dwTimeout / 1000;
+        tsEnd.tv_nsec += (dwTimeout % 1000) * 1000000;
+        if (tsEnd.tv_nsec >= 1000000000)
+        {
+            tsEnd.tv_sec++;
+            tsEnd.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_lock(&m_mutex);
+        while (!m_bSignalled)
+        {
+            int err = (dwTimeout == INFINITE) ?
+                pthread_cond_wait(&m_cond, &m_mutex) :
+                pthread_cond_timedwait(&m_cond, &m_mutex, &tsEnd);
+            if (err == ETIMEDOUT)
+            {
+                break;
+            }
+        }
+        BOOL bSignalled = m_bSignalled;
+        if (!m_bManual)
+        {
+            m_bSignalled = false;
+        }
+        pthread_mutex_unlock(&m_mutex);
+        return bSignalled;
+    }
+private:
+    CAMEvent(const CAMEvent&);
+    CAMEvent& operator=(const CAMEvent&);
+
+    bool m_bManual;
+    bool m_bSignalled;
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_cond;
+};
+
+// worker thread, as the DirectShow base class CAMThread
+// (without the CallWorker request mechanism)
+class CAMThread
+{
+public:
+    CAMThread()
+    : m_bThread(false)
+    {
+    }
+    virtual ~CAMThread()
+    {
+        Close();
+    }
+    BOOL Create()
+    {
+        if (m_bThread)
+        {
+            return FALSE;
+        }
+        m_bThread = (pthread_create(&m_thread, NULL, InitialThreadProc, this) == 0);
+        return m_bThread;
+    }
+    BOOL ThreadExists()
+    {
+        return m_bThread;
+    }
+    void Close()
+    {
+        if (m_bThread)
+        {
+            pthread_join(m_thread, NULL);
+            m_bThread = false;
+        }
+    }
+    virtual DWORD ThreadProc() = 0;
+
+private:
+    CAMThread(const CAMThread&);
+    CAMThread& operator=(const CAMThread&);
+
+    static void* InitialThreadProc(void* pv)
+    {
+        ((CAMThread*)pv)->ThreadProc();
+        return NULL;
+    }
+
+    bool m_bThread;
+    pthread_t m_thread;
+};
+
+#include "smartptr.h"
+
+#endif // _WIN32
@@ -0,0 +1,418 @@
+// PreRoll.cpp: pre-event capture ring buffers in front of the mux engine
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "PreRoll.h"
+#include "MovieWriter.h"
+
+PreRollBuffer::PreRollBuffer(const MuxCodecConfig* pConfig, REFERENCE_TIME tWindow, LONGLONG cMaxBytes)
+: m_config(*pConfig),
+  m_tWindow(tWindow),
+  m_cMaxBytes(cMaxBytes),
+  m_cBytes(0),
+  m_pTrack(NULL),
+  m_bPassing(false),
+  m_tPassing(0),
+  m_pRecorder(NULL),
+  m_idx(0)
+{
+    // the track is made later, so keep our own copy of the config bytes
+    if (pConfig->cConfig > 0)
+    {
+        m_pConfigBytes = new BYTE[pConfig->cConfig];
+        CopyMemory(m_pConfigBytes, pConfig->pConfig, pConfig->cConfig);
+        m_config.pConfig = m_pConfigBytes;
+    }
+}
+
+HRESULT
+PreRollBuffer::Add(const MuxSample* pSample)
+{
+    CAutoLock lock(&m_csRing);
+    if (m_bPassing)
+    {
+        // after the held samples
+        Keep(&m_Passing, pSample);
+        return S_OK;
+    }
+    if (m_pTrack != NULL)
+    {
+        return m_pTrack->Add(pSample);
+    }
+    Hold(pSample);
+    Evict();
+    return S_OK;
+}
+
+void
+PreRollBuffer::Hold(const MuxSample* pSample)
+{
+    if (pSample->IsSync())
+    {
+        GOP gop;
+        gop.tStart = -1;
+        gop.tStop = -1;
+        gop.cBytes = 0;
+        gop.nSamples = 0;
+        m_GOPs.push_back(gop);
+    }
+    else if (m_GOPs.empty())
+    {
+        // cannot be decoded without the earlier key frame
+        return;
+    }
+
+    Keep(&m_Samples, pSample);
+
+    GOP& gop = m_GOPs.back();
+    gop.cBytes += pSample->cBytes;
+    gop.nSamples++;
+    if (pSample->HasTime())
+    {
+        if ((gop.tStart < 0) || (pSample->tStart < gop.tStart))
+        {
+            gop.tStart = pSample->tStart;
+        }
+        if (pSample->tStop > gop.tStop)
+        {
+            gop.tStop = pSample->tStop;
+        }
+    }
+    m_cBytes += pSample->cBytes;
+}
+
+//static
+void
+PreRollBuffer::Keep(list<MuxSample>* pList, const MuxSample* pSample)
+{
+    pList->push_back(*pSample);
+    if (pSample->pBuffer == NULL)
+    {
+        // the only copy: the engine writes from this buffer
+        HeapBuffer* pCopy = new HeapBuffer(pSample->pData, pSample->cBytes);
+        pList->back().pBuffer = pCopy;
+        pList->back().pData = pCopy->Data();
+    }
+}
+
+void
+PreRollBuffer::PopGOP()
+{
+    GOP& gop = m_GOPs.front();
+    for (long i = 0; i < gop.nSamples; i++)
+    {
+        m_Samples.pop_front();
+    }
+    m_cBytes -= gop.cBytes;
+    m_GOPs.pop_front();
+}
+
+void
+PreRollBuffer::Evict()
+{
+    bool bVideo = m_config.IsVideo();
+    REFERENCE_TIME tFloor = -1;
+    if (!bVideo && (m_pRecorder != NULL))
+    {
+        tFloor = m_pRecorder->VideoFloor();
+    }
+
+    while (m_GOPs.size() > 1)
+    {
+        list<GOP>::iterator itNext = m_GOPs.begin();
+        itNext++;
+        bool bBytes = (m_cMaxBytes > 0) && (m_cBytes > m_cMaxBytes);
+        bool bTime;
+        if (tFloor >= 0)
+        {
+            bTime = (itNext->tStart >= 0) && (itNext->tStart <= tFloor);
+        }
+        else
+        {
+            bTime = (m_tWindow > 0) && (itNext->tStart >= 0) &&
+                    ((m_GOPs.back().tStop - itNext->tStart) >= m_tWindow);
+        }
+        if (!bBytes && !bTime)
+        {
+            break;
+        }
+        PopGOP();
+    }
+
+    if ((m_cMaxBytes > 0) && (m_cBytes > m_cMaxBytes))
+    {
+        // one GOP larger than the limit
+        Reset();
+    }
+
+    if (bVideo && (m_pRecorder != NULL))
+    {
+        m_pRecorder->SetVideoStart(m_idx, m_GOPs.empty() ? -1 : m_GOPs.front().tStart);
+    }
+}
+
+void
+PreRollBuffer::Reset()
+{
+    CAutoLock lock(&m_csRing);
+    m_Samples.clear();
+    m_GOPs.clear();
+    m_cBytes = 0;
+}
+
+REFERENCE_TIME
+PreRollBuffer::HeldStart()
+{
+    CAutoLock lock(&m_csRing);
+    if (m_GOPs.empty())
+    {
+        return -1;
+    }
+    return m_GOPs.front().tStart;
+}
+
+REFERENCE_TIME
+PreRollBuffer::HeldDuration()
+{
+    CAutoLock lock(&m_csRing);
+    if (m_GOPs.empty() || (m_GOPs.front().tStart < 0))
+    {
+        return 0;
+    }
+    return m_GOPs.back().tStop - m_GOPs.front().tStart;
+}
+
+LONGLONG
+PreRollBuffer::HeldBytes()
+{
+    CAutoLock lock(&m_csRing);
+    return m_cBytes;
+}
+
+void
+PreRollBuffer::Attach(TrackWriter* pTrack, REFERENCE_TIME tStart)
+{
+    // keep the last GOP that starts at or before tStart
+    while (m_GOPs.size() > 1)
+    {
+        list<GOP>::iterator itNext = m_GOPs.begin();
+        itNext++;
+        if ((itNext->tStart < 0) || (itNext->tStart > tStart))
+        {
+            break;
+        }
+        PopGOP();
+    }
+    m_tPassing = m_GOPs.empty() ? 0 : m_GOPs.front().tStart;
+
+    // the ring is empty from now on
+    m_Passing.splice(m_Passing.end(), m_Samples);
+    m_GOPs.clear();
+    m_cBytes = 0;
+    m_bPassing = true;
+    m_pTrack = pTrack;
+}
+
+bool
+PreRollBuffer::NextHeldTime(REFERENCE_TIME* ptNext)
+{
+    CAutoLock lock(&m_csRing);
+    if (m_Passing.empty())
+    {
+        m_bPassing = false;
+        return false;
+    }
+    const MuxSample& sample = m_Passing.front();
+    *ptNext = sample.HasTime() ? sample.tStart : m_tPassing;
+    return true;
+}
+
+HRESULT
+PreRollBuffer::AddNextHeld()
+{
+    MuxSample sample;
+    {
+        CAutoLock lock(&m_csRing);
+        sample = m_Passing.front();
+        m_Passing.pop_front();
+        if (sample.HasTime())
+        {
+            m_tPassing = sample.tStart;
+        }
+    }
+
+    // only this thread takes from the list, and live
+    // samples are queued while it is not empty
+    return m_pTrack->Add(&sample);
+}
+
+void
+PreRollBuffer::Detach()
+{
+    CAutoLock lock(&m_csRing);
+    m_pTrack = NULL;
+    m_bPassing = false;
+    m_Passing.clear();
+}
+
+// --- recorder --------------------------------------------
+
+PreRollRecorder::PreRollRecorder(REFERENCE_TIME tWindow, LONGLONG cMaxBytes)
+: m_tWindow(tWindow),
+  m_cMaxBytes(cMaxBytes),
+  m_pMovie(NULL)
+{
+}
+
+PreRollBuffer*
+PreRollRecorder::AddTrack(const MuxCodecConfig* pConfig)
+{
+    CAutoLock lock(&m_csEvent);
+    PreRollBufferPtr pBuffer = new PreRollBuffer(pConfig, m_tWindow, m_cMaxBytes);
+    pBuffer->m_pRecorder = this;
+    pBuffer->m_idx = (long)m_Buffers.size();
+    m_Buffers.push_back(pBuffer);
+    {
+        CAutoLock lockFloor(&m_csFloor);
+        m_VideoStart.push_back(-1);
+    }
+    return pBuffer;
+}
+
+void
+PreRollRecorder::SetVideoStart(long idx, REFERENCE_TIME tStart)
+{
+    CAutoLock lock(&m_csFloor);
+    m_VideoStart[idx] = tStart;
+}
+
+REFERENCE_TIME
+PreRollRecorder::VideoFloor()
+{
+    CAutoLock lock(&m_csFloor);
+    REFERENCE_TIME tFloor = -1;
+    for (size_t i = 0; i < m_VideoStart.size(); i++)
+    {
+        if ((m_VideoStart[i] >= 0) && ((tFloor < 0) || (m_VideoStart[i] < tFloor)))
+        {
+            tFloor = m_VideoStart[i];
+        }
+    }
+    return tFloor;
+}
+
+HRESULT
+PreRollRecorder::Trigger(MovieWriter* pMovie)
+{
+    CAutoLock lock(&m_csEvent);
+    if (m_pMovie != NULL)
+    {
+        return VFW_E_WRONG_STATE;
+    }
+
+    m_Tracks.clear();
+    for (size_t i = 0; i < m_Buffers.size(); i++)
+    {
+        TrackWriter* pTrack = pMovie->MakeTrack(m_Buffers[i]->Config());
+        if (pTrack == NULL)
+        {
+            m_Tracks.clear();
+            return VFW_E_TYPE_NOT_ACCEPTED;
+        }
+        m_Tracks.push_back(pTrack);
+    }
+
+    // hold all the buffers only while the held samples are taken,
+    // so that every track starts from the same point
+    for (size_t i = 0; i < m_Buffers.size(); i++)
+    {
+        m_Buffers[i]->m_csRing.Lock();
+    }
+
+    // start where every video track has a key frame
+    REFERENCE_TIME tStart = -1;
+    for (size_t i = 0; i < m_Buffers.size(); i++)
+    {
+        PreRollBuffer* pBuffer = m_Buffers[i];
+        if (pBuffer->Config()->IsVideo() && !pBuffer->m_GOPs.empty())
+        {
+            tStart = max(tStart, pBuffer->m_GOPs.front().tStart);
+        }
+    }
+    for (size_t i = 0; i < m_Buffers.size(); i++)
+    {
+        m_Buffers[i]->Attach(m_Tracks[i], tStart);
+    }
+
+    for (size_t i = 0; i < m_Buffers.size(); i++)
+    {
+        m_Buffers[i]->m_csRing.Unlock();
+    }
+    m_pMovie = pMovie;
+
+    // in time order across the tracks, so that
+    // the interleaving queues stay short
+    vector<bool> bPassing(m_Buffers.size(), true);
+    HRESULT hr = S_OK;
+    for (;;)
+    {
+        PreRollBuffer* pNext = NULL;
+        REFERENCE_TIME tNext = 0;
+        for (size_t i = 0; i < m_Buffers.size(); i++)
+        {
+            REFERENCE_TIME t = 0;
+            if (bPassing[i] && !m_Buffers[i]->NextHeldTime(&t))
+            {
+                // now live
+                bPassing[i] = false;
+            }
+            if (bPassing[i] && ((pNext == NULL) || (t < tNext)))
+            {
+                pNext = m_Buffers[i];
+                tNext = t;
+            }
+        }
+        if (pNext == NULL)
+        {
+            break;
+        }
+        hr = pNext->AddNextHeld();
+        if (FAILED(hr))
+        {
+            break;
+        }
+    }
+    if (FAILED(hr))
+    {
+        for (size_t i = 0; i < m_Buffers.size(); i++)
+        {
+            m_Buffers[i]->Detach();
+        }
+        m_Tracks.clear();
+        m_pMovie = NULL;
+    }
+    return hr;
+}
+
+void
+PreRollRecorder::EndEvent()
+{
+    CAutoLock lock(&m_csEvent);
+    if (m_pMovie == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < m_Buffers.size(); i++)
+    {
+        // once detached, no more samples reach the track
+        m_Buffers[i]->Detach();
+        m_Tracks[i]->OnEOS();
+    }
+    m_Tracks.clear();
+    m_pMovie = NULL;
+}
@@ -0,0 +1,156 @@
+// PreRoll.h: pre-event capture ring buffers in front of the mux engine
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "MuxEngine.h"
+
+class MovieWriter;
+class TrackWriter;
+class PreRollRecorder;
+
+// Holds the most recent samples of one track until an event. Samples are
+// held in whole GOPs (from one sync sample to the next), so the held data
+// always starts with a key frame, and the oldest GOP is evicted as new
+// ones arrive:
+//  - while the remaining GOPs still cover tWindow, and
+//  - while more than cMaxBytes are held. If a single GOP is larger than
+//    that, it is dropped and nothing is held until the next sync sample.
+// Either limit may be 0, for no limit. In a PreRollRecorder, the audio
+// tracks are held back to the oldest video key frame instead of tWindow,
+// since the video window is rounded out to a whole GOP.
+//
+// Samples with a buffer are held by reference; samples without one are
+// copied once on entry. When the event is triggered the held samples are
+// passed to the track with their buffers, so they are not copied again,
+// and from then on each sample goes straight to the track. The held
+// samples are passed on without the lock held: live samples that arrive
+// meanwhile are queued behind them, so that the order is kept and the
+// source waits only for the hand-over, not for the track.
+class PreRollBuffer
+{
+public:
+    PreRollBuffer(const MuxCodecConfig* pConfig, REFERENCE_TIME tWindow, LONGLONG cMaxBytes);
+
+    const MuxCodecConfig* Config()
+    {
+        return &m_config;
+    }
+
+    // holds the sample, or passes it on while an event is being recorded.
+    // Non-sync samples are discarded while no GOP is held.
+    HRESULT Add(const MuxSample* pSample);
+
+    // the start time of the oldest held GOP, or -1 if none is held
+    REFERENCE_TIME HeldStart();
+    REFERENCE_TIME HeldDuration();
+    LONGLONG HeldBytes();
+
+    // empties the ring and discards anything held
+    void Reset();
+
+private:
+    friend class PreRollRecorder;
+
+    // GOPs held from tStart onwards are to be passed to pTrack, and
+    // later samples follow them. Called with the lock held.
+    void Attach(TrackWriter* pTrack, REFERENCE_TIME tStart);
+
+    // each takes the lock. NextHeldTime returns false once
+    // all are passed on: then live samples go straight to the track
+    bool NextHeldTime(REFERENCE_TIME* ptNext);
+    HRESULT AddNextHeld();
+    void Detach();
+
+    void Hold(const MuxSample* pSample);
+    static void Keep(list<MuxSample>* pList, const MuxSample* pSample);
+    void Evict();
+    void PopGOP();
+
+private:
+    CCritSec m_csRing;
+    MuxCodecConfig m_config;
+    smart_array<BYTE> m_pConfigBytes;
+    REFERENCE_TIME m_tWindow;
+    LONGLONG m_cMaxBytes;
+
+    struct GOP
+    {
+        REFERENCE_TIME tStart;
+        REFERENCE_TIME tStop;
+        LONGLONG cBytes;
+        long nSamples;
+    };
+    list<MuxSample> m_Samples;
+    list<GOP> m_GOPs;
+    LONGLONG m_cBytes;
+
+    // while an event is recorded
+    TrackWriter* m_pTrack;
+    bool m_bPassing;                // held samples not yet all passed on
+    list<MuxSample> m_Passing;      // held, then live samples, for pTrack
+    REFERENCE_TIME m_tPassing;      // for those without a time
+
+    PreRollRecorder* m_pRecorder;
+    long m_idx;
+};
+typedef smart_ptr<PreRollBuffer> PreRollBufferPtr;
+
+// Pre-roll buffers for all the tracks of a source. Trigger starts an event
+// file with the held samples of every track, from the latest of the
+// video tracks' oldest key frames (so no track starts earlier than the
+// video can be decoded), and continues it with the live samples until
+// EndEvent. The buffers then start holding samples again.
+//
+//      PreRollRecorder preroll(10 * UNITS, 64 * 1024 * 1024);
+//      PreRollBuffer* pVideo = preroll.AddTrack(&config);
+//      ...
+//      pVideo->Add(&sample);           // instead of TrackWriter::Add
+//      ...
+//      MovieWriter movie(&file);       // on the event
+//      preroll.Trigger(&movie);
+//      ...
+//      preroll.EndEvent();
+//      movie.Close(&tDuration);
+class PreRollRecorder
+{
+public:
+    // the window and memory limit apply to each track
+    PreRollRecorder(REFERENCE_TIME tWindow, LONGLONG cMaxBytes);
+
+    PreRollBuffer* AddTrack(const MuxCodecConfig* pConfig);
+
+    HRESULT Trigger(MovieWriter* pMovie);
+    void EndEvent();
+
+    bool IsRecording()
+    {
+        CAutoLock lock(&m_csEvent);
+        return m_pMovie != NULL;
+    }
+
+private:
+    friend class PreRollBuffer;
+
+    // the oldest key frame held on each video track
+    void SetVideoStart(long idx, REFERENCE_TIME tStart);
+    REFERENCE_TIME VideoFloor();
+
+private:
+    REFERENCE_TIME m_tWindow;
+    LONGLONG m_cMaxBytes;
+    vector<PreRollBufferPtr> m_Buffers;
+
+    // taken inside the buffer locks, so never held while taking them
+    CCritSec m_csFloor;
+    vector<REFERENCE_TIME> m_VideoStart;
+
+    CCritSec m_csEvent;
+    MovieWriter* m_pMovie;
+    vector<TrackWriter*> m_Tracks;
+};
@@ -0,0 +1,87 @@
+// QueueSpill.cpp: temporary file for the payload of queued chunks
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "QueueSpill.h"
+
+QueueSpill::QueueSpill()
+: m_llOutstanding(0)
+{
+}
+
+QueueSpill::~QueueSpill()
+{
+    if (m_File.IsOpen())
+    {
+        m_File.Close();
+        FileSink::Delete(m_strFile.c_str());
+    }
+}
+
+//static
+wstring
+QueueSpill::DefaultPath(LPCWSTR pszFile)
+{
+    wstring strPath = pszFile;
+    strPath += L".queue";
+    return strPath;
+}
+
+HRESULT
+QueueSpill::Create(LPCWSTR pszFile)
+{
+    CAutoLock lock(&m_csSpill);
+    HRESULT hr = m_File.Create(pszFile);
+    if (SUCCEEDED(hr))
+    {
+        m_strFile = pszFile;
+    }
+    return hr;
+}
+
+HRESULT
+QueueSpill::Write(const BYTE* pData, long cBytes, LONGLONG* pPos)
+{
+    CAutoLock lock(&m_csSpill);
+    if (!m_File.IsOpen())
+    {
+        return VFW_E_WRONG_STATE;
+    }
+    *pPos = m_File.Length();
+    HRESULT hr = m_File.Append(pData, cBytes);
+    if (SUCCEEDED(hr))
+    {
+        m_llOutstanding += cBytes;
+    }
+    else
+    {
+        // nothing after the chunks already written is used
+        m_File.SetLength(*pPos);
+    }
+    return hr;
+}
+
+HRESULT
+QueueSpill::Read(LONGLONG pos, BYTE* pData, long cBytes)
+{
+    CAutoLock lock(&m_csSpill);
+    return m_File.Read(pos, pData, cBytes);
+}
+
+void
+QueueSpill::Release(long cBytes)
+{
+    CAutoLock lock(&m_csSpill);
+    m_llOutstanding -= cBytes;
+    if (m_llOutstanding == 0)
+    {
+        // every chunk in the file has been written or discarded:
+        // start again from the beginning
+        m_File.SetLength(0);
+    }
+}
@@ -0,0 +1,54 @@
+// QueueSpill.h: temporary file for the payload of queued chunks
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "FileSink.h"
+
+// Each track queues its completed chunks until the interleaving lets
+// them be written, and a chunk holds its samples' buffers until then.
+// If one input stalls (eg audio that stops arriving), the other tracks
+// are held back once they are InterleaveLead ahead of it, and their
+// queues grow with the stall: the source's buffers stay pinned, and
+// either it is starved of buffers or the memory grows without limit.
+//
+// With a queue spill file, each track keeps only a limited amount of
+// its queue in memory (see MovieWriter::SetQueueSpill). The payload of
+// each chunk completed beyond the limit is appended to this file as one
+// write, and its buffers released; it is read back as one read when
+// the chunk's turn to be written comes, so the file is written in the
+// same order as without it. One file serves all the tracks of a movie,
+// and it is emptied whenever no chunk in it remains to be written, so
+// it grows only to the longest stall.
+//
+// The file is deleted when the movie is done with it.
+class QueueSpill
+{
+public:
+    QueueSpill();
+    ~QueueSpill();
+
+    HRESULT Create(LPCWSTR pszFile);
+
+    // appends a chunk's payload, returning the position written
+    HRESULT Write(const BYTE* pData, long cBytes, LONGLONG* pPos);
+    HRESULT Read(LONGLONG pos, BYTE* pData, long cBytes);
+
+    // a chunk written here is no longer needed (written to the
+    // movie, or discarded)
+    void Release(long cBytes);
+
+    // <media file>.queue
+    static wstring DefaultPath(LPCWSTR pszFile);
+
+private:
+    CCritSec m_csSpill;
+    FileSink m_File;
+    wstring m_strFile;
+    LONGLONG m_llOutstanding;   // bytes of chunks not yet released
+};
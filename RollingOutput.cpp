@@ -0,0 +1,149 @@
+// RollingOutput.cpp: supplies the files for a rolling recording
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "RollingOutput.h"
+
+RollingOutput::RollingOutput(IMuxSegmentCallback* pCallback)
+: m_pCallback(pCallback),
+  m_bExit(false),
+  m_bPrepare(false),
+  m_nNextFile(1)      // file 0 is the output pin
+{
+}
+
+RollingOutput::~RollingOutput()
+{
+    Stop();
+}
+
+HRESULT
+RollingOutput::Start()
+{
+    m_bExit = false;
+    if (!Create())
+    {
+        return E_FAIL;
+    }
+    return S_OK;
+}
+
+void
+RollingOutput::Stop()
+{
+    if (ThreadExists())
+    {
+        {
+            CAutoLock lock(&m_csQueue);
+            m_bExit = true;
+        }
+        m_evWork.Set();
+        Close();
+    }
+
+    // a stream prepared but not used is released without notification
+    CAutoLock lock(&m_csQueue);
+    m_pReady = NULL;
+}
+
+void
+RollingOutput::Prepare()
+{
+    CAutoLock lock(&m_csQueue);
+    m_bPrepare = true;
+    m_evWork.Set();
+}
+
+AtomWriter*
+RollingOutput::Next()
+{
+    CAutoLock lock(&m_csQueue);
+    if (m_pReady == NULL)
+    {
+        return NULL;
+    }
+    Segment* pSegment = m_pReady;
+    m_InUse.push_back(m_pReady);
+    m_pReady = NULL;
+    return pSegment;
+}
+
+void
+RollingOutput::Release(AtomWriter* pContainer)
+{
+    CAutoLock lock(&m_csQueue);
+    list<SegmentPtr>::iterator it;
+    for (it = m_InUse.begin(); it != m_InUse.end(); it++)
+    {
+        Segment* pSegment = *it;
+        if (static_cast<AtomWriter*>(pSegment) == pContainer)
+        {
+            m_Complete.push_back(*it);
+            m_InUse.erase(it);
+            m_evWork.Set();
+            break;
+        }
+    }
+}
+
+DWORD
+RollingOutput::ThreadProc()
+{
+    CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    for (;;)
+    {
+        WaitForSingleObject(m_evWork, INFINITE);
+
+        bool bExit;
+        bool bPrepare;
+        long nFile;
+        list<SegmentPtr> complete;
+        {
+            CAutoLock lock(&m_csQueue);
+            bExit = m_bExit;
+            bPrepare = m_bPrepare && (m_pReady == NULL);
+            m_bPrepare = false;
+            nFile = m_nNextFile;
+            complete.swap(m_Complete);
+        }
+
+        // close completed files (by releasing the stream) before telling the app
+        while (complete.size() > 0)
+        {
+            long nComplete = complete.front()->File();
+            complete.pop_front();
+            m_pCallback->FileComplete(nComplete);
+        }
+
+        if (bExit)
+        {
+            break;
+        }
+
+        if (bPrepare)
+        {
+            IStream* pStream = NULL;
+            HRESULT hr = m_pCallback->GetNextFile(nFile, &pStream);
+            if (SUCCEEDED(hr) && (pStream != NULL))
+            {
+                SegmentPtr pSegment = new Segment(pStream, nFile);
+                pStream->Release();
+
+                CAutoLock lock(&m_csQueue);
+                m_pReady = pSegment;
+                m_nNextFile++;
+            }
+            else
+            {
+                DbgLog((LOG_ERROR, 0, TEXT("Mux: no stream for file %d (0x%x)"), nFile, hr));
+            }
+        }
+    }
+    CoUninitialize();
+    return 0;
+}
@@ -0,0 +1,73 @@
+// RollingOutput.h: supplies the files for a rolling recording
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "FileSink.h"
+#include "MuxConfig.h"
+
+_COM_SMARTPTR_TYPEDEF(IMuxSegmentCallback, __uuidof(IMuxSegmentCallback));
+
+// The MovieWriter asks for the next file as soon as the size or
+// time limit is reached, but only switches at the next key frame.
+// The application callback is made on our worker thread in the
+// meantime, so opening the file never holds up the write path: if the
+// stream is not ready by the key frame, the split waits for a later one.
+// Completed streams are released, and the application notified,
+// on the worker thread as well.
+class RollingOutput
+: public CAMThread,
+  public SegmentSource
+{
+public:
+    RollingOutput(IMuxSegmentCallback* pCallback);
+    ~RollingOutput();
+
+    HRESULT Start();
+
+    // releases all completed files
+    void Stop();
+
+    // SegmentSource methods
+    void Prepare();
+    AtomWriter* Next();
+    void Release(AtomWriter* pContainer);
+
+private:
+    DWORD ThreadProc();
+
+    // one file of the recording
+    class Segment : public StreamSink
+    {
+    public:
+        Segment(IStream* pStream, long nFile)
+        : StreamSink(pStream),
+          m_nFile(nFile)
+        {
+        }
+        long File()
+        {
+            return m_nFile;
+        }
+    private:
+        long m_nFile;
+    };
+    typedef smart_ptr<Segment> SegmentPtr;
+
+private:
+    IMuxSegmentCallbackPtr m_pCallback;
+
+    CCritSec m_csQueue;
+    CAMEvent m_evWork;
+    bool m_bExit;
+    bool m_bPrepare;
+    long m_nNextFile;
+    SegmentPtr m_pReady;
+    list<SegmentPtr> m_InUse;
+    list<SegmentPtr> m_Complete;
+};
@@ -0,0 +1,214 @@
+// SeekIndex.cpp: keyframe seek index sidecar, written with the movie
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "SeekIndex.h"
+#include "MovieWriter.h"
+#include "TypeHandler.h"
+#include <algorithm>
+
+// ordered by time, and by position for equal times
+static bool
+EarlierEntry(const SeekEntry& a, const SeekEntry& b)
+{
+    if (a.tStart != b.tStart)
+    {
+        return a.tStart < b.tStart;
+    }
+    return a.pos < b.pos;
+}
+
+//static
+wstring
+SeekIndex::DefaultPath(LPCWSTR pszFile)
+{
+    wstring strPath = pszFile;
+    strPath += L".kidx";
+    return strPath;
+}
+
+HRESULT
+SeekIndex::Create(LPCWSTR pszFile)
+{
+    return m_File.Create(pszFile);
+}
+
+HRESULT
+SeekIndex::Write(MovieWriter* pMovie)
+{
+    if (!m_File.IsOpen())
+    {
+        return VFW_E_WRONG_STATE;
+    }
+
+    // key frames are added in decode order; with frame reordering,
+    // their presentation times are normally still in order, but
+    // the table must be sorted, so check
+    long nTracks = pMovie->TrackCount();
+    vector<vector<SeekEntry> > tables(nTracks);
+    for (long i = 0; i < nTracks; i++)
+    {
+        KeyFrameIndex* pKeys = pMovie->Track(i)->KeyFrames();
+        vector<SeekEntry>& table = tables[i];
+        table.resize(pKeys->Entries());
+        bool bSorted = true;
+        for (long n = 0; n < (long)table.size(); n++)
+        {
+            SeekEntry& entry = table[n];
+            pKeys->Entry(n, &entry.tStart, &entry.pos, &entry.cBytes, &entry.nSample);
+            if ((n > 0) && EarlierEntry(entry, table[n - 1]))
+            {
+                bSorted = false;
+            }
+        }
+        if (!bSorted)
+        {
+            stable_sort(table.begin(), table.end(), EarlierEntry);
+        }
+    }
+
+    long cHeader = header_size + (nTracks * track_entry_size);
+    smart_array<BYTE> pHeader = new BYTE[cHeader];
+    ZeroMemory(pHeader, cHeader);
+    WriteLong(DWORD('kidx'), pHeader);
+    WriteLong(seek_version, pHeader + 4);
+    WriteLong(nTracks, pHeader + 8);
+    LONGLONG posTable = cHeader;
+    for (long i = 0; i < nTracks; i++)
+    {
+        BYTE* pDir = pHeader + header_size + (i * track_entry_size);
+        TrackWriter* pTrack = pMovie->Track(i);
+        WriteLong(pTrack->ID(), pDir);
+        WriteLong(pTrack->Handler()->Handler(), pDir + 4);
+        WriteLong((long)tables[i].size(), pDir + 8);
+        WriteI64(posTable, pDir + 16);
+        posTable += LONGLONG(tables[i].size()) * entry_size;
+    }
+    HRESULT hr = m_File.Append(pHeader, cHeader);
+
+    for (long i = 0; SUCCEEDED(hr) && (i < nTracks); i++)
+    {
+        const vector<SeekEntry>& table = tables[i];
+        if (table.empty())
+        {
+            continue;
+        }
+        long cTable = (long)table.size() * entry_size;
+        smart_array<BYTE> pTable = new BYTE[cTable];
+        for (size_t n = 0; n < table.size(); n++)
+        {
+            BYTE* p = pTable + (n * entry_size);
+            WriteI64(table[n].tStart, p);
+            WriteI64(table[n].pos, p + 8);
+            WriteLong(table[n].cBytes, p + 16);
+            WriteLong(table[n].nSample, p + 20);
+        }
+        hr = m_File.Append(pTable, cTable);
+    }
+    m_File.Close();
+    return hr;
+}
+
+// --- reading ---------------------------------------
+
+HRESULT
+SeekIndexFile::Open(const char* pszPath)
+{
+    m_nTracks = 0;
+    m_pFile = new MappedFile;
+    HRESULT hr = m_pFile->Open(pszPath);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    // check every table is within the file, so lookups need not
+    const BYTE* pData = m_pFile->Data();
+    LONGLONG cBytes = m_pFile->Size();
+    if ((cBytes < header_size) ||
+        (DWORD(ReadLong(pData)) != DWORD('kidx')) ||
+        (ReadLong(pData + 4) != SeekIndex::seek_version))
+    {
+        return VFW_E_INVALID_FILE_FORMAT;
+    }
+    long nTracks = ReadLong(pData + 8);
+    if ((nTracks < 0) || (nTracks > ((cBytes - header_size) / track_entry_size)))
+    {
+        return VFW_E_INVALID_FILE_FORMAT;
+    }
+    for (long i = 0; i < nTracks; i++)
+    {
+        const BYTE* pDir = Directory(i);
+        LONGLONG nEntries = ReadLong(pDir + 8);
+        LONGLONG posTable = ReadI64(pDir + 16);
+        if ((nEntries < 0) || (posTable < 0) || (posTable > cBytes) ||
+            (nEntries > ((cBytes - posTable) / entry_size)))
+        {
+            return VFW_E_INVALID_FILE_FORMAT;
+        }
+    }
+    m_nTracks = nTracks;
+    return S_OK;
+}
+
+long
+SeekIndexFile::TrackID(long nTrack)
+{
+    return ReadLong(Directory(nTrack));
+}
+
+DWORD
+SeekIndexFile::Handler(long nTrack)
+{
+    return DWORD(ReadLong(Directory(nTrack) + 4));
+}
+
+long
+SeekIndexFile::Entries(long nTrack)
+{
+    return ReadLong(Directory(nTrack) + 8);
+}
+
+void
+SeekIndexFile::Entry(long nTrack, long nEntry, SeekEntry* pEntry)
+{
+    const BYTE* p = Table(nTrack) + (LONGLONG(nEntry) * entry_size);
+    pEntry->tStart = ReadI64(p);
+    pEntry->pos = ReadI64(p + 8);
+    pEntry->cBytes = ReadLong(p + 16);
+    pEntry->nSample = ReadLong(p + 20);
+}
+
+bool
+SeekIndexFile::Find(long nTrack, REFERENCE_TIME t, SeekEntry* pEntry)
+{
+    long nEntries = Entries(nTrack);
+    if (nEntries == 0)
+    {
+        return false;
+    }
+
+    // first entry later than t
+    const BYTE* pTable = Table(nTrack);
+    long nLow = 0;
+    long nHigh = nEntries;
+    while (nLow < nHigh)
+    {
+        long nMid = nLow + ((nHigh - nLow) / 2);
+        if (ReadI64(pTable + (LONGLONG(nMid) * entry_size)) <= t)
+        {
+            nLow = nMid + 1;
+        }
+        else
+        {
+            nHigh = nMid;
+        }
+    }
+    Entry(nTrack, (nLow > 0) ? (nLow - 1) : 0, pEntry);
+    return true;
+}
@@ -0,0 +1,112 @@
+// SeekIndex.h: keyframe seek index sidecar, written with the movie
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "FileSink.h"
+#include "MappedFile.h"
+
+class MovieWriter;
+
+// To seek in an MP4 file, a player walks stss, stsc and stco/co64 to find
+// the file offset of each key frame. A server opening many files pays for
+// that walk on every open. The seek index is a side file with the result:
+// for each track, a sorted fixed-width table of the samples at which
+// decoding can start, so that a seek is a binary search of a mapped file.
+// The entries are collected as the samples are indexed (KeyFrameIndex),
+// and the file is written once the moov is complete.
+//
+// All values are big-endian, as in the movie:
+//      header (16 bytes)
+//          'kidx', version, track count, 0
+//      one directory entry per track (24 bytes)
+//          track id, handler type ('vide', 'soun'), entry count, 0,
+//          64-bit file offset of the track's table
+//      each table: entry_size bytes per entry, ascending time
+//          64-bit time, 64-bit file offset of the sample,
+//          sample size, 1-based sample number
+//
+// Times are in 100ns units from the start of the movie, on the same
+// timeline as the moov. For a track where every sample is a sync sample
+// (audio) there is one entry per chunk, at the chunk's first sample.
+class SeekIndex
+{
+public:
+    HRESULT Create(LPCWSTR pszFile);
+
+    // writes the tables of all the movie's tracks and closes the file.
+    // Called by the movie once its moov is written.
+    HRESULT Write(MovieWriter* pMovie);
+
+    // <media file>.kidx
+    static wstring DefaultPath(LPCWSTR pszFile);
+
+    enum {
+        seek_version = 1,
+        header_size = 16,
+        track_entry_size = 24,
+        entry_size = 24,
+    };
+
+private:
+    FileSink m_File;
+};
+
+struct SeekEntry
+{
+    REFERENCE_TIME tStart;
+    LONGLONG pos;
+    long cBytes;
+    long nSample;
+};
+
+// read access to a seek index, for servers: the file is mapped,
+// and each lookup is a binary search of the mapped table
+class SeekIndexFile
+{
+public:
+    SeekIndexFile()
+    : m_nTracks(0)
+    {
+    }
+
+    HRESULT Open(const char* pszPath);
+
+    long Tracks()
+    {
+        return m_nTracks;
+    }
+    long TrackID(long nTrack);
+    DWORD Handler(long nTrack);
+    long Entries(long nTrack);
+    void Entry(long nTrack, long nEntry, SeekEntry* pEntry);
+
+    // the last entry at or before t (or the first entry, if t is
+    // earlier). false if the track has no entries.
+    bool Find(long nTrack, REFERENCE_TIME t, SeekEntry* pEntry);
+
+private:
+    const BYTE* Directory(long nTrack)
+    {
+        return m_pFile->Data() + header_size + (nTrack * track_entry_size);
+    }
+    const BYTE* Table(long nTrack)
+    {
+        return m_pFile->Data() + ReadI64(Directory(nTrack) + 16);
+    }
+
+    enum {
+        header_size = SeekIndex::header_size,
+        track_entry_size = SeekIndex::track_entry_size,
+        entry_size = SeekIndex::entry_size,
+    };
+
+private:
+    smart_ptr<MappedFile> m_pFile;
+    long m_nTracks;
+};
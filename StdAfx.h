@@ -5,6 +5,10 @@
 
 #pragma once
 
+#ifndef _WIN32
+// the mux engine alone, without DirectShow
+#include "Portable.h"
+#else
 
 // Insert your headers here
 #define WIN32_LEAN_AND_MEAN     // Exclude rarely-used stuff from Windows headers
@@ -22,15 +26,19 @@
 _COM_SMARTPTR_TYPEDEF(IMediaSample, IID_IMediaSample);
 _COM_SMARTPTR_TYPEDEF(IMediaSeeking, IID_IMediaSeeking);
 _COM_SMARTPTR_TYPEDEF(IMemAllocator, IID_IMemAllocator);
+_COM_SMARTPTR_TYPEDEF(IFileSinkFilter, IID_IFileSinkFilter);
 
 #include <list>
 #include <vector>
+#include <string>
 using namespace std;
 
 #pragma warning(pop)
 
 #include "smartptr.h"
 
+#endif // _WIN32
+
 //{{AFX_INSERT_LOCATION}}
 // Microsoft Visual C++ will insert additional declarations immediately before the previous line.
 
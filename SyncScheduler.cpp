@@ -0,0 +1,234 @@
+// SyncScheduler.cpp: durability policy for the output file
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "SyncScheduler.h"
+
+SyncScheduler::SyncScheduler(AtomWriter* pTarget, DWORD dwPolicy, DWORD dwParam)
+: m_pTarget(pTarget),
+  m_bRunning(false),
+  m_bExit(false),
+  m_llRequested(0),
+  m_tStart(0)
+{
+    ZeroMemory(&m_Stats, sizeof(m_Stats));
+    m_Stats.dwPolicy = dwPolicy;
+    m_Stats.dwParam = dwParam;
+}
+
+SyncScheduler::~SyncScheduler()
+{
+    if (m_bRunning)
+    {
+        Stop();
+    }
+}
+
+//static
+REFERENCE_TIME
+SyncScheduler::Now()
+{
+    LARGE_INTEGER liFreq, liNow;
+    QueryPerformanceFrequency(&liFreq);
+    QueryPerformanceCounter(&liNow);
+    return REFERENCE_TIME(double(liNow.QuadPart) * UNITS / liFreq.QuadPart);
+}
+
+HRESULT
+SyncScheduler::Start()
+{
+    {
+        CAutoLock lock(&m_csStats);
+        DWORD dwPolicy = m_Stats.dwPolicy;
+        DWORD dwParam = m_Stats.dwParam;
+        ZeroMemory(&m_Stats, sizeof(m_Stats));
+        m_Stats.dwPolicy = dwPolicy;
+        m_Stats.dwParam = dwParam;
+        m_llRequested = 0;
+        m_bExit = false;
+        m_tStart = Now();
+        m_bRunning = true;
+    }
+
+    if ((m_Stats.dwPolicy != MuxDurability_None) && !Create())
+    {
+        m_bRunning = false;
+        return E_FAIL;
+    }
+    return S_OK;
+}
+
+HRESULT
+SyncScheduler::Stop()
+{
+    if (ThreadExists())
+    {
+        {
+            CAutoLock lock(&m_csStats);
+            m_bExit = true;
+        }
+        m_evWake.Set();
+        Close();
+    }
+
+    HRESULT hr = S_OK;
+    if (m_Stats.dwPolicy != MuxDurability_None)
+    {
+        {
+            CAutoLock lock(&m_csStats);
+            m_Stats.cRequests++;
+        }
+        hr = Sync();
+    }
+
+    CAutoLock lock(&m_csStats);
+    m_Stats.tElapsed = Now() - m_tStart;
+    m_bRunning = false;
+    DbgLog((LOG_TRACE, 0, TEXT("Mux sync policy %d: %d syncs for %d requests, max latency %d ms, mean %d ms"),
+        m_Stats.dwPolicy, long(m_Stats.cSyncs), long(m_Stats.cRequests),
+        long(m_Stats.tLatencyMax / 10000),
+        long(m_Stats.cSyncs ? (m_Stats.tLatencyTotal / m_Stats.cSyncs / 10000) : 0)));
+    return hr;
+}
+
+void
+SyncScheduler::OnWrite(long cBytes, bool bKey)
+{
+    bool bRequest = false;
+    {
+        CAutoLock lock(&m_csStats);
+        m_Stats.llWritten += cBytes;
+        switch(m_Stats.dwPolicy)
+        {
+        case MuxDurability_Bytes:
+            {
+                LONGLONG llEvery = LONGLONG(max(m_Stats.dwParam, DWORD(1))) * 1024 * 1024;
+                bRequest = ((m_Stats.llWritten - m_llRequested) >= llEvery);
+            }
+            break;
+
+        case MuxDurability_Keyframe:
+            bRequest = bKey;
+            break;
+
+        default:
+            // interval policy is timed by the worker
+            break;
+        }
+        if (bRequest)
+        {
+            m_llRequested = m_Stats.llWritten;
+            m_Stats.cRequests++;
+        }
+    }
+
+    if (bRequest)
+    {
+        m_evWake.Set();
+    }
+}
+
+void
+SyncScheduler::SetTarget(AtomWriter* pTarget)
+{
+    CAutoLock lock(&m_csTarget);
+    m_pTarget = pTarget;
+}
+
+DWORD
+SyncScheduler::ThreadProc()
+{
+    DWORD dwTimeout = INFINITE;
+    if (m_Stats.dwPolicy == MuxDurability_Interval)
+    {
+        dwTimeout = max(m_Stats.dwParam, DWORD(1));
+    }
+
+    for (;;)
+    {
+        DWORD dw = WaitForSingleObject(m_evWake, dwTimeout);
+
+        bool bDue;
+        {
+            CAutoLock lock(&m_csStats);
+            if (m_bExit)
+            {
+                break;
+            }
+            bDue = (m_Stats.llWritten > m_Stats.llSynced);
+            if (bDue && (dw == WAIT_TIMEOUT))
+            {
+                m_Stats.cRequests++;
+            }
+        }
+
+        // all requests made up to this point are
+        // covered by one sync
+        if (bDue)
+        {
+            Sync();
+        }
+    }
+    return 0;
+}
+
+HRESULT
+SyncScheduler::Sync()
+{
+    // everything reported as written before the flush
+    // starts is covered by it
+    LONGLONG llCovered;
+    {
+        CAutoLock lock(&m_csStats);
+        llCovered = m_Stats.llWritten;
+        if ((llCovered - m_Stats.llSynced) > m_Stats.llMaxAtRisk)
+        {
+            m_Stats.llMaxAtRisk = llCovered - m_Stats.llSynced;
+        }
+    }
+
+    REFERENCE_TIME tStart = Now();
+    HRESULT hr;
+    {
+        CAutoLock lock(&m_csTarget);
+        hr = m_pTarget->Flush();
+    }
+    REFERENCE_TIME tLatency = Now() - tStart;
+
+    CAutoLock lock(&m_csStats);
+    m_Stats.cSyncs++;
+    m_Stats.tLatencyTotal += tLatency;
+    if (tLatency > m_Stats.tLatencyMax)
+    {
+        m_Stats.tLatencyMax = tLatency;
+    }
+    if (SUCCEEDED(hr))
+    {
+        m_Stats.llSynced = llCovered;
+    }
+    else
+    {
+        DbgLog((LOG_ERROR, 0, TEXT("Mux sync failed 0x%x"), hr));
+    }
+    return hr;
+}
+
+void
+SyncScheduler::GetStats(MuxDurabilityStats* pStats)
+{
+    CAutoLock lock(&m_csStats);
+    *pStats = m_Stats;
+    if (m_bRunning)
+    {
+        pStats->tElapsed = Now() - m_tStart;
+    }
+    if (pStats->tElapsed > 0)
+    {
+        pStats->llBytesPerSec = LONGLONG(double(pStats->llWritten) * UNITS / pStats->tElapsed);
+    }
+}
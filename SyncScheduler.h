@@ -0,0 +1,62 @@
+// SyncScheduler.h: durability policy for the output file
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "MovieWriter.h"
+#include "MuxConfig.h"
+
+// Without an explicit sync, written data reaches the disk whenever the
+// file system chooses, so on power loss an unbounded amount is lost. But
+// syncing after each write stalls the writer on every flush.
+//
+// Instead, the writer reports each chunk as it is written, and the
+// policy decides when a sync is due. The sync is performed on a worker
+// thread, and any requests made while it is in progress are satisfied
+// by a single further sync (group commit), so the writer never waits
+// for the disk.
+class SyncScheduler
+: public CAMThread,
+  public WriteObserver
+{
+public:
+    SyncScheduler(AtomWriter* pTarget, DWORD dwPolicy, DWORD dwParam);
+    ~SyncScheduler();
+
+    HRESULT Start();
+
+    // stop the worker and make a final sync to
+    // cover anything written since (eg the moov)
+    HRESULT Stop();
+
+    // called on the write path after each chunk is written
+    void OnWrite(long cBytes, bool bKey);
+
+    // rolling output: syncs go to the new file from now on.
+    // Waits for any sync of the old file to complete.
+    void SetTarget(AtomWriter* pTarget);
+
+    void GetStats(MuxDurabilityStats* pStats);
+
+private:
+    DWORD ThreadProc();
+    HRESULT Sync();
+    static REFERENCE_TIME Now();
+
+private:
+    CCritSec m_csTarget;
+    AtomWriter* m_pTarget;
+
+    CCritSec m_csStats;
+    CAMEvent m_evWake;
+    bool m_bRunning;
+    bool m_bExit;
+    LONGLONG m_llRequested;         // bytes written at last request
+    REFERENCE_TIME m_tStart;
+    MuxDurabilityStats m_Stats;
+};
@@ -0,0 +1,268 @@
+// TeeSink.cpp: one file written to several destinations
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "TeeSink.h"
+
+TeeSink::TeeSink(AtomWriter* pPrimary, DWORD dwFlags, LONGLONG llMaxLag)
+: m_pPrimary(pPrimary),
+  m_dwFlags(dwFlags),
+  m_llMaxLag(llMaxLag),
+  m_cBlockUsed(0)
+{
+}
+
+TeeSink::~TeeSink()
+{
+    Close();
+}
+
+void
+TeeSink::AddReplica(AtomWriter* pReplica)
+{
+    CAutoLock lock(&m_csTee);
+    m_Replicas.push_back(new Replica(pReplica));
+}
+
+void
+TeeSink::Close()
+{
+    for (UINT i = 0; i < m_Replicas.size(); i++)
+    {
+        m_Replicas[i]->Close();
+    }
+}
+
+void
+TeeSink::GetStatus(long nReplica, HRESULT* phr, LONGLONG* pllLag)
+{
+    m_Replicas[nReplica]->GetStatus(phr, pllLag);
+}
+
+HRESULT
+TeeSink::Replace(LONGLONG pos, const BYTE* pBuffer, long cBytes)
+{
+    CAutoLock lock(&m_csTee);
+    HRESULT hr = m_pPrimary->Replace(pos, pBuffer, cBytes);
+    if (SUCCEEDED(hr))
+    {
+        hr = Replicate(op_replace, pos, pBuffer, cBytes);
+    }
+    return hr;
+}
+
+HRESULT
+TeeSink::Append(const BYTE* pBuffer, long cBytes)
+{
+    CAutoLock lock(&m_csTee);
+    LONGLONG pos = m_pPrimary->Length();
+    HRESULT hr = m_pPrimary->Append(pBuffer, cBytes);
+    if (SUCCEEDED(hr))
+    {
+        hr = Replicate(op_append, pos, pBuffer, cBytes);
+    }
+    return hr;
+}
+
+HRESULT
+TeeSink::Flush()
+{
+    // not under the tee lock: the primary flush is called
+    // from the sync thread while writing continues
+    HRESULT hr = m_pPrimary->Flush();
+
+    CAutoLock lock(&m_csTee);
+    HRESULT hrReplicas = Replicate(op_flush, 0, NULL, 0);
+    if (SUCCEEDED(hr))
+    {
+        hr = hrReplicas;
+    }
+    return hr;
+}
+
+HRESULT
+TeeSink::Replicate(op_type type, LONGLONG pos, const BYTE* pBuffer, long cBytes)
+{
+    if (m_Replicas.size() == 0)
+    {
+        return S_OK;
+    }
+
+    WriteOp op;
+    op.type = type;
+    op.pos = pos;
+    op.offset = 0;
+    op.cBytes = cBytes;
+    if (cBytes > 0)
+    {
+        // one copy of the data, shared by all the replica queues.
+        // Small writes (eg atom headers) are packed into a common block.
+        if (cBytes > (block_size / 4))
+        {
+            op.pBlock = new BYTE[cBytes];
+        }
+        else
+        {
+            if ((m_pBlock == NULL) || ((m_cBlockUsed + cBytes) > block_size))
+            {
+                m_pBlock = new BYTE[block_size];
+                m_cBlockUsed = 0;
+            }
+            op.pBlock = m_pBlock;
+            op.offset = m_cBlockUsed;
+            m_cBlockUsed += cBytes;
+        }
+        CopyMemory(op.pBlock + op.offset, pBuffer, cBytes);
+    }
+
+    HRESULT hr = S_OK;
+    for (UINT i = 0; i < m_Replicas.size(); i++)
+    {
+        HRESULT hrThis = m_Replicas[i]->Queue(op, this);
+        if (FAILED(hrThis) && (m_dwFlags & MuxReplica_FailOnError))
+        {
+            hr = hrThis;
+        }
+    }
+    return hr;
+}
+
+// --- replica ----------------------------------------------------
+
+TeeSink::Replica::Replica(AtomWriter* pContainer)
+: m_pContainer(pContainer),
+  m_llQueued(0),
+  m_hr(S_OK),
+  m_bExit(false)
+{
+    Create();
+}
+
+TeeSink::Replica::~Replica()
+{
+    Close();
+}
+
+HRESULT
+TeeSink::Replica::Queue(const WriteOp& op, TeeSink* pTee)
+{
+    CAutoLock lock(&m_csQueue);
+    if (FAILED(m_hr) || m_bExit)
+    {
+        return m_hr;
+    }
+    while ((m_llQueued > 0) && ((m_llQueued + op.cBytes) > pTee->m_llMaxLag))
+    {
+        if (!(pTee->m_dwFlags & MuxReplica_WaitOnLag))
+        {
+            DbgLog((LOG_ERROR, 0, TEXT("Mux replica dropped: more than %d MB behind"),
+                long(pTee->m_llMaxLag / (1024 * 1024))));
+            m_hr = VFW_E_BUFFER_OVERFLOW;
+            m_Queue.clear();
+            m_llQueued = 0;
+            return m_hr;
+        }
+
+        // strict mirroring: wait for the replica to catch up
+        m_csQueue.Unlock();
+        m_evSpace.Wait();
+        m_csQueue.Lock();
+        if (FAILED(m_hr))
+        {
+            return m_hr;
+        }
+    }
+    m_Queue.push_back(op);
+    m_llQueued += op.cBytes;
+    m_evWork.Set();
+    return S_OK;
+}
+
+void
+TeeSink::Replica::Close()
+{
+    // the worker completes the queue before exiting
+    if (ThreadExists())
+    {
+        {
+            CAutoLock lock(&m_csQueue);
+            m_bExit = true;
+        }
+        m_evWork.Set();
+        CAMThread::Close();
+    }
+}
+
+void
+TeeSink::Replica::GetStatus(HRESULT* phr, LONGLONG* pllLag)
+{
+    CAutoLock lock(&m_csQueue);
+    *phr = m_hr;
+    *pllLag = m_llQueued;
+}
+
+void
+TeeSink::Replica::Fail(HRESULT hr)
+{
+    CAutoLock lock(&m_csQueue);
+    DbgLog((LOG_ERROR, 0, TEXT("Mux replica dropped: write failed 0x%x"), hr));
+    m_hr = hr;
+    m_Queue.clear();
+    m_llQueued = 0;
+    m_evSpace.Set();
+}
+
+DWORD
+TeeSink::Replica::ThreadProc()
+{
+    for (;;)
+    {
+        WriteOp op;
+        {
+            CAutoLock lock(&m_csQueue);
+            if (m_Queue.size() == 0)
+            {
+                if (m_bExit || FAILED(m_hr))
+                {
+                    break;
+                }
+                m_csQueue.Unlock();
+                m_evWork.Wait();
+                m_csQueue.Lock();
+                continue;
+            }
+            op = m_Queue.front();
+            m_Queue.pop_front();
+        }
+
+        HRESULT hr = S_OK;
+        switch(op.type)
+        {
+        case op_append:
+            hr = m_pContainer->Append(op.pBlock + op.offset, op.cBytes);
+            break;
+        case op_replace:
+            hr = m_pContainer->Replace(op.pos, op.pBlock + op.offset, op.cBytes);
+            break;
+        case op_flush:
+            hr = m_pContainer->Flush();
+            break;
+        }
+        if (FAILED(hr))
+        {
+            Fail(hr);
+        }
+        else
+        {
+            CAutoLock lock(&m_csQueue);
+            m_llQueued -= op.cBytes;
+            m_evSpace.Set();
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,123 @@
+// TeeSink.h: one file written to several destinations
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "MovieWriter.h"
+#include "MuxConfig.h"
+
+// Container that writes to a primary container and replicates
+// every Append and Replace to any number of replica containers, so
+// that one mux produces identical copies without repeating the
+// interleaving or indexing.
+//
+// The primary is written synchronously. Each replica has its own queue
+// and worker thread, so a slow replica does not hold up the primary.
+// Data is copied once into shared, reference-counted blocks which the
+// queues refer to. Small writes share a block.
+//
+// When a replica's queue exceeds the lag limit, it is either dropped or
+// the writer waits for it (MuxReplica_WaitOnLag). When a replica write
+// fails, the replica is dropped, or with MuxReplica_FailOnError, the
+// failure is returned to the writer as if the primary had failed.
+// A dropped replica's file is left incomplete.
+class TeeSink : public AtomWriter
+{
+public:
+    TeeSink(AtomWriter* pPrimary, DWORD dwFlags, LONGLONG llMaxLag);
+    ~TeeSink();
+
+    // the tee owns the replica
+    void AddReplica(AtomWriter* pReplica);
+
+    // wait for all replicas to complete their queued writes
+    void Close();
+
+    long Replicas()
+    {
+        return (long)m_Replicas.size();
+    }
+    void GetStatus(long nReplica, HRESULT* phr, LONGLONG* pllLag);
+
+    // AtomWriter methods
+    LONGLONG Length()
+    {
+        return m_pPrimary->Length();
+    }
+    LONGLONG Position()
+    {
+        return m_pPrimary->Position();
+    }
+    HRESULT Replace(LONGLONG pos, const BYTE* pBuffer, long cBytes);
+    HRESULT Append(const BYTE* pBuffer, long cBytes);
+
+    // flushes the primary; replicas flush in turn when they
+    // reach this point in their queue
+    HRESULT Flush();
+
+    enum {
+        block_size = 64 * 1024,
+    };
+
+private:
+    enum op_type {
+        op_append,
+        op_replace,
+        op_flush,
+    };
+
+    // a queued write: a range of a shared block
+    struct WriteOp
+    {
+        op_type type;
+        LONGLONG pos;
+        smart_array<BYTE> pBlock;
+        long offset;
+        long cBytes;
+    };
+
+    class Replica : public CAMThread
+    {
+    public:
+        Replica(AtomWriter* pContainer);
+        ~Replica();
+
+        HRESULT Queue(const WriteOp& op, TeeSink* pTee);
+        void Close();
+        void GetStatus(HRESULT* phr, LONGLONG* pllLag);
+
+    private:
+        DWORD ThreadProc();
+        void Fail(HRESULT hr);
+
+    private:
+        smart_ptr<AtomWriter> m_pContainer;
+        CCritSec m_csQueue;
+        CAMEvent m_evWork;
+        CAMEvent m_evSpace;
+        list<WriteOp> m_Queue;
+        LONGLONG m_llQueued;
+        HRESULT m_hr;
+        bool m_bExit;
+    };
+    typedef smart_ptr<Replica> ReplicaPtr;
+
+    HRESULT Replicate(op_type type, LONGLONG pos, const BYTE* pBuffer, long cBytes);
+
+private:
+    AtomWriter* m_pPrimary;
+    DWORD m_dwFlags;
+    LONGLONG m_llMaxLag;
+
+    CCritSec m_csTee;
+    vector<ReplicaPtr> m_Replicas;
+
+    // current shared block for small writes
+    smart_array<BYTE> m_pBlock;
+    long m_cBlockUsed;
+};
@@ -0,0 +1,730 @@
+// TsDemux.cpp: MPEG-2 transport stream front end for the mux engine
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "TsDemux.h"
+#include "MovieWriter.h"
+#include "NALUnit.h"
+
+const BYTE ts_sync_byte = 0x47;
+const long stream_type_AAC = 0x0f;      // ADTS
+const long stream_type_H264 = 0x1b;
+
+// PES timestamp: 33 bits in 5 bytes, with marker bits
+inline LONGLONG ReadTimestamp(const BYTE* p)
+{
+    return (LONGLONG(p[0] & 0x0e) << 29) |
+           (LONGLONG(p[1]) << 22) |
+           (LONGLONG(p[2] & 0xfe) << 14) |
+           (LONGLONG(p[3]) << 7) |
+           (LONGLONG(p[4]) >> 1);
+}
+
+// reads the payload of a NALU, skipping emulation prevention bytes
+class RbspReader
+{
+public:
+    RbspReader(const BYTE* p, const BYTE* pEnd)
+    : m_p(p),
+      m_pEnd(pEnd),
+      m_cZeros(0)
+    {
+    }
+
+    // false at the end of the NALU
+    bool Next(BYTE* pb)
+    {
+        if ((m_cZeros >= 2) && (m_p < m_pEnd) && (*m_p == 0x03))
+        {
+            m_p++;
+            m_cZeros = 0;
+        }
+        if (m_p >= m_pEnd)
+        {
+            return false;
+        }
+        *pb = *m_p++;
+        m_cZeros = (*pb == 0) ? (m_cZeros + 1) : 0;
+        return true;
+    }
+
+    bool Skip(long cBytes)
+    {
+        BYTE b;
+        while (cBytes-- > 0)
+        {
+            if (!Next(&b))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // an SEI message type or size: each 0xff byte adds 255,
+    // up to a final byte that is less
+    bool ReadValue(long* pValue)
+    {
+        *pValue = 0;
+        BYTE b;
+        do
+        {
+            if (!Next(&b))
+            {
+                return false;
+            }
+            *pValue += b;
+        } while (b == 0xff);
+        return true;
+    }
+
+    // anything before the stop bit (and any zero padding)
+    bool MoreData()
+    {
+        if ((m_p >= m_pEnd) || (*m_p != 0x80))
+        {
+            return (m_p < m_pEnd);
+        }
+        for (const BYTE* p = m_p + 1; p < m_pEnd; p++)
+        {
+            if (*p != 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    const BYTE* m_p;
+    const BYTE* m_pEnd;
+    int m_cZeros;
+};
+
+// an SEI NALU (after the header byte) may hold several messages:
+// a recovery point need not be the first
+static bool
+HasRecoveryPoint(const BYTE* p, const BYTE* pEnd)
+{
+    const long sei_recovery_point = 6;
+    RbspReader rbsp(p, pEnd);
+    while (rbsp.MoreData())
+    {
+        long type, cBytes;
+        if (!rbsp.ReadValue(&type) || !rbsp.ReadValue(&cBytes))
+        {
+            break;
+        }
+        if (type == sei_recovery_point)
+        {
+            return true;
+        }
+        if (!rbsp.Skip(cBytes))
+        {
+            break;
+        }
+    }
+    return false;
+}
+
+// an IDR picture, or a recovery point SEI (as used for
+// broadcast open GOPs) before the first slice
+static bool
+IsRandomAccess(const BYTE* pData, const BYTE* pEnd)
+{
+    const BYTE* p = FindStartCode(pData, pEnd);
+    while (p < pEnd)
+    {
+        const BYTE* pHdr = p;
+        while ((pHdr < pEnd) && (*pHdr == 0))
+        {
+            pHdr++;
+        }
+        pHdr++;
+        if (pHdr >= pEnd)
+        {
+            break;
+        }
+        const BYTE* pNext = FindStartCode(pHdr, pEnd);
+        int type = pHdr[0] & 0x1f;
+        if (type == NALUnit::NAL_IDR_Slice)
+        {
+            return true;
+        }
+        if ((type >= NALUnit::NAL_Slice) && (type <= NALUnit::NAL_PartitionC))
+        {
+            return false;
+        }
+        if ((type == NALUnit::NAL_SEI) && HasRecoveryPoint(pHdr + 1, pNext))
+        {
+            return true;
+        }
+        p = pNext;
+    }
+    return false;
+}
+
+// --- stream ----------------------------------------------
+
+TsStream::TsStream(TsDemux* pDemux, long pid, DWORD codec)
+: m_pDemux(pDemux),
+  m_pid(pid),
+  m_codec(codec),
+  m_pTrack(NULL),
+  m_bConfigured(false)
+{
+    Reset();
+}
+
+void
+TsStream::Reset()
+{
+    m_pHold = NULL;
+    m_pBlock = NULL;
+    m_posUnit = 0;
+    m_cValid = 0;
+    m_bInPES = false;
+    m_bBroken = false;
+    m_cc = -1;
+    m_bUnitTime = false;
+    m_tUnitStart = 0;
+    m_tUnitDecode = 0;
+    m_tLastDuration = 0;
+    m_bSeenSync = false;
+    m_posPES = 0;
+    m_bPESTime = false;
+    m_tPES = 0;
+    m_tNextAudio = 0;
+}
+
+void
+TsStream::Append(const BYTE* pData, long cBytes)
+{
+    if ((m_pBlock == NULL) || ((m_cValid + cBytes) > m_pBlock->Size()))
+    {
+        // start a new block, moving the undelivered data to the start
+        long cPending = m_cValid - m_posUnit;
+        long cBlock = max(long(arena_block_size), (cPending + cBytes) * 2);
+        TsArenaBlock* pBlock = new TsArenaBlock(cBlock);
+        if (cPending > 0)
+        {
+            CopyMemory(pBlock->Data(), m_pBlock->Data() + m_posUnit, cPending);
+        }
+        m_posPES = max(m_posPES - m_posUnit, 0L);
+        m_posUnit = 0;
+        m_cValid = cPending;
+        m_pBlock = pBlock;
+        m_pHold = pBlock;
+    }
+    CopyMemory(m_pBlock->Data() + m_cValid, pData, cBytes);
+    m_cValid += cBytes;
+}
+
+bool
+TsStream::StartPES(const BYTE* p, long cBytes, long* pcHeader)
+{
+    // packet start code prefix, stream id, length, flags, header length
+    if ((cBytes < 9) || (p[0] != 0) || (p[1] != 0) || (p[2] != 1))
+    {
+        return false;
+    }
+    long cHeader = 9 + p[8];
+    if (cHeader > cBytes)
+    {
+        return false;
+    }
+    *pcHeader = cHeader;
+
+    int flags = p[7] >> 6;
+    if ((flags & 2) == 0)
+    {
+        // no timestamp: continues the previous unit
+        return true;
+    }
+    if (cHeader < (9 + ((flags == 3) ? 10 : 5)))
+    {
+        return false;
+    }
+    REFERENCE_TIME tStart = m_pDemux->Unwrap(ReadTimestamp(p + 9));
+    REFERENCE_TIME tDecode = tStart;
+    if (flags == 3)
+    {
+        tDecode = m_pDemux->Unwrap(ReadTimestamp(p + 14));
+    }
+
+    if (m_codec == MuxCodec_H264ByteStream)
+    {
+        // the previous access unit is complete
+        DeliverVideo(tDecode, true);
+        m_bUnitTime = true;
+        m_tUnitStart = tStart;
+        m_tUnitDecode = tDecode;
+    }
+    else
+    {
+        // the first frame starting in this PES has this time
+        m_posPES = m_cValid;
+        m_bPESTime = true;
+        m_tPES = tStart;
+    }
+    return true;
+}
+
+void
+TsStream::OnPacket(const BYTE* pPayload, long cPayload, bool bUnitStart, int cc)
+{
+    // continuity: a repeated counter is a duplicate packet
+    if (m_cc >= 0)
+    {
+        if (cc == m_cc)
+        {
+            return;
+        }
+        if (cc != ((m_cc + 1) & 0xf))
+        {
+            m_pDemux->OnContinuityError();
+            if (m_codec == MuxCodec_H264ByteStream)
+            {
+                m_bBroken = true;
+            }
+            else
+            {
+                // drop any partial frame
+                m_posUnit = m_cValid;
+            }
+        }
+    }
+    m_cc = cc;
+
+    if (bUnitStart)
+    {
+        long cHeader = 0;
+        m_bInPES = StartPES(pPayload, cPayload, &cHeader);
+        if (!m_bInPES)
+        {
+            if (m_codec == MuxCodec_H264ByteStream)
+            {
+                m_bBroken = true;
+            }
+            return;
+        }
+        pPayload += cHeader;
+        cPayload -= cHeader;
+    }
+    if (!m_bInPES || (cPayload <= 0))
+    {
+        return;
+    }
+
+    Append(pPayload, cPayload);
+    if (m_codec == MuxCodec_AAC)
+    {
+        DeliverAudio();
+    }
+}
+
+void
+TsStream::DeliverVideo(REFERENCE_TIME tNextDecode, bool bNextValid)
+{
+    const BYTE* pUnit = m_pBlock ? (m_pBlock->Data() + m_posUnit) : NULL;
+    long cUnit = m_cValid - m_posUnit;
+
+    // the next unit starts after this one
+    m_posUnit = m_cValid;
+    bool bBroken = m_bBroken;
+    m_bBroken = false;
+    if ((cUnit <= 0) || !m_bUnitTime || bBroken)
+    {
+        return;
+    }
+
+    if (!m_bConfigured)
+    {
+        m_bConfigured = H264ConfigFromByteStream(pUnit, pUnit + cUnit, 0, &m_config);
+    }
+
+    REFERENCE_TIME tDuration = m_tLastDuration;
+    if (bNextValid && (tNextDecode > m_tUnitDecode))
+    {
+        tDuration = tNextDecode - m_tUnitDecode;
+        m_tLastDuration = tDuration;
+        if (m_bConfigured && (m_config.tFrame == 0))
+        {
+            m_config.tFrame = tDuration;
+        }
+    }
+
+    bool bSync = IsRandomAccess(pUnit, pUnit + cUnit);
+    if (bSync)
+    {
+        m_bSeenSync = true;
+    }
+    if (!m_bSeenSync)
+    {
+        // not decodable without an earlier frame
+        return;
+    }
+
+    MuxSample sample;
+    sample.pData = pUnit;
+    sample.cBytes = cUnit;
+    sample.tStart = m_tUnitStart;
+    sample.tStop = m_tUnitStart + tDuration;
+    sample.tDecode = m_tUnitDecode;
+    sample.dwFlags = MuxSample_Time | MuxSample_DecodeTime;
+    if (bSync)
+    {
+        sample.dwFlags |= MuxSample_Sync;
+    }
+    sample.pBuffer = m_pHold;
+    Deliver(&sample);
+}
+
+void
+TsStream::DeliverAudio()
+{
+    while ((m_cValid - m_posUnit) >= ADTSHeader::min_header_size)
+    {
+        const BYTE* p = m_pBlock->Data() + m_posUnit;
+        long cAvail = m_cValid - m_posUnit;
+        ADTSHeader hdr;
+        if (!hdr.Parse(p, cAvail))
+        {
+            // resync
+            m_posUnit++;
+            continue;
+        }
+        if (hdr.cFrame > cAvail)
+        {
+            // wait for the rest of the frame
+            break;
+        }
+        if (!m_bConfigured)
+        {
+            m_ADTS = hdr;
+            m_ADTS.GetConfig(&m_config);
+            m_bConfigured = true;
+        }
+
+        REFERENCE_TIME tStart = m_tNextAudio;
+        if (m_bPESTime && (m_posUnit >= m_posPES))
+        {
+            tStart = m_tPES;
+            m_bPESTime = false;
+        }
+        REFERENCE_TIME tStop = tStart + (LONGLONG(hdr.nBlocks) * ADTSHeader::samples_per_block * UNITS / hdr.SampleRate);
+        m_tNextAudio = tStop;
+
+        MuxSample sample;
+        sample.pData = p + hdr.cHeader;
+        sample.cBytes = hdr.cFrame - hdr.cHeader;
+        sample.tStart = tStart;
+        sample.tStop = tStop;
+        sample.dwFlags = MuxSample_Time | MuxSample_Sync;
+        sample.pBuffer = m_pHold;
+        m_posUnit += hdr.cFrame;
+        Deliver(&sample);
+    }
+}
+
+void
+TsStream::Deliver(MuxSample* pSample)
+{
+    if ((m_pTrack != NULL) && !m_pDemux->IsProbing())
+    {
+        HRESULT hr = m_pTrack->Add(pSample);
+        if (FAILED(hr))
+        {
+            m_pDemux->OnError(hr);
+        }
+    }
+}
+
+void
+TsStream::EndOfStream()
+{
+    if (m_codec == MuxCodec_H264ByteStream)
+    {
+        DeliverVideo(0, false);
+    }
+    if (m_pTrack != NULL)
+    {
+        m_pTrack->OnEOS();
+    }
+}
+
+// --- demux -----------------------------------------------
+
+TsDemux::TsDemux()
+: m_pidPMT(-1),
+  m_bPMT(false),
+  m_cbPacket(packet_size),
+  m_cbPrefix(0),
+  m_bProbe(false),
+  m_hr(S_OK),
+  m_cErrors(0),
+  m_bTime(false),
+  m_tsLast(0)
+{
+    ZeroMemory(m_PIDs, sizeof(m_PIDs));
+}
+
+REFERENCE_TIME
+TsDemux::Unwrap(LONGLONG ts)
+{
+    // take the value closest to the last one: timestamps
+    // may be a little out of order, but never by half the range
+    const LONGLONG wrap = LONGLONG(1) << 33;
+    if (!m_bTime)
+    {
+        m_bTime = true;
+    }
+    else
+    {
+        LONGLONG epoch = m_tsLast - (m_tsLast & (wrap - 1));
+        ts += epoch;
+        if (ts < (m_tsLast - (wrap / 2)))
+        {
+            ts += wrap;
+        }
+        else if (ts > (m_tsLast + (wrap / 2)))
+        {
+            ts -= wrap;
+        }
+    }
+    m_tsLast = ts;
+
+    // 90kHz to 100ns
+    return ts * 1000 / 9;
+}
+
+bool
+TsDemux::FindSync(const BYTE* pData, LONGLONG cBytes, LONGLONG* ppos)
+{
+    // three sync bytes in a row
+    for (LONGLONG pos = *ppos; (pos + (3 * m_cbPacket)) <= cBytes; pos++)
+    {
+        if ((pData[pos + m_cbPrefix] == ts_sync_byte) &&
+            (pData[pos + m_cbPrefix + m_cbPacket] == ts_sync_byte) &&
+            (pData[pos + m_cbPrefix + (2 * m_cbPacket)] == ts_sync_byte))
+        {
+            *ppos = pos;
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+TsDemux::OnPSI(long pid, const BYTE* p, long cBytes)
+{
+    // one section per packet, after the pointer field
+    if (cBytes < 1)
+    {
+        return;
+    }
+    long cPointer = p[0] + 1;
+    p += cPointer;
+    cBytes -= cPointer;
+    if (cBytes < 12)
+    {
+        return;
+    }
+    long cSection = ((p[1] & 0x0f) << 8) | p[2];
+    if ((cSection + 3) > cBytes)
+    {
+        return;
+    }
+    const BYTE* pEnd = p + 3 + cSection - 4;     // before CRC
+
+    if ((pid == 0) && (p[0] == 0) && (m_pidPMT < 0))
+    {
+        // PAT: the first programme
+        for (const BYTE* pEntry = p + 8; (pEntry + 4) <= pEnd; pEntry += 4)
+        {
+            long program = (pEntry[0] << 8) | pEntry[1];
+            if (program != 0)
+            {
+                m_pidPMT = ((pEntry[2] & 0x1f) << 8) | pEntry[3];
+                break;
+            }
+        }
+    }
+    else if ((pid == m_pidPMT) && (p[0] == 2) && !m_bPMT)
+    {
+        // PMT: the streams we can mux
+        m_bPMT = true;
+        long cInfo = ((p[10] & 0x0f) << 8) | p[11];
+        const BYTE* pEntry = p + 12 + cInfo;
+        while ((pEntry + 5) <= pEnd)
+        {
+            long type = pEntry[0];
+            long pidES = ((pEntry[1] & 0x1f) << 8) | pEntry[2];
+            long cES = ((pEntry[3] & 0x0f) << 8) | pEntry[4];
+            DWORD codec = MuxCodec_None;
+            if (type == stream_type_H264)
+            {
+                codec = MuxCodec_H264ByteStream;
+            }
+            else if (type == stream_type_AAC)
+            {
+                codec = MuxCodec_AAC;
+            }
+            if ((codec != MuxCodec_None) && (m_PIDs[pidES] == NULL))
+            {
+                TsStreamPtr pStream = new TsStream(this, pidES, codec);
+                m_Streams.push_back(pStream);
+                m_PIDs[pidES] = pStream;
+            }
+            pEntry += 5 + cES;
+        }
+    }
+}
+
+void
+TsDemux::OnPacket(const BYTE* p)
+{
+    // transport error, or payload absent
+    if ((p[1] & 0x80) || !(p[3] & 0x10))
+    {
+        return;
+    }
+    long pid = ((p[1] & 0x1f) << 8) | p[2];
+    TsStream* pStream = m_PIDs[pid];
+    if ((pStream == NULL) && (pid != 0) && (pid != m_pidPMT))
+    {
+        return;
+    }
+
+    bool bUnitStart = (p[1] & 0x40) ? true : false;
+    long idx = 4;
+    if (p[3] & 0x20)
+    {
+        // adaptation field
+        idx += 1 + p[4];
+        if (idx >= packet_size)
+        {
+            return;
+        }
+    }
+    if (pStream != NULL)
+    {
+        pStream->OnPacket(p + idx, packet_size - idx, bUnitStart, p[3] & 0x0f);
+    }
+    else if (bUnitStart)
+    {
+        OnPSI(pid, p + idx, packet_size - idx);
+    }
+}
+
+LONGLONG
+TsDemux::Demux(const BYTE* pData, LONGLONG cBytes, bool bProbe)
+{
+    LONGLONG pos = 0;
+    if (!FindSync(pData, cBytes, &pos))
+    {
+        return 0;
+    }
+    while ((pos + m_cbPacket) <= cBytes)
+    {
+        const BYTE* p = pData + pos + m_cbPrefix;
+        if (p[0] != ts_sync_byte)
+        {
+            pos++;
+            if (!FindSync(pData, cBytes, &pos))
+            {
+                break;
+            }
+            continue;
+        }
+        OnPacket(p);
+        pos += m_cbPacket;
+
+        if (FAILED(m_hr))
+        {
+            break;
+        }
+        if (bProbe && ((pos >= probe_bytes) || AllConfigured()))
+        {
+            break;
+        }
+    }
+    return pos;
+}
+
+bool
+TsDemux::AllConfigured()
+{
+    if (!m_bPMT)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < m_Streams.size(); i++)
+    {
+        if (!m_Streams[i]->IsConfigured())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+HRESULT
+TsDemux::Probe(const BYTE* pData, LONGLONG cBytes)
+{
+    // 188-byte packets, or 192 with a 4-byte timecode prefix (m2ts):
+    // whichever finds sync first, since the sync byte can also
+    // appear in the payload at the wrong spacing
+    LONGLONG cSearch = min(cBytes, LONGLONG(probe_bytes));
+    LONGLONG pos = 0;
+    bool bFound = FindSync(pData, cSearch, &pos);
+    m_cbPacket = packet_size + 4;
+    m_cbPrefix = 4;
+    LONGLONG posPrefix = 0;
+    if (FindSync(pData, cSearch, &posPrefix) && (!bFound || (posPrefix < pos)))
+    {
+        bFound = true;
+    }
+    else
+    {
+        m_cbPacket = packet_size;
+        m_cbPrefix = 0;
+    }
+    if (!bFound)
+    {
+        return VFW_E_TYPE_NOT_ACCEPTED;
+    }
+
+    m_bProbe = true;
+    Demux(pData, cBytes, true);
+    m_bProbe = false;
+
+    bool bAny = false;
+    for (size_t i = 0; i < m_Streams.size(); i++)
+    {
+        m_Streams[i]->Reset();
+        if (m_Streams[i]->IsConfigured())
+        {
+            bAny = true;
+        }
+    }
+    m_bTime = false;
+    return bAny ? S_OK : VFW_E_TYPE_NOT_ACCEPTED;
+}
+
+HRESULT
+TsDemux::Parse(const BYTE* pData, LONGLONG cBytes)
+{
+    m_hr = S_OK;
+    Demux(pData, cBytes, false);
+    for (size_t i = 0; i < m_Streams.size(); i++)
+    {
+        m_Streams[i]->EndOfStream();
+    }
+    return m_hr;
+}
@@ -0,0 +1,205 @@
+// TsDemux.h: MPEG-2 transport stream front end for the mux engine
+//
+// Copyright (c) GDCL 2004-6. All Rights Reserved.
+// You are free to re-use this as the basis for your own filter development,
+// provided you retain this copyright notice in the source.
+// http://www.gdcl.co.uk
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "MuxEngine.h"
+#include "ElementaryStream.h"
+
+class TrackWriter;
+class TsDemux;
+
+// PES payloads are reassembled into large blocks shared by many samples,
+// so the demux makes no allocation per packet or per sample (the H.264
+// handler adds a small list of length fields to each access unit, see
+// H264ByteStreamHandler::Transform). Each block is freed when the last
+// sample that refers to it has been written.
+class TsArenaBlock : public MuxBuffer
+{
+public:
+    TsArenaBlock(long cBytes)
+    : m_pData(new BYTE[cBytes]),
+      m_cBytes(cBytes)
+    {
+    }
+    ~TsArenaBlock()
+    {
+        delete[] m_pData;
+    }
+    BYTE* Data()
+    {
+        return m_pData;
+    }
+    long Size()
+    {
+        return m_cBytes;
+    }
+private:
+    TsArenaBlock(const TsArenaBlock&);
+    TsArenaBlock& operator=(const TsArenaBlock&);
+
+    BYTE* m_pData;
+    long m_cBytes;
+};
+
+// One elementary stream (PID) of the programme: reassembles its PES
+// packets and passes access units to its track.
+//
+// H.264: an access unit runs from a PES packet with a PTS to the next
+// one. Its duration is the difference between the two DTS values.
+// Leading frames before the first random access point are dropped.
+// AAC: each ADTS frame is a sample; frames may span PES packets.
+class TsStream
+{
+public:
+    TsStream(TsDemux* pDemux, long pid, DWORD codec);
+
+    long PID()
+    {
+        return m_pid;
+    }
+    bool IsConfigured()
+    {
+        return m_bConfigured;
+    }
+    const MuxCodecConfig* Config()
+    {
+        return &m_config;
+    }
+    void SetTrack(TrackWriter* pTrack)
+    {
+        m_pTrack = pTrack;
+    }
+
+    void OnPacket(const BYTE* pPayload, long cPayload, bool bUnitStart, int cc);
+
+    // pass on any data held, and end the track
+    void EndOfStream();
+
+    // discard all state except the format, to parse again from the start
+    void Reset();
+
+    enum {
+        arena_block_size = 2 * 1024 * 1024,
+    };
+
+private:
+    bool StartPES(const BYTE* pData, long cBytes, long* pcHeader);
+    void Append(const BYTE* pData, long cBytes);
+    void DeliverVideo(REFERENCE_TIME tNextDecode, bool bNextValid);
+    void DeliverAudio();
+    void Deliver(MuxSample* pSample);
+
+private:
+    TsDemux* m_pDemux;
+    long m_pid;
+    DWORD m_codec;
+    TrackWriter* m_pTrack;
+    MuxCodecConfig m_config;
+    bool m_bConfigured;
+    ADTSHeader m_ADTS;              // holds the AAC config bytes
+
+    // reassembly
+    MuxBufferPtr m_pHold;
+    TsArenaBlock* m_pBlock;
+    long m_posUnit;                 // start of the data not yet delivered
+    long m_cValid;                  // end of the data in the block
+    bool m_bInPES;
+    bool m_bBroken;                 // packets lost in the current unit
+    int m_cc;                       // last continuity counter, or -1
+
+    // timing
+    bool m_bUnitTime;               // video: the current unit has times
+    REFERENCE_TIME m_tUnitStart;
+    REFERENCE_TIME m_tUnitDecode;
+    REFERENCE_TIME m_tLastDuration;
+    bool m_bSeenSync;
+    long m_posPES;                  // audio: where the current PES payload starts
+    bool m_bPESTime;                // audio: the current PES has a PTS not yet used
+    REFERENCE_TIME m_tPES;
+    REFERENCE_TIME m_tNextAudio;
+};
+typedef smart_ptr<TsStream> TsStreamPtr;
+
+// Demultiplexes the first programme of a transport stream (188-byte
+// packets, or 192-byte with a timecode prefix). Packets on other PIDs
+// are skipped after reading the header. PTS and DTS are extended past
+// the 33-bit wrap and passed to the engine as exact decode times.
+class TsDemux
+{
+public:
+    TsDemux();
+
+    // finds the programme's H.264 and AAC streams and their formats,
+    // reading no further than necessary (and at most probe_bytes)
+    HRESULT Probe(const BYTE* pData, LONGLONG cBytes);
+
+    long Streams()
+    {
+        return (long)m_Streams.size();
+    }
+    TsStream* Stream(long idx)
+    {
+        return m_Streams[idx];
+    }
+
+    // demuxes the whole buffer into the tracks set on the
+    // configured streams, then ends the tracks
+    HRESULT Parse(const BYTE* pData, LONGLONG cBytes);
+
+    // 90kHz timestamp to 100ns units, extended beyond 33 bits
+    REFERENCE_TIME Unwrap(LONGLONG ts);
+
+    bool IsProbing()
+    {
+        return m_bProbe;
+    }
+    void OnError(HRESULT hr)
+    {
+        if (SUCCEEDED(m_hr))
+        {
+            m_hr = hr;
+        }
+    }
+    long ContinuityErrors()
+    {
+        return m_cErrors;
+    }
+    void OnContinuityError()
+    {
+        m_cErrors++;
+    }
+
+    enum {
+        packet_size = 188,
+        max_pid = 0x2000,
+        probe_bytes = 32 * 1024 * 1024,
+    };
+
+private:
+    LONGLONG Demux(const BYTE* pData, LONGLONG cBytes, bool bProbe);
+    bool FindSync(const BYTE* pData, LONGLONG cBytes, LONGLONG* ppos);
+    void OnPacket(const BYTE* pPacket);
+    void OnPSI(long pid, const BYTE* pPayload, long cPayload);
+    bool AllConfigured();
+
+private:
+    vector<TsStreamPtr> m_Streams;
+    TsStream* m_PIDs[max_pid];
+    long m_pidPMT;
+    bool m_bPMT;
+    long m_cbPacket;                // 188 or 192
+    long m_cbPrefix;                // 0 or 4
+    bool m_bProbe;
+    HRESULT m_hr;
+    long m_cErrors;
+
+    // 33-bit timestamp extension
+    bool m_bTime;
+    LONGLONG m_tsLast;
+};
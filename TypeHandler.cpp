@@ -8,10 +8,8 @@
 
 #include "stdafx.h"
 #include "MovieWriter.h"
-#include <dvdmedia.h>
-#include <mmreg.h>  // for a-law and u-law G.711 audio types
 
-#include "nalunit.h"
+#include "NALUnit.h"
 #include "ParseBuffer.h"
 
 void WriteVariable(ULONG val, BYTE* pDest, int cBytes)
@@ -22,10 +20,19 @@ void WriteVariable(ULONG val, BYTE* pDest, int cBytes)
     }
 }
 
+// little-endian, for WAVEFORMATEX
+void WriteLittle(ULONG val, BYTE* pDest, int cBytes)
+{
+    for (int i = 0; i < cBytes; i++)
+    {
+        pDest[i] = BYTE((val >> (8 * i)) & 0xff);
+    }
+}
+
 class DivxHandler : public TypeHandler
 {
 public:
-    DivxHandler(const CMediaType* pmt);
+    DivxHandler(const MuxCodecConfig* pConfig);
 
     DWORD Handler() 
     {
@@ -50,14 +57,20 @@ public:
     {
         return 90000;
     }
-    long Width();
-    long Height();
+    long Width()    { return m_config.width; }
+    long Height()   { return m_config.height; }
 
     void WriteDescriptor(Atom* patm, int id, int dataref, long scale);
-    HRESULT WriteData(Atom* patm, const BYTE* pData, int cBytes, int* pcActual);
+    void Transform(MuxSample* pSample);
+    void RecoverConfig(const BYTE* pData, long cBytes);
+
+private:
+    void FindConfig(const BYTE* pData, long cBytes);
 
 private:
-    CMediaType m_mt;
+    // VOL header, from the media type or the data.
+    // Found on the track's thread, read under the write lock
+    CCritSec m_csConfig;
     smart_array<BYTE> m_pConfig;
     long m_cConfig;
 };
@@ -65,8 +78,8 @@ private:
 class H264Handler : public TypeHandler
 {
 public:
-    H264Handler(const CMediaType* pmt)
-    : m_mt(*pmt)
+    H264Handler(const MuxCodecConfig* pConfig)
+    : TypeHandler(pConfig)
     {}
 
     DWORD Handler() 
@@ -92,34 +105,31 @@ public:
     {
         return 90000;
     }
-    long Width();
-    long Height();
+    long Width()    { return m_config.width; }
+    long Height()   { return m_config.height; }
 
     void WriteDescriptor(Atom* patm, int id, int dataref, long scale);
-    LONGLONG FrameDuration();
-
-protected:
-    CMediaType m_mt;
+    LONGLONG FrameDuration()
+    {
+        return m_config.tFrame;
+    }
 };
 
 class H264ByteStreamHandler : public H264Handler
 {
 public:
-    H264ByteStreamHandler(const CMediaType* pmt);
+    H264ByteStreamHandler(const MuxCodecConfig* pConfig);
 
     void WriteDescriptor(Atom* patm, int id, int dataref, long scale);
-    LONGLONG FrameDuration();
-    HRESULT WriteData(Atom* patm, const BYTE* pData, int cBytes, int* pcActual);
-
-    long Width()    { return m_cx; }
-    long Height()   { return m_cy; }
+    void Transform(MuxSample* pSample);
+    void RecoverConfig(const BYTE* pData, long cBytes);
 
     enum { nalunit_length_field = 4 };
 private:
-    REFERENCE_TIME m_tFrame;
-    long m_cx;
-    long m_cy;
+    void StoreParamSet(NALUnit* pnal);
 
+private:
+    CCritSec m_csParamSets;
     ParseBuffer m_ParamSets;        // stores param sets for WriteDescriptor
     bool m_bSPS;
     bool m_bPPS;
@@ -128,8 +138,8 @@ private:
 class YUVVideoHandler : public TypeHandler
 {
 public:
-    YUVVideoHandler(const CMediaType* pmt)
-    : m_mt(*pmt)
+    YUVVideoHandler(const MuxCodecConfig* pConfig)
+    : TypeHandler(pConfig)
     {}
 
     DWORD Handler() 
@@ -155,18 +165,16 @@ public:
     {
         return 90000;
     }
-    long Width();
-    long Height();
+    long Width()    { return m_config.width; }
+    long Height()   { return m_config.height; }
     void WriteDescriptor(Atom* patm, int id, int dataref, long scale);
-private:
-    CMediaType m_mt;
 };
 
 class AACHandler : public TypeHandler
 {
 public:
-    AACHandler(const CMediaType* pmt)
-    : m_mt(*pmt)
+    AACHandler(const MuxCodecConfig* pConfig)
+    : TypeHandler(pConfig)
     {}
 
     DWORD Handler() 
@@ -190,8 +198,6 @@ public:
     long Width()    { return 0; }
     long Height()   { return 0; }
     void WriteDescriptor(Atom* patm, int id, int dataref, long scale);
-private:
-    CMediaType m_mt;
 };
 
 
@@ -199,8 +205,8 @@ private:
 class WaveHandler : public TypeHandler
 {
 public:
-    WaveHandler(const CMediaType* pmt)
-    : m_mt(*pmt)
+    WaveHandler(const MuxCodecConfig* pConfig)
+    : TypeHandler(pConfig)
     {}
 
     DWORD Handler() 
@@ -221,244 +227,120 @@ public:
         return 50;
     }
     bool CanTruncate();
-    bool Truncate(IMediaSample* pSample, REFERENCE_TIME tNewStart);
+    bool Truncate(MuxSample* pSample, REFERENCE_TIME tNewStart);
 
     long Scale();
     long Width()    { return 0; }
     long Height()   { return 0; }
     void WriteDescriptor(Atom* patm, int id, int dataref, long scale);
-private:
-    CMediaType m_mt;
-};
-
-// -----------------------------------------------------------------------------------------
 
-const int WAVE_FORMAT_AAC = 0x00ff;
-const int WAVE_FORMAT_AACEncoder = 0x1234;
-
-// Broadcom/Cyberlink Byte-Stream H264 subtype
-// CLSID_H264
-class DECLSPEC_UUID("8D2D71CB-243F-45E3-B2D8-5FD7967EC09B") CLSID_H264_BSF;
+    enum { wave_format_size = 18 };     // sizeof(WAVEFORMATEX)
+};
 
-//static 
-bool
-TypeHandler::CanSupport(const CMediaType* pmt)
+// a sample description from an existing file, written back unchanged
+class SampleEntryHandler : public TypeHandler
 {
-    if (*pmt->Type() == MEDIATYPE_Video)
-    {
-        // divx
-        FOURCCMap divx(DWORD('xvid'));
-        FOURCCMap xvidCaps(DWORD('XVID'));
-        FOURCCMap divxCaps(DWORD('DIVX'));
-        FOURCCMap dx50(DWORD('05XD'));
-        if (((*pmt->Subtype() == divx) || 
-            (*pmt->Subtype() == divxCaps) ||
-            (*pmt->Subtype() == xvidCaps) ||
-            (*pmt->Subtype() == dx50)) 
-                &&
-                (*pmt->FormatType() == FORMAT_VideoInfo))
-        {
-            return true;
-        }
-
-        FOURCCMap x264(DWORD('462x'));
-        FOURCCMap H264(DWORD('462H'));
-        FOURCCMap h264(DWORD('462h'));
-        FOURCCMap avc1(DWORD('1CVA'));
-
-        // H264 BSF
-        if ((*pmt->Subtype() == x264) || 
-            (*pmt->Subtype() == H264) ||
-            (*pmt->Subtype() == h264) ||
-            (*pmt->Subtype() == avc1) ||
-            (*pmt->Subtype() == __uuidof(CLSID_H264_BSF)))
-        {
-            // BSF
-            if ((*pmt->FormatType() == FORMAT_VideoInfo) || (*pmt->FormatType() == FORMAT_VideoInfo2))
-            {
-                return true;
-            }
-            // length-prepended
-            if (*pmt->FormatType() == FORMAT_MPEG2Video)
-            {
-                return true;
-            }
-        }
+public:
+    SampleEntryHandler(const MuxCodecConfig* pConfig)
+    : TypeHandler(pConfig)
+    {}
 
-        // uncompressed
-        // it would be nice to select any uncompressed type eg by checking that
-        // the bitcount and biSize match up with the dimensions, but that
-        // also works for ffdshow encoder outputs, so I'm returning to an 
-        // explicit list. 
-        FOURCCMap fcc(pmt->subtype.Data1);
-        if ((fcc == *pmt->Subtype()) && (*pmt->FormatType() == FORMAT_VideoInfo))
+    DWORD Handler() 
+    {
+        return m_config.fourcc;
+    }
+    void WriteTREF(Atom* patm) {UNREFERENCED_PARAMETER(patm);}
+    bool IsVideo() 
+    {
+        return m_config.fourcc == DWORD('vide');
+    }
+    bool IsAudio()
+    { 
+        return m_config.fourcc == DWORD('soun');
+    }
+    long SampleRate()
+    {
+        // an approximation is sufficient
+        return IsVideo() ? 30 : 50;
+    }
+    LONGLONG FrameDuration()
+    {
+        if (m_config.tFrame > 0)
         {
-            VIDEOINFOHEADER* pvi = (VIDEOINFOHEADER*)pmt->Format();
-            if ((pvi->bmiHeader.biBitCount > 0) && (DIBSIZE(pvi->bmiHeader) == pmt->GetSampleSize()))
-            {
-                FOURCCMap yuy2(DWORD('2YUY'));
-                FOURCCMap uyvy(DWORD('YVYU'));
-                FOURCCMap yv12(DWORD('21VY'));
-                FOURCCMap nv12(DWORD('21VN'));
-                FOURCCMap i420(DWORD('024I'));
-                if ((*pmt->Subtype() == yuy2) ||
-                    (*pmt->Subtype() == uyvy) ||
-                    (*pmt->Subtype() == yv12) ||
-                    (*pmt->Subtype() == nv12) ||
-//                  (*pmt->Subtype() == MEDIASUBTYPE_RGB32) ||
-//                  (*pmt->Subtype() == MEDIASUBTYPE_RGB24) ||
-                    (*pmt->Subtype() == i420)
-                    )
-                {
-                    return true;
-                }
-            }
+            return m_config.tFrame;
         }
-    } else if (*pmt->Type() == MEDIATYPE_Audio)
+        return TypeHandler::FrameDuration();
+    }
+    // the timescale of the original, so the tables are unchanged
+    long Scale()
     {
-        // rely on format tag to identify formats -- for 
-        // this, subtype adds nothing
+        return m_config.sampleRate;
+    }
+    long Width()    { return m_config.width; }
+    long Height()   { return m_config.height; }
+    void WriteDescriptor(Atom* patm, int id, int dataref, long scale);
+};
 
-        if (*pmt->FormatType() == FORMAT_WaveFormatEx)
-        {
-            // CoreAAC decoder
-            WAVEFORMATEX* pwfx = (WAVEFORMATEX*)pmt->Format();
-            if ((pwfx->wFormatTag == WAVE_FORMAT_AAC) || 
-                (pwfx->wFormatTag == WAVE_FORMAT_AACEncoder))
-            {
-                return true;
-            }
+// -----------------------------------------------------------------------------------------
 
-            if ((pwfx->wFormatTag == WAVE_FORMAT_PCM) ||
-                (pwfx->wFormatTag == WAVE_FORMAT_ALAW) ||
-                (pwfx->wFormatTag == WAVE_FORMAT_MULAW))
-            {
-                return true;
-            }
-        }
+TypeHandler::TypeHandler(const MuxCodecConfig* pConfig)
+: m_config(*pConfig)
+{
+    // keep our own copy of the codec-specific data
+    m_config.pConfig = NULL;
+    m_config.cConfig = 0;
+    if ((pConfig->pConfig != NULL) && (pConfig->cConfig > 0))
+    {
+        m_pConfigData = new BYTE[pConfig->cConfig];
+        CopyMemory(m_pConfigData, pConfig->pConfig, pConfig->cConfig);
+        m_config.pConfig = m_pConfigData;
+        m_config.cConfig = pConfig->cConfig;
     }
-    return false;
 }
 
 //static 
 TypeHandler* 
-TypeHandler::Make(const CMediaType* pmt)
+TypeHandler::Make(const MuxCodecConfig* pConfig)
 {
-    if (!CanSupport(pmt))
+    switch (pConfig->codec)
     {
-        return NULL;
-    }
-    if (*pmt->Type() == MEDIATYPE_Video)
-    {
-        // divx
-        FOURCCMap divx(DWORD('xvid'));
-        FOURCCMap xvidCaps(DWORD('XVID'));
-        FOURCCMap divxCaps(DWORD('DIVX'));
-        FOURCCMap dx50(DWORD('05XD'));
-        if ((*pmt->Subtype() == divx) || 
-            (*pmt->Subtype() == divxCaps) ||
-            (*pmt->Subtype() == xvidCaps) ||
-            (*pmt->Subtype() == dx50)) 
-        {
-            return new DivxHandler(pmt);
-        }
+    case MuxCodec_MPEG4Video:
+        return new DivxHandler(pConfig);
 
-        FOURCCMap x264(DWORD('462x'));
-        FOURCCMap H264(DWORD('462H'));
-        FOURCCMap h264(DWORD('462h'));
-        FOURCCMap avc1(DWORD('1CVA'));
-
-        // H264
-        if ((*pmt->Subtype() == x264) || 
-            (*pmt->Subtype() == H264) ||
-            (*pmt->Subtype() == h264) ||
-            (*pmt->Subtype() == avc1) ||
-            (*pmt->Subtype() == __uuidof(CLSID_H264_BSF)))
-        {
-            // BSF
-            if ((*pmt->FormatType() == FORMAT_VideoInfo) || (*pmt->FormatType() == FORMAT_VideoInfo2))
-            {
-                return new H264ByteStreamHandler(pmt);
-            }
-            // length-prepended
-            if (*pmt->FormatType() == FORMAT_MPEG2Video)
-            {
-                return new H264Handler(pmt);
-            }
-        }
+    case MuxCodec_H264:
+        return new H264Handler(pConfig);
 
-        // other: uncompressed (checked in CanSupport)
-        FOURCCMap fcc(pmt->subtype.Data1);
-        if ((fcc == *pmt->Subtype()) && (*pmt->FormatType() == FORMAT_VideoInfo))
-        {
-            VIDEOINFOHEADER* pvi = (VIDEOINFOHEADER*)pmt->Format();
-            if ((pvi->bmiHeader.biBitCount > 0) && (DIBSIZE(pvi->bmiHeader) == pmt->GetSampleSize()))
-            {
-                return new YUVVideoHandler(pmt);
-            }
-        }
+    case MuxCodec_H264ByteStream:
+        return new H264ByteStreamHandler(pConfig);
 
-    } else if (*pmt->Type() == MEDIATYPE_Audio)
-    {
-        // rely on format tag to identify formats -- for 
-        // this, subtype adds nothing
+    case MuxCodec_Uncompressed:
+        return new YUVVideoHandler(pConfig);
 
-        if (*pmt->FormatType() == FORMAT_WaveFormatEx)
-        {
-            // CoreAAC decoder
-            WAVEFORMATEX* pwfx = (WAVEFORMATEX*)pmt->Format();
-            if ((pwfx->wFormatTag == WAVE_FORMAT_AAC) || 
-                (pwfx->wFormatTag == WAVE_FORMAT_AACEncoder))
-            {
-                return new AACHandler(pmt);
-            }
+    case MuxCodec_AAC:
+        return new AACHandler(pConfig);
 
-            if ((pwfx->wFormatTag == WAVE_FORMAT_PCM) ||
-                (pwfx->wFormatTag == WAVE_FORMAT_ALAW) ||
-                (pwfx->wFormatTag == WAVE_FORMAT_MULAW))
-            {
-                return new WaveHandler(pmt);
-            }
+    case MuxCodec_PCM:
+    case MuxCodec_ALaw:
+    case MuxCodec_MuLaw:
+        return new WaveHandler(pConfig);
+
+    case MuxCodec_SampleEntry:
+        if (pConfig->cConfig < 16)
+        {
+            return NULL;
         }
+        return new SampleEntryHandler(pConfig);
     }
     return NULL;
 }
 
-HRESULT 
-TypeHandler::WriteData(Atom* patm, const BYTE* pData, int cBytes, int* pcActual)
-{
-    *pcActual = cBytes;
-    return patm->Append(pData, cBytes);
-}
-
 
 // -------------------------------------------
-DivxHandler::DivxHandler(const CMediaType* pmt)
-: m_mt(*pmt),
-  m_cConfig(0)
-{
-    if ((*m_mt.FormatType() == FORMAT_VideoInfo) && 
-        (m_mt.FormatLength() > sizeof(VIDEOINFOHEADER)))
-    {
-        m_cConfig = m_mt.FormatLength() - sizeof(VIDEOINFOHEADER);
-        m_pConfig = new BYTE[m_cConfig];
-        const BYTE* pExtra = m_mt.Format() + sizeof(VIDEOINFOHEADER);
-        CopyMemory(m_pConfig, pExtra, m_cConfig);
-    }
-}
-
-long 
-DivxHandler::Width()
+DivxHandler::DivxHandler(const MuxCodecConfig* pConfig)
+: TypeHandler(pConfig),
+  m_pConfig(m_pConfigData),
+  m_cConfig(m_config.cConfig)
 {
-    VIDEOINFOHEADER* pvi = (VIDEOINFOHEADER*)m_mt.Format();
-    return pvi->bmiHeader.biWidth;
-}
-
-long 
-DivxHandler::Height()
-{
-    VIDEOINFOHEADER* pvi = (VIDEOINFOHEADER*)m_mt.Format();
-    return abs(pvi->bmiHeader.biHeight);
 }
 
 void 
@@ -467,9 +349,8 @@ DivxHandler::WriteDescriptor(Atom* patm, int id, int dataref, long scale)
     UNREFERENCED_PARAMETER(scale);
     smart_ptr<Atom> psd = patm->CreateAtom('mp4v');
 
-    VIDEOINFOHEADER* pvi = (VIDEOINFOHEADER*)m_mt.Format();
-    int width = pvi->bmiHeader.biWidth;
-    int height = abs(pvi->bmiHeader.biHeight);
+    int width = m_config.width;
+    int height = m_config.height;
 
     BYTE b[78];
     ZeroMemory(b, 78);
@@ -509,7 +390,10 @@ DivxHandler::WriteDescriptor(Atom* patm, int id, int dataref, long scale)
     dcfg.Append(b, 13);
     Descriptor dsi(Descriptor::Decoder_Specific_Info);
 
-    dsi.Append(m_pConfig, m_cConfig);
+    {
+        CAutoLock lock(&m_csConfig);
+        dsi.Append(m_pConfig, m_cConfig);
+    }
     dcfg.Append(&dsi);
     es.Append(&dcfg);
     Descriptor sl(Descriptor::SL_Config);
@@ -532,9 +416,10 @@ inline bool NextStartCode(const BYTE*&pBuffer, long& cBytes)
     return cBytes >= 4;
 }
 
-HRESULT 
-DivxHandler::WriteData(Atom* patm, const BYTE* pData, int cBytes, int* pcActual)
+void
+DivxHandler::FindConfig(const BYTE* pData, long cBytes)
 {
+    CAutoLock lock(&m_csConfig);
     if (m_cConfig == 0)
     {
         const BYTE* p = pData;
@@ -560,7 +445,20 @@ DivxHandler::WriteData(Atom* patm, const BYTE* pData, int cBytes, int* pcActual)
             c -= 4;
         }
     }
-    return __super::WriteData(patm, pData, cBytes, pcActual);
+}
+
+void
+DivxHandler::Transform(MuxSample* pSample)
+{
+    // data is written unchanged
+    FindConfig(pSample->pData, pSample->cBytes);
+}
+
+void
+DivxHandler::RecoverConfig(const BYTE* pData, long cBytes)
+{
+    // data is written unchanged
+    FindConfig(pData, cBytes);
 }
 
 long 
@@ -568,14 +466,13 @@ AACHandler::Scale()
 {
     // for audio, the scale should be the sampling rate but
     // must not exceed 65535
-    WAVEFORMATEX* pwfx = (WAVEFORMATEX*)m_mt.Format();
-    if (pwfx->nSamplesPerSec > 65535)
+    if (m_config.sampleRate > 65535)
     {
         return 45000;
     }
     else
     {
-        return pwfx->nSamplesPerSec;
+        return m_config.sampleRate;
     }
 }
 
@@ -589,7 +486,7 @@ AACHandler::WriteDescriptor(Atom* patm, int id, int dataref, long scale)
     WriteShort(dataref, b+6);
     WriteShort(2, b+16);
     WriteShort(16, b+18);
-    WriteShort(unsigned short(scale), b+24);    // this is what forces us to use short audio scales
+    WriteShort((unsigned short)scale, b+24);    // this is what forces us to use short audio scales
     psd->Append(b, 28);
 
     smart_ptr<Atom> pesd = psd->CreateAtom('esds');
@@ -616,11 +513,9 @@ AACHandler::WriteDescriptor(Atom* patm, int id, int dataref, long scale)
     WriteLong(0, b+9);          // avg bitrate 0 = variable
     dcfg.Append(b, 13);
     Descriptor dsi(Descriptor::Decoder_Specific_Info);
-    BYTE* pExtra = m_mt.Format() + sizeof(WAVEFORMATEX);
-    long cExtra = m_mt.FormatLength() - sizeof(WAVEFORMATEX);
-    if (cExtra > 0)
+    if (m_config.cConfig > 0)
     {
-        dsi.Append(pExtra, cExtra);
+        dsi.Append(m_config.pConfig, m_config.cConfig);
     }
     dcfg.Append(&dsi);
     es.Append(&dcfg);
@@ -633,27 +528,6 @@ AACHandler::WriteDescriptor(Atom* patm, int id, int dataref, long scale)
     psd->Close();
 }
     
-LONGLONG 
-H264Handler::FrameDuration()
-{
-    MPEG2VIDEOINFO* pvi = (MPEG2VIDEOINFO*)m_mt.Format();
-    return pvi->hdr.AvgTimePerFrame;
-}
-
-long 
-H264Handler::Width()
-{
-    MPEG2VIDEOINFO* pvi = (MPEG2VIDEOINFO*)m_mt.Format();
-    return pvi->hdr.bmiHeader.biWidth;
-}
-
-long 
-H264Handler::Height()
-{
-    MPEG2VIDEOINFO* pvi = (MPEG2VIDEOINFO*)m_mt.Format();
-    return abs(pvi->hdr.bmiHeader.biHeight);
-}
-
 void 
 H264Handler::WriteDescriptor(Atom* patm, int id, int dataref, long scale)
 {
@@ -661,10 +535,8 @@ H264Handler::WriteDescriptor(Atom* patm, int id, int dataref, long scale)
     UNREFERENCED_PARAMETER(id);
     smart_ptr<Atom> psd = patm->CreateAtom('avc1');
 
-    MPEG2VIDEOINFO* pvi = (MPEG2VIDEOINFO*)m_mt.Format();
-    int width = pvi->hdr.bmiHeader.biWidth;
-    int height = abs(pvi->hdr.bmiHeader.biHeight);
-
+    int width = m_config.width;
+    int height = m_config.height;
 
     BYTE b[78];
     ZeroMemory(b, 78);
@@ -680,16 +552,16 @@ H264Handler::WriteDescriptor(Atom* patm, int id, int dataref, long scale)
 
     smart_ptr<Atom> pesd = psd->CreateAtom('avcC');
     b[0] = 1;           // version 1
-    b[1] = (BYTE)pvi->dwProfile;
+    b[1] = (BYTE)m_config.profile;
     b[2] = 0;
-    b[3] = (BYTE)pvi->dwLevel;
+    b[3] = (BYTE)m_config.level;
     // length of length-preceded nalus
-    b[4] = BYTE(0xfC | (pvi->dwFlags - 1));
+    b[4] = BYTE(0xfC | (m_config.nalLength - 1));
     b[5] = 0xe1;        // 1 SPS
 
     // SPS
-    const BYTE* p = (const BYTE*)&pvi->dwSequenceHeader;
-    const BYTE* pEnd = p + pvi->cbSequenceHeader;
+    const BYTE* p = m_config.pConfig;
+    const BYTE* pEnd = p + m_config.cConfig;
     int c = (p[0] << 8) | p[1];
     // extract profile/level compat from SPS
     b[2] = p[4];
@@ -741,51 +613,6 @@ inline USHORT Swap2Bytes(int x)
 {
     return (USHORT) (((x & 0xff) << 8) | ((x >> 8) & 0xff));
 }
-inline DWORD Swap4Bytes(DWORD x)
-{
-    return ((x & 0xff) << 24) |
-           ((x & 0xff00) << 8) |
-           ((x & 0xff0000) >> 8) |
-           ((x >> 24) & 0xff);
-}
-
-long 
-YUVVideoHandler::Width()
-{
-    if (*m_mt.FormatType() == FORMAT_VideoInfo)
-    {
-        VIDEOINFOHEADER* pvi = (VIDEOINFOHEADER*)m_mt.Format();
-        return pvi->bmiHeader.biWidth;
-    }
-    else if (*m_mt.FormatType() == FORMAT_VideoInfo2)
-    {
-        VIDEOINFOHEADER2* pvi = (VIDEOINFOHEADER2*)m_mt.Format();
-        return pvi->bmiHeader.biWidth;
-    }
-    else
-    {
-        return 0;
-    }
-}
-
-long 
-YUVVideoHandler::Height()
-{
-    if (*m_mt.FormatType() == FORMAT_VideoInfo)
-    {
-        VIDEOINFOHEADER* pvi = (VIDEOINFOHEADER*)m_mt.Format();
-        return abs(pvi->bmiHeader.biHeight);
-    }
-    else if (*m_mt.FormatType() == FORMAT_VideoInfo2)
-    {
-        VIDEOINFOHEADER2* pvi = (VIDEOINFOHEADER2*)m_mt.Format();
-        return abs(pvi->bmiHeader.biHeight);
-    }
-    else
-    {
-        return 0;
-    }
-}
 
 void
 YUVVideoHandler::WriteDescriptor(Atom* patm, int id, int dataref, long scale)
@@ -794,28 +621,11 @@ YUVVideoHandler::WriteDescriptor(Atom* patm, int id, int dataref, long scale)
     UNREFERENCED_PARAMETER(dataref);
     UNREFERENCED_PARAMETER(id);
 
-    FOURCCMap fcc = m_mt.Subtype();
-    smart_ptr<Atom> psd = patm->CreateAtom(Swap4Bytes(fcc.GetFOURCC()));
+    smart_ptr<Atom> psd = patm->CreateAtom(m_config.fourcc);
 
-    int cx, cy, depth;
-    if (*m_mt.FormatType() == FORMAT_VideoInfo)
-    {
-        VIDEOINFOHEADER* pvi = (VIDEOINFOHEADER*)m_mt.Format();
-        cx = pvi->bmiHeader.biWidth;
-        cy = abs(pvi->bmiHeader.biHeight);
-        depth = pvi->bmiHeader.biBitCount;
-    }
-    else if (*m_mt.FormatType() == FORMAT_VideoInfo2)
-    {
-        VIDEOINFOHEADER2* pvi = (VIDEOINFOHEADER2*)m_mt.Format();
-        cx = pvi->bmiHeader.biWidth;
-        cy = abs(pvi->bmiHeader.biHeight);
-        depth = pvi->bmiHeader.biBitCount;
-    }
-    else
-    {
-        return;
-    }
+    int cx = m_config.width;
+    int cy = m_config.height;
+    int depth = m_config.bitcount;
 
     QTVideo fmt;
     ZeroMemory(&fmt, sizeof(fmt));
@@ -845,14 +655,13 @@ WaveHandler::Scale()
 {
     // for audio, the scale should be the sampling rate but
     // must not exceed 65535
-    WAVEFORMATEX* pwfx = (WAVEFORMATEX*)m_mt.Format();
-    if (pwfx->nSamplesPerSec > 65535)
+    if (m_config.sampleRate > 65535)
     {
         return 45000;
     }
     else
     {
-        return pwfx->nSamplesPerSec;
+        return m_config.sampleRate;
     }
 }
 
@@ -860,16 +669,19 @@ void
 WaveHandler::WriteDescriptor(Atom* patm, int id, int dataref, long scale)
 {
     DWORD dwAtom = 0;
-    WAVEFORMATEX* pwfx = (WAVEFORMATEX*)m_mt.Format();
-    if (pwfx->wFormatTag == WAVE_FORMAT_PCM)
+    int formatTag = 0;
+    if (m_config.codec == MuxCodec_PCM)
     {
         dwAtom = 'lpcm';
-    } else if (pwfx->wFormatTag == WAVE_FORMAT_MULAW)
+        formatTag = 1;      // WAVE_FORMAT_PCM
+    } else if (m_config.codec == MuxCodec_MuLaw)
     {
         dwAtom = 'ulaw';
-    } else if (pwfx->wFormatTag == WAVE_FORMAT_ALAW)
+        formatTag = 7;      // WAVE_FORMAT_MULAW
+    } else if (m_config.codec == MuxCodec_ALaw)
     {
         dwAtom = 'alaw';
+        formatTag = 6;      // WAVE_FORMAT_ALAW
     }
     smart_ptr<Atom> psd = patm->CreateAtom(dwAtom);
 
@@ -878,7 +690,7 @@ WaveHandler::WriteDescriptor(Atom* patm, int id, int dataref, long scale)
     WriteShort(dataref, b+6);
     WriteShort(2, b+16);
     WriteShort(16, b+18);
-    WriteShort(unsigned short(scale), b+24);    // this is what forces us to use short audio scales
+    WriteShort((unsigned short)scale, b+24);    // this is what forces us to use short audio scales
     psd->Append(b, 28);
 
     smart_ptr<Atom> pesd = psd->CreateAtom('esds');
@@ -907,8 +719,20 @@ WaveHandler::WriteDescriptor(Atom* patm, int id, int dataref, long scale)
     Descriptor dsi(Descriptor::Decoder_Specific_Info);
 
     // write whole WAVEFORMATEX as decoder specific info
-    int cLen = pwfx->cbSize + sizeof(WAVEFORMATEX);
-    dsi.Append((const BYTE*)pwfx, cLen);
+    // (little-endian, followed by any extra format bytes)
+    BYTE wfx[wave_format_size];
+    WriteLittle(formatTag, wfx, 2);
+    WriteLittle(m_config.channels, wfx+2, 2);
+    WriteLittle(m_config.sampleRate, wfx+4, 4);
+    WriteLittle(m_config.bytesPerSec, wfx+8, 4);
+    WriteLittle(m_config.blockAlign, wfx+12, 2);
+    WriteLittle(m_config.bitsPerSample, wfx+14, 2);
+    WriteLittle(m_config.cConfig, wfx+16, 2);
+    dsi.Append(wfx, wave_format_size);
+    if (m_config.cConfig > 0)
+    {
+        dsi.Append(m_config.pConfig, m_config.cConfig);
+    }
     dcfg.Append(&dsi);
     es.Append(&dcfg);
     Descriptor sl(Descriptor::SL_Config);
@@ -923,8 +747,7 @@ WaveHandler::WriteDescriptor(Atom* patm, int id, int dataref, long scale)
 bool 
 WaveHandler::CanTruncate()
 {
-    WAVEFORMATEX* pwfx = (WAVEFORMATEX*)m_mt.Format();
-    if (pwfx->wFormatTag == WAVE_FORMAT_PCM)
+    if (m_config.codec == MuxCodec_PCM)
     {
         return true;
     }
@@ -932,26 +755,23 @@ WaveHandler::CanTruncate()
 }
 
 bool 
-WaveHandler::Truncate(IMediaSample* pSample, REFERENCE_TIME tNewStart)
+WaveHandler::Truncate(MuxSample* pSample, REFERENCE_TIME tNewStart)
 {
     if (!CanTruncate())
     {
         return false;
     }
-    REFERENCE_TIME tStart, tEnd;
-    if (pSample->GetTime(&tStart, &tEnd) != S_OK)
+    if (!pSample->HasTime())
     {
         return false;
     }
-    WAVEFORMATEX* pwfx = (WAVEFORMATEX*)m_mt.Format();
-    LONGLONG tDiff = tNewStart - tStart;
-    long cBytesExcess = long (tDiff * pwfx->nSamplesPerSec / UNITS) * pwfx->nBlockAlign;
-    long cData = pSample->GetActualDataLength();
-    BYTE* pBuffer;
-    pSample->GetPointer(&pBuffer);
-    MoveMemory(pBuffer, pBuffer+cBytesExcess, cData - cBytesExcess);
-    pSample->SetActualDataLength(cData - cBytesExcess);
-    pSample->SetTime(&tNewStart, &tEnd);
+    LONGLONG tDiff = tNewStart - pSample->tStart;
+    long cBytesExcess = long (tDiff * m_config.sampleRate / UNITS) * m_config.blockAlign;
+
+    // the sample now starts further into the same buffer
+    pSample->pData += cBytesExcess;
+    pSample->cBytes -= cBytesExcess;
+    pSample->tStart = tNewStart;
     return true;
 
 }
@@ -1042,36 +862,11 @@ Descriptor::Write(Atom* patm)
 }
 
 // --- H264 BSF support --------------
-H264ByteStreamHandler::H264ByteStreamHandler(const CMediaType* pmt)
-: H264Handler(pmt),
+H264ByteStreamHandler::H264ByteStreamHandler(const MuxCodecConfig* pConfig)
+: H264Handler(pConfig),
   m_bSPS(false),
   m_bPPS(false)
 {
-    if (*m_mt.FormatType() == FORMAT_MPEG2Video)
-    {
-        MPEG2VIDEOINFO* pvi = (MPEG2VIDEOINFO*)m_mt.Format();
-        m_tFrame = pvi->hdr.AvgTimePerFrame;
-        m_cx = pvi->hdr.bmiHeader.biWidth;
-        m_cy = pvi->hdr.bmiHeader.biHeight;
-    }
-    else if (*m_mt.FormatType() == FORMAT_VideoInfo)
-    {
-        VIDEOINFOHEADER* pvi = (VIDEOINFOHEADER*)m_mt.Format();
-        m_tFrame = pvi->AvgTimePerFrame;
-        m_cx = pvi->bmiHeader.biWidth;
-        m_cy = pvi->bmiHeader.biHeight;
-    }
-    else if (*m_mt.FormatType() == FORMAT_VideoInfo2)
-    {
-        VIDEOINFOHEADER2* pvi = (VIDEOINFOHEADER2*)m_mt.Format();
-        m_tFrame = pvi->AvgTimePerFrame;
-        m_cx = pvi->bmiHeader.biWidth;
-        m_cy = pvi->bmiHeader.biHeight;
-    }
-    else
-    {
-        m_tFrame = m_cx = m_cy = 0;
-    }
 }
 
 void 
@@ -1081,7 +876,9 @@ H264ByteStreamHandler::WriteDescriptor(Atom* patm, int id, int dataref, long sca
     UNREFERENCED_PARAMETER(id);
     smart_ptr<Atom> psd = patm->CreateAtom('avc1');
 
-    // locate param sets in parse buffer
+    // locate param sets in parse buffer (the nalus point into
+    // it, so hold the lock until they are written)
+    CAutoLock lock(&m_csParamSets);
     NALUnit sps, pps;
     NALUnit nal;
     const BYTE* pBuffer = m_ParamSets.Data();
@@ -1107,8 +904,8 @@ H264ByteStreamHandler::WriteDescriptor(Atom* patm, int id, int dataref, long sca
     BYTE b[78];
     ZeroMemory(b, 78);
     WriteShort(dataref, b+6);
-    WriteShort(m_cx, b+24);
-    WriteShort(m_cy, b+26);
+    WriteShort(m_config.width, b+24);
+    WriteShort(m_config.height, b+26);
     b[29] = 0x48;
     b[33] = 0x48;
     b[41] = 1;
@@ -1141,50 +938,164 @@ H264ByteStreamHandler::WriteDescriptor(Atom* patm, int id, int dataref, long sca
     psd->Close();
 }
 
-LONGLONG 
-H264ByteStreamHandler::FrameDuration()
+// A sample converted to length-preceded NALUs, without a copy: the
+// length fields are held here, and the NALUs stay in the source's
+// buffer, which this keeps.
+class NaluPieces : public MuxBuffer
 {
-    return m_tFrame;
-}
+public:
+    NaluPieces(const MuxBufferPtr& pSource)
+    : m_pSource(pSource)
+    {
+        // an access unit usually has a few NALUs
+        m_Lengths.reserve(typical_nalus);
+        m_Pieces.reserve(typical_nalus * 2);
+    }
 
-HRESULT 
-H264ByteStreamHandler::WriteData(Atom* patm, const BYTE* pData, int cBytes, int* pcActual)
-{
-    int cActual = 0;
+    void Add(NALUnit* pnal)
+    {
+        // the length field's piece is pointed at it once all are added
+        DWORD dwLength;
+        WriteVariable(pnal->Length(), (BYTE*)&dwLength, H264ByteStreamHandler::nalunit_length_field);
+        m_Lengths.push_back(dwLength);
+        MuxPiece piece;
+        piece.pData = NULL;
+        piece.cBytes = H264ByteStreamHandler::nalunit_length_field;
+        m_Pieces.push_back(piece);
+        piece.pData = pnal->Start();
+        piece.cBytes = pnal->Length();
+        m_Pieces.push_back(piece);
+    }
+    void Complete()
+    {
+        for (size_t i = 0; i < m_Lengths.size(); i++)
+        {
+            m_Pieces[i * 2].pData = (const BYTE*)&m_Lengths[i];
+        }
+    }
+
+    const MuxPiece* Pieces(long* pcPieces)
+    {
+        *pcPieces = (long)m_Pieces.size();
+        return m_Pieces.empty() ? NULL : &m_Pieces[0];
+    }
+
+private:
+    enum { typical_nalus = 4, };
 
+    MuxBufferPtr m_pSource;
+    vector<DWORD> m_Lengths;
+    vector<MuxPiece> m_Pieces;
+};
+
+void
+H264ByteStreamHandler::Transform(MuxSample* pSample)
+{
+    // find the NALUs, and so the size of the length-preceded form
+    const BYTE* pData = pSample->pData;
+    long cBytes = pSample->cBytes;
+    vector<NALUnit> nalus;
+    long cOut = 0;
     NALUnit nal;
+
+    // if the caller's buffer is kept, the start codes are replaced with
+    // big-endian lengths as the sample is written, and the payload is
+    // not copied
+    NaluPieces* pPieces = NULL;
+    if (pSample->pBuffer != NULL)
+    {
+        pPieces = new NaluPieces(pSample->pBuffer);
+    }
     while(nal.Parse(pData, cBytes, 0, true))
     {
         const BYTE* pNext = nal.Start() + nal.Length();
         cBytes-= long(pNext - pData);
         pData = pNext;
 
-        // convert length to correct byte order
-        BYTE length[nalunit_length_field];
-        WriteVariable(nal.Length(), length, nalunit_length_field);
-
-        if (!m_bSPS && (nal.Type() == NALUnit::NAL_Sequence_Params))
+        StoreParamSet(&nal);
+        if (pPieces != NULL)
         {
-            // store in length-preceded format for use in WriteDescriptor
-            m_bSPS = true;
-            m_ParamSets.Append(length, nalunit_length_field);
-            m_ParamSets.Append(nal.Start(), nal.Length());
+            pPieces->Add(&nal);
         }
-        else if (!m_bPPS && (nal.Type() == NALUnit::NAL_Picture_Params))
+        else
         {
-            // store in length-preceded format for use in WriteDescriptor
-            m_bPPS = true;
-            m_ParamSets.Append(length, nalunit_length_field);
-            m_ParamSets.Append(nal.Start(), nal.Length());
+            nalus.push_back(nal);
         }
+        cOut += nalunit_length_field + nal.Length();
+    }
+    if (pPieces != NULL)
+    {
+        pPieces->Complete();
+        pSample->pBuffer = pPieces;
+        pSample->cBytes = cOut;
+        return;
+    }
+
+    // otherwise the engine would copy the data as it is queued: the
+    // converted copy replaces the sample's data, as its buffer
+    HeapBuffer* pOut = new HeapBuffer(cOut);
+    BYTE* pDest = pOut->Space();
+    for (size_t i = 0; i < nalus.size(); i++)
+    {
+        WriteVariable(nalus[i].Length(), pDest, nalunit_length_field);
+        pDest += nalunit_length_field;
+        CopyMemory(pDest, nalus[i].Start(), nalus[i].Length());
+        pDest += nalus[i].Length();
+    }
+    pSample->pBuffer = pOut;
+    pSample->pData = pOut->Data();
+    pSample->cBytes = cOut;
+}
+
+void
+H264ByteStreamHandler::StoreParamSet(NALUnit* pnal)
+{
+    CAutoLock lock(&m_csParamSets);
+    BYTE length[nalunit_length_field];
+    WriteVariable(pnal->Length(), length, nalunit_length_field);
 
-        // write length and data to file
-        patm->Append(length, nalunit_length_field);
-        patm->Append(nal.Start(), nal.Length());
-        cActual += nalunit_length_field + nal.Length();
+    if (!m_bSPS && (pnal->Type() == NALUnit::NAL_Sequence_Params))
+    {
+        // store in length-preceded format for use in WriteDescriptor
+        m_bSPS = true;
+        m_ParamSets.Append(length, nalunit_length_field);
+        m_ParamSets.Append(pnal->Start(), pnal->Length());
     }
+    else if (!m_bPPS && (pnal->Type() == NALUnit::NAL_Picture_Params))
+    {
+        // store in length-preceded format for use in WriteDescriptor
+        m_bPPS = true;
+        m_ParamSets.Append(length, nalunit_length_field);
+        m_ParamSets.Append(pnal->Start(), pnal->Length());
+    }
+}
 
-    *pcActual = cActual;
-    return S_OK;
+void
+H264ByteStreamHandler::RecoverConfig(const BYTE* pData, long cBytes)
+{
+    // the data in the file has already been converted 
+    // to length-preceded NALUs
+    NALUnit nal;
+    while (nal.Parse(pData, cBytes, nalunit_length_field, true))
+    {
+        StoreParamSet(&nal);
+        const BYTE* pNext = nal.Start() + nal.Length();
+        cBytes -= long(pNext - pData);
+        pData = pNext;
+    }
 }
 
+// -------------------------------------------
+
+void
+SampleEntryHandler::WriteDescriptor(Atom* patm, int id, int dataref, long scale)
+{
+    UNREFERENCED_PARAMETER(id);
+    UNREFERENCED_PARAMETER(scale);
+
+    // the data reference index follows the atom header and 6 reserved bytes
+    smart_array<BYTE> pEntry = new BYTE[m_config.cConfig];
+    CopyMemory(pEntry, m_config.pConfig, m_config.cConfig);
+    WriteShort(dataref, pEntry + 14);
+    patm->Append(pEntry, m_config.cConfig);
+}
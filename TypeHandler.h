@@ -54,6 +54,7 @@ class Atom;
 class TypeHandler  
 {
 public:
+    TypeHandler(const MuxCodecConfig* pConfig);
     virtual ~TypeHandler() {}
 
     virtual DWORD Handler() = 0;
@@ -67,7 +68,7 @@ public:
     virtual long Height() = 0;
 
     virtual bool CanTruncate() { return false; }
-    virtual bool Truncate(IMediaSample* pSample, REFERENCE_TIME tNewStart) 
+    virtual bool Truncate(MuxSample* pSample, REFERENCE_TIME tNewStart) 
     { 
         UNREFERENCED_PARAMETER(pSample);
         UNREFERENCED_PARAMETER(tNewStart);
@@ -79,8 +80,32 @@ public:
         return UNITS / SampleRate();
     }
 
-    virtual HRESULT WriteData(Atom* patm, const BYTE* pData, int cBytes, int* pcActual);
-    static bool CanSupport(const CMediaType* pmt);
-    static TypeHandler* Make(const CMediaType* pmt);
+    // Called for each buffer as it is added, on the caller's thread and
+    // outside the movie's write lock, so that the tracks do this work in
+    // parallel with each other and with the writing of the file. A handler
+    // that writes the data in a different form sets the sample's size to
+    // that of the converted form, so that the chunk knows its exact size,
+    // and replaces its buffer with one holding the converted form, or one
+    // that describes it as pieces of the original (see MuxBuffer::Pieces).
+    // Any search of the data for config is also done here.
+    virtual void Transform(MuxSample* pSample)
+    {
+        UNREFERENCED_PARAMETER(pSample);
+    }
+
+    // recover any configuration that Transform would have found in the
+    // data, from a sample as written to the file (for journal recovery)
+    virtual void RecoverConfig(const BYTE* pData, long cBytes)
+    {
+        UNREFERENCED_PARAMETER(pData);
+        UNREFERENCED_PARAMETER(cBytes);
+    }
+    // NULL if the codec is not supported
+    static TypeHandler* Make(const MuxCodecConfig* pConfig);
+
+protected:
+    // copy of the config, pointing to our copy of the config bytes
+    MuxCodecConfig m_config;
+    smart_array<BYTE> m_pConfigData;
 };
 
@@ -7,6 +7,7 @@
 
 #include "stdafx.h"
 #include "muxfilter.h"
+#include "IndexJournal.h"
 
 // --- COM factory table and registration code --------------
 
@@ -40,6 +41,33 @@ STDAPI DllUnregisterServer()
     return hr;
 }
 
+// rebuild the index of a recording that was not stopped cleanly,
+// from its index journal (see IMuxConfig::SetIndexJournal). 
+// pszJournal may be NULL to use the default journal location.
+STDAPI RecoverMovieFile(LPCWSTR pszFile, LPCWSTR pszJournal)
+{
+    if (pszFile == NULL)
+    {
+        return E_POINTER;
+    }
+    HRESULT hr = RecoverMovie(pszFile, pszJournal);
+    if (SUCCEEDED(hr))
+    {
+        DeleteFile(pszJournal ? pszJournal : IndexJournal::DefaultPath(pszFile).c_str());
+    }
+    return hr;
+}
+
+// rundll32 entrypoint for recovery:
+//      rundll32 mp4mux.dll,Recover <file>
+extern "C" void CALLBACK RecoverW(HWND hwnd, HINSTANCE hinst, LPWSTR pszCmdLine, int nCmdShow)
+{
+    UNREFERENCED_PARAMETER(hwnd);
+    UNREFERENCED_PARAMETER(hinst);
+    UNREFERENCED_PARAMETER(nCmdShow);
+    RecoverMovieFile(pszCmdLine, NULL);
+}
+
 // if we declare the correct C runtime entrypoint and then forward it to the DShow base
 // classes we will be sure that both the C/C++ runtimes and the base classes are initialized
 // correctly